@@ -19,10 +19,50 @@ struct spdk_ubi_bdev_opts {
     const char *name;
     const char *image_path;
     const char *snapshot_path;
+    /* delta files between the image and snapshot_path, from the bottom up */
+    const char *const *layers;
+    uint32_t num_layers;
+    /* bdev holding a delta written with target_bdev, instead of snapshot_path */
+    const char *snapshot_bdev;
     const char *base_bdev_name;
     bool no_sync;
     bool directio;
     bool format_bdev;
+    bool subcluster_cow;
+    bool zero_detect;
+};
+
+/*
+ * Parameters of a snapshot. With a parent_path, the delta only has clusters
+ * changed since the snapshot which wrote that delta file. Rate limits of 0
+ * mean unlimited. A non-zero target_latency_us lets the copy rate adapt to the
+ * guest's I/O latency, up to max_bytes_per_sec if that's set. Without
+ * decouple_parent, the snapshot blob is copied directly instead of through a
+ * decoupled clone where the chain allows it. The copy keeps queue_depth
+ * clusters in flight on each of num_threads threads, 0 picking the defaults.
+ * compression names the algorithm clusters are compressed with, "deflate",
+ * or is NULL or "none" to store them raw. With reflink, the file behind an
+ * aio base bdev is cloned to path instead, if its filesystem can share
+ * extents, and a delta is copied otherwise. Guest I/O is paused while the
+ * snapshot is taken, and the snapshot fails if the I/O in flight doesn't
+ * complete within quiesce_timeout_us, 0 waiting for it as long as it takes.
+ * With a target_bdev instead of a path, the delta is written to that bdev,
+ * which a bdev can then be created from with snapshot_bdev.
+ */
+struct spdk_ubi_snapshot_opts {
+    const char *name;
+    const char *path;
+    const char *parent_path;
+    uint64_t max_bytes_per_sec;
+    uint64_t max_ios_per_sec;
+    uint64_t target_latency_us;
+    bool decouple_parent;
+    uint64_t quiesce_timeout_us;
+    uint32_t queue_depth;
+    uint32_t num_threads;
+    const char *compression;
+    bool reflink;
+    const char *target_bdev;
 };
 
 struct ubi_create_context {
@@ -46,7 +86,9 @@ struct ubi_create_context {
 void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
                      struct ubi_create_context *context);
 void bdev_ubi_delete(const char *bdev_name, spdk_delete_ubi_complete cb_fn, void *cb_arg);
-void bdev_ubi_snapshot(const char *name, const char *path,
+void bdev_ubi_snapshot(const struct spdk_ubi_snapshot_opts *opts,
                        spdk_snapshot_ubi_complete cb_fn, void *cb_arg);
+int bdev_ubi_snapshot_set_limits(const char *name, uint64_t max_bytes_per_sec,
+                                 uint64_t max_ios_per_sec, uint64_t target_latency_us);
 
 #endif /* SPDK_BDEV_NULL_H */
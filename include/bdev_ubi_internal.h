@@ -10,6 +10,7 @@
 #include "spdk/stdinc.h"
 #include "spdk/string.h"
 #include "spdk/thread.h"
+#include "spdk/trace.h"
 
 #include "bdev_ubi.h"
 
@@ -18,6 +19,272 @@
 #define UBI_PATH_LEN 1024
 #define MAX_CLUSTERS 1024 * 1024 * 64
 
+/*
+ * Delta files start with a header, followed by the data of the clusters in
+ * the order they were written, and end with a table of extents which lists
+ * every cluster of the delta once, sorted by cluster. The table is synced
+ * after the data, and only then does the header point to it, so the delta of
+ * a snapshot which didn't finish has no table and is refused by readers.
+ *
+ * Extents hold the file offset of each cluster's data and its CRC32C.
+ * Clusters which were all zeroes have no data in the file and are marked with
+ * UBI_DELTA_ZERO_CLUSTER. Clusters may be stored compressed, and every cluster
+ * starts at an offset aligned to UBI_DELTA_ALIGN, so that deltas can be read
+ * with O_DIRECT either way. The header names the delta file an incremental
+ * delta builds on. Clusters which aren't in a delta are read from its parent,
+ * and from the image at the end of the chain.
+ */
+#define UBI_DELTA_MAGIC "UBIDELTA"
+#define UBI_DELTA_VERSION 1
+#define UBI_DELTA_HEADER_SIZE 4096
+#define UBI_DELTA_DATA_OFFSET UBI_DELTA_HEADER_SIZE
+#define UBI_DELTA_ZERO_CLUSTER UINT64_MAX
+#define UBI_DELTA_ALIGN 4096
+
+enum ubi_delta_compression {
+    UBI_DELTA_COMPRESSION_NONE = 0,
+    UBI_DELTA_COMPRESSION_DEFLATE = 1,
+};
+
+struct ubi_delta_header {
+    char magic[8];
+    uint32_t version;
+    /* CRC32C of the header, computed with this field set to 0 */
+    uint32_t header_crc;
+    uint64_t cluster_size;
+    /* 0 until the snapshot completes */
+    uint64_t table_offset;
+    uint64_t table_count;
+    uint32_t table_crc;
+    /* enum ubi_delta_compression of the clusters which are compressed */
+    uint32_t compression;
+    char parent[UBI_PATH_LEN];
+    /* bytes of the snapshotted device, 0 if unknown */
+    uint64_t size;
+    uint8_t reserved[UBI_DELTA_HEADER_SIZE - 56 - UBI_PATH_LEN];
+};
+
+struct ubi_delta_extent {
+    uint64_t cluster;
+    uint64_t offset;
+    /* CRC32C of the cluster's data, uncompressed */
+    uint32_t crc;
+    /* bytes stored if the cluster is compressed, 0 if it's stored raw */
+    uint32_t length;
+};
+
+/*
+ * Deltas written before the header existed are a map of MAX_CLUSTERS file
+ * offsets, 0 for clusters which aren't in the delta, followed by the cluster
+ * data. Those are still read, without checksums or a parent.
+ */
+
+/*
+ * Extents merged from a chain of deltas keep the index of the delta each
+ * cluster is in, 0 being the newest, in the top bits of their offset. The
+ * chain limit counts every delta under a device, across all its layers.
+ */
+#define UBI_DELTA_MAX_CHAIN 16
+#define UBI_DELTA_INDEX_SHIFT 56
+#define UBI_DELTA_OFFSET_MASK ((1ULL << UBI_DELTA_INDEX_SHIFT) - 1)
+
+/* Layers a bdev can be created with, each of which may bring its own chain. */
+#define UBI_MAX_LAYERS 8
+
+/*
+ * A delta which a snapshot wrote to a bdev rather than a file, with its
+ * extent table, loaded by ubi_delta_bdev_load. It's the topmost layer of the
+ * devices it's read through, index 0 in their chain, and parent is the delta
+ * file it's incremental to, if any.
+ */
+struct ubi_delta_bdev {
+    char name[UBI_PATH_LEN];
+    struct spdk_bdev_desc *desc;
+    uint64_t cluster_size;
+    uint64_t size;
+    char parent[UBI_PATH_LEN];
+    struct ubi_delta_extent *extents;
+    uint64_t extent_count;
+};
+
+/*
+ * Tracepoints, enabled with "-e bdev_ubi" and decoded by spdk_trace. The group
+ * and object type ids are picked so they don't collide with SPDK's own.
+ * Guest I/O is traced with the spdk_bdev_io as its object id. Requests to the
+ * image and delta devices use their spdk_bs_dev_cb_args, and carry the
+ * callback argument, which for image reads issued by the module is the
+ * spdk_bdev_io itself.
+ */
+#define TRACE_GROUP_BDEV_UBI 0xE
+#define OBJECT_BDEV_UBI_IO 0xE0
+#define OBJECT_BDEV_UBI_DEV_IO 0xE1
+
+#define TRACE_BDEV_UBI_IO_START SPDK_TPOINT_ID(TRACE_GROUP_BDEV_UBI, 0x0)
+#define TRACE_BDEV_UBI_IO_DONE SPDK_TPOINT_ID(TRACE_GROUP_BDEV_UBI, 0x1)
+#define TRACE_BDEV_UBI_IO_RETRY SPDK_TPOINT_ID(TRACE_GROUP_BDEV_UBI, 0x2)
+#define TRACE_BDEV_UBI_ESNAP_SUBMIT SPDK_TPOINT_ID(TRACE_GROUP_BDEV_UBI, 0x3)
+#define TRACE_BDEV_UBI_ESNAP_REAP SPDK_TPOINT_ID(TRACE_GROUP_BDEV_UBI, 0x4)
+#define TRACE_BDEV_UBI_DELTA_WRITE_START SPDK_TPOINT_ID(TRACE_GROUP_BDEV_UBI, 0x5)
+#define TRACE_BDEV_UBI_DELTA_WRITE_DONE SPDK_TPOINT_ID(TRACE_GROUP_BDEV_UBI, 0x6)
+
+/*
+ * Sub-cluster copy-on-write tracks the validity of each cluster in units of
+ * UBI_SECTOR_SIZE, which matches the I/O split boundary of the bdev.
+ */
+#define UBI_SECTOR_SIZE 4096
+#define UBI_MAX_SECTORS_PER_CLUSTER 256
+#define UBI_PARTIAL_MAX_CLUSTERS 32
+#define UBI_PARTIAL_MAX_FILLS 4
+#define UBI_PARTIAL_XATTR "ubi_partial_clusters"
+
+struct ubi_sector_map {
+    uint64_t bits[UBI_MAX_SECTORS_PER_CLUSTER / 64];
+};
+
+/*
+ * A cluster which was allocated without copying it from the image. Sectors
+ * which aren't "valid" hold garbage in the blob and are read from the image
+ * until the background filler copies them.
+ */
+struct ubi_partial_cluster {
+    uint64_t cluster;
+    bool active;
+    /* the cluster is recorded in the persisted table */
+    bool persisted;
+    /* all sectors are valid, waiting for the entry to be removed on disk */
+    bool retiring;
+    /* set while a metadata sync covering this entry is in flight */
+    bool in_persist;
+    bool retire_in_persist;
+    uint32_t pending_writes;
+    uint64_t last_write_tsc;
+    /* fills which failed since the last drain started */
+    uint32_t fill_failures;
+    struct ubi_sector_map valid;
+    /* valid bits as of the last successful metadata sync */
+    struct ubi_sector_map durable;
+    /* valid bits captured by the metadata sync in flight */
+    struct ubi_sector_map persisting;
+    /* sectors being copied from the image by the filler */
+    struct ubi_sector_map filling;
+};
+
+struct ubi_partial_fill {
+    struct ubi_bdev *ubi_bdev;
+    uint64_t cluster;
+    uint32_t first_sector;
+    uint32_t num_sectors;
+    void *buf;
+    bool busy;
+    struct spdk_bs_dev_cb_args cb_args;
+};
+
+struct ubi_partial_state {
+    /* protects the table, the generations and the waiters list */
+    pthread_mutex_t lock;
+    struct ubi_partial_cluster clusters[UBI_PARTIAL_MAX_CLUSTERS];
+    uint32_t count;
+
+    uint32_t sectors_per_cluster;
+    uint64_t blocks_per_sector;
+
+    /*
+     * One bit per cluster of the bdev, set while the cluster has an entry in
+     * the table. Lets the I/O paths skip the lock for ordinary clusters.
+     */
+    uint64_t *map;
+
+    /*
+     * gen is bumped whenever the table changes in a way which has to reach
+     * the disk. persisted_gen is the value captured by the last successful
+     * metadata sync.
+     */
+    uint64_t gen;
+    uint64_t persisted_gen;
+    uint64_t persist_gen;
+    bool persist_in_progress;
+    bool persist_again;
+    TAILQ_HEAD(, ubi_bdev_io) waiters;
+
+    /* The filler and metadata syncs run on ubi_bdev->thread. */
+    struct spdk_poller *fill_poller;
+    struct spdk_io_channel *bs_channel;
+    struct spdk_io_channel *esnap_channel;
+    struct ubi_partial_fill fills[UBI_PARTIAL_MAX_FILLS];
+    uint32_t fills_in_flight;
+    /* only written on ubi_bdev->thread */
+    uint64_t image_bytes_filled;
+
+    bool draining;
+    spdk_blob_op_complete drain_cb;
+    void *drain_arg;
+    /* error of a cluster which couldn't be filled, passed to drain_cb */
+    int fill_error;
+
+    bool stopping;
+    spdk_blob_op_complete stop_cb;
+    void *stop_arg;
+};
+
+enum ubi_io_class {
+    UBI_IO_CLASS_READ,
+    UBI_IO_CLASS_WRITE,
+    UBI_IO_CLASS_WRITE_ZEROES,
+    UBI_IO_CLASS_FLUSH,
+    UBI_IO_CLASS_COUNT,
+};
+
+/* Phases of a snapshot, which bdev_ubi_snapshot_status reports the time of. */
+enum ubi_snapshot_phase {
+    /* draining partial clusters, quiescing and creating the snapshot blob */
+    UBI_SNAPSHOT_PHASE_SNAPSHOT,
+    UBI_SNAPSHOT_PHASE_CLONE,
+    UBI_SNAPSHOT_PHASE_DECOUPLE,
+    UBI_SNAPSHOT_PHASE_COPY,
+    UBI_SNAPSHOT_PHASE_COUNT,
+};
+
+/* Latency histograms have one bucket per power of two ticks. */
+#define UBI_LATENCY_BUCKETS 48
+
+/* Where the data of a read comes from, decided when it's submitted. */
+enum ubi_read_source {
+    UBI_READ_BLOB,
+    UBI_READ_IMAGE,
+    UBI_READ_ZEROES,
+};
+
+/*
+ * I/O counters of a channel. A channel's counters are only updated and read
+ * on its own thread, so they don't need atomics. All members are uint64_t
+ * counters.
+ */
+struct ubi_io_stats {
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+    uint64_t active_reads;
+
+    uint64_t reads_blob;
+    uint64_t reads_image;
+    uint64_t reads_zeroes;
+    uint64_t image_bytes_read;
+    /* clusters which the blobstore copies from the image on first write */
+    uint64_t cow_copies;
+    uint64_t flushes;
+
+    uint64_t zero_writes_elided;
+    /* I/O which ran out of resources and was queued to be resubmitted */
+    uint64_t ios_deferred;
+    /* I/O currently waiting in the retry queues */
+    uint64_t retry_queue_depth;
+
+    uint64_t latency[UBI_IO_CLASS_COUNT][UBI_LATENCY_BUCKETS];
+};
+
+#define UBI_STAT_ADD(ch, field, n) ((ch)->stats.field += (n))
+
+typedef void (*ubi_io_stats_cb)(void *cb_arg, const struct ubi_io_stats *stats);
+
 /*
  * Block device's state. ubi_create creates and sets up a ubi_bdev.
  * ubi_bdev->bdev is registered with spdk. When registering, a pointer to
@@ -28,9 +295,17 @@ struct ubi_bdev {
 
     char image_path[UBI_PATH_LEN];
     char snapshot_path[UBI_PATH_LEN];
+    /* delta files between the image and snapshot_path, from the bottom up */
+    char layers[UBI_MAX_LAYERS][UBI_PATH_LEN];
+    uint32_t num_layers;
+    /* bdev holding the delta the bdev was restored from, empty if none */
+    char snapshot_bdev[UBI_PATH_LEN];
+    struct ubi_delta_bdev *snapshot_delta;
     uint32_t alignment_bytes;
     bool no_sync;
     bool directio;
+    bool subcluster_cow;
+    bool zero_detect;
 
     struct spdk_bs_dev *bs_dev;
 
@@ -39,13 +314,89 @@ struct ubi_bdev {
     struct spdk_blob *blob;
     char esnap_id[64];
 
+    /* Image device backing the blob chain. Owned by the blobstore. */
+    struct spdk_bs_dev *esnap_dev;
+
+    uint32_t cluster_size;
+    uint64_t blocks_per_cluster;
+    uint64_t num_clusters;
+
+    /*
+     * One bit per cluster, set when the cluster may hold data in the blob or
+     * in any of its snapshots. Bits are set before the I/O which allocates the
+     * cluster is submitted and are never cleared.
+     */
+    uint64_t *alloc_map;
+
+    /* Clusters allocated by sub-cluster copy-on-write which aren't filled yet. */
+    struct ubi_partial_state partial;
+
+    /*
+     * Counters of destroyed channels, added atomically as channels are
+     * destroyed, and the last sum of all counters, for reports which can't
+     * wait for the channels to be visited.
+     */
+    struct ubi_io_stats retired_stats;
+    struct ubi_io_stats last_stats;
+
+    /* Deepest retry queue any channel has had. Updated atomically. */
+    uint64_t retry_queue_depth_max;
+
     struct {
         bool in_progress;
         int result;
         uint64_t copied_clusters;
         uint64_t total_clusters;
+
+        /* Limits of the running snapshot, see spdk_ubi_snapshot_opts. */
+        uint64_t max_bytes_per_sec;
+        uint64_t max_ios_per_sec;
+        uint64_t target_latency_us;
+        /* Copy rate the adaptive mode currently allows, and its back-offs. */
+        uint64_t adaptive_bytes_per_sec;
+        uint64_t backoffs;
+        /* Whether the last snapshot cloned the base file rather than copying. */
+        bool reflinked;
+        /*
+         * Last pause of guest I/O: the time spent waiting for I/O in flight,
+         * the whole time new I/O was held, which includes that wait, and the
+         * number of I/Os held. ios_held is updated atomically.
+         */
+        uint64_t drain_us;
+        uint64_t pause_us;
+        uint64_t ios_held;
+
+        /*
+         * Progress of the last snapshot, updated every throttle period. Copy
+         * rates count the clusters read from the snapshot, over the last
+         * period and since the copy started, and eta_sec is UINT64_MAX until
+         * there's a rate. delta_bytes counts the space taken in the delta file.
+         */
+        uint64_t phase_us[UBI_SNAPSHOT_PHASE_COUNT];
+        uint64_t bytes_per_sec;
+        uint64_t avg_bytes_per_sec;
+        uint64_t eta_sec;
+        uint64_t zero_clusters;
+        uint64_t delta_bytes;
+        /* p99 latency of guest reads and writes in the last period, and its max */
+        uint64_t guest_p99_us;
+        uint64_t guest_p99_us_max;
     } snapshot_status;
 
+    /*
+     * Quiesce of the bdev around snapshots, see bdev_ubi_pause.c. start_tsc is
+     * non-zero from the quiesce until the held I/O was resubmitted, and
+     * end_tsc is UINT64_MAX until the bdev is unquiesced.
+     */
+    struct {
+        uint64_t start_tsc;
+        uint64_t end_tsc;
+        bool timed_out;
+        struct spdk_poller *timeout_poller;
+        spdk_bdev_quiesce_cb cb_fn;
+        void *cb_arg;
+    } pause;
+
     /*
      * Thread where ubi_bdev was initialized. It's essential to close the base
      * bdev in the same thread in which it was opened.
@@ -75,6 +426,21 @@ struct ubi_bdev_io {
     uint64_t block_count;
 
     uint64_t stripes_fetched;
+
+    uint64_t submit_tsc;
+    enum ubi_read_source read_source;
+
+    /* number of blob operations an I/O has been split into */
+    int outstanding;
+    enum spdk_bdev_io_status status;
+
+    /* sub-cluster copy-on-write state */
+    uint64_t partial_gen;
+    bool partial_tracked;
+    bool partial_written;
+    bool partial_busy_sector;
+    struct spdk_bs_dev_cb_args esnap_cb_args;
+    TAILQ_ENTRY(ubi_bdev_io) partial_link;
 };
 
 /*
@@ -85,12 +451,15 @@ struct ubi_io_channel {
     struct spdk_poller *poller;
     struct spdk_io_channel *bs_channel;
 
-    uint64_t blocks_read;
-    uint64_t blocks_written;
+    /* created on first read of a partially valid cluster */
+    struct spdk_io_channel *esnap_channel;
 
-    uint64_t active_reads;
+    struct ubi_io_stats stats;
 
-    /* queue pointer */
+    /*
+     * I/O which couldn't be submitted because the blobstore channel, the
+     * image's ring or a partial cluster was busy. The poller resubmits them.
+     */
     TAILQ_HEAD(, spdk_bdev_io) io;
 };
 
@@ -102,21 +471,107 @@ enum bs_dev_delta_direction {
 /* bdev_ubi_io_channel.c */
 int ubi_create_channel_cb(void *io_device, void *ctx_buf);
 void ubi_destroy_channel_cb(void *io_device, void *ctx_buf);
+int ubi_get_io_stats(struct ubi_bdev *ubi_bdev, ubi_io_stats_cb cb_fn, void *cb_arg);
+void ubi_queue_retry(struct ubi_io_channel *ch, struct spdk_bdev_io *bdev_io);
+
+/* bdev_ubi.c */
+void ubi_submit_io(struct ubi_io_channel *ch, struct spdk_bdev_io *bdev_io);
+
+/* bdev_ubi_alloc_map.c */
+void ubi_alloc_map_load(struct ubi_bdev *ubi_bdev, spdk_blob_op_complete cb_fn,
+                        void *cb_arg);
+uint64_t ubi_alloc_map_mark(struct ubi_bdev *ubi_bdev, uint64_t offset_blocks,
+                            uint64_t num_blocks);
+bool ubi_cluster_is_allocated(struct ubi_bdev *ubi_bdev, uint64_t cluster);
+bool ubi_cluster_reads_zeroes(struct ubi_bdev *ubi_bdev, uint64_t cluster);
+uint64_t ubi_next_data_block(struct ubi_bdev *ubi_bdev, uint64_t offset_blocks);
+uint64_t ubi_next_hole_block(struct ubi_bdev *ubi_bdev, uint64_t offset_blocks);
+
+/* bdev_ubi_subcluster.c */
+int ubi_partial_init(struct ubi_bdev *ubi_bdev);
+void ubi_partial_stop(struct ubi_bdev *ubi_bdev, spdk_blob_op_complete cb_fn,
+                      void *cb_arg);
+void ubi_partial_drain(struct ubi_bdev *ubi_bdev, spdk_blob_op_complete cb_fn,
+                       void *cb_arg);
+void ubi_partial_drain_end(struct ubi_bdev *ubi_bdev);
+bool ubi_partial_submit_read(struct ubi_io_channel *ch, struct spdk_bdev_io *bdev_io);
+bool ubi_partial_submit_write(struct ubi_io_channel *ch, struct spdk_bdev_io *bdev_io);
+bool ubi_partial_claim(struct ubi_io_channel *ch, uint64_t offset_blocks,
+                       uint64_t num_blocks);
+
+/* bdev_ubi_stats.c */
+void ubi_io_complete(struct spdk_bdev_io *bdev_io, enum spdk_bdev_io_status status);
+void ubi_stats_write_json(struct ubi_bdev *ubi_bdev, const struct ubi_io_stats *stats,
+                          struct spdk_json_write_ctx *w);
+
+/* bdev_ubi_zero.c */
+void ubi_zero_detect_init(void);
+bool ubi_iovs_are_zero(const struct iovec *iovs, int iovcnt);
+
+/* bdev_ubi_export.c */
+#define UBI_EXPORT_DEFAULT_QUEUE_DEPTH 16
+#define UBI_EXPORT_MAX_QUEUE_DEPTH 256
+#define UBI_EXPORT_MAX_THREADS 16
+
+typedef void (*ubi_export_status_fn)(uint64_t copied_clusters, uint64_t total_clusters,
+                                     void *cb_arg);
+int ubi_export_start(struct spdk_blob_store *bs, spdk_blob_id blobid,
+                     struct spdk_bs_dev *dst, uint32_t queue_depth, uint32_t num_threads,
+                     ubi_export_status_fn status_fn, spdk_blob_op_complete done_fn,
+                     void *cb_arg);
+
+/* bdev_ubi_pause.c */
+int ubi_pause_begin(struct ubi_bdev *ubi_bdev, uint64_t timeout_us,
+                    spdk_bdev_quiesce_cb cb_fn, void *cb_arg);
+void ubi_pause_end(struct ubi_bdev *ubi_bdev, spdk_bdev_quiesce_cb cb_fn, void *cb_arg);
+void ubi_pause_account_io(struct ubi_bdev *ubi_bdev, struct spdk_bdev_io *bdev_io);
+
+/* bdev_ubi_reflink.c */
+typedef void (*ubi_reflink_done_fn)(void *cb_arg, int rc);
+int ubi_reflink_snapshot(struct ubi_bdev *ubi_bdev, const char *path,
+                         uint64_t quiesce_timeout_us, ubi_reflink_done_fn done_fn,
+                         void *cb_arg);
 
 /* spdk_bs_dev_uring.c */
-struct spdk_bs_dev *bs_dev_uring_create(const char *filename, const char *snapshot_path,
+struct spdk_bs_dev *bs_dev_uring_create(const char *filename, const char *const *layers,
+                                        int layer_count,
+                                        const struct ubi_delta_bdev *top_layer,
                                         uint32_t blocklen, uint32_t cluster_size,
                                         bool directio);
+void bs_dev_uring_set_cow_bypass(struct spdk_bs_dev *dev, uint64_t cluster, bool bypass);
 
 /* spdk_bs_dev_delta.c */
-struct spdk_bs_dev *bs_dev_delta_create(const char *filename, uint64_t blockcnt,
-                                        uint32_t blocklen, uint32_t cluster_size,
-                                        enum bs_dev_delta_direction direction);
+struct spdk_bs_dev *bs_dev_delta_create(const char *filename, const char *parent_path,
+                                        uint64_t blockcnt, uint32_t blocklen,
+                                        uint32_t cluster_size,
+                                        enum bs_dev_delta_direction direction,
+                                        enum ubi_delta_compression compression);
+void bs_dev_delta_set_rate_limit(struct spdk_bs_dev *dev, uint64_t max_bytes_per_sec,
+                                 uint64_t max_ios_per_sec);
+void bs_dev_delta_get_progress(struct spdk_bs_dev *dev, uint64_t *zero_clusters,
+                               uint64_t *bytes_written);
+void bs_dev_delta_on_commit(struct spdk_bs_dev *dev, spdk_blob_op_complete cb_fn,
+                            void *cb_arg);
+typedef void (*bs_dev_delta_create_cb)(void *cb_arg, struct spdk_bs_dev *dev, int rc);
+int bs_dev_delta_create_bdev(const char *bdev_name, const char *parent_path,
+                             uint64_t blockcnt, uint32_t blocklen, uint32_t cluster_size,
+                             enum ubi_delta_compression compression,
+                             bs_dev_delta_create_cb cb_fn, void *cb_arg);
+typedef void (*ubi_delta_bdev_load_cb)(void *cb_arg, struct ubi_delta_bdev *delta,
+                                       int rc);
+int ubi_delta_bdev_load(const char *bdev_name, ubi_delta_bdev_load_cb cb_fn,
+                        void *cb_arg);
+void ubi_delta_bdev_close(struct ubi_delta_bdev *delta);
 
 /* macros */
 #define UBI_ERRLOG(ubi_bdev, format, ...)                                                \
     SPDK_ERRLOG("[%s] " format, ubi_bdev->bdev.name __VA_OPT__(, ) __VA_ARGS__)
 
-int ubi_read_cluster_map(const char *filename, uint64_t *cluster_map);
+int ubi_read_delta_layers(const char *const *files, int file_count, uint64_t cluster_size,
+                          struct ubi_delta_extent **extents, uint64_t *extent_count,
+                          char (*paths)[UBI_PATH_LEN], int *depth, uint64_t *size,
+                          uint32_t *unchecked);
+const struct ubi_delta_extent *ubi_delta_find(const struct ubi_delta_extent *extents,
+                                              uint64_t extent_count, uint64_t cluster);
 
 #endif
@@ -0,0 +1,934 @@
+#include "spdk/stdinc.h"
+
+#include "spdk/crc32.h"
+#include "spdk/util.h"
+
+#include "bdev_ubi_internal.h"
+
+#include <liburing.h>
+#include <pthread.h>
+#include <zlib.h>
+
+/*
+ * ubi_flatten merges an image and the delta layers over it into a single
+ * file, so that a bdev reads it without resolving clusters through a chain.
+ * The output is either a sparse raw image, or a delta file with no parent
+ * which can be mounted as a snapshot_path without an image, optionally with
+ * its clusters compressed.
+ *
+ * Clusters which no layer and no data in the image have, zero clusters of the
+ * layers, and clusters whose data turns out to be all zeroes are left as holes
+ * in the output. The others are copied by several threads, each with its own
+ * io_uring and queue_depth clusters in flight.
+ *
+ * Clusters of the layers which pass through the buffers are checked against
+ * their CRCs, and the flatten fails with -EIO on a mismatch.
+ *
+ * Uncompressed clusters going to a raw output are copied by the kernel with
+ * copy_file_range, which doesn't pass the data through userspace and shares
+ * the extents where the filesystem can. Such clusters aren't checked for
+ * zeroes or against their CRCs. Where the kernel can't copy between the files,
+ * every cluster goes through the buffers instead.
+ */
+
+#define DEFAULT_CLUSTER_SIZE_KB 1024
+#define DEFAULT_QUEUE_DEPTH 32
+#define DEFAULT_THREADS 4
+#define MAX_QUEUE_DEPTH 1024
+#define MAX_THREADS 64
+
+enum flatten_format {
+    FLATTEN_FORMAT_RAW,
+    FLATTEN_FORMAT_DELTA,
+};
+
+enum flatten_cmdline_opts {
+    FLATTEN_OPTION_IMAGE = 0x1000,
+    FLATTEN_OPTION_LAYER,
+    FLATTEN_OPTION_OUTPUT,
+    FLATTEN_OPTION_FORMAT,
+    FLATTEN_OPTION_COMPRESS,
+    FLATTEN_OPTION_CLUSTER_SIZE_KB,
+    FLATTEN_OPTION_QUEUE_DEPTH,
+    FLATTEN_OPTION_THREADS,
+    FLATTEN_OPTION_TRACE,
+    FLATTEN_OPTION_BUFFERED,
+    FLATTEN_OPTION_HELP,
+};
+
+static struct option g_cmdline_opts[] = {
+    {.name = "image", .has_arg = 1, .val = FLATTEN_OPTION_IMAGE},
+    {.name = "layer", .has_arg = 1, .val = FLATTEN_OPTION_LAYER},
+    {.name = "output", .has_arg = 1, .val = FLATTEN_OPTION_OUTPUT},
+    {.name = "format", .has_arg = 1, .val = FLATTEN_OPTION_FORMAT},
+    {.name = "compress", .has_arg = 0, .val = FLATTEN_OPTION_COMPRESS},
+    {.name = "cluster_size_kb", .has_arg = 1, .val = FLATTEN_OPTION_CLUSTER_SIZE_KB},
+    {.name = "queue_depth", .has_arg = 1, .val = FLATTEN_OPTION_QUEUE_DEPTH},
+    {.name = "threads", .has_arg = 1, .val = FLATTEN_OPTION_THREADS},
+    {.name = "trace", .has_arg = 1, .val = FLATTEN_OPTION_TRACE},
+    {.name = "buffered", .has_arg = 0, .val = FLATTEN_OPTION_BUFFERED},
+    {.name = "help", .has_arg = 0, .val = FLATTEN_OPTION_HELP},
+    {.name = NULL}};
+
+struct {
+    const char *image_path;
+    /* layers from the bottom up, as bdev_ubi_create takes them */
+    const char *layers[UBI_DELTA_MAX_CHAIN];
+    int n_layers;
+    const char *output_path;
+    const char *trace_path;
+    enum flatten_format format;
+    bool compress;
+    bool buffered;
+    uint64_t cluster_size;
+    uint32_t queue_depth;
+    uint32_t n_threads;
+} g_opts = {
+    .format = FLATTEN_FORMAT_RAW,
+    .cluster_size = DEFAULT_CLUSTER_SIZE_KB * 1024,
+    .queue_depth = DEFAULT_QUEUE_DEPTH,
+    .n_threads = DEFAULT_THREADS,
+};
+
+/* State shared by the copy threads. */
+struct {
+    uint64_t size;
+    uint64_t num_clusters;
+
+    int image_fd;
+    uint64_t image_size;
+    uint64_t *image_data_map;
+
+    /* deltas of the layers from the top down, and a merged map as the esnap has */
+    char layer_paths[UBI_DELTA_MAX_CHAIN][UBI_PATH_LEN];
+    int layer_fds[UBI_DELTA_MAX_CHAIN];
+    int layer_count;
+    uint64_t *layer_map;
+    uint32_t *layer_lengths;
+    uint32_t *layer_crcs;
+    /* a bit per delta, set for legacy deltas whose clusters have no CRCs */
+    uint32_t layer_unchecked;
+    uint64_t layer_clusters;
+
+    int output_fd;
+    /* clusters to copy, in the order they're copied */
+    uint64_t *order;
+    uint64_t order_count;
+    uint64_t next;
+    int rc;
+    /* cleared once the kernel refuses to copy between the files */
+    bool copy_range;
+
+    /* where each cluster went in a delta output, 0 if it's a hole */
+    uint64_t *out_offsets;
+    uint32_t *out_crcs;
+    uint32_t *out_lengths;
+    uint64_t append_offset;
+
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t clusters_copied;
+    uint64_t clusters_copied_in_kernel;
+    uint64_t zero_clusters;
+} g_flatten;
+
+enum slot_state {
+    SLOT_READ,
+    SLOT_WRITE,
+};
+
+struct flatten_slot {
+    enum slot_state state;
+    uint64_t cluster;
+    /* data read from the source, compressed if clen isn't 0 */
+    void *src;
+    uint32_t clen;
+    /* the cluster's data, and its compressed form for a compressed output */
+    void *buf;
+    void *zbuf;
+    uint64_t write_len;
+};
+
+static void usage(const char *name) {
+    printf("%s [options] --output <path>\n", name);
+    printf(" --image <path>           raw image under the layers\n");
+    printf(" --layer <path>           delta layer, from the bottom up; may repeat\n");
+    printf(" --output <path>          file to write\n");
+    printf(" --format <raw|delta>     output format (default: raw)\n");
+    printf(" --compress               deflate clusters of a delta output\n");
+    printf(" --cluster_size_kb <n>    cluster size of the layers (default: %d)\n",
+           DEFAULT_CLUSTER_SIZE_KB);
+    printf(" --queue_depth <n>        clusters in flight per thread (default: %d)\n",
+           DEFAULT_QUEUE_DEPTH);
+    printf(" --threads <n>            copy threads (default: %d)\n", DEFAULT_THREADS);
+    printf(" --trace <path>           cluster numbers, one per line, to lay out first\n"
+           "                          in a delta output\n");
+    printf(" --buffered               copy every cluster through userspace, which\n"
+           "                          finds zero clusters in the image\n");
+}
+
+static int parse_u64(const char *arg, uint64_t min, uint64_t max, uint64_t *value) {
+    char *end;
+
+    errno = 0;
+    *value = strtoull(arg, &end, 10);
+    if (errno != 0 || *end != '\0' || end == arg || *value < min || *value > max) {
+        fprintf(stderr, "invalid number: %s\n", arg);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int parse_args(int argc, char **argv) {
+    uint64_t value;
+    int ch;
+
+    while ((ch = getopt_long(argc, argv, "", g_cmdline_opts, NULL)) != -1) {
+        switch (ch) {
+        case FLATTEN_OPTION_IMAGE:
+            g_opts.image_path = optarg;
+            break;
+        case FLATTEN_OPTION_LAYER:
+            if (g_opts.n_layers == UBI_DELTA_MAX_CHAIN) {
+                fprintf(stderr, "at most %d layers are supported\n",
+                        UBI_DELTA_MAX_CHAIN);
+                return -EINVAL;
+            }
+            g_opts.layers[g_opts.n_layers++] = optarg;
+            break;
+        case FLATTEN_OPTION_OUTPUT:
+            g_opts.output_path = optarg;
+            break;
+        case FLATTEN_OPTION_FORMAT:
+            if (strcmp(optarg, "raw") == 0) {
+                g_opts.format = FLATTEN_FORMAT_RAW;
+            } else if (strcmp(optarg, "delta") == 0) {
+                g_opts.format = FLATTEN_FORMAT_DELTA;
+            } else {
+                fprintf(stderr, "unknown format: %s\n", optarg);
+                return -EINVAL;
+            }
+            break;
+        case FLATTEN_OPTION_COMPRESS:
+            g_opts.compress = true;
+            break;
+        case FLATTEN_OPTION_CLUSTER_SIZE_KB:
+            if (parse_u64(optarg, 4, 1024 * 1024, &value) || !spdk_u64_is_pow2(value)) {
+                fprintf(stderr, "cluster size must be a power of two\n");
+                return -EINVAL;
+            }
+            g_opts.cluster_size = value * 1024;
+            break;
+        case FLATTEN_OPTION_QUEUE_DEPTH:
+            if (parse_u64(optarg, 1, MAX_QUEUE_DEPTH, &value)) {
+                return -EINVAL;
+            }
+            g_opts.queue_depth = value;
+            break;
+        case FLATTEN_OPTION_THREADS:
+            if (parse_u64(optarg, 1, MAX_THREADS, &value)) {
+                return -EINVAL;
+            }
+            g_opts.n_threads = value;
+            break;
+        case FLATTEN_OPTION_TRACE:
+            g_opts.trace_path = optarg;
+            break;
+        case FLATTEN_OPTION_BUFFERED:
+            g_opts.buffered = true;
+            break;
+        case FLATTEN_OPTION_HELP:
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        default:
+            usage(argv[0]);
+            return -EINVAL;
+        }
+    }
+
+    if (g_opts.output_path == NULL) {
+        fprintf(stderr, "--output is required\n");
+        return -EINVAL;
+    } else if (g_opts.image_path == NULL && g_opts.n_layers == 0) {
+        fprintf(stderr, "either --image or --layer is required\n");
+        return -EINVAL;
+    } else if (g_opts.format == FLATTEN_FORMAT_RAW &&
+               (g_opts.compress || g_opts.trace_path)) {
+        /* Clusters of a raw image have fixed places, and can't be compressed. */
+        fprintf(stderr, "--compress and --trace need --format delta\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static uint32_t flatten_crc(const void *buf, size_t len) {
+    return ~spdk_crc32c_update(buf, len, ~0u);
+}
+
+/*
+ * load_image_map finds the clusters of the image which hold data using
+ * SEEK_DATA/SEEK_HOLE, so holes of the image stay holes in the output.
+ */
+static int load_image_map(void) {
+    uint64_t cluster_size = g_opts.cluster_size;
+    uint64_t clusters = SPDK_CEIL_DIV(g_flatten.image_size, cluster_size);
+    off_t offset = 0;
+
+    g_flatten.image_data_map = calloc(SPDK_CEIL_DIV(clusters, 64) + 1, sizeof(uint64_t));
+    if (g_flatten.image_data_map == NULL) {
+        return -ENOMEM;
+    }
+
+    while ((uint64_t)offset < g_flatten.image_size) {
+        off_t data = lseek(g_flatten.image_fd, offset, SEEK_DATA);
+        off_t hole;
+        if (data < 0 && errno == ENXIO) {
+            break;
+        } else if (data < 0) {
+            /* No hole support, so the whole image is data. */
+            data = offset;
+            hole = g_flatten.image_size;
+        } else {
+            hole = lseek(g_flatten.image_fd, data, SEEK_HOLE);
+            if (hole <= data || (uint64_t)hole > g_flatten.image_size) {
+                hole = g_flatten.image_size;
+            }
+        }
+
+        for (uint64_t c = data / cluster_size; c < SPDK_CEIL_DIV(hole, cluster_size);
+             c++) {
+            g_flatten.image_data_map[c / 64] |= 1ULL << (c % 64);
+        }
+        offset = hole;
+    }
+    return 0;
+}
+
+static bool image_has_data(uint64_t cluster) {
+    if (g_flatten.image_data_map == NULL ||
+        cluster >= SPDK_CEIL_DIV(g_flatten.image_size, g_opts.cluster_size)) {
+        return false;
+    }
+    return (g_flatten.image_data_map[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+static uint64_t layer_entry(uint64_t cluster) {
+    return cluster < g_flatten.layer_clusters ? g_flatten.layer_map[cluster] : 0;
+}
+
+/*
+ * load_layers merges the deltas of the layers into a per-cluster map, the
+ * same way the esnap device of a bdev created with them does.
+ */
+static int load_layers(uint64_t *size) {
+    const char *top_down[UBI_DELTA_MAX_CHAIN];
+    struct ubi_delta_extent *extents;
+    uint64_t count;
+
+    for (int i = 0; i < g_opts.n_layers; i++) {
+        top_down[i] = g_opts.layers[g_opts.n_layers - 1 - i];
+    }
+
+    int rc = ubi_read_delta_layers(top_down, g_opts.n_layers, g_opts.cluster_size,
+                                   &extents, &count, g_flatten.layer_paths,
+                                   &g_flatten.layer_count, size,
+                                   &g_flatten.layer_unchecked);
+    if (rc != 0) {
+        return rc;
+    }
+
+    g_flatten.layer_clusters = count > 0 ? extents[count - 1].cluster + 1 : 0;
+    g_flatten.layer_map = calloc(spdk_max(g_flatten.layer_clusters, 1), sizeof(uint64_t));
+    g_flatten.layer_lengths =
+        calloc(spdk_max(g_flatten.layer_clusters, 1), sizeof(uint32_t));
+    g_flatten.layer_crcs =
+        calloc(spdk_max(g_flatten.layer_clusters, 1), sizeof(uint32_t));
+    if (g_flatten.layer_map == NULL || g_flatten.layer_lengths == NULL ||
+        g_flatten.layer_crcs == NULL) {
+        free(extents);
+        return -ENOMEM;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        g_flatten.layer_map[extents[i].cluster] = extents[i].offset;
+        g_flatten.layer_lengths[extents[i].cluster] = extents[i].length;
+        g_flatten.layer_crcs[extents[i].cluster] = extents[i].crc;
+    }
+    free(extents);
+
+    for (int i = 0; i < g_flatten.layer_count; i++) {
+        g_flatten.layer_fds[i] = open(g_flatten.layer_paths[i], O_RDONLY);
+        if (g_flatten.layer_fds[i] < 0) {
+            fprintf(stderr, "could not open %s: %s\n", g_flatten.layer_paths[i],
+                    strerror(errno));
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+static bool cluster_has_data(uint64_t cluster) {
+    uint64_t entry = layer_entry(cluster);
+    if (entry == UBI_DELTA_ZERO_CLUSTER) {
+        return false;
+    }
+    return entry != 0 || image_has_data(cluster);
+}
+
+/*
+ * build_order lists the clusters to copy. Clusters named by the trace come
+ * first, in the order they were first accessed, and the rest follow in
+ * ascending order.
+ */
+static int build_order(void) {
+    uint64_t *seen = calloc(SPDK_CEIL_DIV(g_flatten.num_clusters, 64) + 1,
+                            sizeof(uint64_t));
+    uint64_t n = 0;
+
+    g_flatten.order = calloc(spdk_max(g_flatten.num_clusters, 1), sizeof(uint64_t));
+    if (seen == NULL || g_flatten.order == NULL) {
+        free(seen);
+        return -ENOMEM;
+    }
+
+    if (g_opts.trace_path) {
+        FILE *trace = fopen(g_opts.trace_path, "r");
+        unsigned long long cluster;
+        if (trace == NULL) {
+            fprintf(stderr, "could not open %s: %s\n", g_opts.trace_path,
+                    strerror(errno));
+            free(seen);
+            return -errno;
+        }
+        while (fscanf(trace, "%llu", &cluster) == 1) {
+            if (cluster >= g_flatten.num_clusters ||
+                (seen[cluster / 64] >> (cluster % 64)) & 1) {
+                continue;
+            }
+            seen[cluster / 64] |= 1ULL << (cluster % 64);
+            if (cluster_has_data(cluster)) {
+                g_flatten.order[n++] = cluster;
+            }
+        }
+        fclose(trace);
+    }
+
+    for (uint64_t cluster = 0; cluster < g_flatten.num_clusters; cluster++) {
+        if (!((seen[cluster / 64] >> (cluster % 64)) & 1) && cluster_has_data(cluster)) {
+            g_flatten.order[n++] = cluster;
+        }
+    }
+
+    free(seen);
+    g_flatten.order_count = n;
+    return 0;
+}
+
+static void set_error(int rc) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&g_flatten.rc, &expected, rc, false, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+}
+
+/*
+ * copy_cluster copies an uncompressed cluster to the raw output within the
+ * kernel. Returns -ENOTSUP if the kernel can't copy between the files, before
+ * anything was copied.
+ */
+static int copy_cluster(uint64_t cluster, uint64_t entry) {
+    uint64_t cluster_size = g_opts.cluster_size;
+    loff_t dst_off = cluster * cluster_size;
+    uint64_t len = spdk_min(cluster_size, g_flatten.size - dst_off);
+    loff_t src_off = dst_off;
+    int fd = g_flatten.image_fd;
+    uint64_t copied = 0;
+
+    if (entry != 0) {
+        fd = g_flatten.layer_fds[entry >> UBI_DELTA_INDEX_SHIFT];
+        src_off = entry & UBI_DELTA_OFFSET_MASK;
+    }
+
+    while (copied < len) {
+        ssize_t n = copy_file_range(fd, &src_off, g_flatten.output_fd, &dst_off,
+                                    len - copied, 0);
+        if (n < 0) {
+            int rc = -errno;
+            if (copied == 0 && (rc == -EXDEV || rc == -EINVAL || rc == -EOPNOTSUPP ||
+                                rc == -ENOSYS)) {
+                return -ENOTSUP;
+            }
+            fprintf(stderr, "could not copy cluster %lu: %s\n", cluster, strerror(-rc));
+            return rc;
+        } else if (n == 0) {
+            /* The image may end within its last cluster, the rest stays a hole. */
+            if (entry != 0) {
+                fprintf(stderr, "could not copy cluster %lu: short read\n", cluster);
+                return -EIO;
+            }
+            break;
+        }
+        copied += n;
+    }
+
+    __atomic_fetch_add(&g_flatten.bytes_read, copied, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_flatten.bytes_written, copied, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_flatten.clusters_copied, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_flatten.clusters_copied_in_kernel, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * slot_read claims the next cluster and submits the read of its data. Clusters
+ * the kernel can copy by itself are copied before the next one is claimed.
+ * Returns false when there's nothing left to copy.
+ */
+static bool slot_read(struct io_uring *ring, struct flatten_slot *slot) {
+    uint64_t cluster_size = g_opts.cluster_size;
+    uint64_t cluster, entry;
+
+    for (;;) {
+        if (__atomic_load_n(&g_flatten.rc, __ATOMIC_RELAXED) != 0) {
+            return false;
+        }
+        uint64_t i = __atomic_fetch_add(&g_flatten.next, 1, __ATOMIC_RELAXED);
+        if (i >= g_flatten.order_count) {
+            return false;
+        }
+
+        cluster = g_flatten.order[i];
+        entry = layer_entry(cluster);
+        if (!__atomic_load_n(&g_flatten.copy_range, __ATOMIC_RELAXED) ||
+            (entry != 0 && g_flatten.layer_lengths[cluster] != 0)) {
+            break;
+        }
+
+        int rc = copy_cluster(cluster, entry);
+        if (rc == -ENOTSUP) {
+            __atomic_store_n(&g_flatten.copy_range, false, __ATOMIC_RELAXED);
+            break;
+        } else if (rc != 0) {
+            set_error(rc);
+            return false;
+        }
+    }
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    slot->state = SLOT_READ;
+    slot->cluster = cluster;
+    slot->clen = 0;
+    if (entry == 0) {
+        io_uring_prep_read(sqe, g_flatten.image_fd, slot->buf, cluster_size,
+                           cluster * cluster_size);
+    } else {
+        int fd = g_flatten.layer_fds[entry >> UBI_DELTA_INDEX_SHIFT];
+        uint64_t offset = entry & UBI_DELTA_OFFSET_MASK;
+        slot->clen = g_flatten.layer_lengths[cluster];
+        if (slot->clen != 0) {
+            io_uring_prep_read(sqe, fd, slot->src, SPDK_ALIGN_CEIL(slot->clen, 4096),
+                               offset);
+        } else {
+            io_uring_prep_read(sqe, fd, slot->buf, cluster_size, offset);
+        }
+    }
+    io_uring_sqe_set_data(sqe, slot);
+    return true;
+}
+
+/*
+ * inflate_cluster decompresses a cluster of a layer. Layers are deflated by
+ * SPDK's accel framework as raw deflate streams.
+ */
+static int inflate_cluster(struct flatten_slot *slot) {
+    z_stream stream = {
+        .next_in = slot->src,
+        .avail_in = slot->clen,
+        .next_out = slot->buf,
+        .avail_out = g_opts.cluster_size,
+    };
+
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        return -ENOMEM;
+    }
+    int zrc = inflate(&stream, Z_FINISH);
+    inflateEnd(&stream);
+    if (zrc != Z_STREAM_END || stream.total_out != g_opts.cluster_size) {
+        fprintf(stderr, "could not decompress cluster %lu\n", slot->cluster);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * deflate_cluster compresses a cluster for a compressed delta output. Returns
+ * the compressed length, or 0 if the cluster should be stored raw because it
+ * doesn't shrink by at least one alignment unit.
+ */
+static uint32_t deflate_cluster(struct flatten_slot *slot) {
+    z_stream stream = {
+        .next_in = slot->buf,
+        .avail_in = g_opts.cluster_size,
+        .next_out = slot->zbuf,
+        .avail_out = g_opts.cluster_size - UBI_DELTA_ALIGN,
+    };
+
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    int zrc = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    return zrc == Z_STREAM_END ? stream.total_out : 0;
+}
+
+/*
+ * slot_write checks a cluster of a layer which was read against its CRC, and
+ * submits its write unless its data is all zeroes. Returns false if nothing
+ * was submitted.
+ */
+static bool slot_write(struct io_uring *ring, struct flatten_slot *slot, int res) {
+    uint64_t cluster_size = g_opts.cluster_size;
+    uint64_t cluster = slot->cluster;
+    uint64_t expected = slot->clen ? slot->clen : cluster_size;
+    uint64_t entry = layer_entry(cluster);
+    uint64_t offset;
+    void *data = slot->buf;
+
+    if (res < 0 || (entry != 0 && (uint64_t)res < expected)) {
+        fprintf(stderr, "could not read cluster %lu: %s\n", cluster,
+                res < 0 ? strerror(-res) : "short read");
+        set_error(-EIO);
+        return false;
+    }
+    __atomic_fetch_add(&g_flatten.bytes_read, res, __ATOMIC_RELAXED);
+
+    if (slot->clen != 0) {
+        int rc = inflate_cluster(slot);
+        if (rc != 0) {
+            set_error(rc);
+            return false;
+        }
+    } else if ((uint64_t)res < cluster_size) {
+        /* The last cluster of the image may be partial. */
+        memset((uint8_t *)slot->buf + res, 0, cluster_size - res);
+    }
+
+    /* A delta output records the CRC of each cluster as well. */
+    uint64_t layer = entry >> UBI_DELTA_INDEX_SHIFT;
+    bool checked = entry != 0 && !((g_flatten.layer_unchecked >> layer) & 1);
+    uint32_t crc = checked || g_opts.format == FLATTEN_FORMAT_DELTA
+                       ? flatten_crc(slot->buf, cluster_size)
+                       : 0;
+    if (checked && crc != g_flatten.layer_crcs[cluster]) {
+        fprintf(stderr, "cluster %lu of %s doesn't match its CRC\n", cluster,
+                g_flatten.layer_paths[layer]);
+        set_error(-EIO);
+        return false;
+    }
+
+    struct iovec iov = {.iov_base = slot->buf, .iov_len = cluster_size};
+    if (ubi_iovs_are_zero(&iov, 1)) {
+        __atomic_fetch_add(&g_flatten.zero_clusters, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if (g_opts.format == FLATTEN_FORMAT_RAW) {
+        offset = cluster * cluster_size;
+        slot->write_len = spdk_min(cluster_size, g_flatten.size - offset);
+    } else {
+        uint32_t clen = g_opts.compress ? deflate_cluster(slot) : 0;
+        slot->write_len = cluster_size;
+        if (clen != 0) {
+            slot->write_len = SPDK_ALIGN_CEIL(clen, UBI_DELTA_ALIGN);
+            memset((uint8_t *)slot->zbuf + clen, 0, slot->write_len - clen);
+            data = slot->zbuf;
+        }
+        offset = __atomic_fetch_add(&g_flatten.append_offset, slot->write_len,
+                                    __ATOMIC_RELAXED);
+        g_flatten.out_offsets[cluster] = offset;
+        g_flatten.out_crcs[cluster] = crc;
+        g_flatten.out_lengths[cluster] = clen;
+    }
+
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    io_uring_prep_write(sqe, g_flatten.output_fd, data, slot->write_len, offset);
+    io_uring_sqe_set_data(sqe, slot);
+    slot->state = SLOT_WRITE;
+    return true;
+}
+
+static void *flatten_thread(void *arg) {
+    uint32_t depth = g_opts.queue_depth;
+    struct flatten_slot *slots = calloc(depth, sizeof(*slots));
+    struct io_uring ring;
+    uint32_t inflight = 0;
+    int rc;
+
+    if (slots == NULL) {
+        set_error(-ENOMEM);
+        return NULL;
+    }
+
+    rc = io_uring_queue_init(depth, &ring, 0);
+    if (rc != 0) {
+        fprintf(stderr, "could not set up io_uring: %s\n", strerror(-rc));
+        set_error(rc);
+        free(slots);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < depth; i++) {
+        if (posix_memalign(&slots[i].src, UBI_DELTA_ALIGN, g_opts.cluster_size) ||
+            posix_memalign(&slots[i].buf, UBI_DELTA_ALIGN, g_opts.cluster_size) ||
+            posix_memalign(&slots[i].zbuf, UBI_DELTA_ALIGN, g_opts.cluster_size)) {
+            set_error(-ENOMEM);
+            break;
+        }
+        inflight += slot_read(&ring, &slots[i]);
+    }
+
+    while (inflight > 0) {
+        struct io_uring_cqe *cqe;
+
+        io_uring_submit(&ring);
+        rc = io_uring_wait_cqe(&ring, &cqe);
+        if (rc != 0) {
+            fprintf(stderr, "io_uring_wait_cqe: %s\n", strerror(-rc));
+            set_error(rc);
+            break;
+        }
+
+        struct flatten_slot *slot = io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+
+        if (slot->state == SLOT_READ && slot_write(&ring, slot, res)) {
+            continue;
+        } else if (slot->state == SLOT_WRITE) {
+            if (res < 0 || (uint64_t)res != slot->write_len) {
+                fprintf(stderr, "could not write cluster %lu: %s\n", slot->cluster,
+                        res < 0 ? strerror(-res) : "short write");
+                set_error(-EIO);
+            } else {
+                __atomic_fetch_add(&g_flatten.bytes_written, res, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&g_flatten.clusters_copied, 1, __ATOMIC_RELAXED);
+            }
+        }
+
+        if (!slot_read(&ring, slot)) {
+            inflight--;
+        }
+    }
+
+    io_uring_queue_exit(&ring);
+    for (uint32_t i = 0; i < depth; i++) {
+        free(slots[i].src);
+        free(slots[i].buf);
+        free(slots[i].zbuf);
+    }
+    free(slots);
+    return NULL;
+}
+
+static int write_all(const void *buf, size_t len, uint64_t offset) {
+    ssize_t n = pwrite(g_flatten.output_fd, buf, len, offset);
+    if (n < 0) {
+        fprintf(stderr, "could not write to %s: %s\n", g_opts.output_path,
+                strerror(errno));
+        return -errno;
+    } else if ((size_t)n != len) {
+        fprintf(stderr, "short write to %s\n", g_opts.output_path);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * write_delta_header writes the header of a delta output. With a table_offset
+ * of 0 the delta reads as incomplete, which it is until the copy finishes.
+ */
+static int write_delta_header(uint64_t table_offset, uint64_t table_count,
+                              uint32_t table_crc) {
+    struct ubi_delta_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, UBI_DELTA_MAGIC, sizeof(header.magic));
+    header.version = UBI_DELTA_VERSION;
+    header.cluster_size = g_opts.cluster_size;
+    header.table_offset = table_offset;
+    header.table_count = table_count;
+    header.table_crc = table_crc;
+    header.compression =
+        g_opts.compress ? UBI_DELTA_COMPRESSION_DEFLATE : UBI_DELTA_COMPRESSION_NONE;
+    header.size = g_flatten.size;
+    header.header_crc = flatten_crc(&header, sizeof(header));
+    return write_all(&header, sizeof(header), 0);
+}
+
+/*
+ * commit_delta writes the extent table of a delta output after its data, and
+ * then the header which points at it.
+ */
+static int commit_delta(void) {
+    struct ubi_delta_extent *extents;
+    uint64_t count = 0;
+
+    extents = calloc(spdk_max(g_flatten.order_count, 1), sizeof(*extents));
+    if (extents == NULL) {
+        return -ENOMEM;
+    }
+    for (uint64_t cluster = 0; cluster < g_flatten.num_clusters; cluster++) {
+        if (g_flatten.out_offsets[cluster] != 0) {
+            extents[count].cluster = cluster;
+            extents[count].offset = g_flatten.out_offsets[cluster];
+            extents[count].crc = g_flatten.out_crcs[cluster];
+            extents[count].length = g_flatten.out_lengths[cluster];
+            count++;
+        }
+    }
+
+    size_t table_len = count * sizeof(*extents);
+    int rc = write_all(extents, table_len, g_flatten.append_offset);
+    if (rc == 0 && fdatasync(g_flatten.output_fd) < 0) {
+        rc = -errno;
+    }
+    if (rc == 0) {
+        rc = write_delta_header(g_flatten.append_offset, count,
+                                flatten_crc(extents, table_len));
+    }
+    free(extents);
+    return rc;
+}
+
+static int open_output(void) {
+    g_flatten.output_fd = open(g_opts.output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (g_flatten.output_fd < 0) {
+        fprintf(stderr, "could not create %s: %s\n", g_opts.output_path,
+                strerror(errno));
+        return -errno;
+    }
+
+    if (g_opts.format == FLATTEN_FORMAT_RAW) {
+        /* Clusters which aren't written stay holes. */
+        if (ftruncate(g_flatten.output_fd, g_flatten.size) < 0) {
+            fprintf(stderr, "could not resize %s: %s\n", g_opts.output_path,
+                    strerror(errno));
+            return -errno;
+        }
+        return 0;
+    }
+
+    g_flatten.out_offsets = calloc(g_flatten.num_clusters, sizeof(uint64_t));
+    g_flatten.out_crcs = calloc(g_flatten.num_clusters, sizeof(uint32_t));
+    g_flatten.out_lengths = calloc(g_flatten.num_clusters, sizeof(uint32_t));
+    if (!g_flatten.out_offsets || !g_flatten.out_crcs || !g_flatten.out_lengths) {
+        return -ENOMEM;
+    }
+    g_flatten.append_offset = UBI_DELTA_DATA_OFFSET;
+    return write_delta_header(0, 0, 0);
+}
+
+static int flatten(void) {
+    uint64_t layers_size = 0;
+    int rc;
+
+    g_flatten.image_fd = -1;
+    g_flatten.output_fd = -1;
+    for (int i = 0; i < UBI_DELTA_MAX_CHAIN; i++) {
+        g_flatten.layer_fds[i] = -1;
+    }
+
+    if (g_opts.image_path) {
+        struct stat st;
+        g_flatten.image_fd = open(g_opts.image_path, O_RDONLY);
+        if (g_flatten.image_fd < 0 || fstat(g_flatten.image_fd, &st) < 0) {
+            fprintf(stderr, "could not open %s: %s\n", g_opts.image_path,
+                    strerror(errno));
+            return -errno;
+        }
+        g_flatten.image_size = st.st_size;
+        rc = load_image_map();
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    rc = load_layers(&layers_size);
+    if (rc != 0) {
+        return rc;
+    }
+
+    /* Legacy deltas don't record the size, so it ends with their last cluster. */
+    if (layers_size == 0) {
+        layers_size = g_flatten.layer_clusters * g_opts.cluster_size;
+    }
+    g_flatten.size = spdk_max(g_flatten.image_size, layers_size);
+    g_flatten.num_clusters = SPDK_CEIL_DIV(g_flatten.size, g_opts.cluster_size);
+
+    rc = build_order();
+    if (rc == 0) {
+        rc = open_output();
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    g_flatten.copy_range = g_opts.format == FLATTEN_FORMAT_RAW && !g_opts.buffered;
+
+    pthread_t threads[MAX_THREADS];
+    uint32_t started = 0;
+    for (; started < g_opts.n_threads; started++) {
+        if (pthread_create(&threads[started], NULL, flatten_thread, NULL) != 0) {
+            set_error(-EAGAIN);
+            break;
+        }
+    }
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    if (g_flatten.rc != 0) {
+        return g_flatten.rc;
+    }
+
+    if (g_opts.format == FLATTEN_FORMAT_DELTA) {
+        rc = commit_delta();
+    }
+    if (rc == 0 && fdatasync(g_flatten.output_fd) < 0) {
+        rc = -errno;
+    }
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    struct timespec start, end;
+
+    if (parse_args(argc, argv) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    ubi_zero_detect_init();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int rc = flatten();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (rc != 0) {
+        fprintf(stderr, "could not flatten into %s: %s\n", g_opts.output_path,
+                strerror(-rc));
+        if (g_flatten.output_fd >= 0) {
+            unlink(g_opts.output_path);
+        }
+        return EXIT_FAILURE;
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double mib = 1024.0 * 1024.0;
+    printf("flattened %s: %lu bytes, %lu of %lu clusters copied, %lu of them in the "
+           "kernel, %lu zero clusters skipped\n",
+           g_opts.output_path, g_flatten.size, g_flatten.clusters_copied,
+           g_flatten.num_clusters, g_flatten.clusters_copied_in_kernel,
+           g_flatten.zero_clusters);
+    printf("read %.1f MiB, wrote %.1f MiB in %.2fs: %.1f MiB/s read, %.1f MiB/s "
+           "written\n",
+           g_flatten.bytes_read / mib, g_flatten.bytes_written / mib, seconds,
+           seconds > 0 ? g_flatten.bytes_read / mib / seconds : 0,
+           seconds > 0 ? g_flatten.bytes_written / mib / seconds : 0);
+    return EXIT_SUCCESS;
+}
@@ -23,6 +23,7 @@ static void ubi_submit_request(struct spdk_io_channel *ch, struct spdk_bdev_io *
 static bool ubi_io_type_supported(void *ctx, enum spdk_bdev_io_type io_type);
 static struct spdk_io_channel *ubi_get_io_channel(void *ctx);
 static void ubi_write_config_json(struct spdk_bdev *bdev, struct spdk_json_write_ctx *w);
+static int ubi_dump_info_json(void *ctx, struct spdk_json_write_ctx *w);
 static void ubi_handle_base_bdev_event(enum spdk_bdev_event_type type,
                                        struct spdk_bdev *bdev, void *event_ctx);
 
@@ -50,6 +51,7 @@ static const struct spdk_bdev_fn_table ubi_fn_table = {
     .io_type_supported = ubi_io_type_supported,
     .get_io_channel = ubi_get_io_channel,
     .write_config_json = ubi_write_config_json,
+    .dump_info_json = ubi_dump_info_json,
 };
 
 static TAILQ_HEAD(, ubi_bdev) g_ubi_bdev_head = TAILQ_HEAD_INITIALIZER(g_ubi_bdev_head);
@@ -57,7 +59,10 @@ static TAILQ_HEAD(, ubi_bdev) g_ubi_bdev_head = TAILQ_HEAD_INITIALIZER(g_ubi_bde
 /*
  * ubi_initialize is called when the module is initialized.
  */
-static int ubi_initialize(void) { return 0; }
+static int ubi_initialize(void) {
+    ubi_zero_detect_init();
+    return 0;
+}
 
 /*
  * ubi_finish is called when the module is finished.
@@ -75,12 +80,58 @@ static int ubi_esnap_dev_create(void *bs_ctx, void *blob_ctx, struct spdk_blob *
     SPDK_WARNLOG("esnap_dev_create\n");
     struct ubi_bdev *ubi_bdev = bs_ctx;
     uint32_t cluster_size = spdk_bs_get_cluster_size(ubi_bdev->blobstore);
-    *bs_dev =
-        bs_dev_uring_create(ubi_bdev->image_path, ubi_bdev->snapshot_path,
-                            ubi_bdev->bdev.blocklen, cluster_size, ubi_bdev->directio);
+    const char *layers[UBI_MAX_LAYERS + 1];
+    int layer_count = 0;
+
+    /*
+     * The device takes its layers from the top down. A delta on a bdev goes
+     * on top, and brings the delta file it's incremental to under it.
+     */
+    if (ubi_bdev->snapshot_path[0]) {
+        layers[layer_count++] = ubi_bdev->snapshot_path;
+    } else if (ubi_bdev->snapshot_delta && ubi_bdev->snapshot_delta->parent[0]) {
+        layers[layer_count++] = ubi_bdev->snapshot_delta->parent;
+    }
+    for (uint32_t i = ubi_bdev->num_layers; i > 0; i--) {
+        layers[layer_count++] = ubi_bdev->layers[i - 1];
+    }
+
+    *bs_dev = bs_dev_uring_create(ubi_bdev->image_path, layers, layer_count,
+                                  ubi_bdev->snapshot_delta, ubi_bdev->bdev.blocklen,
+                                  cluster_size, ubi_bdev->directio);
+    if (*bs_dev == NULL) {
+        return -EINVAL;
+    }
+
+    /*
+     * The first esnap device belongs to the bottom of ubi_bdev->blob's chain,
+     * which stays open as long as the blob does. Devices created later for
+     * temporary clones are not remembered.
+     */
+    if (ubi_bdev->esnap_dev == NULL) {
+        ubi_bdev->esnap_dev = *bs_dev;
+    }
     return 0;
 }
 
+static void ubi_alloc_map_load_complete(void *arg1, int bserrno) {
+    struct ubi_create_context *context = arg1;
+
+    if (bserrno) {
+        UBI_ERRLOG(context->ubi_bdev, "Could not load allocation map: %s\n",
+                   spdk_strerror(-bserrno));
+    } else {
+        bserrno = ubi_partial_init(context->ubi_bdev);
+        if (bserrno) {
+            UBI_ERRLOG(context->ubi_bdev,
+                       "Could not set up sub-cluster copy-on-write: %s\n",
+                       spdk_strerror(-bserrno));
+        }
+    }
+
+    ubi_finish_create(bserrno, context);
+}
+
 static void ubi_blob_open_complete(void *arg1, struct spdk_blob *blob, int bserrno) {
     struct ubi_create_context *context = arg1;
 
@@ -99,7 +150,7 @@ static void ubi_blob_open_complete(void *arg1, struct spdk_blob *blob, int bserr
 
     SPDK_ERRLOG("ubi_blob_open_complete: %lx\n", context->ubi_bdev->blobid);
 
-    ubi_finish_create(0, context);
+    ubi_alloc_map_load(context->ubi_bdev, ubi_alloc_map_load_complete, context);
 }
 
 struct spdk_blob_xattr_opts g_xattrs2 = {0};
@@ -162,6 +213,34 @@ static void ubi_bs_init_complete(void *cb_arg, struct spdk_blob_store *bs, int b
     spdk_bs_create_blob_ext(bs, &context->blob_opts, ubi_blob_create_complete, context);
 }
 
+/* ubi_bs_start loads the blobstore, or initializes it when formatting. */
+static void ubi_bs_start(struct ubi_create_context *context) {
+    struct ubi_bdev *ubi_bdev = context->ubi_bdev;
+
+    if (context->format_bdev) {
+        spdk_bs_init(ubi_bdev->bs_dev, &context->bs_opts, ubi_bs_init_complete, context);
+    } else {
+        spdk_bs_load(ubi_bdev->bs_dev, &context->bs_opts, ubi_bs_init_complete, context);
+    }
+}
+
+static void ubi_snapshot_delta_loaded(void *cb_arg, struct ubi_delta_bdev *delta,
+                                      int rc) {
+    struct ubi_create_context *context = cb_arg;
+
+    if (rc != 0) {
+        UBI_ERRLOG(context->ubi_bdev, "Could not load delta from %s: %s\n",
+                   context->ubi_bdev->snapshot_bdev, spdk_strerror(-rc));
+        /* The blobstore didn't take the base device yet. */
+        context->ubi_bdev->bs_dev->destroy(context->ubi_bdev->bs_dev);
+        ubi_finish_create(rc, context);
+        return;
+    }
+
+    context->ubi_bdev->snapshot_delta = delta;
+    ubi_bs_start(context);
+}
+
 /*
  * bdev_ubi_create. Creates a ubi_bdev and registers it.
  *
@@ -179,6 +258,30 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
         return;
     }
 
+    bool has_snapshot_path = opts->snapshot_path && opts->snapshot_path[0];
+    bool has_snapshot_bdev = opts->snapshot_bdev && opts->snapshot_bdev[0];
+    if ((!opts->image_path || !opts->image_path[0]) && !has_snapshot_path &&
+        !has_snapshot_bdev && opts->num_layers == 0) {
+        SPDK_ERRLOG("Ubi bdev %s needs an image_path, layers or a snapshot.\n",
+                    opts->name);
+        ubi_finish_create(-EINVAL, context);
+        return;
+    }
+
+    if (has_snapshot_path && has_snapshot_bdev) {
+        SPDK_ERRLOG("Ubi bdev %s can't have both a snapshot_path and a snapshot_bdev.\n",
+                    opts->name);
+        ubi_finish_create(-EINVAL, context);
+        return;
+    }
+
+    if (opts->num_layers > UBI_MAX_LAYERS) {
+        SPDK_ERRLOG("Ubi bdev %s has %u layers, at most %d are supported.\n", opts->name,
+                    opts->num_layers, UBI_MAX_LAYERS);
+        ubi_finish_create(-EINVAL, context);
+        return;
+    }
+
     /*
      * By using calloc() we initialize the memory region to all 0, which also
      * ensures that metadata, strip_status, and metadata_dirty are all 0
@@ -207,14 +310,23 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
     /* Save the thread where the base device is opened. */
     ubi_bdev->thread = spdk_get_thread();
 
+    pthread_mutex_init(&ubi_bdev->partial.lock, NULL);
+
     /*
      * Initialize variables that determine the layout of both metadata and
      * actual data on base bdev.
      */
     ubi_bdev->no_sync = opts->no_sync;
+    ubi_bdev->subcluster_cow = opts->subcluster_cow;
+    ubi_bdev->zero_detect = opts->zero_detect;
 
-    strncpy(ubi_bdev->image_path, opts->image_path, UBI_PATH_LEN);
-    ubi_bdev->image_path[UBI_PATH_LEN - 1] = 0;
+    /* Without an image, the bdev reads the snapshot chain on its own. */
+    if (opts->image_path) {
+        strncpy(ubi_bdev->image_path, opts->image_path, UBI_PATH_LEN);
+        ubi_bdev->image_path[UBI_PATH_LEN - 1] = 0;
+    } else {
+        ubi_bdev->image_path[0] = 0;
+    }
 
     if (opts->snapshot_path) {
         strncpy(ubi_bdev->snapshot_path, opts->snapshot_path, UBI_PATH_LEN);
@@ -223,6 +335,19 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
         ubi_bdev->snapshot_path[0] = 0;
     }
 
+    for (uint32_t i = 0; i < opts->num_layers; i++) {
+        strncpy(ubi_bdev->layers[i], opts->layers[i], UBI_PATH_LEN);
+        ubi_bdev->layers[i][UBI_PATH_LEN - 1] = 0;
+    }
+    ubi_bdev->num_layers = opts->num_layers;
+
+    if (has_snapshot_bdev) {
+        strncpy(ubi_bdev->snapshot_bdev, opts->snapshot_bdev, UBI_PATH_LEN);
+        ubi_bdev->snapshot_bdev[UBI_PATH_LEN - 1] = 0;
+    } else {
+        ubi_bdev->snapshot_bdev[0] = 0;
+    }
+
     rc = spdk_bdev_create_bs_dev_ext(opts->base_bdev_name, ubi_handle_base_bdev_event,
                                      NULL, &ubi_bdev->bs_dev);
     if (rc) {
@@ -254,10 +379,15 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
     context->bs_opts.esnap_ctx = ubi_bdev;
     context->bs_opts.max_channel_ops = 20000;
 
-    if (opts->format_bdev) {
-        spdk_bs_init(ubi_bdev->bs_dev, &context->bs_opts, ubi_bs_init_complete, context);
-    } else {
-        spdk_bs_load(ubi_bdev->bs_dev, &context->bs_opts, ubi_bs_init_complete, context);
+    if (!has_snapshot_bdev) {
+        ubi_bs_start(context);
+        return;
+    }
+
+    /* The delta's extents are read before the blobstore needs its device. */
+    rc = ubi_delta_bdev_load(ubi_bdev->snapshot_bdev, ubi_snapshot_delta_loaded, context);
+    if (rc != 0) {
+        ubi_snapshot_delta_loaded(context, NULL, rc);
     }
 }
 
@@ -267,6 +397,10 @@ static void ubi_destruct_bs_unload_cb(void *cb_arg, int bserrno) {
     if (bserrno) {
         UBI_ERRLOG(ubi_bdev, "Could not unload blobstore: %s\n", spdk_strerror(-bserrno));
     }
+
+    /* The esnap devices reading the delta went away with the blobstore. */
+    ubi_delta_bdev_close(ubi_bdev->snapshot_delta);
+    ubi_bdev->snapshot_delta = NULL;
 }
 
 static void ubi_destruct_blob_close_cb(void *cb_arg, int bserrno) {
@@ -313,6 +447,10 @@ static void ubi_finish_create(int status, struct ubi_create_context *context) {
             spdk_io_device_unregister(ubi_bdev, NULL);
         }
 
+        if (ubi_bdev->partial.map) {
+            ubi_partial_stop(ubi_bdev, NULL, NULL);
+        }
+
         if (ubi_bdev->blob) {
             spdk_blob_close(ubi_bdev->blob, ubi_destruct_blob_close_cb, ubi_bdev);
         } else {
@@ -345,17 +483,15 @@ static void _device_unregister_cb(void *io_device) {
     struct ubi_bdev *ubi_bdev = io_device;
 
     /* Done with this ubi_bdev. */
+    pthread_mutex_destroy(&ubi_bdev->partial.lock);
+    free(ubi_bdev->partial.map);
+    free(ubi_bdev->alloc_map);
     free(ubi_bdev->bdev.name);
     free(ubi_bdev);
 }
 
-/*
- * ubi_destruct. Given a pointer to a ubi_bdev, destruct it.
- */
-static int ubi_destruct(void *ctx) {
-    struct ubi_bdev *ubi_bdev = ctx;
-
-    TAILQ_REMOVE(&g_ubi_bdev_head, ubi_bdev, tailq);
+static void ubi_destruct_partial_stopped(void *cb_arg, int bserrno) {
+    struct ubi_bdev *ubi_bdev = cb_arg;
 
     if (ubi_bdev->blob) {
         spdk_blob_close(ubi_bdev->blob, ubi_destruct_blob_close_cb, ubi_bdev);
@@ -363,10 +499,24 @@ static int ubi_destruct(void *ctx) {
         ubi_destruct_blob_close_cb(ubi_bdev, 0);
     }
 
+    spdk_bdev_destruct_done(&ubi_bdev->bdev, 0);
+
     /* Unregister the io_device. */
     spdk_io_device_unregister(ubi_bdev, _device_unregister_cb);
+}
 
-    return 0;
+/*
+ * ubi_destruct. Given a pointer to a ubi_bdev, destruct it. Destruction is
+ * asynchronous since the sub-cluster filler may have I/O in flight.
+ */
+static int ubi_destruct(void *ctx) {
+    struct ubi_bdev *ubi_bdev = ctx;
+
+    TAILQ_REMOVE(&g_ubi_bdev_head, ubi_bdev, tailq);
+
+    ubi_partial_stop(ubi_bdev, ubi_destruct_partial_stopped, ubi_bdev);
+
+    return 1;
 }
 
 /*
@@ -383,11 +533,54 @@ static void ubi_write_config_json(struct spdk_bdev *bdev, struct spdk_json_write
     spdk_json_write_named_object_begin(w, "params");
     spdk_json_write_named_string(w, "name", bdev->name);
     spdk_json_write_named_string(w, "image_path", ubi_bdev->image_path);
+    if (ubi_bdev->num_layers > 0) {
+        spdk_json_write_named_array_begin(w, "layers");
+        for (uint32_t i = 0; i < ubi_bdev->num_layers; i++) {
+            spdk_json_write_string(w, ubi_bdev->layers[i]);
+        }
+        spdk_json_write_array_end(w);
+    }
+    if (ubi_bdev->snapshot_path[0]) {
+        spdk_json_write_named_string(w, "snapshot_path", ubi_bdev->snapshot_path);
+    }
+    if (ubi_bdev->snapshot_bdev[0]) {
+        spdk_json_write_named_string(w, "snapshot_bdev", ubi_bdev->snapshot_bdev);
+    }
+    spdk_json_write_named_bool(w, "subcluster_cow", ubi_bdev->subcluster_cow);
+    spdk_json_write_named_bool(w, "zero_detect", ubi_bdev->zero_detect);
     spdk_json_write_object_end(w);
 
     spdk_json_write_object_end(w);
 }
 
+/*
+ * ubi_dump_info_json writes ubi specific information about the given bdev,
+ * which is reported by bdev_get_bdevs. The counters can't be summed while
+ * writing, so the last sum is reported and a new one started for next time.
+ */
+static int ubi_dump_info_json(void *ctx, struct spdk_json_write_ctx *w) {
+    struct ubi_bdev *ubi_bdev = ctx;
+    struct ubi_io_stats stats = {0};
+    const uint64_t *last = (const uint64_t *)&ubi_bdev->last_stats;
+    uint64_t *s = (uint64_t *)&stats;
+
+    for (size_t i = 0; i < sizeof(stats) / sizeof(uint64_t); i++) {
+        s[i] = __atomic_load_n(&last[i], __ATOMIC_RELAXED);
+    }
+    ubi_get_io_stats(ubi_bdev, NULL, NULL);
+
+    spdk_json_write_named_object_begin(w, "ubi");
+    spdk_json_write_named_string(w, "image_path", ubi_bdev->image_path);
+    spdk_json_write_named_bool(w, "subcluster_cow", ubi_bdev->subcluster_cow);
+    spdk_json_write_named_bool(w, "zero_detect", ubi_bdev->zero_detect);
+    spdk_json_write_named_object_begin(w, "stats");
+    ubi_stats_write_json(ubi_bdev, &stats, w);
+    spdk_json_write_object_end(w);
+    spdk_json_write_object_end(w);
+
+    return 0;
+}
+
 /*
  * ubi_io_type_supported determines which I/O operations are supported.
  */
@@ -400,13 +593,10 @@ static bool ubi_io_type_supported(void *ctx, enum spdk_bdev_io_type io_type) {
     case SPDK_BDEV_IO_TYPE_READ:
     case SPDK_BDEV_IO_TYPE_WRITE:
     case SPDK_BDEV_IO_TYPE_FLUSH:
-        return true;
     case SPDK_BDEV_IO_TYPE_WRITE_ZEROES:
-        /*
-         * Write zeros to given address range. We don't support it explicitly
-         * yet. Generic bdev code is capable if emulating this by sending
-         * regular writes.
-         */
+    case SPDK_BDEV_IO_TYPE_SEEK_DATA:
+    case SPDK_BDEV_IO_TYPE_SEEK_HOLE:
+        return true;
     case SPDK_BDEV_IO_TYPE_RESET:
         /*
          * Request to abort all I/O and return the underlying device to its
@@ -428,24 +618,170 @@ static bool ubi_io_type_supported(void *ctx, enum spdk_bdev_io_type io_type) {
 
 static void ubi_blob_io_complete(void *cb_arg, int bserrno) {
     struct spdk_bdev_io *bdev_io = cb_arg;
-    if (bserrno) {
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+
+    if (bserrno == -ENOMEM) {
+        ubi_queue_retry(ubi_io->ubi_ch, bdev_io);
+        return;
+    } else if (bserrno) {
         SPDK_ERRLOG(
             "I/O error: %s, io_type: %d, offset_blocks: 0x%lu, size_blocks: %lu\n",
             spdk_strerror(-bserrno), bdev_io->type, bdev_io->u.bdev.offset_blocks,
             bdev_io->u.bdev.num_blocks);
     }
-    spdk_bdev_io_complete(bdev_io, bserrno ? SPDK_BDEV_IO_STATUS_FAILED
-                                           : SPDK_BDEV_IO_STATUS_SUCCESS);
+    ubi_io_complete(bdev_io, bserrno ? SPDK_BDEV_IO_STATUS_FAILED
+                                     : SPDK_BDEV_IO_STATUS_SUCCESS);
+}
+
+static void ubi_write_zeroes_complete(void *cb_arg, int bserrno) {
+    struct spdk_bdev_io *bdev_io = cb_arg;
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+
+    if (bserrno == -ENOMEM) {
+        if (ubi_io->status == SPDK_BDEV_IO_STATUS_SUCCESS) {
+            ubi_io->status = SPDK_BDEV_IO_STATUS_NOMEM;
+        }
+    } else if (bserrno) {
+        SPDK_ERRLOG("write_zeroes error: %s, offset_blocks: %lu, size_blocks: %lu\n",
+                    spdk_strerror(-bserrno), bdev_io->u.bdev.offset_blocks,
+                    bdev_io->u.bdev.num_blocks);
+        ubi_io->status = SPDK_BDEV_IO_STATUS_FAILED;
+    }
+
+    if (--ubi_io->outstanding > 0) {
+        return;
+    }
+
+    /* Writing zeroes is idempotent, so the whole request can be retried. */
+    if (ubi_io->status == SPDK_BDEV_IO_STATUS_NOMEM) {
+        ubi_queue_retry(ubi_io->ubi_ch, bdev_io);
+    } else {
+        ubi_io_complete(bdev_io, ubi_io->status);
+    }
 }
 
 /*
- * ubi_submit_request is called when an I/O request arrives. It will enqueue
- * an stripe fetch if necessary, and then enqueue the I/O request so it is
- * served in the poller.
+ * ubi_submit_write_zeroes serves a WRITE_ZEROES request. Clusters which
+ * already read as zeroes are skipped, so they are neither allocated nor copied
+ * from the image. The remaining ranges are passed to the blobstore, which
+ * zeroes allocated clusters on the base bdev without transferring any data.
+ */
+static void ubi_submit_write_zeroes(struct ubi_io_channel *ch,
+                                    struct spdk_bdev_io *bdev_io) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+    uint64_t blocks_per_cluster = ubi_bdev->blocks_per_cluster;
+    uint64_t offset = bdev_io->u.bdev.offset_blocks;
+    uint64_t end = offset + bdev_io->u.bdev.num_blocks;
+
+    /* Hold a reference so that the I/O isn't completed while being split. */
+    ubi_io->outstanding = 1;
+    ubi_io->status = SPDK_BDEV_IO_STATUS_SUCCESS;
+
+    while (offset < end) {
+        uint64_t cluster = offset / blocks_per_cluster;
+        uint64_t segment_end = spdk_min((cluster + 1) * blocks_per_cluster, end);
+
+        if (ubi_cluster_reads_zeroes(ubi_bdev, cluster)) {
+            offset = segment_end;
+            continue;
+        }
+
+        /* Merge following clusters which need zeroing into the same request. */
+        while (segment_end < end &&
+               !ubi_cluster_reads_zeroes(ubi_bdev, segment_end / blocks_per_cluster)) {
+            segment_end = spdk_min(segment_end + blocks_per_cluster, end);
+        }
+
+        /*
+         * Zeroing a partial cluster would race with its filler. Retrying the
+         * whole request is fine, since writing zeroes is idempotent.
+         */
+        if (!ubi_partial_claim(ch, offset, segment_end - offset)) {
+            ubi_io->status = SPDK_BDEV_IO_STATUS_NOMEM;
+            break;
+        }
+
+        ubi_io->outstanding++;
+        spdk_blob_io_write_zeroes(ubi_bdev->blob, ch->bs_channel, offset,
+                                  segment_end - offset, ubi_write_zeroes_complete,
+                                  bdev_io);
+        offset = segment_end;
+    }
+
+    ubi_write_zeroes_complete(bdev_io, 0);
+}
+
+/*
+ * ubi_write_is_elidable returns true if the given write only has zeroes and
+ * goes to clusters which already read as zeroes, so that completing it without
+ * touching the blob leaves the bdev's content unchanged and saves allocating
+ * the clusters. The cluster check is done first since it's cheaper and fails
+ * for most writes.
+ */
+static bool ubi_write_is_elidable(struct ubi_bdev *ubi_bdev,
+                                  struct spdk_bdev_io *bdev_io) {
+    uint64_t offset = bdev_io->u.bdev.offset_blocks;
+    uint64_t end = offset + bdev_io->u.bdev.num_blocks;
+    uint64_t first = offset / ubi_bdev->blocks_per_cluster;
+    uint64_t last = (end - 1) / ubi_bdev->blocks_per_cluster;
+
+    for (uint64_t cluster = first; cluster <= last; cluster++) {
+        if (!ubi_cluster_reads_zeroes(ubi_bdev, cluster)) {
+            return false;
+        }
+    }
+
+    return ubi_iovs_are_zero(bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt);
+}
+
+/*
+ * ubi_read_source tells where a read starting at the given block gets its
+ * data from. Reads never cross a cluster boundary, since they're split on
+ * sector boundaries.
+ */
+static enum ubi_read_source ubi_read_source(struct ubi_bdev *ubi_bdev,
+                                            uint64_t offset_blocks) {
+    uint64_t cluster = offset_blocks / ubi_bdev->blocks_per_cluster;
+
+    if (ubi_cluster_is_allocated(ubi_bdev, cluster)) {
+        return UBI_READ_BLOB;
+    } else if (ubi_cluster_reads_zeroes(ubi_bdev, cluster)) {
+        return UBI_READ_ZEROES;
+    }
+    return UBI_READ_IMAGE;
+}
+
+/*
+ * ubi_submit_request is called when an I/O request arrives.
  */
 static void ubi_submit_request(struct spdk_io_channel *_ch,
                                struct spdk_bdev_io *bdev_io) {
     struct ubi_io_channel *ch = spdk_io_channel_get_ctx(_ch);
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+
+    ubi_io->submit_tsc = spdk_get_ticks();
+    spdk_trace_record_tsc(ubi_io->submit_tsc, TRACE_BDEV_UBI_IO_START, 0,
+                          bdev_io->u.bdev.num_blocks * bdev_io->bdev->blocklen,
+                          (uintptr_t)bdev_io, bdev_io->type,
+                          bdev_io->u.bdev.offset_blocks, bdev_io->u.bdev.num_blocks);
+    if (bdev_io->type == SPDK_BDEV_IO_TYPE_READ) {
+        UBI_STAT_ADD(ch, active_reads, 1);
+    }
+    if (spdk_unlikely(__atomic_load_n(&ubi_bdev->pause.start_tsc, __ATOMIC_RELAXED))) {
+        ubi_pause_account_io(ubi_bdev, bdev_io);
+    }
+
+    ubi_submit_io(ch, bdev_io);
+}
+
+/*
+ * ubi_submit_io serves an I/O request on the given channel. It's also called
+ * by the channel's poller to resubmit I/O which was queued for retry.
+ */
+void ubi_submit_io(struct ubi_io_channel *ch, struct spdk_bdev_io *bdev_io) {
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
     struct ubi_bdev *ubi_bdev = bdev_io->bdev->ctxt;
     struct spdk_blob *blob = ubi_bdev->blob;
     struct spdk_io_channel *blob_ch = ch->bs_channel;
@@ -453,21 +789,47 @@ static void ubi_submit_request(struct spdk_io_channel *_ch,
     uint64_t offset = bdev_io->u.bdev.offset_blocks;
     uint64_t length = bdev_io->u.bdev.num_blocks;
 
+    ubi_io->ubi_bdev = ubi_bdev;
+    ubi_io->ubi_ch = ch;
+
     switch (bdev_io->type) {
     case SPDK_BDEV_IO_TYPE_READ:
+        ubi_io->read_source = ubi_read_source(ubi_bdev, offset);
+        if (ubi_partial_submit_read(ch, bdev_io)) {
+            break;
+        }
         spdk_blob_io_readv(blob, blob_ch, bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt,
                            offset, length, ubi_blob_io_complete, bdev_io);
         break;
     case SPDK_BDEV_IO_TYPE_WRITE:
+        if (ubi_bdev->zero_detect && ubi_write_is_elidable(ubi_bdev, bdev_io)) {
+            UBI_STAT_ADD(ch, zero_writes_elided, 1);
+            ubi_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_SUCCESS);
+            break;
+        }
+        if (ubi_partial_submit_write(ch, bdev_io)) {
+            break;
+        }
         spdk_blob_io_writev(blob, blob_ch, bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt,
                             offset, length, ubi_blob_io_complete, bdev_io);
         break;
+    case SPDK_BDEV_IO_TYPE_WRITE_ZEROES:
+        ubi_submit_write_zeroes(ch, bdev_io);
+        break;
     case SPDK_BDEV_IO_TYPE_FLUSH:
-        spdk_bdev_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_SUCCESS);
+        ubi_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_SUCCESS);
+        break;
+    case SPDK_BDEV_IO_TYPE_SEEK_DATA:
+        bdev_io->u.bdev.seek.offset = ubi_next_data_block(ubi_bdev, offset);
+        ubi_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_SUCCESS);
+        break;
+    case SPDK_BDEV_IO_TYPE_SEEK_HOLE:
+        bdev_io->u.bdev.seek.offset = ubi_next_hole_block(ubi_bdev, offset);
+        ubi_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_SUCCESS);
         break;
     default:
         UBI_ERRLOG(ubi_bdev, "Unsupported I/O type %d\n", bdev_io->type);
-        spdk_bdev_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_FAILED);
+        ubi_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_FAILED);
         return;
     }
 }
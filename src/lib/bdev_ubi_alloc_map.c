@@ -0,0 +1,213 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/blob.h"
+#include "spdk/log.h"
+
+/*
+ * The allocation map answers "can this cluster hold anything but image data?"
+ * without walking the blob chain on every I/O. It is built once when the bdev
+ * is opened, by scanning the blob and all of its snapshots, and afterwards
+ * kept up to date by the write paths.
+ */
+
+struct alloc_map_load_ctx {
+    struct ubi_bdev *ubi_bdev;
+    spdk_blob_id blobid;
+    spdk_blob_op_complete cb_fn;
+    void *cb_arg;
+};
+
+static void alloc_map_load_next(struct alloc_map_load_ctx *ctx);
+
+static void alloc_map_load_done(struct alloc_map_load_ctx *ctx, int bserrno) {
+    ctx->cb_fn(ctx->cb_arg, bserrno);
+    free(ctx);
+}
+
+/*
+ * alloc_map_mark_blob sets the bits of all clusters allocated in the given
+ * blob.
+ */
+static void alloc_map_mark_blob(struct ubi_bdev *ubi_bdev, struct spdk_blob *blob) {
+    uint64_t num_io_units = spdk_blob_get_num_io_units(blob);
+    uint64_t offset = spdk_blob_get_next_allocated_io_unit(blob, 0);
+
+    while (offset < num_io_units) {
+        uint64_t end = spdk_blob_get_next_unallocated_io_unit(blob, offset);
+        if (end > num_io_units) {
+            end = num_io_units;
+        }
+
+        ubi_alloc_map_mark(ubi_bdev, offset, end - offset);
+        offset = spdk_blob_get_next_allocated_io_unit(blob, end);
+    }
+}
+
+static void alloc_map_close_cb(void *cb_arg, int bserrno) {
+    struct alloc_map_load_ctx *ctx = cb_arg;
+
+    if (bserrno) {
+        UBI_ERRLOG(ctx->ubi_bdev, "Could not close snapshot blob: %s\n",
+                   spdk_strerror(-bserrno));
+        alloc_map_load_done(ctx, bserrno);
+        return;
+    }
+
+    alloc_map_load_next(ctx);
+}
+
+static void alloc_map_open_cb(void *cb_arg, struct spdk_blob *blob, int bserrno) {
+    struct alloc_map_load_ctx *ctx = cb_arg;
+
+    if (bserrno) {
+        UBI_ERRLOG(ctx->ubi_bdev, "Could not open snapshot blob: %s\n",
+                   spdk_strerror(-bserrno));
+        alloc_map_load_done(ctx, bserrno);
+        return;
+    }
+
+    alloc_map_mark_blob(ctx->ubi_bdev, blob);
+    spdk_blob_close(blob, alloc_map_close_cb, ctx);
+}
+
+static void alloc_map_load_next(struct alloc_map_load_ctx *ctx) {
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+    spdk_blob_id parent = spdk_blob_get_parent_snapshot(ubi_bdev->blobstore, ctx->blobid);
+
+    if (parent == SPDK_BLOBID_INVALID || parent == SPDK_BLOBID_EXTERNAL_SNAPSHOT) {
+        alloc_map_load_done(ctx, 0);
+        return;
+    }
+
+    ctx->blobid = parent;
+    spdk_bs_open_blob(ubi_bdev->blobstore, parent, alloc_map_open_cb, ctx);
+}
+
+/*
+ * ubi_alloc_map_load allocates the allocation map of ubi_bdev and fills it
+ * from ubi_bdev->blob and its snapshot chain. cb_fn is always called.
+ */
+void ubi_alloc_map_load(struct ubi_bdev *ubi_bdev, spdk_blob_op_complete cb_fn,
+                        void *cb_arg) {
+    struct spdk_blob_store *bs = ubi_bdev->blobstore;
+    struct alloc_map_load_ctx *ctx;
+
+    ubi_bdev->cluster_size = spdk_bs_get_cluster_size(bs);
+    ubi_bdev->blocks_per_cluster = ubi_bdev->cluster_size / spdk_bs_get_io_unit_size(bs);
+    ubi_bdev->num_clusters = spdk_blob_get_num_clusters(ubi_bdev->blob);
+    ubi_bdev->alloc_map =
+        calloc(SPDK_CEIL_DIV(ubi_bdev->num_clusters, 64), sizeof(uint64_t));
+    if (ubi_bdev->alloc_map == NULL) {
+        UBI_ERRLOG(ubi_bdev, "could not allocate allocation map\n");
+        cb_fn(cb_arg, -ENOMEM);
+        return;
+    }
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        cb_fn(cb_arg, -ENOMEM);
+        return;
+    }
+
+    ctx->ubi_bdev = ubi_bdev;
+    ctx->blobid = ubi_bdev->blobid;
+    ctx->cb_fn = cb_fn;
+    ctx->cb_arg = cb_arg;
+
+    alloc_map_mark_blob(ubi_bdev, ubi_bdev->blob);
+    alloc_map_load_next(ctx);
+}
+
+/*
+ * ubi_alloc_map_mark marks all clusters overlapping the given block range as
+ * allocated. It can be called from any thread. Returns the number of clusters
+ * newly marked by this call which have data in the image, i.e. which the
+ * blobstore will copy from the image when allocating them.
+ */
+uint64_t ubi_alloc_map_mark(struct ubi_bdev *ubi_bdev, uint64_t offset_blocks,
+                            uint64_t num_blocks) {
+    struct spdk_bs_dev *esnap_dev = ubi_bdev->esnap_dev;
+    uint64_t first, last, copies = 0;
+
+    if (num_blocks == 0) {
+        return 0;
+    }
+
+    first = offset_blocks / ubi_bdev->blocks_per_cluster;
+    last = (offset_blocks + num_blocks - 1) / ubi_bdev->blocks_per_cluster;
+    for (uint64_t cluster = first; cluster <= last && cluster < ubi_bdev->num_clusters;
+         cluster++) {
+        uint64_t bit = 1ULL << (cluster % 64);
+        uint64_t *word = &ubi_bdev->alloc_map[cluster / 64];
+        if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0) {
+            continue;
+        }
+
+        bool copy = esnap_dev != NULL &&
+                    !esnap_dev->is_zeroes(
+                        esnap_dev, cluster * ubi_bdev->cluster_size / esnap_dev->blocklen,
+                        ubi_bdev->cluster_size / esnap_dev->blocklen);
+        if ((__atomic_fetch_or(word, bit, __ATOMIC_RELEASE) & bit) == 0 && copy) {
+            copies++;
+        }
+    }
+
+    return copies;
+}
+
+bool ubi_cluster_is_allocated(struct ubi_bdev *ubi_bdev, uint64_t cluster) {
+    uint64_t word = __atomic_load_n(&ubi_bdev->alloc_map[cluster / 64], __ATOMIC_ACQUIRE);
+    return (word >> (cluster % 64)) & 1;
+}
+
+/*
+ * ubi_cluster_reads_zeroes returns true if the cluster isn't allocated in the
+ * blob chain and the image doesn't have data for it, i.e. if it is a hole in
+ * the image or lies past the end of the image.
+ */
+bool ubi_cluster_reads_zeroes(struct ubi_bdev *ubi_bdev, uint64_t cluster) {
+    struct spdk_bs_dev *esnap_dev = ubi_bdev->esnap_dev;
+    uint64_t lba, lba_count;
+
+    if (esnap_dev == NULL || ubi_cluster_is_allocated(ubi_bdev, cluster)) {
+        return false;
+    }
+
+    lba = cluster * ubi_bdev->cluster_size / esnap_dev->blocklen;
+    lba_count = ubi_bdev->cluster_size / esnap_dev->blocklen;
+    return esnap_dev->is_zeroes(esnap_dev, lba, lba_count);
+}
+
+/*
+ * ubi_next_data_block returns the first block at or after offset_blocks which
+ * may hold non-zero data, or UINT64_MAX if there is none.
+ */
+uint64_t ubi_next_data_block(struct ubi_bdev *ubi_bdev, uint64_t offset_blocks) {
+    uint64_t blocks_per_cluster = ubi_bdev->blocks_per_cluster;
+
+    for (uint64_t cluster = offset_blocks / blocks_per_cluster;
+         cluster < ubi_bdev->num_clusters; cluster++) {
+        if (!ubi_cluster_reads_zeroes(ubi_bdev, cluster)) {
+            return spdk_max(offset_blocks, cluster * blocks_per_cluster);
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+/*
+ * ubi_next_hole_block returns the first block at or after offset_blocks which
+ * is known to read as zeroes, or the block count of the bdev if there is none.
+ */
+uint64_t ubi_next_hole_block(struct ubi_bdev *ubi_bdev, uint64_t offset_blocks) {
+    uint64_t blocks_per_cluster = ubi_bdev->blocks_per_cluster;
+
+    for (uint64_t cluster = offset_blocks / blocks_per_cluster;
+         cluster < ubi_bdev->num_clusters; cluster++) {
+        if (ubi_cluster_reads_zeroes(ubi_bdev, cluster)) {
+            return spdk_max(offset_blocks, cluster * blocks_per_cluster);
+        }
+    }
+
+    return ubi_bdev->bdev.blockcnt;
+}
@@ -0,0 +1,402 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/blob.h"
+#include "spdk/env.h"
+#include "spdk/log.h"
+#include "spdk/thread.h"
+
+/*
+ * Snapshot export. Copies the clusters a blob owns to a bs_dev, keeping up to
+ * queue_depth clusters in flight on each of num_threads workers. Every slot of
+ * a worker runs its own pipeline: read the cluster from the blob, write it to
+ * the bs_dev, which checks for zeroes, then claim the next cluster. Clusters
+ * are claimed from a shared list with an atomic counter, so workers stay busy
+ * until the list runs out whatever their speed.
+ *
+ * The first worker runs on the thread which started the export, and the others
+ * on threads created for them, which exit when their worker is done. The
+ * export completes once the delta device has committed, after its last
+ * channel is destroyed.
+ */
+#define UBI_EXPORT_STATUS_PERIOD_US 100000
+
+struct ubi_export_worker;
+
+struct ubi_export_slot {
+    struct ubi_export_worker *worker;
+    void *buf;
+    uint64_t cluster;
+    struct spdk_bs_dev_cb_args cb_args;
+};
+
+struct ubi_export_worker {
+    struct ubi_export *export;
+    struct spdk_thread *thread;
+    struct spdk_io_channel *bs_channel;
+    struct spdk_io_channel *dst_channel;
+    struct ubi_export_slot *slots;
+    /* slots which are reading or writing, plus one while the worker starts */
+    uint32_t active;
+};
+
+struct ubi_export {
+    struct spdk_blob_store *bs;
+    struct spdk_blob *blob;
+    struct spdk_bs_dev *dst;
+    struct spdk_thread *thread;
+
+    /*
+     * Channel of dst which is held until every worker is done, so that the
+     * bs_dev doesn't see its channels drop to none between workers.
+     */
+    struct spdk_io_channel *dst_channel;
+    struct spdk_poller *status_poller;
+
+    uint64_t cluster_size;
+    uint64_t io_units_per_cluster;
+    uint32_t queue_depth;
+    uint32_t num_threads;
+
+    /* clusters the blob owns, in order */
+    uint64_t *clusters;
+    uint64_t cluster_count;
+
+    /* Shared by the workers, updated with atomics. */
+    uint64_t next;
+    uint64_t copied;
+    int rc;
+
+    struct ubi_export_worker *workers;
+    uint32_t workers_done;
+    /* the blob close and the commit of dst, if it had channels, to wait for */
+    uint32_t pending;
+
+    ubi_export_status_fn status_fn;
+    spdk_blob_op_complete done_fn;
+    void *cb_arg;
+};
+
+static void export_slot_next(struct ubi_export_slot *slot);
+
+static void export_fail(struct ubi_export *export, int rc) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&export->rc, &expected, rc, false, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+}
+
+static void export_free(struct ubi_export *export) {
+    if (export->workers != NULL) {
+        for (uint32_t i = 0; i < export->num_threads; i++) {
+            free(export->workers[i].slots);
+        }
+    }
+    free(export->workers);
+    free(export->clusters);
+    free(export);
+}
+
+static int export_status_poll(void *arg) {
+    struct ubi_export *export = arg;
+
+    export->status_fn(__atomic_load_n(&export->copied, __ATOMIC_RELAXED),
+                      export->cluster_count, export->cb_arg);
+    return SPDK_POLLER_BUSY;
+}
+
+static void export_put(struct ubi_export *export) {
+    if (--export->pending != 0) {
+        return;
+    }
+
+    export->done_fn(export->cb_arg, export->rc);
+    export_free(export);
+}
+
+static void export_blob_closed(void *cb_arg, int bserrno) {
+    struct ubi_export *export = cb_arg;
+
+    if (bserrno != 0) {
+        export_fail(export, bserrno);
+    }
+    export_put(export);
+}
+
+static void export_dst_committed(void *cb_arg, int rc) {
+    struct ubi_export *export = cb_arg;
+
+    if (rc != 0) {
+        SPDK_ERRLOG("could not commit export: %s\n", spdk_strerror(-rc));
+        export_fail(export, rc);
+    }
+    export_put(export);
+}
+
+/*
+ * export_worker_done runs on the thread which started the export. Once every
+ * worker is done, the held channel of dst is released and the blob closed.
+ */
+static void export_worker_done(void *arg) {
+    struct ubi_export *export = arg;
+
+    if (++export->workers_done < export->num_threads) {
+        return;
+    }
+
+    spdk_poller_unregister(&export->status_poller);
+    export_status_poll(export);
+    export->dst->destroy_channel(export->dst, export->dst_channel);
+    spdk_blob_close(export->blob, export_blob_closed, export);
+}
+
+static void export_worker_finish(struct ubi_export_worker *worker) {
+    struct ubi_export *export = worker->export;
+
+    for (uint32_t i = 0; i < export->queue_depth; i++) {
+        spdk_dma_free(worker->slots[i].buf);
+        worker->slots[i].buf = NULL;
+    }
+    if (worker->bs_channel != NULL) {
+        spdk_bs_free_io_channel(worker->bs_channel);
+    }
+    if (worker->dst_channel != NULL) {
+        export->dst->destroy_channel(export->dst, worker->dst_channel);
+    }
+
+    spdk_thread_send_msg(export->thread, export_worker_done, export);
+    if (worker->thread != export->thread) {
+        spdk_thread_exit(worker->thread);
+    }
+}
+
+static void export_worker_put(struct ubi_export_worker *worker) {
+    if (--worker->active == 0) {
+        export_worker_finish(worker);
+    }
+}
+
+static void export_slot_idle(struct ubi_export_slot *slot) {
+    export_worker_put(slot->worker);
+}
+
+static void export_write_done(struct spdk_io_channel *channel, void *cb_arg,
+                              int bserrno) {
+    struct ubi_export_slot *slot = cb_arg;
+    struct ubi_export *export = slot->worker->export;
+
+    if (bserrno != 0) {
+        SPDK_ERRLOG("could not export cluster %lu: %s\n", slot->cluster,
+                    spdk_strerror(-bserrno));
+        export_fail(export, bserrno);
+        export_slot_idle(slot);
+        return;
+    }
+
+    __atomic_fetch_add(&export->copied, 1, __ATOMIC_RELAXED);
+    export_slot_next(slot);
+}
+
+static void export_read_done(void *cb_arg, int bserrno) {
+    struct ubi_export_slot *slot = cb_arg;
+    struct ubi_export_worker *worker = slot->worker;
+    struct ubi_export *export = worker->export;
+    struct spdk_bs_dev *dst = export->dst;
+
+    if (bserrno != 0) {
+        SPDK_ERRLOG("could not read cluster %lu for export: %s\n", slot->cluster,
+                    spdk_strerror(-bserrno));
+        export_fail(export, bserrno);
+        export_slot_idle(slot);
+        return;
+    }
+
+    slot->cb_args.cb_fn = export_write_done;
+    slot->cb_args.cb_arg = slot;
+    slot->cb_args.channel = worker->dst_channel;
+    dst->write(dst, worker->dst_channel, slot->buf,
+               slot->cluster * export->cluster_size / dst->blocklen,
+               export->cluster_size / dst->blocklen, &slot->cb_args);
+}
+
+/*
+ * export_slot_next claims the next cluster of the list and reads it. The
+ * slot goes idle when the list is exhausted or the export failed.
+ */
+static void export_slot_next(struct ubi_export_slot *slot) {
+    struct ubi_export_worker *worker = slot->worker;
+    struct ubi_export *export = worker->export;
+
+    uint64_t index = __atomic_fetch_add(&export->next, 1, __ATOMIC_RELAXED);
+    if (index >= export->cluster_count ||
+        __atomic_load_n(&export->rc, __ATOMIC_RELAXED) != 0) {
+        export_slot_idle(slot);
+        return;
+    }
+
+    slot->cluster = export->clusters[index];
+    spdk_blob_io_read(export->blob, worker->bs_channel, slot->buf,
+                      slot->cluster * export->io_units_per_cluster,
+                      export->io_units_per_cluster, export_read_done, slot);
+}
+
+static void export_worker_start(void *arg) {
+    struct ubi_export_worker *worker = arg;
+    struct ubi_export *export = worker->export;
+
+    worker->active = 1;
+    worker->bs_channel = spdk_bs_alloc_io_channel(export->bs);
+    worker->dst_channel = export->dst->create_channel(export->dst);
+    if (worker->bs_channel == NULL || worker->dst_channel == NULL) {
+        SPDK_ERRLOG("could not get channels for export\n");
+        export_fail(export, -ENOMEM);
+        export_worker_finish(worker);
+        return;
+    }
+
+    for (uint32_t i = 0; i < export->queue_depth; i++) {
+        struct ubi_export_slot *slot = &worker->slots[i];
+
+        slot->worker = worker;
+        slot->buf = spdk_dma_malloc(export->cluster_size, 0x1000, NULL);
+        if (slot->buf == NULL) {
+            SPDK_ERRLOG("could not allocate export buffer\n");
+            export_fail(export, -ENOMEM);
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < export->queue_depth && worker->slots[i].buf; i++) {
+        worker->active++;
+        export_slot_next(&worker->slots[i]);
+    }
+    export_worker_put(worker);
+}
+
+/*
+ * export_list_clusters lists the clusters the blob owns. The blob is walked
+ * twice, once to size the list and once to fill it, as walking it only reads
+ * its cluster table.
+ */
+static int export_list_clusters(struct ubi_export *export) {
+    uint64_t per_cluster = export->io_units_per_cluster;
+    uint64_t n = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        n = 0;
+        uint64_t offset = spdk_blob_get_next_allocated_io_unit(export->blob, 0);
+        while (offset != UINT64_MAX) {
+            uint64_t cluster = offset / per_cluster;
+            if (export->clusters != NULL) {
+                export->clusters[n] = cluster;
+            }
+            n++;
+            offset = spdk_blob_get_next_allocated_io_unit(export->blob,
+                                                          (cluster + 1) * per_cluster);
+        }
+
+        if (pass == 0) {
+            export->clusters = calloc(spdk_max(n, 1), sizeof(uint64_t));
+            if (export->clusters == NULL) {
+                return -ENOMEM;
+            }
+        }
+    }
+
+    export->cluster_count = n;
+    return 0;
+}
+
+static void export_blob_opened(void *cb_arg, struct spdk_blob *blob, int bserrno) {
+    struct ubi_export *export = cb_arg;
+
+    if (bserrno != 0) {
+        SPDK_ERRLOG("could not open blob for export: %s\n", spdk_strerror(-bserrno));
+        export->done_fn(export->cb_arg, bserrno);
+        export_free(export);
+        return;
+    }
+
+    export->blob = blob;
+    int rc = export_list_clusters(export);
+    if (rc == 0) {
+        export->workers = calloc(export->num_threads, sizeof(*export->workers));
+        rc = export->workers == NULL ? -ENOMEM : 0;
+    }
+    for (uint32_t i = 0; rc == 0 && i < export->num_threads; i++) {
+        export->workers[i].slots =
+            calloc(export->queue_depth, sizeof(struct ubi_export_slot));
+        rc = export->workers[i].slots == NULL ? -ENOMEM : 0;
+    }
+    export->dst_channel = rc == 0 ? export->dst->create_channel(export->dst) : NULL;
+    if (rc == 0 && export->dst_channel == NULL) {
+        rc = -ENOMEM;
+    } else if (rc == 0) {
+        /* Releasing the last channel of dst commits it. */
+        export->pending++;
+    }
+    if (rc != 0) {
+        export->rc = rc;
+        spdk_blob_close(blob, export_blob_closed, export);
+        return;
+    }
+
+    SPDK_NOTICELOG("exporting %lu clusters with %u threads, queue depth %u\n",
+                   export->cluster_count, export->num_threads, export->queue_depth);
+    export->status_poller =
+        SPDK_POLLER_REGISTER(export_status_poll, export, UBI_EXPORT_STATUS_PERIOD_US);
+    export_status_poll(export);
+
+    for (uint32_t i = 0; i < export->num_threads; i++) {
+        struct ubi_export_worker *worker = &export->workers[i];
+        char name[32];
+
+        worker->export = export;
+        worker->thread = export->thread;
+        if (i > 0) {
+            snprintf(name, sizeof(name), "ubi_export_%u", i);
+            worker->thread = spdk_thread_create(name, NULL);
+            if (worker->thread == NULL) {
+                SPDK_WARNLOG("could not create export thread %u, sharing this one\n", i);
+                worker->thread = export->thread;
+            }
+        }
+        spdk_thread_send_msg(worker->thread, export_worker_start, worker);
+    }
+}
+
+/*
+ * ubi_export_start copies the clusters which blob blobid owns to dst, a
+ * writing delta device, at the same offsets. status_fn is called periodically
+ * and once at the end with the number of clusters copied and to copy, and
+ * done_fn when the export is complete and dst committed, with the first error
+ * of either. Must be called on the blobstore's metadata thread.
+ */
+int ubi_export_start(struct spdk_blob_store *bs, spdk_blob_id blobid,
+                     struct spdk_bs_dev *dst, uint32_t queue_depth, uint32_t num_threads,
+                     ubi_export_status_fn status_fn, spdk_blob_op_complete done_fn,
+                     void *cb_arg) {
+    if (queue_depth == 0 || queue_depth > UBI_EXPORT_MAX_QUEUE_DEPTH ||
+        num_threads == 0 || num_threads > UBI_EXPORT_MAX_THREADS) {
+        return -EINVAL;
+    }
+
+    struct ubi_export *export = calloc(1, sizeof(*export));
+    if (export == NULL) {
+        return -ENOMEM;
+    }
+
+    export->bs = bs;
+    export->dst = dst;
+    export->thread = spdk_get_thread();
+    export->cluster_size = spdk_bs_get_cluster_size(bs);
+    export->io_units_per_cluster = export->cluster_size / spdk_bs_get_io_unit_size(bs);
+    export->queue_depth = queue_depth;
+    export->num_threads = num_threads;
+    export->status_fn = status_fn;
+    export->done_fn = done_fn;
+    export->cb_arg = cb_arg;
+    export->pending = 1;
+
+    bs_dev_delta_on_commit(dst, export_dst_committed, export);
+    spdk_bs_open_blob(bs, blobid, export_blob_opened, export);
+    return 0;
+}
@@ -9,6 +9,32 @@
  */
 static int ubi_io_poll(void *arg);
 
+/*
+ * stats_add adds the counters of src to dst. Counters of src may be updated
+ * concurrently by other threads.
+ */
+static void stats_add(struct ubi_io_stats *dst, const struct ubi_io_stats *src) {
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+
+    for (size_t i = 0; i < sizeof(*dst) / sizeof(uint64_t); i++) {
+        d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * stats_add_atomic adds the counters of src to dst, which other threads may
+ * update or read concurrently.
+ */
+static void stats_add_atomic(struct ubi_io_stats *dst, const struct ubi_io_stats *src) {
+    uint64_t *d = (uint64_t *)dst;
+    const uint64_t *s = (const uint64_t *)src;
+
+    for (size_t i = 0; i < sizeof(*dst) / sizeof(uint64_t); i++) {
+        __atomic_fetch_add(&d[i], s[i], __ATOMIC_RELAXED);
+    }
+}
+
 /*
  * ubi_create_channel_cb is called when an I/O channel needs to be created. In
  * the VM world this can happen for example when VMM's firmware needs to use the
@@ -36,11 +62,120 @@ int ubi_create_channel_cb(void *io_device, void *ctx_buf) {
  */
 void ubi_destroy_channel_cb(void *io_device, void *ctx_buf) {
     struct ubi_io_channel *ch = ctx_buf;
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    struct spdk_bs_dev *esnap_dev = ubi_bdev->esnap_dev;
+
+    stats_add_atomic(&ubi_bdev->retired_stats, &ch->stats);
     spdk_poller_unregister(&ch->poller);
     spdk_bs_free_io_channel(ch->bs_channel);
+    if (ch->esnap_channel) {
+        esnap_dev->destroy_channel(esnap_dev, ch->esnap_channel);
+    }
+}
+
+struct ubi_stats_gather {
+    struct ubi_bdev *ubi_bdev;
+    struct ubi_io_stats stats;
+    ubi_io_stats_cb cb_fn;
+    void *cb_arg;
+};
+
+static void ubi_stats_gather_channel(struct spdk_io_channel_iter *i) {
+    struct ubi_stats_gather *gather = spdk_io_channel_iter_get_ctx(i);
+    struct spdk_io_channel *_ch = spdk_io_channel_iter_get_channel(i);
+    struct ubi_io_channel *ch = spdk_io_channel_get_ctx(_ch);
+
+    stats_add(&gather->stats, &ch->stats);
+    spdk_for_each_channel_continue(i, 0);
+}
+
+static void ubi_stats_gather_done(struct spdk_io_channel_iter *i, int status) {
+    struct ubi_stats_gather *gather = spdk_io_channel_iter_get_ctx(i);
+    struct ubi_bdev *ubi_bdev = gather->ubi_bdev;
+    uint64_t *last = (uint64_t *)&ubi_bdev->last_stats;
+    const uint64_t *s = (const uint64_t *)&gather->stats;
+
+    for (size_t j = 0; j < sizeof(gather->stats) / sizeof(uint64_t); j++) {
+        __atomic_store_n(&last[j], s[j], __ATOMIC_RELAXED);
+    }
+
+    if (gather->cb_fn != NULL) {
+        gather->cb_fn(gather->cb_arg, &gather->stats);
+    }
+    free(gather);
 }
 
 /*
- * ubi_io_poll is the poller function that is called regularly by SPDK.
+ * ubi_get_io_stats sums the counters of all channels of ubi_bdev, including
+ * the ones which were already destroyed, and calls cb_fn, which may be NULL,
+ * with the sum. Each channel's counters are read on the channel's thread.
+ * The sum is also kept in ubi_bdev->last_stats. Returns -ENOMEM without
+ * calling cb_fn if the sum can't be started.
  */
-static int ubi_io_poll(void *arg) { return SPDK_POLLER_IDLE; }
+int ubi_get_io_stats(struct ubi_bdev *ubi_bdev, ubi_io_stats_cb cb_fn, void *cb_arg) {
+    struct ubi_stats_gather *gather = calloc(1, sizeof(*gather));
+
+    if (gather == NULL) {
+        return -ENOMEM;
+    }
+
+    gather->ubi_bdev = ubi_bdev;
+    gather->cb_fn = cb_fn;
+    gather->cb_arg = cb_arg;
+
+    /*
+     * Channels which exist now aren't destroyed until they're visited, so the
+     * counters retired by then aren't counted twice.
+     */
+    stats_add(&gather->stats, &ubi_bdev->retired_stats);
+    spdk_for_each_channel(ubi_bdev, ubi_stats_gather_channel, gather,
+                          ubi_stats_gather_done);
+    return 0;
+}
+
+/*
+ * ubi_queue_retry defers an I/O which failed for lack of resources, e.g. when
+ * the blobstore channel ran out of request sets. It will be resubmitted from
+ * the channel's poller instead of failing back to the guest. Must be called on
+ * the channel's thread.
+ */
+void ubi_queue_retry(struct ubi_io_channel *ch, struct spdk_bdev_io *bdev_io) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    uint64_t depth = ch->stats.retry_queue_depth + 1;
+    uint64_t max = __atomic_load_n(&ubi_bdev->retry_queue_depth_max, __ATOMIC_RELAXED);
+
+    TAILQ_INSERT_TAIL(&ch->io, bdev_io, module_link);
+    UBI_STAT_ADD(ch, ios_deferred, 1);
+    UBI_STAT_ADD(ch, retry_queue_depth, 1);
+    spdk_trace_record(TRACE_BDEV_UBI_IO_RETRY, 0, 0, (uintptr_t)bdev_io, depth);
+
+    while (depth > max &&
+           !__atomic_compare_exchange_n(&ubi_bdev->retry_queue_depth_max, &max, depth,
+                                        true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+/*
+ * ubi_io_poll is the poller function that is called regularly by SPDK. It
+ * resubmits the I/O which was queued for retry. I/O which fails again is
+ * queued behind the ones taken here, so it waits for the next poll.
+ */
+static int ubi_io_poll(void *arg) {
+    struct ubi_io_channel *ch = arg;
+    TAILQ_HEAD(, spdk_bdev_io) retry;
+    struct spdk_bdev_io *bdev_io;
+
+    if (spdk_likely(TAILQ_EMPTY(&ch->io))) {
+        return SPDK_POLLER_IDLE;
+    }
+
+    TAILQ_INIT(&retry);
+    TAILQ_CONCAT(&retry, &ch->io, module_link);
+    while ((bdev_io = TAILQ_FIRST(&retry)) != NULL) {
+        TAILQ_REMOVE(&retry, bdev_io, module_link);
+        UBI_STAT_ADD(ch, retry_queue_depth, -1);
+        ubi_submit_io(ch, bdev_io);
+    }
+
+    return SPDK_POLLER_BUSY;
+}
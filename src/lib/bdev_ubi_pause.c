@@ -0,0 +1,142 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/log.h"
+
+/*
+ * Guest I/O pauses. Snapshots quiesce the bdev so that what they capture is
+ * consistent like after a power loss: once the bdev layer has stopped passing
+ * new I/O to the module and the I/O in flight has completed, nothing changes
+ * until the bdev is unquiesced.
+ *
+ * Quiescing waits for the I/O in flight, which may take long on a busy base
+ * bdev. With a timeout, the caller is told the pause failed when it runs out,
+ * and the bdev is unquiesced as soon as the quiesce completes.
+ *
+ * I/O which the bdev layer held while the bdev was quiesced is counted when
+ * it reaches the module, by the time it was submitted to the bdev layer.
+ */
+
+static void ubi_pause_unquiesced(void *cb_arg, int status) {
+    struct ubi_bdev *ubi_bdev = cb_arg;
+    spdk_bdev_quiesce_cb cb_fn = ubi_bdev->pause.cb_fn;
+    void *fn_arg = ubi_bdev->pause.cb_arg;
+
+    if (status != 0) {
+        SPDK_ERRLOG("could not unquiesce %s: %d\n", ubi_bdev->bdev.name, status);
+    }
+
+    /* Held I/O was resubmitted before the unquiesce completed. */
+    __atomic_store_n(&ubi_bdev->pause.start_tsc, 0, __ATOMIC_RELAXED);
+    ubi_bdev->pause.cb_fn = NULL;
+    ubi_bdev->pause.cb_arg = NULL;
+    if (cb_fn != NULL) {
+        cb_fn(fn_arg, status);
+    }
+}
+
+/*
+ * ubi_pause_end unquiesces ubi_bdev and calls cb_fn, if it isn't NULL, once
+ * the I/O which was held has been resubmitted.
+ */
+void ubi_pause_end(struct ubi_bdev *ubi_bdev, spdk_bdev_quiesce_cb cb_fn, void *cb_arg) {
+    uint64_t now = spdk_get_ticks();
+
+    __atomic_store_n(&ubi_bdev->pause.end_tsc, now, __ATOMIC_RELAXED);
+    ubi_bdev->snapshot_status.pause_us =
+        (now - ubi_bdev->pause.start_tsc) * SPDK_SEC_TO_USEC / spdk_get_ticks_hz();
+    ubi_bdev->pause.cb_fn = cb_fn;
+    ubi_bdev->pause.cb_arg = cb_arg;
+
+    int rc = spdk_bdev_unquiesce(&ubi_bdev->bdev, ubi_bdev->bdev.module,
+                                 ubi_pause_unquiesced, ubi_bdev);
+    if (rc != 0) {
+        ubi_pause_unquiesced(ubi_bdev, rc);
+    }
+}
+
+static void ubi_pause_quiesced(void *cb_arg, int status) {
+    struct ubi_bdev *ubi_bdev = cb_arg;
+    spdk_bdev_quiesce_cb cb_fn = ubi_bdev->pause.cb_fn;
+    void *fn_arg = ubi_bdev->pause.cb_arg;
+
+    spdk_poller_unregister(&ubi_bdev->pause.timeout_poller);
+    ubi_bdev->snapshot_status.drain_us = (spdk_get_ticks() - ubi_bdev->pause.start_tsc) *
+                                         SPDK_SEC_TO_USEC / spdk_get_ticks_hz();
+
+    if (status != 0) {
+        SPDK_ERRLOG("could not quiesce %s: %d\n", ubi_bdev->bdev.name, status);
+        __atomic_store_n(&ubi_bdev->pause.start_tsc, 0, __ATOMIC_RELAXED);
+        ubi_bdev->pause.cb_fn = NULL;
+        if (!ubi_bdev->pause.timed_out) {
+            cb_fn(fn_arg, status);
+        }
+        return;
+    }
+
+    if (ubi_bdev->pause.timed_out) {
+        /* The caller gave up already. */
+        ubi_pause_end(ubi_bdev, NULL, NULL);
+        return;
+    }
+    cb_fn(fn_arg, 0);
+}
+
+static int ubi_pause_timeout(void *arg) {
+    struct ubi_bdev *ubi_bdev = arg;
+
+    SPDK_ERRLOG("%s wasn't quiesced within the timeout\n", ubi_bdev->bdev.name);
+    spdk_poller_unregister(&ubi_bdev->pause.timeout_poller);
+    ubi_bdev->pause.timed_out = true;
+    ubi_bdev->pause.cb_fn(ubi_bdev->pause.cb_arg, -ETIMEDOUT);
+    return SPDK_POLLER_BUSY;
+}
+
+/*
+ * ubi_pause_begin quiesces ubi_bdev and calls cb_fn once no guest I/O is in
+ * flight, or with -ETIMEDOUT if that takes more than timeout_us, 0 waiting as
+ * long as it takes. Unless cb_fn gets an error, the caller ends the pause with
+ * ubi_pause_end. Returns -EBUSY if ubi_bdev is paused already.
+ */
+int ubi_pause_begin(struct ubi_bdev *ubi_bdev, uint64_t timeout_us,
+                    spdk_bdev_quiesce_cb cb_fn, void *cb_arg) {
+    if (ubi_bdev->pause.start_tsc != 0) {
+        return -EBUSY;
+    }
+
+    ubi_bdev->pause.cb_fn = cb_fn;
+    ubi_bdev->pause.cb_arg = cb_arg;
+    ubi_bdev->pause.timed_out = false;
+    ubi_bdev->snapshot_status.drain_us = 0;
+    ubi_bdev->snapshot_status.pause_us = 0;
+    __atomic_store_n(&ubi_bdev->snapshot_status.ios_held, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ubi_bdev->pause.end_tsc, UINT64_MAX, __ATOMIC_RELAXED);
+    __atomic_store_n(&ubi_bdev->pause.start_tsc, spdk_get_ticks(), __ATOMIC_RELAXED);
+
+    int rc = spdk_bdev_quiesce(&ubi_bdev->bdev, ubi_bdev->bdev.module,
+                               ubi_pause_quiesced, ubi_bdev);
+    if (rc != 0) {
+        __atomic_store_n(&ubi_bdev->pause.start_tsc, 0, __ATOMIC_RELAXED);
+        ubi_bdev->pause.cb_fn = NULL;
+        return rc;
+    }
+
+    if (timeout_us != 0) {
+        ubi_bdev->pause.timeout_poller =
+            SPDK_POLLER_REGISTER(ubi_pause_timeout, ubi_bdev, timeout_us);
+    }
+    return 0;
+}
+
+/*
+ * ubi_pause_account_io counts bdev_io as held if it was submitted to the bdev
+ * layer while ubi_bdev was paused. Called as I/O arrives while a pause is on.
+ */
+void ubi_pause_account_io(struct ubi_bdev *ubi_bdev, struct spdk_bdev_io *bdev_io) {
+    uint64_t start = __atomic_load_n(&ubi_bdev->pause.start_tsc, __ATOMIC_RELAXED);
+    uint64_t end = __atomic_load_n(&ubi_bdev->pause.end_tsc, __ATOMIC_RELAXED);
+    uint64_t tsc = spdk_bdev_io_get_submit_tsc(bdev_io);
+
+    if (start != 0 && tsc >= start && tsc < end) {
+        __atomic_fetch_add(&ubi_bdev->snapshot_status.ios_held, 1, __ATOMIC_RELAXED);
+    }
+}
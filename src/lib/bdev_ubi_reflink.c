@@ -0,0 +1,258 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/json.h"
+#include "spdk/log.h"
+#include "spdk/thread.h"
+
+#include <linux/fs.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+
+/*
+ * Reflink snapshots. When the base bdev is an aio bdev over a file on a
+ * filesystem with shared extents, such as XFS or btrfs, the whole file can be
+ * cloned with FICLONE, which only copies extent metadata. The bdev is
+ * paused while the file is cloned, so the clone has every write the guest
+ * saw complete and is consistent the way it would be after a power loss.
+ *
+ * The clone is made by a thread of its own, as the ioctl blocks while the
+ * filesystem copies the extent map, and the result is passed back to the
+ * thread which started it.
+ */
+
+struct ubi_reflink {
+    struct ubi_bdev *ubi_bdev;
+    struct spdk_thread *thread;
+    char *src_path;
+    char *dst_path;
+    uint64_t quiesce_timeout_us;
+    int rc;
+    ubi_reflink_done_fn done_fn;
+    void *cb_arg;
+};
+
+struct ubi_aio_info {
+    char *filename;
+};
+
+static const struct spdk_json_object_decoder ubi_aio_info_decoders[] = {
+    {"filename", offsetof(struct ubi_aio_info, filename), spdk_json_decode_string},
+};
+
+static int decode_aio_info(const struct spdk_json_val *val, void *out) {
+    return spdk_json_decode_object_relaxed(val, ubi_aio_info_decoders,
+                                           SPDK_COUNTOF(ubi_aio_info_decoders), out);
+}
+
+static const struct spdk_json_object_decoder ubi_bdev_info_decoders[] = {
+    {"aio", 0, decode_aio_info},
+};
+
+struct ubi_json_buf {
+    char *data;
+    size_t len;
+};
+
+static int ubi_json_buf_write(void *cb_ctx, const void *data, size_t size) {
+    struct ubi_json_buf *buf = cb_ctx;
+    char *grown = realloc(buf->data, buf->len + size + 1);
+
+    if (grown == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(grown + buf->len, data, size);
+    buf->data = grown;
+    buf->len += size;
+    buf->data[buf->len] = '\0';
+    return 0;
+}
+
+/*
+ * ubi_base_file_path returns the file behind the base bdev of ubi_bdev, which
+ * the caller frees, or NULL if the base bdev isn't an aio bdev. The aio module
+ * reports its file in the bdev's info, which is the only place it's exposed.
+ */
+static char *ubi_base_file_path(struct ubi_bdev *ubi_bdev) {
+    struct spdk_bdev *base = ubi_bdev->bs_dev->get_base_bdev(ubi_bdev->bs_dev);
+    struct ubi_aio_info info = {NULL};
+    struct ubi_json_buf buf = {NULL};
+    struct spdk_json_val *values = NULL;
+    ssize_t count;
+
+    if (base == NULL || strcmp(spdk_bdev_get_module_name(base), "aio") != 0) {
+        return NULL;
+    }
+
+    struct spdk_json_write_ctx *w = spdk_json_write_begin(ubi_json_buf_write, &buf, 0);
+    if (w == NULL) {
+        return NULL;
+    }
+    spdk_json_write_object_begin(w);
+    spdk_bdev_dump_info_json(base, w);
+    spdk_json_write_object_end(w);
+    if (spdk_json_write_end(w) != 0 || buf.data == NULL) {
+        goto out;
+    }
+
+    count = spdk_json_parse(buf.data, buf.len, NULL, 0, NULL, 0);
+    if (count <= 0) {
+        goto out;
+    }
+    values = calloc(count, sizeof(*values));
+    if (values == NULL ||
+        spdk_json_parse(buf.data, buf.len, values, count, NULL,
+                        SPDK_JSON_PARSE_FLAG_DECODE_IN_PLACE) != count) {
+        goto out;
+    }
+    spdk_json_decode_object_relaxed(values, ubi_bdev_info_decoders,
+                                    SPDK_COUNTOF(ubi_bdev_info_decoders), &info);
+
+out:
+    free(values);
+    free(buf.data);
+    return info.filename;
+}
+
+/*
+ * ubi_reflink_file clones src_path into dst_path. Returns -ENOTSUP if the
+ * files can't share extents, which is the case across filesystems and on
+ * filesystems without reflinks.
+ */
+static int ubi_reflink_file(const char *src_path, const char *dst_path) {
+    int rc = 0;
+
+    int src = open(src_path, O_RDONLY);
+    if (src < 0) {
+        SPDK_ERRLOG("could not open %s: %s\n", src_path, strerror(errno));
+        return -errno;
+    }
+
+    int dst = open(dst_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst < 0) {
+        rc = -errno;
+        SPDK_ERRLOG("could not create %s: %s\n", dst_path, strerror(-rc));
+        close(src);
+        return rc;
+    }
+
+    if (ioctl(dst, FICLONE, src) < 0) {
+        rc = -errno;
+        if (rc == -EOPNOTSUPP || rc == -EXDEV || rc == -EINVAL || rc == -ENOTTY) {
+            rc = -ENOTSUP;
+        }
+    } else if (fsync(dst) < 0) {
+        rc = -errno;
+    }
+
+    close(dst);
+    close(src);
+    if (rc != 0) {
+        unlink(dst_path);
+    }
+    return rc;
+}
+
+static void ubi_reflink_unquiesced(void *cb_arg, int status) {
+    struct ubi_reflink *reflink = cb_arg;
+
+    ubi_partial_drain_end(reflink->ubi_bdev);
+    reflink->done_fn(reflink->cb_arg, reflink->rc);
+    free(reflink->src_path);
+    free(reflink->dst_path);
+    free(reflink);
+}
+
+static void ubi_reflink_cloned(void *arg) {
+    struct ubi_reflink *reflink = arg;
+
+    ubi_pause_end(reflink->ubi_bdev, ubi_reflink_unquiesced, reflink);
+}
+
+static void *ubi_reflink_thread(void *arg) {
+    struct ubi_reflink *reflink = arg;
+
+    reflink->rc = ubi_reflink_file(reflink->src_path, reflink->dst_path);
+    spdk_thread_send_msg(reflink->thread, ubi_reflink_cloned, reflink);
+    return NULL;
+}
+
+static void ubi_reflink_quiesced(void *cb_arg, int status) {
+    struct ubi_reflink *reflink = cb_arg;
+    pthread_t thread;
+
+    if (status != 0) {
+        reflink->rc = status;
+        ubi_partial_drain_end(reflink->ubi_bdev);
+        reflink->done_fn(reflink->cb_arg, status);
+        free(reflink->src_path);
+        free(reflink->dst_path);
+        free(reflink);
+        return;
+    }
+
+    if (pthread_create(&thread, NULL, ubi_reflink_thread, reflink) != 0) {
+        reflink->rc = -EAGAIN;
+        ubi_reflink_cloned(reflink);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static void ubi_reflink_drained(void *cb_arg, int bserrno) {
+    struct ubi_reflink *reflink = cb_arg;
+
+    if (bserrno != 0) {
+        ubi_partial_drain_end(reflink->ubi_bdev);
+        reflink->done_fn(reflink->cb_arg, bserrno);
+        free(reflink->src_path);
+        free(reflink->dst_path);
+        free(reflink);
+        return;
+    }
+
+    int rc = ubi_pause_begin(reflink->ubi_bdev, reflink->quiesce_timeout_us,
+                             ubi_reflink_quiesced, reflink);
+    if (rc != 0) {
+        ubi_reflink_quiesced(reflink, rc);
+    }
+}
+
+/*
+ * ubi_reflink_snapshot clones the file behind the base bdev of ubi_bdev into
+ * path, with the bdev paused, and calls done_fn with the result. Returns
+ * -ENOTSUP without calling done_fn if the base bdev isn't backed by a file.
+ * done_fn gets -ENOTSUP if the file can't be reflinked, and path is left
+ * untouched then, so the caller can fall back to copying.
+ */
+int ubi_reflink_snapshot(struct ubi_bdev *ubi_bdev, const char *path,
+                         uint64_t quiesce_timeout_us, ubi_reflink_done_fn done_fn,
+                         void *cb_arg) {
+    struct ubi_reflink *reflink = calloc(1, sizeof(*reflink));
+
+    if (reflink == NULL) {
+        return -ENOMEM;
+    }
+
+    reflink->src_path = ubi_base_file_path(ubi_bdev);
+    if (reflink->src_path == NULL) {
+        free(reflink);
+        return -ENOTSUP;
+    }
+
+    reflink->dst_path = strdup(path);
+    if (reflink->dst_path == NULL) {
+        free(reflink->src_path);
+        free(reflink);
+        return -ENOMEM;
+    }
+
+    reflink->ubi_bdev = ubi_bdev;
+    reflink->quiesce_timeout_us = quiesce_timeout_us;
+    reflink->thread = spdk_get_thread();
+    reflink->done_fn = done_fn;
+    reflink->cb_arg = cb_arg;
+
+    /* Partially filled clusters are completed first, like for a copy. */
+    ubi_partial_drain(ubi_bdev, ubi_reflink_drained, reflink);
+    return 0;
+}
@@ -7,13 +7,22 @@
 #include "bdev_ubi.h"
 #include "bdev_ubi_internal.h"
 
+struct rpc_ubi_layers {
+    size_t num_layers;
+    char *layers[UBI_MAX_LAYERS];
+};
+
 struct rpc_construct_ubi {
     char *name;
     char *image_path;
     char *snapshot_path;
+    struct rpc_ubi_layers layers;
+    char *snapshot_bdev;
     char *base_bdev_name;
     bool no_sync;
     bool format_bdev;
+    bool subcluster_cow;
+    bool zero_detect;
     // deperacated options
     uint32_t stripe_size_kb;
     bool copy_on_read;
@@ -23,13 +32,23 @@ struct rpc_construct_ubi {
 static void free_rpc_construct_ubi(struct rpc_construct_ubi *req) {
     free(req->name);
     free(req->image_path);
+    free(req->snapshot_bdev);
     free(req->base_bdev_name);
+    for (size_t i = 0; i < req->layers.num_layers; i++) {
+        free(req->layers.layers[i]);
+    }
+}
+
+static int decode_ubi_layers(const struct spdk_json_val *val, void *out) {
+    struct rpc_ubi_layers *layers = out;
+    return spdk_json_decode_array(val, spdk_json_decode_string, layers->layers,
+                                  UBI_MAX_LAYERS, &layers->num_layers, sizeof(char *));
 }
 
 static const struct spdk_json_object_decoder rpc_construct_ubi_decoders[] = {
     {"name", offsetof(struct rpc_construct_ubi, name), spdk_json_decode_string},
     {"image_path", offsetof(struct rpc_construct_ubi, image_path),
-     spdk_json_decode_string},
+     spdk_json_decode_string, true},
     {"base_bdev", offsetof(struct rpc_construct_ubi, base_bdev_name),
      spdk_json_decode_string},
     {"format_bdev", offsetof(struct rpc_construct_ubi, format_bdev),
@@ -39,6 +58,13 @@ static const struct spdk_json_object_decoder rpc_construct_ubi_decoders[] = {
      true},
     {"snapshot_path", offsetof(struct rpc_construct_ubi, snapshot_path),
      spdk_json_decode_string, true},
+    {"layers", offsetof(struct rpc_construct_ubi, layers), decode_ubi_layers, true},
+    {"snapshot_bdev", offsetof(struct rpc_construct_ubi, snapshot_bdev),
+     spdk_json_decode_string, true},
+    {"subcluster_cow", offsetof(struct rpc_construct_ubi, subcluster_cow),
+     spdk_json_decode_bool, true},
+    {"zero_detect", offsetof(struct rpc_construct_ubi, zero_detect),
+     spdk_json_decode_bool, true},
     // deperacated options: stripe_size_kb, copy_on_read, directio
     {"stripe_size_kb", offsetof(struct rpc_construct_ubi, stripe_size_kb),
      spdk_json_decode_uint32, true},
@@ -90,6 +116,11 @@ static void rpc_bdev_ubi_create(struct spdk_jsonrpc_request *request,
     opts.format_bdev = req.format_bdev;
     opts.directio = req.directio;
     opts.snapshot_path = req.snapshot_path;
+    opts.layers = (const char *const *)req.layers.layers;
+    opts.num_layers = req.layers.num_layers;
+    opts.snapshot_bdev = req.snapshot_bdev;
+    opts.subcluster_cow = req.subcluster_cow;
+    opts.zero_detect = req.zero_detect;
 
     struct ubi_create_context *context = calloc(1, sizeof(struct ubi_create_context));
     context->done_fn = bdev_ubi_create_done;
@@ -137,11 +168,43 @@ SPDK_RPC_REGISTER("bdev_ubi_delete", rpc_bdev_ubi_delete, SPDK_RPC_RUNTIME)
 struct rpc_snapshot_ubi {
     char *name;
     char *path;
+    char *parent_path;
+    uint64_t max_bytes_per_sec;
+    uint64_t max_ios_per_sec;
+    uint64_t target_latency_us;
+    bool decouple_parent;
+    uint64_t quiesce_timeout_us;
+    uint32_t queue_depth;
+    uint32_t num_threads;
+    char *compression;
+    bool reflink;
+    char *target_bdev;
 };
 
 static const struct spdk_json_object_decoder rpc_snapshot_ubi_decoders[] = {
     {"name", offsetof(struct rpc_snapshot_ubi, name), spdk_json_decode_string},
-    {"path", offsetof(struct rpc_snapshot_ubi, path), spdk_json_decode_string},
+    {"path", offsetof(struct rpc_snapshot_ubi, path), spdk_json_decode_string, true},
+    {"parent_path", offsetof(struct rpc_snapshot_ubi, parent_path),
+     spdk_json_decode_string, true},
+    {"max_bytes_per_sec", offsetof(struct rpc_snapshot_ubi, max_bytes_per_sec),
+     spdk_json_decode_uint64, true},
+    {"max_ios_per_sec", offsetof(struct rpc_snapshot_ubi, max_ios_per_sec),
+     spdk_json_decode_uint64, true},
+    {"target_latency_us", offsetof(struct rpc_snapshot_ubi, target_latency_us),
+     spdk_json_decode_uint64, true},
+    {"decouple_parent", offsetof(struct rpc_snapshot_ubi, decouple_parent),
+     spdk_json_decode_bool, true},
+    {"quiesce_timeout_us", offsetof(struct rpc_snapshot_ubi, quiesce_timeout_us),
+     spdk_json_decode_uint64, true},
+    {"queue_depth", offsetof(struct rpc_snapshot_ubi, queue_depth),
+     spdk_json_decode_uint32, true},
+    {"num_threads", offsetof(struct rpc_snapshot_ubi, num_threads),
+     spdk_json_decode_uint32, true},
+    {"compression", offsetof(struct rpc_snapshot_ubi, compression),
+     spdk_json_decode_string, true},
+    {"reflink", offsetof(struct rpc_snapshot_ubi, reflink), spdk_json_decode_bool, true},
+    {"target_bdev", offsetof(struct rpc_snapshot_ubi, target_bdev),
+     spdk_json_decode_string, true},
 };
 
 static void rpc_bdev_ubi_snapshot_cb(void *cb_arg, int bdeverrno) {
@@ -157,6 +220,7 @@ static void rpc_bdev_ubi_snapshot_cb(void *cb_arg, int bdeverrno) {
 static void rpc_bdev_ubi_snapshot(struct spdk_jsonrpc_request *request,
                                   const struct spdk_json_val *params) {
     struct rpc_snapshot_ubi req = {NULL};
+    req.decouple_parent = true;
 
     if (spdk_json_decode_object(params, rpc_snapshot_ubi_decoders,
                                 SPDK_COUNTOF(rpc_snapshot_ubi_decoders), &req)) {
@@ -165,12 +229,81 @@ static void rpc_bdev_ubi_snapshot(struct spdk_jsonrpc_request *request,
         return;
     }
 
-    bdev_ubi_snapshot(req.name, req.path, rpc_bdev_ubi_snapshot_cb, request);
+    struct spdk_ubi_snapshot_opts opts = {
+        .name = req.name,
+        .path = req.path,
+        .parent_path = req.parent_path,
+        .max_bytes_per_sec = req.max_bytes_per_sec,
+        .max_ios_per_sec = req.max_ios_per_sec,
+        .target_latency_us = req.target_latency_us,
+        .decouple_parent = req.decouple_parent,
+        .quiesce_timeout_us = req.quiesce_timeout_us,
+        .queue_depth = req.queue_depth,
+        .num_threads = req.num_threads,
+        .compression = req.compression,
+        .reflink = req.reflink,
+        .target_bdev = req.target_bdev,
+    };
+    bdev_ubi_snapshot(&opts, rpc_bdev_ubi_snapshot_cb, request);
     free(req.name);
     free(req.path);
+    free(req.parent_path);
+    free(req.compression);
+    free(req.target_bdev);
 }
 SPDK_RPC_REGISTER("bdev_ubi_snapshot", rpc_bdev_ubi_snapshot, SPDK_RPC_RUNTIME)
 
+struct rpc_snapshot_ubi_set_limits {
+    char *name;
+    uint64_t max_bytes_per_sec;
+    uint64_t max_ios_per_sec;
+    uint64_t target_latency_us;
+};
+
+static const struct spdk_json_object_decoder rpc_snapshot_ubi_set_limits_decoders[] = {
+    {"name", offsetof(struct rpc_snapshot_ubi_set_limits, name), spdk_json_decode_string},
+    {"max_bytes_per_sec", offsetof(struct rpc_snapshot_ubi_set_limits, max_bytes_per_sec),
+     spdk_json_decode_uint64, true},
+    {"max_ios_per_sec", offsetof(struct rpc_snapshot_ubi_set_limits, max_ios_per_sec),
+     spdk_json_decode_uint64, true},
+    {"target_latency_us", offsetof(struct rpc_snapshot_ubi_set_limits, target_latency_us),
+     spdk_json_decode_uint64, true},
+};
+
+static void rpc_bdev_ubi_snapshot_set_limits(struct spdk_jsonrpc_request *request,
+                                             const struct spdk_json_val *params) {
+    struct rpc_snapshot_ubi_set_limits req = {NULL};
+
+    if (spdk_json_decode_object(params, rpc_snapshot_ubi_set_limits_decoders,
+                                SPDK_COUNTOF(rpc_snapshot_ubi_set_limits_decoders),
+                                &req)) {
+        spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INTERNAL_ERROR,
+                                         "spdk_json_decode_object failed");
+        free(req.name);
+        return;
+    }
+
+    int rc = bdev_ubi_snapshot_set_limits(req.name, req.max_bytes_per_sec,
+                                          req.max_ios_per_sec, req.target_latency_us);
+    free(req.name);
+    if (rc == -ENOENT) {
+        spdk_jsonrpc_send_error_response(request, rc, "bdev not found");
+    } else if (rc != 0) {
+        spdk_jsonrpc_send_error_response(request, rc, "no snapshot in progress");
+    } else {
+        spdk_jsonrpc_send_bool_response(request, true);
+    }
+}
+SPDK_RPC_REGISTER("bdev_ubi_snapshot_set_limits", rpc_bdev_ubi_snapshot_set_limits,
+                  SPDK_RPC_RUNTIME)
+
+static const char *const g_snapshot_phase_names[UBI_SNAPSHOT_PHASE_COUNT] = {
+    [UBI_SNAPSHOT_PHASE_SNAPSHOT] = "snapshot",
+    [UBI_SNAPSHOT_PHASE_CLONE] = "clone",
+    [UBI_SNAPSHOT_PHASE_DECOUPLE] = "decouple",
+    [UBI_SNAPSHOT_PHASE_COPY] = "copy",
+};
+
 struct rpc_snapshot_ubi_status {
     char *name;
 };
@@ -206,8 +339,176 @@ static void rpc_bdev_ubi_snapshot_status(struct spdk_jsonrpc_request *request,
                                  ubi_bdev->snapshot_status.copied_clusters);
     spdk_json_write_named_uint64(w, "total_clusters",
                                  ubi_bdev->snapshot_status.total_clusters);
+    spdk_json_write_named_uint64(w, "max_bytes_per_sec",
+                                 ubi_bdev->snapshot_status.max_bytes_per_sec);
+    spdk_json_write_named_uint64(w, "max_ios_per_sec",
+                                 ubi_bdev->snapshot_status.max_ios_per_sec);
+    spdk_json_write_named_uint64(w, "target_latency_us",
+                                 ubi_bdev->snapshot_status.target_latency_us);
+    spdk_json_write_named_uint64(w, "adaptive_bytes_per_sec",
+                                 ubi_bdev->snapshot_status.adaptive_bytes_per_sec);
+    spdk_json_write_named_uint64(w, "backoffs", ubi_bdev->snapshot_status.backoffs);
+    spdk_json_write_named_string(
+        w, "method", ubi_bdev->snapshot_status.reflinked ? "reflink" : "copy");
+    spdk_json_write_named_uint64(w, "drain_us", ubi_bdev->snapshot_status.drain_us);
+    spdk_json_write_named_uint64(w, "pause_us", ubi_bdev->snapshot_status.pause_us);
+    spdk_json_write_named_uint64(
+        w, "ios_held",
+        __atomic_load_n(&ubi_bdev->snapshot_status.ios_held, __ATOMIC_RELAXED));
+
+    spdk_json_write_named_uint64(w, "bytes_per_sec",
+                                 ubi_bdev->snapshot_status.bytes_per_sec);
+    spdk_json_write_named_uint64(w, "avg_bytes_per_sec",
+                                 ubi_bdev->snapshot_status.avg_bytes_per_sec);
+    if (ubi_bdev->snapshot_status.eta_sec == UINT64_MAX) {
+        spdk_json_write_named_null(w, "eta_sec");
+    } else {
+        spdk_json_write_named_uint64(w, "eta_sec", ubi_bdev->snapshot_status.eta_sec);
+    }
+    spdk_json_write_named_uint64(w, "zero_clusters",
+                                 ubi_bdev->snapshot_status.zero_clusters);
+    spdk_json_write_named_uint64(w, "delta_bytes", ubi_bdev->snapshot_status.delta_bytes);
+    spdk_json_write_named_object_begin(w, "phase_us");
+    for (int phase = 0; phase < UBI_SNAPSHOT_PHASE_COUNT; phase++) {
+        spdk_json_write_named_uint64(w, g_snapshot_phase_names[phase],
+                                     ubi_bdev->snapshot_status.phase_us[phase]);
+    }
+    spdk_json_write_object_end(w);
+    spdk_json_write_named_uint64(w, "guest_p99_us",
+                                 ubi_bdev->snapshot_status.guest_p99_us);
+    spdk_json_write_named_uint64(w, "guest_p99_us_max",
+                                 ubi_bdev->snapshot_status.guest_p99_us_max);
     spdk_json_write_object_end(w);
     spdk_jsonrpc_end_result(request, w);
 }
 SPDK_RPC_REGISTER("bdev_ubi_snapshot_status", rpc_bdev_ubi_snapshot_status,
                   SPDK_RPC_RUNTIME)
+
+struct rpc_get_stats_ubi {
+    char *name;
+};
+
+static const struct spdk_json_object_decoder rpc_get_stats_ubi_decoders[] = {
+    {"name", offsetof(struct rpc_get_stats_ubi, name), spdk_json_decode_string, true}};
+
+static bool is_ubi_bdev(struct spdk_bdev *bdev) {
+    return strcmp(spdk_bdev_get_module_name(bdev), "ubi") == 0;
+}
+
+/*
+ * Stats of several bdevs are summed one bdev after the other. Bdevs are
+ * looked up by name again for each sum, since one may be deleted meanwhile.
+ */
+struct rpc_get_stats_ctx {
+    struct spdk_jsonrpc_request *request;
+    struct spdk_json_write_ctx *w;
+    char **names;
+    size_t n_names;
+    size_t next;
+};
+
+static void rpc_get_stats_next(struct rpc_get_stats_ctx *ctx);
+
+static void rpc_get_stats_free(struct rpc_get_stats_ctx *ctx) {
+    for (size_t i = 0; i < ctx->n_names; i++) {
+        free(ctx->names[i]);
+    }
+    free(ctx->names);
+    free(ctx);
+}
+
+static void rpc_get_stats_write(void *cb_arg, const struct ubi_io_stats *stats) {
+    struct rpc_get_stats_ctx *ctx = cb_arg;
+    struct spdk_bdev *bdev = spdk_bdev_get_by_name(ctx->names[ctx->next - 1]);
+
+    if (bdev != NULL) {
+        spdk_json_write_object_begin(ctx->w);
+        spdk_json_write_named_string(ctx->w, "name", spdk_bdev_get_name(bdev));
+        ubi_stats_write_json(bdev->ctxt, stats, ctx->w);
+        spdk_json_write_object_end(ctx->w);
+    }
+    rpc_get_stats_next(ctx);
+}
+
+static void rpc_get_stats_next(struct rpc_get_stats_ctx *ctx) {
+    while (ctx->next < ctx->n_names) {
+        struct spdk_bdev *bdev = spdk_bdev_get_by_name(ctx->names[ctx->next++]);
+
+        if (bdev != NULL && is_ubi_bdev(bdev) &&
+            ubi_get_io_stats(bdev->ctxt, rpc_get_stats_write, ctx) == 0) {
+            return;
+        }
+    }
+
+    spdk_json_write_array_end(ctx->w);
+    spdk_jsonrpc_end_result(ctx->request, ctx->w);
+    rpc_get_stats_free(ctx);
+}
+
+/*
+ * rpc_bdev_ubi_get_stats reports I/O statistics of the given ubi bdev, or of
+ * all ubi bdevs if no name is given.
+ */
+static void rpc_bdev_ubi_get_stats(struct spdk_jsonrpc_request *request,
+                                   const struct spdk_json_val *params) {
+    struct rpc_get_stats_ubi req = {NULL};
+    struct rpc_get_stats_ctx *ctx;
+    struct spdk_bdev *bdev = NULL;
+    size_t n_bdevs = 0;
+
+    if (params && spdk_json_decode_object(params, rpc_get_stats_ubi_decoders,
+                                          SPDK_COUNTOF(rpc_get_stats_ubi_decoders),
+                                          &req)) {
+        spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INTERNAL_ERROR,
+                                         "spdk_json_decode_object failed");
+        return;
+    }
+
+    if (req.name) {
+        bdev = spdk_bdev_get_by_name(req.name);
+        if (bdev == NULL || !is_ubi_bdev(bdev)) {
+            free(req.name);
+            spdk_jsonrpc_send_error_response(request, -ENOENT, "bdev not found");
+            return;
+        }
+        n_bdevs = 1;
+    } else {
+        for (bdev = spdk_bdev_first(); bdev; bdev = spdk_bdev_next(bdev)) {
+            n_bdevs += is_ubi_bdev(bdev);
+        }
+    }
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx != NULL) {
+        ctx->names = calloc(spdk_max(n_bdevs, 1), sizeof(char *));
+    }
+    if (ctx == NULL || ctx->names == NULL) {
+        free(ctx);
+        free(req.name);
+        spdk_jsonrpc_send_error_response(request, -ENOMEM, spdk_strerror(ENOMEM));
+        return;
+    }
+    ctx->request = request;
+
+    if (req.name) {
+        ctx->names[ctx->n_names++] = req.name;
+    } else {
+        for (bdev = spdk_bdev_first(); bdev; bdev = spdk_bdev_next(bdev)) {
+            if (!is_ubi_bdev(bdev)) {
+                continue;
+            }
+            ctx->names[ctx->n_names] = strdup(spdk_bdev_get_name(bdev));
+            if (ctx->names[ctx->n_names++] == NULL) {
+                rpc_get_stats_free(ctx);
+                spdk_jsonrpc_send_error_response(request, -ENOMEM,
+                                                 spdk_strerror(ENOMEM));
+                return;
+            }
+        }
+    }
+
+    ctx->w = spdk_jsonrpc_begin_result(request);
+    spdk_json_write_array_begin(ctx->w);
+    rpc_get_stats_next(ctx);
+}
+SPDK_RPC_REGISTER("bdev_ubi_get_stats", rpc_bdev_ubi_get_stats, SPDK_RPC_RUNTIME)
@@ -4,6 +4,34 @@
 #include "spdk/likely.h"
 #include "spdk/log.h"
 
+/*
+ * Snapshot throttling. The copy competes with the guest for the base
+ * bdev, so its rate can be limited. In adaptive mode the rate is adjusted
+ * every UBI_THROTTLE_PERIOD_US: it's halved when the guest's p99 latency in
+ * the last period exceeded the target, and raised by a fixed step otherwise.
+ * The progress of the snapshot is sampled at the same period, from the start
+ * of the snapshot.
+ */
+#define UBI_THROTTLE_PERIOD_US 100000
+#define UBI_ADAPTIVE_START_BYTES_PER_SEC (256ULL << 20)
+#define UBI_ADAPTIVE_MIN_BYTES_PER_SEC (4ULL << 20)
+#define UBI_ADAPTIVE_STEP_BYTES_PER_SEC (16ULL << 20)
+
+/*
+ * Delta files written by snapshots of a bdev are recorded in an xattr of its
+ * blob, with the snapshot blob each one was copied from, so that later
+ * snapshots can be incremental to them. Records are packed oldest first, each
+ * a ubi_snapshot_record followed by the path. The oldest records are dropped
+ * when the xattr would grow past UBI_SNAPSHOTS_XATTR_MAX.
+ */
+#define UBI_SNAPSHOTS_XATTR "ubi_snapshots"
+#define UBI_SNAPSHOTS_XATTR_MAX 2048
+
+struct ubi_snapshot_record {
+    uint64_t blobid;
+    uint16_t path_len;
+} __attribute__((packed));
+
 /*
  * Static function forward declarations
  */
@@ -14,41 +42,433 @@ struct snapshot_context {
     struct ubi_bdev *ubi_bdev;
     spdk_blob_id snapshot_blobid;
     spdk_blob_id clone_blobid;
+    /* blob whose own clusters are copied to the delta file */
+    spdk_blob_id copy_blobid;
+    /*
+     * Snapshot the copy stops at, whose clusters are in the parent delta.
+     * SPDK_BLOBID_INVALID if the copy goes down to the image.
+     */
+    spdk_blob_id base_blobid;
+    bool decouple_parent;
+    uint64_t quiesce_timeout_us;
+    uint32_t queue_depth;
+    uint32_t num_threads;
+    enum ubi_delta_compression compression;
     struct spdk_io_channel *ch;
-    struct spdk_bs_dev *shallow_copy_bs_dev;
+    struct spdk_bs_dev *delta_bs_dev;
     char *path;
+    char *parent_path;
+    /* bdev the delta is written to instead of path, empty if none */
+    char *target_bdev;
+
+    struct spdk_poller *throttle_poller;
+    /* guest I/O stats at the last throttle period */
+    struct ubi_io_stats *last_stats;
+    bool stats_sampled;
+    /* a sum of the stats is in flight, and the context is freed after it */
+    bool stats_pending;
+    bool released;
+
+    enum ubi_snapshot_phase phase;
+    uint64_t phase_tsc;
+    uint64_t phase_ticks[UBI_SNAPSHOT_PHASE_COUNT];
+    /* copied clusters at the last throttle period, and when that was */
+    uint64_t last_copied;
+    uint64_t last_poll_tsc;
 };
 
+/*
+ * ubi_snapshot_phase accounts the time since the last call to the current
+ * phase, and moves on to the given one. UBI_SNAPSHOT_PHASE_COUNT ends the
+ * snapshot.
+ */
+static void ubi_snapshot_phase(struct snapshot_context *ctx,
+                               enum ubi_snapshot_phase phase) {
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+    uint64_t now = spdk_get_ticks();
+
+    if (ctx->phase < UBI_SNAPSHOT_PHASE_COUNT) {
+        ctx->phase_ticks[ctx->phase] += now - ctx->phase_tsc;
+        ubi_bdev->snapshot_status.phase_us[ctx->phase] =
+            ctx->phase_ticks[ctx->phase] * SPDK_SEC_TO_USEC / spdk_get_ticks_hz();
+    }
+    ctx->phase = phase;
+    ctx->phase_tsc = now;
+}
+
+/*
+ * cleanup_snapshot_context ends the snapshot, after which another one can be
+ * started on the bdev.
+ */
 static void cleanup_snapshot_context(struct snapshot_context *ctx) {
-    if (ctx->shallow_copy_bs_dev != NULL) {
-        ctx->shallow_copy_bs_dev->destroy(ctx->shallow_copy_bs_dev);
+    ctx->ubi_bdev->snapshot_status.in_progress = false;
+    ubi_snapshot_phase(ctx, UBI_SNAPSHOT_PHASE_COUNT);
+    spdk_poller_unregister(&ctx->throttle_poller);
+    if (ctx->delta_bs_dev != NULL) {
+        ctx->delta_bs_dev->destroy(ctx->delta_bs_dev);
+        ctx->delta_bs_dev = NULL;
     }
     if (ctx->ch != NULL) {
         spdk_bs_free_io_channel(ctx->ch);
+        ctx->ch = NULL;
     }
     free(ctx->path);
+    free(ctx->parent_path);
+    free(ctx->target_bdev);
+    ctx->path = ctx->parent_path = ctx->target_bdev = NULL;
+
+    if (ctx->stats_pending) {
+        ctx->released = true;
+        return;
+    }
+    free(ctx->last_stats);
     free(ctx);
 }
 
-static void ubi_shallow_copy_complete_cb(void *cb_arg, int rc) {
-    SPDK_WARNLOG("shallow copy complete\n");
+/*
+ * find_snapshot_record returns the snapshot blob the delta file at path was
+ * copied from, or SPDK_BLOBID_INVALID if no snapshot of ubi_bdev wrote it.
+ */
+static spdk_blob_id find_snapshot_record(struct ubi_bdev *ubi_bdev, const char *path) {
+    spdk_blob_id blobid = SPDK_BLOBID_INVALID;
+    struct ubi_snapshot_record record;
+    const char *value;
+    size_t len, off = 0;
+
+    if (spdk_blob_get_xattr_value(ubi_bdev->blob, UBI_SNAPSHOTS_XATTR,
+                                  (const void **)&value, &len)) {
+        return SPDK_BLOBID_INVALID;
+    }
+
+    while (off + sizeof(record) <= len) {
+        memcpy(&record, value + off, sizeof(record));
+        off += sizeof(record);
+        if (off + record.path_len > len) {
+            break;
+        }
+        if (record.path_len == strlen(path) &&
+            memcmp(value + off, path, record.path_len) == 0) {
+            blobid = record.blobid;
+        }
+        off += record.path_len;
+    }
+    return blobid;
+}
+
+/*
+ * add_snapshot_record appends a record to the xattr of ubi_bdev's blob. The
+ * caller syncs the blob's metadata.
+ */
+static int add_snapshot_record(struct ubi_bdev *ubi_bdev, spdk_blob_id blobid,
+                               const char *path) {
+    struct ubi_snapshot_record record = {.blobid = blobid, .path_len = strlen(path)};
+    char buf[UBI_SNAPSHOTS_XATTR_MAX];
+    size_t new_len = sizeof(record) + record.path_len;
+    const char *value = NULL;
+    size_t len = 0, off = 0;
+
+    if (new_len > sizeof(buf)) {
+        return -ENAMETOOLONG;
+    }
+
+    if (spdk_blob_get_xattr_value(ubi_bdev->blob, UBI_SNAPSHOTS_XATTR,
+                                  (const void **)&value, &len)) {
+        len = 0;
+    }
+
+    /* Drop the oldest records until the new one fits. */
+    while (len - off + new_len > sizeof(buf)) {
+        struct ubi_snapshot_record old;
+        memcpy(&old, value + off, sizeof(old));
+        off += sizeof(old) + old.path_len;
+    }
+
+    memcpy(buf, value + off, len - off);
+    memcpy(buf + len - off, &record, sizeof(record));
+    memcpy(buf + len - off + sizeof(record), path, record.path_len);
+    return spdk_blob_set_xattr(ubi_bdev->blob, UBI_SNAPSHOTS_XATTR, buf,
+                               len - off + new_len);
+}
+
+static bool is_chain_root(spdk_blob_id blobid) {
+    return blobid == SPDK_BLOBID_INVALID || blobid == SPDK_BLOBID_EXTERNAL_SNAPSHOT;
+}
+
+/*
+ * copy_reaches_base returns true if a blob whose parent is parent_blobid has
+ * all clusters the delta needs.
+ */
+static bool copy_reaches_base(struct snapshot_context *ctx, spdk_blob_id parent_blobid) {
+    return parent_blobid == ctx->base_blobid || is_chain_root(parent_blobid);
+}
+
+/*
+ * find_copy_base sets the snapshot a copy of snapshot blobid stops at. An
+ * incremental stops at the snapshot of its parent delta, which must be in the
+ * chain. A full copy stops at the bottom of the chain, the snapshot which
+ * ubi_create takes before the blob is written, as it never has data.
+ */
+static int find_copy_base(struct snapshot_context *ctx, spdk_blob_id blobid) {
+    struct spdk_blob_store *bs = ctx->ubi_bdev->blobstore;
+    spdk_blob_id parent_blobid = ctx->base_blobid;
+
+    ctx->base_blobid = SPDK_BLOBID_INVALID;
+    for (spdk_blob_id id = blobid;;) {
+        spdk_blob_id next = spdk_blob_get_parent_snapshot(bs, id);
+        if (is_chain_root(next)) {
+            if (parent_blobid != SPDK_BLOBID_INVALID) {
+                return -ENOENT;
+            }
+            ctx->base_blobid = id != blobid ? id : SPDK_BLOBID_INVALID;
+            return 0;
+        } else if (next == parent_blobid) {
+            ctx->base_blobid = next;
+            return 0;
+        }
+        id = next;
+    }
+}
+
+/*
+ * guest_latency_p99_us estimates the 99th percentile latency of the guest
+ * reads and writes which completed between two stats samples, as the upper
+ * bound of the histogram bucket it falls in. Returns 0 if there was no I/O.
+ */
+static uint64_t guest_latency_p99_us(const struct ubi_io_stats *now,
+                                     const struct ubi_io_stats *prev) {
+    static const int classes[] = {UBI_IO_CLASS_READ, UBI_IO_CLASS_WRITE};
+    uint64_t counts[UBI_LATENCY_BUCKETS] = {0};
+    uint64_t total = 0, seen = 0;
+
+    for (size_t i = 0; i < SPDK_COUNTOF(classes); i++) {
+        for (uint32_t b = 0; b < UBI_LATENCY_BUCKETS; b++) {
+            uint64_t n = now->latency[classes[i]][b] - prev->latency[classes[i]][b];
+            counts[b] += n;
+            total += n;
+        }
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    for (uint32_t b = 0; b < UBI_LATENCY_BUCKETS - 1; b++) {
+        seen += counts[b];
+        if (seen * 100 >= total * 99) {
+            return (double)(1ULL << b) * SPDK_SEC_TO_USEC / spdk_get_ticks_hz();
+        }
+    }
+    return UINT64_MAX;
+}
+
+/*
+ * ubi_snapshot_throttle passes the current limits of the snapshot to its
+ * delta device, so limits changed at runtime apply within one period. The
+ * device limits each channel, and every export thread has one, so the limits
+ * are split between the threads. p99 is the guest's latency in the last period.
+ */
+static void ubi_snapshot_throttle(struct snapshot_context *ctx, uint64_t p99) {
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+    uint64_t max_rate = ubi_bdev->snapshot_status.max_bytes_per_sec;
+    uint64_t rate = max_rate;
+
+    if (ubi_bdev->snapshot_status.target_latency_us) {
+        rate = ubi_bdev->snapshot_status.adaptive_bytes_per_sec;
+        if (rate == 0) {
+            rate = UBI_ADAPTIVE_START_BYTES_PER_SEC;
+        } else if (p99 > ubi_bdev->snapshot_status.target_latency_us) {
+            rate = spdk_max(rate / 2, UBI_ADAPTIVE_MIN_BYTES_PER_SEC);
+            ubi_bdev->snapshot_status.backoffs++;
+        } else {
+            rate += UBI_ADAPTIVE_STEP_BYTES_PER_SEC;
+        }
+        if (max_rate != 0) {
+            rate = spdk_min(rate, max_rate);
+        }
+    }
+
+    ubi_bdev->snapshot_status.adaptive_bytes_per_sec =
+        ubi_bdev->snapshot_status.target_latency_us ? rate : 0;
+    bs_dev_delta_set_rate_limit(
+        ctx->delta_bs_dev, SPDK_CEIL_DIV(rate, ctx->num_threads),
+        SPDK_CEIL_DIV(ubi_bdev->snapshot_status.max_ios_per_sec, ctx->num_threads));
+}
+
+/*
+ * ubi_snapshot_update_progress derives the copy rates and the time left from
+ * the clusters copied, which the export reports every period.
+ */
+static void ubi_snapshot_update_progress(struct snapshot_context *ctx) {
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+    uint64_t cluster_size = spdk_bs_get_cluster_size(ubi_bdev->blobstore);
+    uint64_t copied = ubi_bdev->snapshot_status.copied_clusters;
+    uint64_t total = ubi_bdev->snapshot_status.total_clusters;
+    uint64_t copy_ticks = ctx->phase_ticks[UBI_SNAPSHOT_PHASE_COPY];
+    uint64_t hz = spdk_get_ticks_hz();
+    uint64_t now = spdk_get_ticks();
+
+    if (now > ctx->last_poll_tsc && copied >= ctx->last_copied) {
+        ubi_bdev->snapshot_status.bytes_per_sec =
+            (double)(copied - ctx->last_copied) * cluster_size * hz /
+            (now - ctx->last_poll_tsc);
+    }
+    ctx->last_copied = copied;
+    ctx->last_poll_tsc = now;
+
+    uint64_t avg = copy_ticks ? (double)copied * cluster_size * hz / copy_ticks : 0;
+    ubi_bdev->snapshot_status.avg_bytes_per_sec = avg;
+    ubi_bdev->snapshot_status.eta_sec =
+        avg ? (total > copied ? (total - copied) * cluster_size / avg : 0) : UINT64_MAX;
+    bs_dev_delta_get_progress(ctx->delta_bs_dev, &ubi_bdev->snapshot_status.zero_clusters,
+                              &ubi_bdev->snapshot_status.delta_bytes);
+}
+
+static void ubi_snapshot_reset_progress(struct ubi_bdev *ubi_bdev) {
+    memset(ubi_bdev->snapshot_status.phase_us, 0,
+           sizeof(ubi_bdev->snapshot_status.phase_us));
+    ubi_bdev->snapshot_status.copied_clusters = 0;
+    ubi_bdev->snapshot_status.total_clusters = 0;
+    ubi_bdev->snapshot_status.bytes_per_sec = 0;
+    ubi_bdev->snapshot_status.avg_bytes_per_sec = 0;
+    ubi_bdev->snapshot_status.eta_sec = UINT64_MAX;
+    ubi_bdev->snapshot_status.zero_clusters = 0;
+    ubi_bdev->snapshot_status.delta_bytes = 0;
+    ubi_bdev->snapshot_status.guest_p99_us = 0;
+    ubi_bdev->snapshot_status.guest_p99_us_max = 0;
+}
+
+/*
+ * ubi_snapshot_stats_cb gets the guest's I/O stats sampled by the last period,
+ * and adapts the copy rate to the latency since the sample before.
+ */
+static void ubi_snapshot_stats_cb(void *cb_arg, const struct ubi_io_stats *now) {
+    struct snapshot_context *ctx = cb_arg;
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+
+    ctx->stats_pending = false;
+    if (ctx->released) {
+        free(ctx->last_stats);
+        free(ctx);
+        return;
+    } else if (!ctx->stats_sampled) {
+        *ctx->last_stats = *now;
+        ctx->stats_sampled = true;
+        return;
+    }
+
+    uint64_t p99 = guest_latency_p99_us(now, ctx->last_stats);
+    *ctx->last_stats = *now;
+    ubi_bdev->snapshot_status.guest_p99_us = p99;
+    ubi_bdev->snapshot_status.guest_p99_us_max =
+        spdk_max(ubi_bdev->snapshot_status.guest_p99_us_max, p99);
+
+    if (ctx->delta_bs_dev != NULL) {
+        ubi_snapshot_throttle(ctx, p99);
+    }
+}
+
+static void ubi_snapshot_sample_stats(struct snapshot_context *ctx) {
+    if (!ctx->stats_pending) {
+        ctx->stats_pending = true;
+        if (ubi_get_io_stats(ctx->ubi_bdev, ubi_snapshot_stats_cb, ctx) != 0) {
+            ctx->stats_pending = false;
+        }
+    }
+}
+
+static int ubi_snapshot_poll(void *arg) {
+    struct snapshot_context *ctx = arg;
+
+    ubi_snapshot_phase(ctx, ctx->phase);
+    if (ctx->delta_bs_dev != NULL) {
+        ubi_snapshot_update_progress(ctx);
+    }
+    ubi_snapshot_sample_stats(ctx);
+    return SPDK_POLLER_BUSY;
+}
+
+static void ubi_snapshot_recorded_cb(void *cb_arg, int bserrno) {
     struct snapshot_context *ctx = cb_arg;
     struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
 
+    if (bserrno != 0) {
+        SPDK_ERRLOG("Failed to record snapshot of %s: %d\n", ubi_bdev->bdev.name,
+                    bserrno);
+    }
+
+    cleanup_snapshot_context(ctx);
+}
+
+static void ubi_export_complete_cb(void *cb_arg, int rc) {
+    SPDK_WARNLOG("export complete\n");
+    struct snapshot_context *ctx = cb_arg;
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+
+    ubi_snapshot_phase(ctx, UBI_SNAPSHOT_PHASE_COUNT);
+    ubi_snapshot_update_progress(ctx);
+
     if (rc != 0) {
-        SPDK_ERRLOG("Failed to shallow copy %s: %d\n", ubi_bdev->bdev.name, rc);
+        SPDK_ERRLOG("Failed to export %s: %d\n", ubi_bdev->bdev.name, rc);
         ubi_bdev->snapshot_status.result = rc;
+        cleanup_snapshot_context(ctx);
+        return;
     }
 
-    cleanup_snapshot_context(ctx);
-    ubi_bdev->snapshot_status.in_progress = false;
+    /*
+     * Later snapshots may be incremental to this one. Deltas are only chained
+     * to files, so one on a bdev isn't recorded.
+     */
+    if (ctx->target_bdev[0] != '\0') {
+        ubi_snapshot_recorded_cb(ctx, 0);
+        return;
+    }
+    rc = add_snapshot_record(ubi_bdev, ctx->snapshot_blobid, ctx->path);
+    if (rc != 0) {
+        ubi_snapshot_recorded_cb(ctx, rc);
+        return;
+    }
+    spdk_blob_sync_md(ubi_bdev->blob, ubi_snapshot_recorded_cb, ctx);
 }
 
-static void ubi_shallow_copy_status_cb(uint64_t copied_clusters, void *cb_arg) {
-    SPDK_WARNLOG("shallow copy status: %lu\n", copied_clusters);
+static void ubi_export_status_cb(uint64_t copied_clusters, uint64_t total_clusters,
+                                 void *cb_arg) {
     struct snapshot_context *context = cb_arg;
     struct ubi_bdev *ubi_bdev = context->ubi_bdev;
     ubi_bdev->snapshot_status.copied_clusters = copied_clusters;
+    ubi_bdev->snapshot_status.total_clusters = total_clusters;
+}
+
+/*
+ * ubi_snapshot_export copies the clusters of the snapshot to the delta
+ * device, once that's created.
+ */
+static void ubi_snapshot_export(void *cb_arg, struct spdk_bs_dev *delta_bs_dev, int rc) {
+    struct snapshot_context *ctx = cb_arg;
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+
+    ctx->delta_bs_dev = delta_bs_dev;
+    if (rc != 0) {
+        ubi_bdev->snapshot_status.result = rc;
+        ctx->cb_fn(ctx->cb_arg, rc);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+
+    ubi_bdev->snapshot_status.adaptive_bytes_per_sec = 0;
+    ubi_snapshot_throttle(ctx, 0);
+
+    SPDK_WARNLOG("starting export for %s, blobid: %lu\n", ubi_bdev->bdev.name,
+                 ctx->copy_blobid);
+    int ret = ubi_export_start(ubi_bdev->blobstore, ctx->copy_blobid,
+                               ctx->delta_bs_dev, ctx->queue_depth,
+                               ctx->num_threads, ubi_export_status_cb,
+                               ubi_export_complete_cb, ctx);
+    SPDK_WARNLOG("export returned %d\n", ret);
+    ctx->cb_fn(ctx->cb_arg, ret);
+    if (ret != 0) {
+        ubi_bdev->snapshot_status.result = ret;
+        cleanup_snapshot_context(ctx);
+    }
 }
 
 static void ubi_start_snapshot(void *cb_arg, int bserrno) {
@@ -65,25 +485,36 @@ static void ubi_start_snapshot(void *cb_arg, int bserrno) {
         return;
     }
 
-    ubi_bdev->snapshot_status.in_progress = true;
-    ubi_bdev->snapshot_status.total_clusters =
-        spdk_bs_total_data_cluster_count(ubi_bdev->blobstore);
+    /* The export reports how many clusters it copies once it listed them. */
+    ubi_bdev->snapshot_status.total_clusters = 0;
+    ubi_snapshot_phase(ctx, UBI_SNAPSHOT_PHASE_COPY);
+    ctx->last_poll_tsc = ctx->phase_tsc;
 
     uint64_t cluster_size = spdk_bs_get_cluster_size(ubi_bdev->blobstore);
 
-    ctx->shallow_copy_bs_dev =
-        bs_dev_delta_create(ctx->path, ubi_bdev->bdev.blockcnt, ubi_bdev->bdev.blocklen,
-                            cluster_size, BS_DEV_DELTA_WRITE);
+    if (ctx->target_bdev[0] != '\0') {
+        int rc = bs_dev_delta_create_bdev(ctx->target_bdev, ctx->parent_path,
+                                          ubi_bdev->bdev.blockcnt,
+                                          ubi_bdev->bdev.blocklen, cluster_size,
+                                          ctx->compression, ubi_snapshot_export, ctx);
+        if (rc != 0) {
+            ubi_snapshot_export(ctx, NULL, rc);
+        }
+        return;
+    }
 
-    SPDK_WARNLOG("starting shallow copy for %s, blobid: %lu\n", ubi_bdev->bdev.name,
-                 ctx->clone_blobid);
-    int ret = spdk_bs_blob_shallow_copy(
-        ubi_bdev->blobstore, ctx->ch, ctx->clone_blobid, ctx->shallow_copy_bs_dev,
-        ubi_shallow_copy_status_cb, ctx, ubi_shallow_copy_complete_cb, ctx);
-    SPDK_WARNLOG("shallow copy returned %d\n", ret);
-    ctx->cb_fn(ctx->cb_arg, ret);
+    struct spdk_bs_dev *delta_bs_dev =
+        bs_dev_delta_create(ctx->path, ctx->parent_path, ubi_bdev->bdev.blockcnt,
+                            ubi_bdev->bdev.blocklen, cluster_size, BS_DEV_DELTA_WRITE,
+                            ctx->compression);
+    ubi_snapshot_export(ctx, delta_bs_dev, delta_bs_dev != NULL ? 0 : -EIO);
 }
 
+/*
+ * ubi_decouple_parent_cb decouples the clone from one snapshot after the
+ * other, each time copying the clusters of its parent which the clone doesn't
+ * have yet, until the clone has every cluster changed since the base.
+ */
 static void ubi_decouple_parent_cb(void *cb_arg, int bserrno) {
     struct snapshot_context *ctx = cb_arg;
     struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
@@ -97,9 +528,16 @@ static void ubi_decouple_parent_cb(void *cb_arg, int bserrno) {
         return;
     }
 
-    SPDK_WARNLOG("Parent decoupled for %s\n", ubi_bdev->bdev.name);
+    spdk_blob_id parent_blobid =
+        spdk_blob_get_parent_snapshot(ubi_bdev->blobstore, ctx->clone_blobid);
+    if (copy_reaches_base(ctx, parent_blobid)) {
+        SPDK_WARNLOG("Parent decoupled for %s\n", ubi_bdev->bdev.name);
+        ubi_start_snapshot(ctx, 0);
+        return;
+    }
 
-    ubi_start_snapshot(ctx, 0);
+    spdk_bs_blob_decouple_parent(ubi_bdev->blobstore, ctx->ch, ctx->clone_blobid,
+                                 ubi_decouple_parent_cb, ctx);
 }
 
 static void ubi_close_clone_cb(void *cb_arg, int bserrno) {
@@ -116,8 +554,8 @@ static void ubi_close_clone_cb(void *cb_arg, int bserrno) {
 
     SPDK_WARNLOG("Clone closed for %s\n", ubi_bdev->bdev.name);
 
-    spdk_bs_blob_decouple_parent(ubi_bdev->blobstore, ctx->ch, ctx->clone_blobid,
-                                 ubi_decouple_parent_cb, ctx);
+    ubi_snapshot_phase(ctx, UBI_SNAPSHOT_PHASE_DECOUPLE);
+    ubi_decouple_parent_cb(ctx, 0);
 }
 
 static void ubi_open_clone_cb(void *cb_arg, struct spdk_blob *blob, int bserrno) {
@@ -162,6 +600,7 @@ static void ubi_clone_create_cb(void *cb_arg, spdk_blob_id blobid, int bserrno)
     SPDK_WARNLOG("Clone created for %s, blobid: %lu \n", ubi_bdev->bdev.name, blobid);
 
     ctx->clone_blobid = blobid;
+    ctx->copy_blobid = blobid;
 
     spdk_bs_open_blob(ubi_bdev->blobstore, blobid, ubi_open_clone_cb, ctx);
 }
@@ -172,6 +611,13 @@ static void ubi_snapshot_create_cb(void *cb_arg, spdk_blob_id blobid, int bserrn
     struct snapshot_context *ctx = cb_arg;
     struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
 
+    /* The clusters of the snapshot are settled, new writes may be partial again. */
+    ubi_pause_end(ubi_bdev, NULL, NULL);
+    ubi_partial_drain_end(ubi_bdev);
+    SPDK_NOTICELOG("Guest I/O of %s paused for %luus to snapshot, %luus of it draining\n",
+                   ubi_bdev->bdev.name, ubi_bdev->snapshot_status.pause_us,
+                   ubi_bdev->snapshot_status.drain_us);
+
     if (bserrno != 0) {
         SPDK_ERRLOG("Failed to create snapshot for %s: %d\n", ubi_bdev->bdev.name,
                     bserrno);
@@ -183,7 +629,7 @@ static void ubi_snapshot_create_cb(void *cb_arg, spdk_blob_id blobid, int bserrn
 
     SPDK_WARNLOG("Snapshot created for %s, blobid: %lu \n", ubi_bdev->bdev.name, blobid);
 
-    if (ctx->path[0] == '\0') {
+    if (ctx->path[0] == '\0' && ctx->target_bdev[0] == '\0') {
         SPDK_WARNLOG("No path provided for snapshot\n");
         ctx->cb_fn(ctx->cb_arg, 0);
         cleanup_snapshot_context(ctx);
@@ -193,28 +639,256 @@ static void ubi_snapshot_create_cb(void *cb_arg, spdk_blob_id blobid, int bserrn
     ctx->snapshot_blobid = blobid;
     ctx->ch = spdk_bs_alloc_io_channel(ubi_bdev->blobstore);
 
+    int rc = find_copy_base(ctx, blobid);
+    if (rc != 0) {
+        SPDK_ERRLOG("Snapshot of %s isn't in the chain of %s\n", ctx->parent_path,
+                    ubi_bdev->bdev.name);
+        ubi_bdev->snapshot_status.result = rc;
+        ctx->cb_fn(ctx->cb_arg, rc);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+
+    /*
+     * If the snapshot sits right on the base, the clusters it owns are exactly
+     * those the decoupled clone would get, and the snapshot is read-only
+     * already, so it can be exported as is. Clusters it borrows from the
+     * base stay where they are, and read from there through the delta's empty
+     * entries. Deeper chains still need the clone.
+     */
+    spdk_blob_id parent_blobid =
+        spdk_blob_get_parent_snapshot(ubi_bdev->blobstore, blobid);
+    if (!ctx->decouple_parent && copy_reaches_base(ctx, parent_blobid)) {
+        ctx->copy_blobid = blobid;
+        ubi_start_snapshot(ctx, 0);
+        return;
+    }
+
+    ubi_snapshot_phase(ctx, UBI_SNAPSHOT_PHASE_CLONE);
     spdk_bs_create_clone(ubi_bdev->blobstore, blobid, &g_xattrs, ubi_clone_create_cb,
                          ctx);
 }
 
-void bdev_ubi_snapshot(const char *name, const char *path,
+/*
+ * ubi_snapshot_quiesced is called once no guest I/O is in flight. The bdev
+ * stays quiesced until the snapshot blob is created, so the snapshot has every
+ * write the guest saw complete and none of the later ones.
+ */
+static void ubi_snapshot_quiesced(void *cb_arg, int status) {
+    struct snapshot_context *ctx = cb_arg;
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+
+    if (status != 0) {
+        ubi_partial_drain_end(ubi_bdev);
+        SPDK_ERRLOG("Failed to quiesce %s: %d\n", ubi_bdev->bdev.name, status);
+        ubi_bdev->snapshot_status.result = status;
+        ctx->cb_fn(ctx->cb_arg, status);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+
+    spdk_bs_create_snapshot(ubi_bdev->blobstore, ubi_bdev->blobid, &g_xattrs,
+                            ubi_snapshot_create_cb, ctx);
+}
+
+/*
+ * ubi_snapshot_partial_drained is called once no cluster of the blob is
+ * partially valid, so that the snapshot captures complete clusters only.
+ */
+static void ubi_snapshot_partial_drained(void *cb_arg, int bserrno) {
+    struct snapshot_context *ctx = cb_arg;
+
+    if (bserrno != 0) {
+        ubi_partial_drain_end(ctx->ubi_bdev);
+        SPDK_ERRLOG("Failed to fill partial clusters of %s: %d\n",
+                    ctx->ubi_bdev->bdev.name, bserrno);
+        ctx->ubi_bdev->snapshot_status.result = bserrno;
+        ctx->cb_fn(ctx->cb_arg, bserrno);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+
+    int rc = ubi_pause_begin(ctx->ubi_bdev, ctx->quiesce_timeout_us,
+                             ubi_snapshot_quiesced, ctx);
+    if (rc != 0) {
+        ubi_snapshot_quiesced(ctx, rc);
+    }
+}
+
+/*
+ * ubi_snapshot_reflinked is called once the base file was cloned, or couldn't
+ * be, in which case the snapshot is copied to a delta file instead.
+ */
+static void ubi_snapshot_reflinked(void *cb_arg, int rc) {
+    struct snapshot_context *ctx = cb_arg;
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+
+    if (rc == -ENOTSUP) {
+        SPDK_NOTICELOG("Base of %s can't be reflinked, copying a delta\n",
+                       ubi_bdev->bdev.name);
+        ubi_partial_drain(ubi_bdev, ubi_snapshot_partial_drained, ctx);
+        return;
+    }
+
+    if (rc != 0) {
+        SPDK_ERRLOG("Failed to reflink base of %s: %d\n", ubi_bdev->bdev.name, rc);
+    }
+    ubi_bdev->snapshot_status.reflinked = rc == 0;
+    ubi_bdev->snapshot_status.result = rc;
+    ctx->cb_fn(ctx->cb_arg, rc);
+    cleanup_snapshot_context(ctx);
+}
+
+void bdev_ubi_snapshot(const struct spdk_ubi_snapshot_opts *opts,
                        spdk_snapshot_ubi_complete cb_fn, void *cb_arg) {
-    struct spdk_bdev *bdev = spdk_bdev_get_by_name(name);
+    struct spdk_bdev *bdev = spdk_bdev_get_by_name(opts->name);
     if (bdev == NULL) {
-        SPDK_ERRLOG("bdev %s not found\n", name);
+        SPDK_ERRLOG("bdev %s not found\n", opts->name);
         cb_fn(cb_arg, -ENOENT);
         return;
     }
 
     struct ubi_bdev *ubi_bdev = SPDK_CONTAINEROF(bdev, struct ubi_bdev, bdev);
+    if (ubi_bdev->snapshot_status.in_progress) {
+        SPDK_ERRLOG("a snapshot of %s is in progress already\n", opts->name);
+        cb_fn(cb_arg, -EBUSY);
+        return;
+    }
+
     struct snapshot_context *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        cb_fn(cb_arg, -ENOMEM);
+        return;
+    }
     SPDK_WARNLOG("Creating snapshot for %s, blobid: %lu\n", ubi_bdev->bdev.name,
                  ubi_bdev->blobid);
 
+    /* Set until cleanup_snapshot_context, on every path of the snapshot. */
+    ubi_bdev->snapshot_status.in_progress = true;
+    ubi_bdev->snapshot_status.result = 0;
     ctx->cb_fn = cb_fn;
     ctx->cb_arg = cb_arg;
+    ctx->phase = UBI_SNAPSHOT_PHASE_COUNT;
     ctx->ubi_bdev = ubi_bdev;
-    ctx->path = strdup(path);
-    spdk_bs_create_snapshot(ubi_bdev->blobstore, ubi_bdev->blobid, &g_xattrs,
-                            ubi_snapshot_create_cb, ctx);
+    ctx->path = strdup(opts->path ? opts->path : "");
+    ctx->target_bdev = strdup(opts->target_bdev ? opts->target_bdev : "");
+    if (ctx->path == NULL || ctx->target_bdev == NULL) {
+        cb_fn(cb_arg, -ENOMEM);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+    ctx->decouple_parent = opts->decouple_parent;
+    ctx->quiesce_timeout_us = opts->quiesce_timeout_us;
+    ctx->queue_depth = opts->queue_depth ? opts->queue_depth
+                                         : UBI_EXPORT_DEFAULT_QUEUE_DEPTH;
+    ctx->num_threads = opts->num_threads ? opts->num_threads : 1;
+    if (opts->compression == NULL || opts->compression[0] == '\0' ||
+        strcmp(opts->compression, "none") == 0) {
+        ctx->compression = UBI_DELTA_COMPRESSION_NONE;
+    } else if (strcmp(opts->compression, "deflate") == 0) {
+        ctx->compression = UBI_DELTA_COMPRESSION_DEFLATE;
+    } else {
+        SPDK_ERRLOG("unsupported compression %s\n", opts->compression);
+        cb_fn(cb_arg, -EINVAL);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+    if (ctx->path[0] != '\0' && ctx->target_bdev[0] != '\0') {
+        SPDK_ERRLOG("a snapshot goes either to a path or to a target_bdev\n");
+        cb_fn(cb_arg, -EINVAL);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+    if (ctx->queue_depth > UBI_EXPORT_MAX_QUEUE_DEPTH ||
+        ctx->num_threads > UBI_EXPORT_MAX_THREADS) {
+        SPDK_ERRLOG("queue_depth must be at most %d and num_threads at most %d\n",
+                    UBI_EXPORT_MAX_QUEUE_DEPTH, UBI_EXPORT_MAX_THREADS);
+        cb_fn(cb_arg, -EINVAL);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+
+    /*
+     * An incremental delta records its parent delta. A full one records the
+     * delta the bdev was created from, if any, as that's below the image.
+     */
+    ctx->base_blobid = SPDK_BLOBID_INVALID;
+    if (opts->parent_path && opts->parent_path[0]) {
+        ctx->base_blobid = find_snapshot_record(ubi_bdev, opts->parent_path);
+        ctx->parent_path = strdup(opts->parent_path);
+        if (ctx->parent_path == NULL) {
+            cb_fn(cb_arg, -ENOMEM);
+            cleanup_snapshot_context(ctx);
+            return;
+        }
+        if (ctx->base_blobid == SPDK_BLOBID_INVALID) {
+            SPDK_ERRLOG("No snapshot of %s wrote %s\n", ubi_bdev->bdev.name,
+                        opts->parent_path);
+            cb_fn(cb_arg, -ENOENT);
+            cleanup_snapshot_context(ctx);
+            return;
+        }
+    } else {
+        ctx->parent_path = strdup(ubi_bdev->snapshot_path);
+        if (ctx->parent_path == NULL) {
+            cb_fn(cb_arg, -ENOMEM);
+            cleanup_snapshot_context(ctx);
+            return;
+        }
+    }
+
+    ubi_bdev->snapshot_status.max_bytes_per_sec = opts->max_bytes_per_sec;
+    ubi_bdev->snapshot_status.max_ios_per_sec = opts->max_ios_per_sec;
+    ubi_bdev->snapshot_status.target_latency_us = opts->target_latency_us;
+    ubi_bdev->snapshot_status.backoffs = 0;
+    ubi_bdev->snapshot_status.reflinked = false;
+    ubi_snapshot_reset_progress(ubi_bdev);
+
+    ctx->last_stats = calloc(1, sizeof(*ctx->last_stats));
+    if (ctx->last_stats == NULL) {
+        cb_fn(cb_arg, -ENOMEM);
+        cleanup_snapshot_context(ctx);
+        return;
+    }
+    ubi_snapshot_sample_stats(ctx);
+    ubi_snapshot_phase(ctx, UBI_SNAPSHOT_PHASE_SNAPSHOT);
+    ctx->throttle_poller =
+        SPDK_POLLER_REGISTER(ubi_snapshot_poll, ctx, UBI_THROTTLE_PERIOD_US);
+
+    if (opts->reflink && ctx->path[0] != '\0') {
+        int rc = ubi_reflink_snapshot(ubi_bdev, ctx->path, ctx->quiesce_timeout_us,
+                                      ubi_snapshot_reflinked, ctx);
+        if (rc == 0) {
+            return;
+        } else if (rc != -ENOTSUP) {
+            cb_fn(cb_arg, rc);
+            cleanup_snapshot_context(ctx);
+            return;
+        }
+        SPDK_NOTICELOG("Base of %s isn't a file, copying a delta\n", ubi_bdev->bdev.name);
+    }
+
+    ubi_partial_drain(ubi_bdev, ubi_snapshot_partial_drained, ctx);
+}
+
+/*
+ * bdev_ubi_snapshot_set_limits changes the rate limits of the snapshot which
+ * is being copied. Returns -EINVAL if there's none.
+ */
+int bdev_ubi_snapshot_set_limits(const char *name, uint64_t max_bytes_per_sec,
+                                 uint64_t max_ios_per_sec, uint64_t target_latency_us) {
+    struct spdk_bdev *bdev = spdk_bdev_get_by_name(name);
+    if (bdev == NULL) {
+        return -ENOENT;
+    }
+
+    struct ubi_bdev *ubi_bdev = SPDK_CONTAINEROF(bdev, struct ubi_bdev, bdev);
+    if (!ubi_bdev->snapshot_status.in_progress) {
+        return -EINVAL;
+    }
+
+    ubi_bdev->snapshot_status.max_bytes_per_sec = max_bytes_per_sec;
+    ubi_bdev->snapshot_status.max_ios_per_sec = max_ios_per_sec;
+    ubi_bdev->snapshot_status.target_latency_us = target_latency_us;
+    return 0;
 }
@@ -0,0 +1,152 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/likely.h"
+
+/*
+ * I/O statistics. Every I/O of a ubi bdev completes through ubi_io_complete,
+ * which updates the counters of the channel the I/O was submitted on. The
+ * counters are summed over all channels when they're reported, which tells
+ * whether a bdev is mostly served from its image or from the base bdev.
+ */
+
+static const char *const g_io_class_names[UBI_IO_CLASS_COUNT] = {
+    [UBI_IO_CLASS_READ] = "read",
+    [UBI_IO_CLASS_WRITE] = "write",
+    [UBI_IO_CLASS_WRITE_ZEROES] = "write_zeroes",
+    [UBI_IO_CLASS_FLUSH] = "flush",
+};
+
+static int io_class(uint8_t io_type) {
+    switch (io_type) {
+    case SPDK_BDEV_IO_TYPE_READ:
+        return UBI_IO_CLASS_READ;
+    case SPDK_BDEV_IO_TYPE_WRITE:
+        return UBI_IO_CLASS_WRITE;
+    case SPDK_BDEV_IO_TYPE_WRITE_ZEROES:
+        return UBI_IO_CLASS_WRITE_ZEROES;
+    case SPDK_BDEV_IO_TYPE_FLUSH:
+        return UBI_IO_CLASS_FLUSH;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * latency_bucket returns the histogram bucket of the given latency. Bucket b
+ * holds latencies of less than 2^b ticks which don't fit an earlier bucket.
+ */
+static uint32_t latency_bucket(uint64_t ticks) {
+    uint32_t bucket = ticks == 0 ? 0 : 64 - __builtin_clzll(ticks);
+    return spdk_min(bucket, UBI_LATENCY_BUCKETS - 1);
+}
+
+/*
+ * ubi_io_complete accounts a finished I/O to its channel and completes it.
+ * Must be called on the thread of the channel the I/O was submitted on.
+ */
+void ubi_io_complete(struct spdk_bdev_io *bdev_io, enum spdk_bdev_io_status status) {
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+    struct ubi_io_channel *ch = ubi_io->ubi_ch;
+    uint64_t num_blocks = bdev_io->u.bdev.num_blocks;
+    bool success = status == SPDK_BDEV_IO_STATUS_SUCCESS;
+    int class = io_class(bdev_io->type);
+
+    spdk_trace_record(TRACE_BDEV_UBI_IO_DONE, 0, 0, (uintptr_t)bdev_io, status);
+    if (spdk_likely(class >= 0)) {
+        uint32_t bucket = latency_bucket(spdk_get_ticks() - ubi_io->submit_tsc);
+        UBI_STAT_ADD(ch, latency[class][bucket], 1);
+    }
+
+    switch (bdev_io->type) {
+    case SPDK_BDEV_IO_TYPE_READ:
+        UBI_STAT_ADD(ch, active_reads, -1);
+        if (!success) {
+            break;
+        }
+
+        UBI_STAT_ADD(ch, blocks_read, num_blocks);
+        if (ubi_io->read_source == UBI_READ_BLOB) {
+            UBI_STAT_ADD(ch, reads_blob, 1);
+        } else if (ubi_io->read_source == UBI_READ_IMAGE) {
+            UBI_STAT_ADD(ch, reads_image, 1);
+            UBI_STAT_ADD(ch, image_bytes_read, num_blocks * bdev_io->bdev->blocklen);
+        } else {
+            UBI_STAT_ADD(ch, reads_zeroes, 1);
+        }
+        break;
+    case SPDK_BDEV_IO_TYPE_WRITE:
+        if (success) {
+            UBI_STAT_ADD(ch, blocks_written, num_blocks);
+        }
+        break;
+    case SPDK_BDEV_IO_TYPE_FLUSH:
+        UBI_STAT_ADD(ch, flushes, 1);
+        break;
+    default:
+        break;
+    }
+
+    spdk_bdev_io_complete(bdev_io, status);
+}
+
+static void write_latency_json(struct spdk_json_write_ctx *w, const char *name,
+                               const uint64_t *buckets) {
+    double ticks_per_us = (double)spdk_get_ticks_hz() / SPDK_SEC_TO_USEC;
+
+    spdk_json_write_named_array_begin(w, name);
+    for (uint32_t b = 0; b < UBI_LATENCY_BUCKETS; b++) {
+        if (buckets[b] == 0) {
+            continue;
+        }
+
+        spdk_json_write_object_begin(w);
+        if (b == UBI_LATENCY_BUCKETS - 1) {
+            spdk_json_write_named_null(w, "le_us");
+        } else {
+            spdk_json_write_named_double(w, "le_us", (double)(1ULL << b) / ticks_per_us);
+        }
+        spdk_json_write_named_uint64(w, "count", buckets[b]);
+        spdk_json_write_object_end(w);
+    }
+    spdk_json_write_array_end(w);
+}
+
+/*
+ * ubi_stats_write_json writes the statistics of ubi_bdev, with stats summed by
+ * ubi_get_io_stats, as members of the current json object. Latency histograms
+ * only list non-empty buckets, each with the upper bound of its latencies in
+ * microseconds.
+ */
+void ubi_stats_write_json(struct ubi_bdev *ubi_bdev, const struct ubi_io_stats *stats,
+                          struct spdk_json_write_ctx *w) {
+    uint64_t filled =
+        __atomic_load_n(&ubi_bdev->partial.image_bytes_filled, __ATOMIC_RELAXED);
+
+    spdk_json_write_named_uint64(w, "blocks_read", stats->blocks_read);
+    spdk_json_write_named_uint64(w, "blocks_written", stats->blocks_written);
+    spdk_json_write_named_uint64(w, "active_reads", stats->active_reads);
+    spdk_json_write_named_uint64(w, "reads_blob", stats->reads_blob);
+    spdk_json_write_named_uint64(w, "reads_image", stats->reads_image);
+    spdk_json_write_named_uint64(w, "reads_zeroes", stats->reads_zeroes);
+    spdk_json_write_named_uint64(w, "cow_copies", stats->cow_copies);
+    spdk_json_write_named_uint64(w, "flushes", stats->flushes);
+
+    /* Copies are counted as whole clusters, even at the end of the image. */
+    spdk_json_write_named_uint64(w, "image_bytes_read", stats->image_bytes_read);
+    spdk_json_write_named_uint64(w, "image_bytes_copied",
+                                 stats->cow_copies * ubi_bdev->cluster_size);
+    spdk_json_write_named_uint64(w, "image_bytes_filled", filled);
+
+    spdk_json_write_named_uint64(w, "zero_writes_elided", stats->zero_writes_elided);
+    spdk_json_write_named_uint64(w, "ios_deferred", stats->ios_deferred);
+    spdk_json_write_named_uint64(w, "retry_queue_depth", stats->retry_queue_depth);
+    spdk_json_write_named_uint64(
+        w, "retry_queue_depth_max",
+        __atomic_load_n(&ubi_bdev->retry_queue_depth_max, __ATOMIC_RELAXED));
+
+    spdk_json_write_named_object_begin(w, "latency");
+    for (int class = 0; class < UBI_IO_CLASS_COUNT; class++) {
+        write_latency_json(w, g_io_class_names[class], stats->latency[class]);
+    }
+    spdk_json_write_object_end(w);
+}
@@ -0,0 +1,988 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/blob.h"
+#include "spdk/env.h"
+#include "spdk/log.h"
+
+/*
+ * Sub-cluster copy-on-write.
+ *
+ * The first write to a cluster which is backed by the image makes the
+ * blobstore copy the whole cluster from the image before the write lands. For
+ * writes which cover a whole sector we instead allocate the cluster without
+ * the copy and remember which sectors of it hold valid data. Reads of the
+ * other sectors are served from the image, and a filler running on
+ * ubi_bdev->thread copies them into the blob in the background. Once all
+ * sectors are valid the cluster becomes an ordinary allocated cluster.
+ *
+ * The table is persisted in the UBI_PARTIAL_XATTR xattr of the blob:
+ *  - a cluster is recorded before it is allocated, so that an allocated
+ *    cluster without a record never exposes the garbage it was allocated with,
+ *  - a sector is recorded as valid after its data was written and before the
+ *    write is acknowledged.
+ */
+
+/* Clusters are filled once they weren't written for this long. */
+#define UBI_PARTIAL_FILL_DELAY_US (100 * 1000)
+#define UBI_PARTIAL_FILL_POLL_US 1000
+/* Failed fills of a cluster are retried this many times before giving up. */
+#define UBI_PARTIAL_FILL_RETRIES 3
+
+struct ubi_partial_record {
+    uint64_t cluster;
+    struct ubi_sector_map valid;
+};
+
+enum partial_write_action {
+    /* not a partial cluster, the caller uses the normal write path */
+    PARTIAL_WRITE_NONE,
+    /* the sector is durable, write and complete */
+    PARTIAL_WRITE_DIRECT,
+    /* the cluster was just created, persist it, write, then persist the sector */
+    PARTIAL_WRITE_PERSIST_FIRST,
+    /* write, then persist the table before completing */
+    PARTIAL_WRITE_PERSIST_AFTER,
+    /* the sector is busy or the cluster is retiring, retry later */
+    PARTIAL_WRITE_RETRY,
+    /* the sector has to be filled first, but filling it failed */
+    PARTIAL_WRITE_FAIL,
+};
+
+static void partial_persist(void *arg);
+static void partial_write_blob(struct spdk_bdev_io *bdev_io);
+
+static inline bool sector_test(const struct ubi_sector_map *map, uint32_t sector) {
+    return (map->bits[sector / 64] >> (sector % 64)) & 1;
+}
+
+static inline void sector_set(struct ubi_sector_map *map, uint32_t sector) {
+    map->bits[sector / 64] |= 1ULL << (sector % 64);
+}
+
+static inline void sector_clear(struct ubi_sector_map *map, uint32_t sector) {
+    map->bits[sector / 64] &= ~(1ULL << (sector % 64));
+}
+
+static bool sector_map_full(const struct ubi_sector_map *map, uint32_t num_sectors) {
+    for (uint32_t sector = 0; sector < num_sectors; sector++) {
+        if (!sector_test(map, sector)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool sector_map_empty(const struct ubi_sector_map *map) {
+    for (size_t i = 0; i < SPDK_COUNTOF(map->bits); i++) {
+        if (map->bits[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool partial_map_test(struct ubi_partial_state *state, uint64_t cluster) {
+    uint64_t word = __atomic_load_n(&state->map[cluster / 64], __ATOMIC_ACQUIRE);
+    return (word >> (cluster % 64)) & 1;
+}
+
+static uint64_t io_cluster(struct ubi_bdev *ubi_bdev, struct spdk_bdev_io *bdev_io) {
+    return bdev_io->u.bdev.offset_blocks / ubi_bdev->blocks_per_cluster;
+}
+
+static uint32_t io_sector(struct ubi_bdev *ubi_bdev, struct spdk_bdev_io *bdev_io) {
+    uint64_t offset = bdev_io->u.bdev.offset_blocks % ubi_bdev->blocks_per_cluster;
+    return offset / ubi_bdev->partial.blocks_per_sector;
+}
+
+/*
+ * partial_may_exist returns false if the cluster neither is nor can become a
+ * partial cluster, which is decided without taking the lock. An entry is
+ * always published in state->map before its cluster is marked allocated.
+ */
+static bool partial_may_exist(struct ubi_bdev *ubi_bdev, uint64_t cluster) {
+    if (ubi_bdev->partial.map == NULL) {
+        return false;
+    } else if (ubi_cluster_is_allocated(ubi_bdev, cluster)) {
+        return partial_map_test(&ubi_bdev->partial, cluster);
+    }
+    return ubi_bdev->subcluster_cow;
+}
+
+static struct ubi_partial_cluster *partial_find(struct ubi_partial_state *state,
+                                                uint64_t cluster) {
+    for (int i = 0; i < UBI_PARTIAL_MAX_CLUSTERS; i++) {
+        if (state->clusters[i].active && state->clusters[i].cluster == cluster) {
+            return &state->clusters[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * partial_create adds an entry for the given cluster if the first write to it
+ * can skip the copy from the image. Called with the lock held.
+ */
+static struct ubi_partial_cluster *partial_create(struct ubi_bdev *ubi_bdev,
+                                                  uint64_t cluster) {
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    struct spdk_bs_dev *esnap_dev = ubi_bdev->esnap_dev;
+    uint64_t image_size = esnap_dev->blockcnt * esnap_dev->blocklen;
+    struct ubi_partial_cluster *pc = NULL;
+
+    if (!ubi_bdev->subcluster_cow || state->draining ||
+        ubi_bdev->snapshot_status.in_progress ||
+        state->count == UBI_PARTIAL_MAX_CLUSTERS) {
+        return NULL;
+    }
+
+    /*
+     * Clusters which read as zeroes are already allocated without a copy, and
+     * the image device can't serve sector reads past its end.
+     */
+    if ((cluster + 1) * ubi_bdev->cluster_size > image_size ||
+        ubi_cluster_reads_zeroes(ubi_bdev, cluster)) {
+        return NULL;
+    }
+
+    for (int i = 0; i < UBI_PARTIAL_MAX_CLUSTERS; i++) {
+        if (!state->clusters[i].active) {
+            pc = &state->clusters[i];
+            break;
+        }
+    }
+
+    memset(pc, 0, sizeof(*pc));
+    pc->cluster = cluster;
+    pc->active = true;
+    __atomic_fetch_add(&state->count, 1, __ATOMIC_RELEASE);
+
+    __atomic_fetch_or(&state->map[cluster / 64], 1ULL << (cluster % 64),
+                      __ATOMIC_RELEASE);
+    ubi_alloc_map_mark(ubi_bdev, cluster * ubi_bdev->blocks_per_cluster,
+                       ubi_bdev->blocks_per_cluster);
+    bs_dev_uring_set_cow_bypass(esnap_dev, cluster, true);
+    return pc;
+}
+
+/*
+ * partial_check_retire starts retiring the entry if all of its sectors are
+ * valid and nothing is in flight. Returns true if the table needs to be
+ * persisted. Called with the lock held.
+ */
+static bool partial_check_retire(struct ubi_partial_state *state,
+                                 struct ubi_partial_cluster *pc) {
+    if (pc == NULL || pc->retiring || !pc->persisted || pc->pending_writes != 0 ||
+        !sector_map_empty(&pc->filling) ||
+        !sector_map_full(&pc->valid, state->sectors_per_cluster)) {
+        return false;
+    }
+
+    pc->retiring = true;
+    state->gen++;
+    return true;
+}
+
+static void partial_kick_persist(struct ubi_bdev *ubi_bdev) {
+    spdk_thread_send_msg(ubi_bdev->thread, partial_persist, ubi_bdev);
+}
+
+static enum partial_write_action partial_prepare_write(struct ubi_bdev *ubi_bdev,
+                                                       struct spdk_bdev_io *bdev_io) {
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    uint64_t offset = bdev_io->u.bdev.offset_blocks;
+    uint64_t num_blocks = bdev_io->u.bdev.num_blocks;
+    uint64_t cluster = io_cluster(ubi_bdev, bdev_io);
+    enum partial_write_action action;
+    struct ubi_partial_cluster *pc;
+    uint32_t sector;
+    bool full;
+
+    ubi_io->partial_tracked = false;
+    ubi_io->partial_written = false;
+    ubi_io->partial_busy_sector = false;
+
+    if (!partial_may_exist(ubi_bdev, cluster)) {
+        UBI_STAT_ADD(ubi_io->ubi_ch, cow_copies,
+                     ubi_alloc_map_mark(ubi_bdev, offset, num_blocks));
+        return PARTIAL_WRITE_NONE;
+    }
+
+    sector = io_sector(ubi_bdev, bdev_io);
+    full = offset % state->blocks_per_sector == 0 &&
+           num_blocks == state->blocks_per_sector;
+
+    pthread_mutex_lock(&state->lock);
+    pc = partial_find(state, cluster);
+    if (pc == NULL) {
+        if (full && !ubi_cluster_is_allocated(ubi_bdev, cluster) &&
+            (pc = partial_create(ubi_bdev, cluster)) != NULL) {
+            /* The sector becomes valid once the write after the sync is done. */
+            sector_set(&pc->filling, sector);
+            ubi_io->partial_busy_sector = true;
+            action = PARTIAL_WRITE_PERSIST_FIRST;
+        } else {
+            /* Marked under the lock so that no entry is created concurrently. */
+            UBI_STAT_ADD(ubi_io->ubi_ch, cow_copies,
+                         ubi_alloc_map_mark(ubi_bdev, offset, num_blocks));
+            action = PARTIAL_WRITE_NONE;
+        }
+    } else if (pc->retiring || !pc->persisted || sector_test(&pc->filling, sector)) {
+        action = PARTIAL_WRITE_RETRY;
+    } else if (sector_test(&pc->durable, sector)) {
+        action = PARTIAL_WRITE_DIRECT;
+    } else if (sector_test(&pc->valid, sector)) {
+        action = PARTIAL_WRITE_PERSIST_AFTER;
+    } else if (full) {
+        /* Keep the filler away from the sector until the write is done. */
+        sector_set(&pc->filling, sector);
+        ubi_io->partial_busy_sector = true;
+        action = PARTIAL_WRITE_PERSIST_AFTER;
+    } else if (pc->fill_failures >= UBI_PARTIAL_FILL_RETRIES) {
+        action = PARTIAL_WRITE_FAIL;
+    } else {
+        /* A partial write has to wait until the sector is filled. */
+        action = PARTIAL_WRITE_RETRY;
+    }
+
+    if (action != PARTIAL_WRITE_NONE && action != PARTIAL_WRITE_RETRY &&
+        action != PARTIAL_WRITE_FAIL) {
+        pc->pending_writes++;
+        pc->last_write_tsc = spdk_get_ticks();
+        ubi_io->partial_tracked = true;
+    }
+
+    if (action == PARTIAL_WRITE_PERSIST_FIRST) {
+        ubi_io->partial_gen = ++state->gen;
+        TAILQ_INSERT_TAIL(&state->waiters, ubi_io, partial_link);
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    return action;
+}
+
+static void partial_write_complete(void *cb_arg, int bserrno) {
+    struct spdk_bdev_io *bdev_io = cb_arg;
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+    struct ubi_bdev *ubi_bdev = ubi_io->ubi_bdev;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    uint32_t sector = io_sector(ubi_bdev, bdev_io);
+    struct ubi_partial_cluster *pc;
+    bool wait = false, kick = false;
+
+    if (bserrno && bserrno != -ENOMEM) {
+        SPDK_ERRLOG("I/O error: %s, offset_blocks: %lu, size_blocks: %lu\n",
+                    spdk_strerror(-bserrno), bdev_io->u.bdev.offset_blocks,
+                    bdev_io->u.bdev.num_blocks);
+    }
+
+    pthread_mutex_lock(&state->lock);
+    pc = partial_find(state, io_cluster(ubi_bdev, bdev_io));
+    if (pc != NULL && ubi_io->partial_tracked) {
+        if (ubi_io->partial_busy_sector) {
+            sector_clear(&pc->filling, sector);
+            if (bserrno == 0) {
+                sector_set(&pc->valid, sector);
+            }
+        }
+
+        if (bserrno == 0 && !sector_test(&pc->durable, sector)) {
+            /* Complete once the sector is recorded as valid on disk. */
+            ubi_io->partial_written = true;
+            ubi_io->partial_gen = ++state->gen;
+            TAILQ_INSERT_TAIL(&state->waiters, ubi_io, partial_link);
+            wait = kick = true;
+        }
+
+        pc->pending_writes--;
+        kick = partial_check_retire(state, pc) || kick;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    if (kick) {
+        partial_kick_persist(ubi_bdev);
+    }
+
+    if (wait) {
+        return;
+    } else if (bserrno == -ENOMEM) {
+        /* Nothing was written, the write starts over from the retry queue. */
+        ubi_queue_retry(ubi_io->ubi_ch, bdev_io);
+    } else {
+        ubi_io_complete(bdev_io, bserrno ? SPDK_BDEV_IO_STATUS_FAILED
+                                         : SPDK_BDEV_IO_STATUS_SUCCESS);
+    }
+}
+
+static void partial_write_blob(struct spdk_bdev_io *bdev_io) {
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+
+    spdk_blob_io_writev(ubi_io->ubi_bdev->blob, ubi_io->ubi_ch->bs_channel,
+                        bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt,
+                        bdev_io->u.bdev.offset_blocks, bdev_io->u.bdev.num_blocks,
+                        partial_write_complete, bdev_io);
+}
+
+/*
+ * partial_resume continues a write on its own thread once the metadata sync
+ * it was waiting for is done.
+ */
+static void partial_resume(void *arg) {
+    struct spdk_bdev_io *bdev_io = arg;
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+
+    if (ubi_io->partial_written) {
+        ubi_io_complete(bdev_io, ubi_io->status);
+    } else if (ubi_io->status != SPDK_BDEV_IO_STATUS_SUCCESS) {
+        partial_write_complete(bdev_io, -EIO);
+    } else {
+        partial_write_blob(bdev_io);
+    }
+}
+
+/*
+ * ubi_partial_submit_write serves writes to partial clusters and to clusters
+ * which may become one. Returns false if the caller should submit the write
+ * to the blob as usual, in which case the allocation map is already updated.
+ */
+bool ubi_partial_submit_write(struct ubi_io_channel *ch, struct spdk_bdev_io *bdev_io) {
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+
+    ubi_io->ubi_bdev = ubi_bdev;
+    ubi_io->ubi_ch = ch;
+
+    switch (partial_prepare_write(ubi_bdev, bdev_io)) {
+    case PARTIAL_WRITE_NONE:
+        return false;
+    case PARTIAL_WRITE_RETRY:
+        ubi_queue_retry(ch, bdev_io);
+        break;
+    case PARTIAL_WRITE_FAIL:
+        ubi_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_FAILED);
+        break;
+    case PARTIAL_WRITE_PERSIST_FIRST:
+        partial_kick_persist(ubi_bdev);
+        break;
+    case PARTIAL_WRITE_DIRECT:
+    case PARTIAL_WRITE_PERSIST_AFTER:
+        partial_write_blob(bdev_io);
+        break;
+    }
+
+    return true;
+}
+
+static void partial_esnap_read_complete(struct spdk_io_channel *channel, void *cb_arg,
+                                        int bserrno) {
+    struct spdk_bdev_io *bdev_io = cb_arg;
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+
+    if (bserrno == -ENOMEM) {
+        ubi_queue_retry(ubi_io->ubi_ch, bdev_io);
+        return;
+    } else if (bserrno) {
+        SPDK_ERRLOG("image read error: %s, offset_blocks: %lu, size_blocks: %lu\n",
+                    spdk_strerror(-bserrno), bdev_io->u.bdev.offset_blocks,
+                    bdev_io->u.bdev.num_blocks);
+    }
+    ubi_io_complete(bdev_io, bserrno ? SPDK_BDEV_IO_STATUS_FAILED
+                                     : SPDK_BDEV_IO_STATUS_SUCCESS);
+}
+
+/*
+ * ubi_partial_submit_read serves reads of sectors which aren't valid in their
+ * partial cluster from the image. Returns false if the caller should read
+ * from the blob.
+ */
+bool ubi_partial_submit_read(struct ubi_io_channel *ch, struct spdk_bdev_io *bdev_io) {
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    struct spdk_bs_dev *esnap_dev = ubi_bdev->esnap_dev;
+    uint64_t cluster = io_cluster(ubi_bdev, bdev_io);
+    struct ubi_partial_cluster *pc;
+    bool from_image;
+
+    if (state->map == NULL || !partial_map_test(state, cluster)) {
+        return false;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    pc = partial_find(state, cluster);
+    from_image = pc != NULL && !sector_test(&pc->valid, io_sector(ubi_bdev, bdev_io));
+    pthread_mutex_unlock(&state->lock);
+
+    if (!from_image) {
+        return false;
+    }
+
+    ubi_io->read_source = UBI_READ_IMAGE;
+
+    if (ch->esnap_channel == NULL) {
+        ch->esnap_channel = esnap_dev->create_channel(esnap_dev);
+        if (ch->esnap_channel == NULL) {
+            ubi_queue_retry(ch, bdev_io);
+            return true;
+        }
+    }
+
+    ubi_io->esnap_cb_args.cb_fn = partial_esnap_read_complete;
+    ubi_io->esnap_cb_args.channel = ch->esnap_channel;
+    ubi_io->esnap_cb_args.cb_arg = bdev_io;
+    esnap_dev->readv(esnap_dev, ch->esnap_channel, bdev_io->u.bdev.iovs,
+                     bdev_io->u.bdev.iovcnt,
+                     bdev_io->u.bdev.offset_blocks * ubi_bdev->bdev.blocklen /
+                         esnap_dev->blocklen,
+                     bdev_io->u.bdev.num_blocks * ubi_bdev->bdev.blocklen /
+                         esnap_dev->blocklen,
+                     &ubi_io->esnap_cb_args);
+    return true;
+}
+
+/*
+ * ubi_partial_claim marks the given range as allocated unless it overlaps a
+ * partial cluster, in which case it returns false and the caller should retry
+ * the I/O later. Used by write paths which don't go through
+ * ubi_partial_submit_write.
+ */
+bool ubi_partial_claim(struct ubi_io_channel *ch, uint64_t offset_blocks,
+                       uint64_t num_blocks) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    uint64_t first = offset_blocks / ubi_bdev->blocks_per_cluster;
+    uint64_t last = (offset_blocks + num_blocks - 1) / ubi_bdev->blocks_per_cluster;
+    bool locked = false, claimed = true;
+
+    for (uint64_t cluster = first; cluster <= last; cluster++) {
+        if (!partial_may_exist(ubi_bdev, cluster)) {
+            continue;
+        }
+
+        if (!locked) {
+            pthread_mutex_lock(&state->lock);
+            locked = true;
+        }
+
+        if (partial_map_test(state, cluster)) {
+            claimed = false;
+            break;
+        }
+    }
+
+    if (claimed) {
+        UBI_STAT_ADD(ch, cow_copies,
+                     ubi_alloc_map_mark(ubi_bdev, offset_blocks, num_blocks));
+    }
+
+    if (locked) {
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    return claimed;
+}
+
+static void partial_drain_check(struct ubi_bdev *ubi_bdev) {
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    spdk_blob_op_complete cb_fn = state->drain_cb;
+
+    if (cb_fn == NULL || (state->fill_error == 0 &&
+                          __atomic_load_n(&state->count, __ATOMIC_ACQUIRE) != 0)) {
+        return;
+    }
+
+    state->drain_cb = NULL;
+    cb_fn(state->drain_arg, state->fill_error);
+}
+
+static void partial_free_resources(struct ubi_bdev *ubi_bdev) {
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+
+    for (int i = 0; i < UBI_PARTIAL_MAX_FILLS; i++) {
+        spdk_free(state->fills[i].buf);
+        state->fills[i].buf = NULL;
+    }
+
+    if (state->esnap_channel != NULL) {
+        ubi_bdev->esnap_dev->destroy_channel(ubi_bdev->esnap_dev, state->esnap_channel);
+        state->esnap_channel = NULL;
+    }
+
+    if (state->bs_channel != NULL) {
+        spdk_bs_free_io_channel(state->bs_channel);
+        state->bs_channel = NULL;
+    }
+}
+
+static void partial_stop_check(struct ubi_bdev *ubi_bdev) {
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    spdk_blob_op_complete cb_fn = state->stop_cb;
+
+    if (!state->stopping || state->fills_in_flight != 0 || state->persist_in_progress) {
+        return;
+    }
+
+    partial_free_resources(ubi_bdev);
+
+    state->stop_cb = NULL;
+    if (cb_fn != NULL) {
+        cb_fn(state->stop_arg, 0);
+    }
+}
+
+static void partial_persist_done(void *cb_arg, int bserrno) {
+    struct ubi_bdev *ubi_bdev = cb_arg;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    TAILQ_HEAD(, ubi_bdev_io) resume = TAILQ_HEAD_INITIALIZER(resume);
+    struct ubi_bdev_io *ubi_io, *tmp;
+    bool again;
+
+    if (bserrno) {
+        UBI_ERRLOG(ubi_bdev, "Could not persist partial clusters: %s\n",
+                   spdk_strerror(-bserrno));
+    }
+
+    pthread_mutex_lock(&state->lock);
+    for (int i = 0; i < UBI_PARTIAL_MAX_CLUSTERS; i++) {
+        struct ubi_partial_cluster *pc = &state->clusters[i];
+
+        if (pc->retire_in_persist && bserrno == 0) {
+            bs_dev_uring_set_cow_bypass(ubi_bdev->esnap_dev, pc->cluster, false);
+            __atomic_fetch_and(&state->map[pc->cluster / 64],
+                               ~(1ULL << (pc->cluster % 64)), __ATOMIC_RELEASE);
+            memset(pc, 0, sizeof(*pc));
+            __atomic_fetch_sub(&state->count, 1, __ATOMIC_RELEASE);
+        } else if (pc->in_persist && bserrno == 0) {
+            pc->durable = pc->persisting;
+            pc->persisted = true;
+        }
+        pc->in_persist = false;
+        pc->retire_in_persist = false;
+    }
+
+    if (bserrno == 0) {
+        state->persisted_gen = state->persist_gen;
+    }
+
+    TAILQ_FOREACH_SAFE(ubi_io, &state->waiters, partial_link, tmp) {
+        if (ubi_io->partial_gen > state->persist_gen) {
+            continue;
+        }
+
+        TAILQ_REMOVE(&state->waiters, ubi_io, partial_link);
+        ubi_io->status =
+            bserrno ? SPDK_BDEV_IO_STATUS_FAILED : SPDK_BDEV_IO_STATUS_SUCCESS;
+        TAILQ_INSERT_TAIL(&resume, ubi_io, partial_link);
+    }
+
+    again = state->persist_again || (bserrno == 0 && state->gen != state->persisted_gen);
+    pthread_mutex_unlock(&state->lock);
+
+    state->persist_in_progress = false;
+
+    TAILQ_FOREACH_SAFE(ubi_io, &resume, partial_link, tmp) {
+        struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(ubi_io);
+        spdk_thread_send_msg(spdk_bdev_io_get_thread(bdev_io), partial_resume, bdev_io);
+    }
+
+    partial_drain_check(ubi_bdev);
+    partial_stop_check(ubi_bdev);
+
+    if (again && !state->stopping) {
+        partial_persist(ubi_bdev);
+    }
+}
+
+/*
+ * partial_persist writes the table to the blob's metadata. Entries which are
+ * retiring are left out. Runs on ubi_bdev->thread.
+ */
+static void partial_persist(void *arg) {
+    struct ubi_bdev *ubi_bdev = arg;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    struct ubi_partial_record records[UBI_PARTIAL_MAX_CLUSTERS];
+    size_t n_records = 0;
+    int rc;
+
+    if (state->persist_in_progress) {
+        state->persist_again = true;
+        return;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    if (state->gen == state->persisted_gen) {
+        pthread_mutex_unlock(&state->lock);
+        return;
+    }
+
+    for (int i = 0; i < UBI_PARTIAL_MAX_CLUSTERS; i++) {
+        struct ubi_partial_cluster *pc = &state->clusters[i];
+
+        if (!pc->active) {
+            continue;
+        } else if (pc->retiring) {
+            pc->retire_in_persist = true;
+            continue;
+        }
+
+        pc->in_persist = true;
+        pc->persisting = pc->valid;
+        records[n_records].cluster = pc->cluster;
+        records[n_records].valid = pc->valid;
+        n_records++;
+    }
+    state->persist_gen = state->gen;
+    pthread_mutex_unlock(&state->lock);
+
+    state->persist_in_progress = true;
+    state->persist_again = false;
+
+    if (n_records > 0) {
+        rc = spdk_blob_set_xattr(ubi_bdev->blob, UBI_PARTIAL_XATTR, records,
+                                 n_records * sizeof(records[0]));
+    } else {
+        rc = spdk_blob_remove_xattr(ubi_bdev->blob, UBI_PARTIAL_XATTR);
+        if (rc == -ENOENT) {
+            rc = 0;
+        }
+    }
+
+    if (rc) {
+        partial_persist_done(ubi_bdev, rc);
+        return;
+    }
+
+    spdk_blob_sync_md(ubi_bdev->blob, partial_persist_done, ubi_bdev);
+}
+
+static void partial_fill_done(struct ubi_partial_fill *fill, int bserrno) {
+    struct ubi_bdev *ubi_bdev = fill->ubi_bdev;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    struct ubi_partial_cluster *pc;
+
+    if (bserrno) {
+        UBI_ERRLOG(ubi_bdev, "Could not fill cluster %lu: %s\n", fill->cluster,
+                   spdk_strerror(-bserrno));
+    }
+
+    pthread_mutex_lock(&state->lock);
+    pc = partial_find(state, fill->cluster);
+    if (pc != NULL) {
+        for (uint32_t i = 0; i < fill->num_sectors; i++) {
+            sector_clear(&pc->filling, fill->first_sector + i);
+            if (bserrno == 0) {
+                sector_set(&pc->valid, fill->first_sector + i);
+            }
+        }
+        if (bserrno == 0) {
+            state->gen++;
+        } else if (++pc->fill_failures == UBI_PARTIAL_FILL_RETRIES) {
+            /* The filler leaves the cluster alone until the next drain. */
+            state->fill_error = bserrno;
+        }
+        partial_check_retire(state, pc);
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    fill->busy = false;
+    state->fills_in_flight--;
+
+    partial_drain_check(ubi_bdev);
+    partial_stop_check(ubi_bdev);
+    if (!state->stopping) {
+        partial_persist(ubi_bdev);
+    }
+}
+
+static void partial_fill_write_complete(void *cb_arg, int bserrno) {
+    partial_fill_done(cb_arg, bserrno);
+}
+
+static void partial_fill_read_complete(struct spdk_io_channel *channel, void *cb_arg,
+                                       int bserrno) {
+    struct ubi_partial_fill *fill = cb_arg;
+    struct ubi_bdev *ubi_bdev = fill->ubi_bdev;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+
+    if (bserrno) {
+        partial_fill_done(fill, bserrno);
+        return;
+    }
+
+    __atomic_store_n(&state->image_bytes_filled,
+                     state->image_bytes_filled + fill->num_sectors * UBI_SECTOR_SIZE,
+                     __ATOMIC_RELAXED);
+    spdk_blob_io_write(ubi_bdev->blob, state->bs_channel, fill->buf,
+                       fill->cluster * ubi_bdev->blocks_per_cluster +
+                           fill->first_sector * state->blocks_per_sector,
+                       fill->num_sectors * state->blocks_per_sector,
+                       partial_fill_write_complete, fill);
+}
+
+static void partial_fill_start(struct ubi_partial_fill *fill) {
+    struct ubi_bdev *ubi_bdev = fill->ubi_bdev;
+    struct spdk_bs_dev *esnap_dev = ubi_bdev->esnap_dev;
+    uint64_t offset =
+        fill->cluster * ubi_bdev->cluster_size + fill->first_sector * UBI_SECTOR_SIZE;
+
+    fill->cb_args.cb_fn = partial_fill_read_complete;
+    fill->cb_args.channel = ubi_bdev->partial.esnap_channel;
+    fill->cb_args.cb_arg = fill;
+    esnap_dev->read(esnap_dev, ubi_bdev->partial.esnap_channel, fill->buf,
+                    offset / esnap_dev->blocklen,
+                    fill->num_sectors * UBI_SECTOR_SIZE / esnap_dev->blocklen,
+                    &fill->cb_args);
+}
+
+/*
+ * partial_fill_poll copies the invalid sectors of partial clusters from the
+ * image. Clusters which are still being written are left alone for a while,
+ * since sequential writers often make the whole cluster valid by themselves.
+ */
+static int partial_fill_poll(void *arg) {
+    struct ubi_bdev *ubi_bdev = arg;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    struct ubi_partial_fill *started[UBI_PARTIAL_MAX_FILLS];
+    uint64_t delay = UBI_PARTIAL_FILL_DELAY_US * spdk_get_ticks_hz() / SPDK_SEC_TO_USEC;
+    uint64_t now = spdk_get_ticks();
+    int n_started = 0;
+
+    partial_drain_check(ubi_bdev);
+
+    if (!state->persist_in_progress && state->gen != state->persisted_gen) {
+        /* Retry failed syncs and record entries dropped at load time. */
+        partial_persist(ubi_bdev);
+    }
+
+    if (__atomic_load_n(&state->count, __ATOMIC_ACQUIRE) == 0) {
+        return SPDK_POLLER_IDLE;
+    }
+
+    pthread_mutex_lock(&state->lock);
+    for (int i = 0; i < UBI_PARTIAL_MAX_CLUSTERS; i++) {
+        struct ubi_partial_cluster *pc = &state->clusters[i];
+        struct ubi_partial_fill *fill = NULL;
+        uint32_t first, end;
+
+        if (state->fills_in_flight == UBI_PARTIAL_MAX_FILLS) {
+            break;
+        }
+
+        if (!pc->active || !pc->persisted || pc->retiring ||
+            pc->fill_failures >= UBI_PARTIAL_FILL_RETRIES) {
+            continue;
+        }
+
+        if (!state->draining && state->count < UBI_PARTIAL_MAX_CLUSTERS &&
+            now - pc->last_write_tsc < delay) {
+            continue;
+        }
+
+        for (first = 0; first < state->sectors_per_cluster; first++) {
+            if (!sector_test(&pc->valid, first) && !sector_test(&pc->filling, first)) {
+                break;
+            }
+        }
+
+        if (first == state->sectors_per_cluster) {
+            continue;
+        }
+
+        for (end = first; end < state->sectors_per_cluster; end++) {
+            if (sector_test(&pc->valid, end) || sector_test(&pc->filling, end)) {
+                break;
+            }
+            sector_set(&pc->filling, end);
+        }
+
+        for (int j = 0; j < UBI_PARTIAL_MAX_FILLS; j++) {
+            if (!state->fills[j].busy) {
+                fill = &state->fills[j];
+                break;
+            }
+        }
+
+        fill->busy = true;
+        fill->cluster = pc->cluster;
+        fill->first_sector = first;
+        fill->num_sectors = end - first;
+        state->fills_in_flight++;
+        started[n_started++] = fill;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    for (int i = 0; i < n_started; i++) {
+        partial_fill_start(started[i]);
+    }
+
+    return n_started > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+/*
+ * partial_load restores the table from the blob's metadata. Entries whose
+ * cluster was never allocated are dropped: the write which created them
+ * didn't complete, so all of their sectors still come from the image.
+ */
+static int partial_load(struct ubi_bdev *ubi_bdev) {
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    struct ubi_partial_record record;
+    const void *value;
+    size_t len;
+    int rc;
+
+    rc = spdk_blob_get_xattr_value(ubi_bdev->blob, UBI_PARTIAL_XATTR, &value, &len);
+    if (rc == -ENOENT) {
+        return 0;
+    } else if (rc) {
+        return rc;
+    }
+
+    if (len % sizeof(record) != 0 || len / sizeof(record) > UBI_PARTIAL_MAX_CLUSTERS) {
+        UBI_ERRLOG(ubi_bdev, "Invalid partial cluster table of size %lu\n", len);
+        return -EINVAL;
+    }
+
+    for (size_t i = 0; i < len / sizeof(record); i++) {
+        struct ubi_partial_cluster *pc = &state->clusters[state->count];
+
+        memcpy(&record, (const char *)value + i * sizeof(record), sizeof(record));
+        if (record.cluster >= ubi_bdev->num_clusters ||
+            !ubi_cluster_is_allocated(ubi_bdev, record.cluster)) {
+            state->gen++;
+            continue;
+        }
+
+        pc->cluster = record.cluster;
+        pc->active = true;
+        pc->persisted = true;
+        pc->valid = record.valid;
+        pc->durable = record.valid;
+        state->map[record.cluster / 64] |= 1ULL << (record.cluster % 64);
+        state->count++;
+    }
+
+    if (state->count > 0) {
+        SPDK_NOTICELOG("[%s] restored %u partial clusters\n", ubi_bdev->bdev.name,
+                       state->count);
+    }
+
+    return 0;
+}
+
+/*
+ * ubi_partial_init sets up sub-cluster copy-on-write after the blob and the
+ * allocation map are loaded, and starts the filler if there is anything to
+ * fill. Must be called on ubi_bdev->thread.
+ */
+int ubi_partial_init(struct ubi_bdev *ubi_bdev) {
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+    struct spdk_bs_dev *esnap_dev = ubi_bdev->esnap_dev;
+    uint32_t io_unit_size = spdk_bs_get_io_unit_size(ubi_bdev->blobstore);
+    int rc;
+
+    TAILQ_INIT(&state->waiters);
+
+    if (esnap_dev == NULL || ubi_bdev->cluster_size % UBI_SECTOR_SIZE != 0 ||
+        ubi_bdev->cluster_size / UBI_SECTOR_SIZE > UBI_MAX_SECTORS_PER_CLUSTER ||
+        io_unit_size > UBI_SECTOR_SIZE) {
+        if (ubi_bdev->subcluster_cow) {
+            SPDK_NOTICELOG("[%s] sub-cluster copy-on-write isn't supported with "
+                           "cluster size %u\n",
+                           ubi_bdev->bdev.name, ubi_bdev->cluster_size);
+        }
+        ubi_bdev->subcluster_cow = false;
+        return 0;
+    }
+
+    state->sectors_per_cluster = ubi_bdev->cluster_size / UBI_SECTOR_SIZE;
+    state->blocks_per_sector = UBI_SECTOR_SIZE / io_unit_size;
+    state->map = calloc(SPDK_CEIL_DIV(ubi_bdev->num_clusters, 64), sizeof(uint64_t));
+    if (state->map == NULL) {
+        return -ENOMEM;
+    }
+
+    rc = partial_load(ubi_bdev);
+    if (rc) {
+        return rc;
+    }
+
+    if (!ubi_bdev->subcluster_cow && state->count == 0) {
+        return 0;
+    }
+
+    state->bs_channel = spdk_bs_alloc_io_channel(ubi_bdev->blobstore);
+    state->esnap_channel = esnap_dev->create_channel(esnap_dev);
+    for (int i = 0; i < UBI_PARTIAL_MAX_FILLS; i++) {
+        state->fills[i].ubi_bdev = ubi_bdev;
+        state->fills[i].buf = spdk_malloc(ubi_bdev->cluster_size, UBI_SECTOR_SIZE, NULL,
+                                          SPDK_ENV_LCORE_ID_ANY, SPDK_MALLOC_DMA);
+        if (state->fills[i].buf == NULL) {
+            rc = -ENOMEM;
+        }
+    }
+
+    if (rc || state->bs_channel == NULL || state->esnap_channel == NULL) {
+        UBI_ERRLOG(ubi_bdev, "could not allocate sub-cluster fill resources\n");
+        partial_free_resources(ubi_bdev);
+        return -ENOMEM;
+    }
+
+    state->fill_poller =
+        SPDK_POLLER_REGISTER(partial_fill_poll, ubi_bdev, UBI_PARTIAL_FILL_POLL_US);
+    return 0;
+}
+
+static void partial_stop_msg(void *arg) {
+    struct ubi_bdev *ubi_bdev = arg;
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+
+    state->stopping = true;
+    spdk_poller_unregister(&state->fill_poller);
+    partial_stop_check(ubi_bdev);
+}
+
+/*
+ * ubi_partial_stop stops the filler and waits for the fills and metadata
+ * syncs in flight. cb_fn, which may be NULL, is called on ubi_bdev->thread.
+ * Partial clusters are left in the table and restored on the next load.
+ */
+void ubi_partial_stop(struct ubi_bdev *ubi_bdev, spdk_blob_op_complete cb_fn,
+                      void *cb_arg) {
+    ubi_bdev->partial.stop_cb = cb_fn;
+    ubi_bdev->partial.stop_arg = cb_arg;
+    spdk_thread_send_msg(ubi_bdev->thread, partial_stop_msg, ubi_bdev);
+}
+
+/*
+ * ubi_partial_drain stops creating partial clusters and calls cb_fn once all
+ * existing ones are filled and retired. Snapshots must not capture partial
+ * clusters, since their invalid sectors are garbage. cb_fn gets the error of
+ * the fill if a cluster can't be filled from the image. Must be called on
+ * ubi_bdev->thread, and followed by ubi_partial_drain_end.
+ */
+void ubi_partial_drain(struct ubi_bdev *ubi_bdev, spdk_blob_op_complete cb_fn,
+                       void *cb_arg) {
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+
+    pthread_mutex_lock(&state->lock);
+    state->draining = true;
+    /* Clusters which failed to fill before get another round of retries. */
+    state->fill_error = 0;
+    for (int i = 0; i < UBI_PARTIAL_MAX_CLUSTERS; i++) {
+        state->clusters[i].fill_failures = 0;
+    }
+    pthread_mutex_unlock(&state->lock);
+
+    state->drain_cb = cb_fn;
+    state->drain_arg = cb_arg;
+    partial_drain_check(ubi_bdev);
+}
+
+void ubi_partial_drain_end(struct ubi_bdev *ubi_bdev) {
+    struct ubi_partial_state *state = &ubi_bdev->partial;
+
+    pthread_mutex_lock(&state->lock);
+    state->draining = false;
+    pthread_mutex_unlock(&state->lock);
+}
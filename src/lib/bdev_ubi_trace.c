@@ -0,0 +1,64 @@
+#include "bdev_ubi_internal.h"
+
+/*
+ * Registers the bdev_ubi trace group. A guest I/O shows up as IO_START and
+ * IO_DONE with IO_RETRY in between if it had to be queued, and the image
+ * reads and delta writes it causes as separate objects on the same thread.
+ */
+static void ubi_trace(void) {
+    struct spdk_trace_tpoint_opts opts[] = {
+        {"UBI_IO_START",
+         TRACE_BDEV_UBI_IO_START,
+         OWNER_NONE,
+         OBJECT_BDEV_UBI_IO,
+         1,
+         {{"type", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"offset", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"len", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_IO_DONE",
+         TRACE_BDEV_UBI_IO_DONE,
+         OWNER_NONE,
+         OBJECT_BDEV_UBI_IO,
+         0,
+         {{"status", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_IO_RETRY",
+         TRACE_BDEV_UBI_IO_RETRY,
+         OWNER_NONE,
+         OBJECT_BDEV_UBI_IO,
+         0,
+         {{"depth", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_ESNAP_SUBMIT",
+         TRACE_BDEV_UBI_ESNAP_SUBMIT,
+         OWNER_NONE,
+         OBJECT_BDEV_UBI_DEV_IO,
+         1,
+         {{"lba", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"count", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"ctx", SPDK_TRACE_ARG_TYPE_PTR, 8}}},
+        {"UBI_ESNAP_REAP",
+         TRACE_BDEV_UBI_ESNAP_REAP,
+         OWNER_NONE,
+         OBJECT_BDEV_UBI_DEV_IO,
+         0,
+         {{"res", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_DELTA_WR_START",
+         TRACE_BDEV_UBI_DELTA_WRITE_START,
+         OWNER_NONE,
+         OBJECT_BDEV_UBI_DEV_IO,
+         1,
+         {{"lba", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"count", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"ctx", SPDK_TRACE_ARG_TYPE_PTR, 8}}},
+        {"UBI_DELTA_WR_DONE",
+         TRACE_BDEV_UBI_DELTA_WRITE_DONE,
+         OWNER_NONE,
+         OBJECT_BDEV_UBI_DEV_IO,
+         0,
+         {{"res", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+    };
+
+    spdk_trace_register_object(OBJECT_BDEV_UBI_IO, 'u');
+    spdk_trace_register_object(OBJECT_BDEV_UBI_DEV_IO, 'd');
+    spdk_trace_register_description_ext(opts, SPDK_COUNTOF(opts));
+}
+SPDK_TRACE_REGISTER_FN(ubi_trace, "bdev_ubi", TRACE_GROUP_BDEV_UBI)
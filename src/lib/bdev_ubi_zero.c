@@ -0,0 +1,107 @@
+#include "bdev_ubi_internal.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Zero detection for guest writes. Guests zero-fill large regions when they
+ * create filesystems or wipe partitions, and writing those zeroes into a
+ * cluster which already reads as zeroes would allocate it for nothing. The
+ * check runs on every write when zero_detect is enabled, so it uses the
+ * widest vector unit the CPU has and bails out at the first non-zero chunk.
+ */
+
+typedef bool (*buf_is_zero_fn)(const uint8_t *buf, size_t len);
+
+static bool buf_is_zero_scalar(const uint8_t *buf, size_t len) {
+    uint64_t acc = 0, word;
+    size_t i = 0;
+
+    for (; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, buf + i, sizeof(word));
+        acc |= word;
+        if (acc) {
+            return false;
+        }
+    }
+
+    for (; i < len; i++) {
+        acc |= buf[i];
+    }
+
+    return acc == 0;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static bool buf_is_zero_avx2(const uint8_t *buf,
+                                                              size_t len) {
+    size_t i = 0;
+
+    for (; i + 128 <= len; i += 128) {
+        __m256i acc = _mm256_or_si256(
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i)),
+                            _mm256_loadu_si256((const __m256i *)(buf + i + 32))),
+            _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(buf + i + 64)),
+                            _mm256_loadu_si256((const __m256i *)(buf + i + 96))));
+        if (!_mm256_testz_si256(acc, acc)) {
+            return false;
+        }
+    }
+
+    return buf_is_zero_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx512f"))) static bool buf_is_zero_avx512(const uint8_t *buf,
+                                                                   size_t len) {
+    size_t i = 0;
+
+    for (; i + 256 <= len; i += 256) {
+        __m512i acc = _mm512_or_si512(
+            _mm512_or_si512(_mm512_loadu_si512(buf + i),
+                            _mm512_loadu_si512(buf + i + 64)),
+            _mm512_or_si512(_mm512_loadu_si512(buf + i + 128),
+                            _mm512_loadu_si512(buf + i + 192)));
+        if (_mm512_test_epi64_mask(acc, acc)) {
+            return false;
+        }
+    }
+
+    return buf_is_zero_scalar(buf + i, len - i);
+}
+#endif
+
+static buf_is_zero_fn g_buf_is_zero = buf_is_zero_scalar;
+
+/*
+ * ubi_zero_detect_init picks the zero check for the CPU we're running on.
+ * Called once when the module is initialized.
+ */
+void ubi_zero_detect_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        g_buf_is_zero = buf_is_zero_avx512;
+        return;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        g_buf_is_zero = buf_is_zero_avx2;
+        return;
+    }
+#endif
+    g_buf_is_zero = buf_is_zero_scalar;
+}
+
+/*
+ * ubi_iovs_are_zero returns true if every byte of the given iovecs is zero.
+ */
+bool ubi_iovs_are_zero(const struct iovec *iovs, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (!g_buf_is_zero(iovs[i].iov_base, iovs[i].iov_len)) {
+            return false;
+        }
+    }
+    return true;
+}
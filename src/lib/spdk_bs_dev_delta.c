@@ -1,56 +1,808 @@
 #include "bdev_ubi_internal.h"
+#include "spdk/accel.h"
+#include "spdk/assert.h"
+#include "spdk/bdev.h"
 #include "spdk/blob.h"
+#include "spdk/crc32.h"
 #include "spdk/env.h"
 #include "spdk/log.h"
 #include "spdk/thread.h"
 #include <liburing.h>
+#include <pthread.h>
 
 #define UBI_URING_QUEUE_SIZE 128
 
+SPDK_STATIC_ASSERT(sizeof(struct ubi_delta_header) == UBI_DELTA_HEADER_SIZE,
+                   "delta header must fill its block");
+SPDK_STATIC_ASSERT(UBI_DELTA_MAX_CHAIN <= 32, "a chain must fit a bit per delta");
+
+/*
+ * A cluster write to the delta file. Writes are queued in "pending" and
+ * submitted in order to the channel's ring, or to the target bdev, as the rate
+ * limit and the ring or the bdev allow. Data is written from the caller's
+ * iovecs, which blobstore keeps valid until the write completes. Single
+ * buffer writes use the embedded iov.
+ * Compressed clusters are written from cbuf, and queued once the accel
+ * framework has compressed them.
+ */
+struct delta_write {
+    struct bs_dev_delta_io_channel *ch;
+    struct spdk_bs_dev_cb_args *cb_args;
+    struct iovec *iovs;
+    int iovcnt;
+    struct iovec iov;
+    uint64_t cluster;
+    uint64_t offset;
+    /* bytes of the cluster, and bytes written to the file */
+    uint64_t len;
+    uint64_t write_len;
+    uint32_t crc;
+    /* all-zero clusters are only listed in the extent table */
+    bool zero;
+
+    void *cbuf;
+    uint32_t clen;
+    struct iovec ciov;
+    TAILQ_ENTRY(delta_write) link;
+};
+
 struct bs_dev_delta_io_channel {
+    struct bs_dev_delta *delta_dev;
     int delta_file_fd;
     struct io_uring image_file_ring;
+    /* channel of the target bdev, NULL if the delta goes to a file */
+    struct spdk_io_channel *bdev_channel;
     struct spdk_poller *poller;
+    TAILQ_HEAD(, delta_write) pending;
 
-    uint64_t cluster_map[MAX_CLUSTERS];
-    bool initialized;
+    /* Token buckets of the rate limits, see delta_refill. */
+    int64_t byte_tokens;
+    int64_t io_tokens;
+    uint64_t last_refill_tsc;
+
+    /* accel channel to compress clusters, NULL if they're stored raw */
+    struct spdk_io_channel *accel_channel;
 };
 
 struct bs_dev_delta {
     struct spdk_bs_dev base;
     char filename[1024];
+    char parent_path[UBI_PATH_LEN];
     enum bs_dev_delta_direction direction;
+    enum ubi_delta_compression compression;
     bool directio;
     uint32_t cluster_size;
+
+    /*
+     * File offset where the next cluster is written. Shared by all channels,
+     * so space is reserved with an atomic add.
+     */
+    uint64_t append_offset;
+    /* clusters which were all zeroes, updated atomically */
+    uint64_t zero_clusters;
+
+    /* Rate limits of each channel, 0 if unlimited. Set with atomic stores. */
+    uint64_t max_bytes_per_sec;
+    uint64_t max_ios_per_sec;
+
+    /*
+     * File offset of each cluster's data, 0 if the cluster wasn't written and
+     * UBI_DELTA_ZERO_CLUSTER if it was all zeroes, the CRC32C of the data and
+     * its compressed length, 0 if it's stored raw.
+     * Shared by all channels. Blobstore writes each cluster once, so every
+     * entry has a single writer, which publishes it with a release store.
+     * Pages of clusters which aren't written are never touched.
+     */
+    uint64_t *cluster_offsets;
+    uint32_t *cluster_crcs;
+    uint32_t *cluster_lengths;
+    uint64_t num_clusters;
+
+    /* Open channels. The last one to be destroyed commits the delta. */
+    uint32_t channel_count;
+
+    /*
+     * Target bdev if the delta is written to one instead of a file, whose
+     * name is in filename, and its size in bytes. The delta is laid out on it
+     * like in a file. Its commit is asynchronous and holds a reference to
+     * delta_dev, as does the io_device, and the last to let go frees it.
+     */
+    struct spdk_bdev_desc *desc;
+    uint64_t target_size;
+    struct spdk_thread *thread;
+    uint32_t refs;
+    struct spdk_io_channel *commit_channel;
+    void *commit_table;
+    void *commit_header;
+    /* the delta file, which a file's commit writes on a thread of its own */
+    int commit_fd;
+
+    /*
+     * Called with the commit's status on done_thread once the last channel
+     * of a writing delta is destroyed and the delta is committed.
+     */
+    spdk_blob_op_complete done_fn;
+    void *done_arg;
+    struct spdk_thread *done_thread;
+    int commit_rc;
 };
 
-int ubi_read_cluster_map(const char *filename, uint64_t *cluster_map) {
-    SPDK_WARNLOG("reading cluster_map from %s\n", filename);
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-        SPDK_ERRLOG("could not open %s: %s\n", filename, strerror(errno));
-        return -1;
+static uint32_t delta_crc(const void *buf, size_t len) {
+    return ~spdk_crc32c_update(buf, len, ~0u);
+}
+
+/*
+ * append_extent adds an extent to a growable array, which is doubled when
+ * it's full.
+ */
+static int append_extent(struct ubi_delta_extent **extents, uint64_t *count,
+                         uint64_t *capacity, uint64_t cluster, uint64_t offset,
+                         uint32_t crc) {
+    if (*count == *capacity) {
+        uint64_t new_capacity = spdk_max(*capacity * 2, 1024);
+        struct ubi_delta_extent *grown =
+            realloc(*extents, new_capacity * sizeof(struct ubi_delta_extent));
+        if (grown == NULL) {
+            return -ENOMEM;
+        }
+        *extents = grown;
+        *capacity = new_capacity;
+    }
+
+    (*extents)[(*count)++] = (struct ubi_delta_extent){
+        .cluster = cluster,
+        .offset = offset,
+        .crc = crc,
+    };
+    return 0;
+}
+
+/*
+ * read_legacy_delta reads the extents of a delta written before the header
+ * existed, which has no parent. The map is read in chunks, so only the
+ * extents take memory.
+ */
+static int read_legacy_delta(int fd, const char *filename,
+                             struct ubi_delta_extent **extents, uint64_t *count,
+                             char *parent) {
+    const size_t chunk_len = 16384;
+    uint64_t *chunk = malloc(chunk_len * sizeof(uint64_t));
+    uint64_t capacity = 0;
+    int rc = 0;
+
+    if (chunk == NULL) {
+        return -ENOMEM;
     }
 
-    ssize_t n = read(fd, cluster_map, sizeof(uint64_t) * MAX_CLUSTERS);
-    SPDK_ERRLOG("read %lu bytes\n", n);
-    SPDK_ERRLOG("first item is: %lu\n", cluster_map[0]);
+    for (uint64_t first = 0; first < MAX_CLUSTERS && rc == 0; first += chunk_len) {
+        ssize_t n =
+            pread(fd, chunk, chunk_len * sizeof(uint64_t), first * sizeof(uint64_t));
+        if (n < 0) {
+            SPDK_ERRLOG("could not read cluster map of %s: %s\n", filename,
+                        strerror(errno));
+            rc = -errno;
+            break;
+        }
+
+        for (uint64_t i = 0; i < n / sizeof(uint64_t) && rc == 0; i++) {
+            if (chunk[i] != 0) {
+                rc = append_extent(extents, count, &capacity, first + i, chunk[i], 0);
+            }
+        }
+
+        if (n < (ssize_t)(chunk_len * sizeof(uint64_t))) {
+            break;
+        }
+    }
+    free(chunk);
+
+    parent[0] = '\0';
+    return rc;
+}
+
+/*
+ * check_delta_header checks the header of the delta at filename against its
+ * CRC, and refuses deltas whose snapshot didn't complete or whose cluster
+ * size isn't cluster_size, if that isn't 0.
+ */
+static int check_delta_header(struct ubi_delta_header *header, const char *filename,
+                              uint64_t cluster_size) {
+    uint32_t crc = header->header_crc;
+
+    header->header_crc = 0;
+    if (delta_crc(header, sizeof(*header)) != crc) {
+        SPDK_ERRLOG("header of %s is corrupt\n", filename);
+        return -EILSEQ;
+    } else if (header->version != UBI_DELTA_VERSION) {
+        SPDK_ERRLOG("%s has unsupported version %u\n", filename, header->version);
+        return -ENOTSUP;
+    } else if (header->compression > UBI_DELTA_COMPRESSION_DEFLATE) {
+        SPDK_ERRLOG("%s has unsupported compression %u\n", filename,
+                    header->compression);
+        return -ENOTSUP;
+    } else if (header->table_offset == 0) {
+        SPDK_ERRLOG("%s is incomplete, its snapshot didn't finish\n", filename);
+        return -EINVAL;
+    } else if (cluster_size != 0 && header->cluster_size != cluster_size) {
+        SPDK_ERRLOG("%s has cluster size %lu, expected %lu\n", filename,
+                    header->cluster_size, cluster_size);
+        return -EINVAL;
+    } else if (header->table_count > MAX_CLUSTERS) {
+        SPDK_ERRLOG("%s has too many extents: %lu\n", filename, header->table_count);
+        return -EINVAL;
+    }
+
+    header->parent[UBI_PATH_LEN - 1] = '\0';
+    return 0;
+}
+
+static int check_delta_extents(const struct ubi_delta_extent *extents, uint64_t count,
+                               const char *filename) {
+    for (uint64_t i = 1; i < count; i++) {
+        if (extents[i - 1].cluster >= extents[i].cluster) {
+            SPDK_ERRLOG("extent table of %s isn't sorted\n", filename);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * read_delta reads the extent table, parent and device size of a delta file.
+ * The header and the table are checked against their CRCs, and deltas whose
+ * snapshot didn't complete or whose cluster size isn't cluster_size are
+ * refused. Legacy deltas don't record the size, which is reported as 0, and
+ * have no CRCs of their clusters, which legacy is set for.
+ */
+static int read_delta(int fd, const char *filename, uint64_t cluster_size,
+                      struct ubi_delta_extent **extents, uint64_t *count,
+                      char *parent, uint64_t *size, bool *legacy) {
+    struct ubi_delta_header header;
+
+    *legacy = false;
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
     if (n < 0) {
-        SPDK_ERRLOG("could not read cluster_map: %s\n", strerror(errno));
-        close(fd);
-        return -1;
+        SPDK_ERRLOG("could not read header of %s: %s\n", filename, strerror(errno));
+        return -errno;
+    } else if (n < (ssize_t)sizeof(header) ||
+               memcmp(header.magic, UBI_DELTA_MAGIC, sizeof(header.magic))) {
+        *size = 0;
+        *legacy = true;
+        return read_legacy_delta(fd, filename, extents, count, parent);
     }
 
-    close(fd);
+    int rc = check_delta_header(&header, filename, cluster_size);
+    if (rc != 0) {
+        return rc;
+    }
+
+    size_t table_len = header.table_count * sizeof(struct ubi_delta_extent);
+    *extents = malloc(spdk_max(table_len, 1));
+    if (*extents == NULL) {
+        return -ENOMEM;
+    }
+
+    n = pread(fd, *extents, table_len, header.table_offset);
+    if (n < 0) {
+        SPDK_ERRLOG("could not read extents of %s: %s\n", filename, strerror(errno));
+        return -errno;
+    } else if ((size_t)n != table_len ||
+               delta_crc(*extents, table_len) != header.table_crc) {
+        SPDK_ERRLOG("extent table of %s is corrupt\n", filename);
+        return -EILSEQ;
+    }
+    *count = header.table_count;
+
+    rc = check_delta_extents(*extents, *count, filename);
+    if (rc != 0) {
+        return rc;
+    }
+
+    strcpy(parent, header.parent);
+    *size = header.size;
     return 0;
 }
 
+/*
+ * merge_extents merges the extents of the delta at index in the chain into
+ * merged, which holds those of the newer deltas. Both are sorted, and
+ * clusters which a newer delta has are left alone.
+ */
+static int merge_extents(struct ubi_delta_extent **merged, uint64_t *merged_count,
+                         const struct ubi_delta_extent *older, uint64_t older_count,
+                         uint64_t index) {
+    struct ubi_delta_extent *result =
+        malloc(spdk_max(*merged_count + older_count, 1) * sizeof(*result));
+    uint64_t i = 0, j = 0, n = 0;
+
+    if (result == NULL) {
+        return -ENOMEM;
+    }
+
+    while (i < *merged_count || j < older_count) {
+        if (j == older_count ||
+            (i < *merged_count && (*merged)[i].cluster <= older[j].cluster)) {
+            if (j < older_count && (*merged)[i].cluster == older[j].cluster) {
+                j++;
+            }
+            result[n++] = (*merged)[i++];
+            continue;
+        }
+
+        result[n] = older[j++];
+        if (result[n].offset != UBI_DELTA_ZERO_CLUSTER) {
+            result[n].offset |= index << UBI_DELTA_INDEX_SHIFT;
+        }
+        n++;
+    }
+
+    free(*merged);
+    *merged = result;
+    *merged_count = n;
+    return 0;
+}
+
+/*
+ * ubi_read_delta_layers merges the extents of the given deltas and their
+ * ancestors into a sorted array, which the caller frees. files are ordered
+ * from the top down, and each is followed by its own ancestors before the
+ * next one is read, so a cluster comes from the topmost delta which has it.
+ * paths receives every delta read, from the top down, and depth their count.
+ * size receives the size in bytes of the device the topmost delta which
+ * records it was taken of, or 0 if none does. unchecked receives a bit per
+ * delta, by index, set for legacy deltas whose clusters have no CRCs.
+ */
+int ubi_read_delta_layers(const char *const *files, int file_count, uint64_t cluster_size,
+                          struct ubi_delta_extent **extents, uint64_t *extent_count,
+                          char (*paths)[UBI_PATH_LEN], int *depth, uint64_t *size,
+                          uint32_t *unchecked) {
+    char parent[UBI_PATH_LEN];
+    uint64_t delta_size;
+    bool legacy;
+    int rc = 0;
+
+    *extents = NULL;
+    *extent_count = 0;
+    *size = 0;
+    *depth = 0;
+    *unchecked = 0;
+    for (int f = 0; f < file_count && rc == 0; f++) {
+        snprintf(parent, sizeof(parent), "%s", files[f]);
+        for (; parent[0] != '\0'; (*depth)++) {
+            struct ubi_delta_extent *delta_extents = NULL;
+            uint64_t delta_count = 0;
+
+            if (*depth == UBI_DELTA_MAX_CHAIN) {
+                SPDK_ERRLOG("more than %d deltas under %s\n", UBI_DELTA_MAX_CHAIN,
+                            files[0]);
+                rc = -E2BIG;
+                break;
+            }
+
+            strcpy(paths[*depth], parent);
+            int fd = open(paths[*depth], O_RDONLY);
+            if (fd < 0) {
+                SPDK_ERRLOG("could not open %s: %s\n", paths[*depth], strerror(errno));
+                rc = -errno;
+                break;
+            }
+
+            rc = read_delta(fd, paths[*depth], cluster_size, &delta_extents,
+                            &delta_count, parent, &delta_size, &legacy);
+            close(fd);
+            if (rc == 0 && *size == 0) {
+                *size = delta_size;
+            }
+            if (rc == 0 && legacy) {
+                *unchecked |= 1u << *depth;
+            }
+            if (rc == 0) {
+                rc = merge_extents(extents, extent_count, delta_extents, delta_count,
+                                   *depth);
+            }
+            free(delta_extents);
+            if (rc) {
+                break;
+            }
+        }
+    }
+
+    if (rc) {
+        free(*extents);
+        *extents = NULL;
+        *extent_count = 0;
+    }
+    return rc;
+}
+
+/*
+ * ubi_delta_find returns the extent of a cluster in a sorted extent array, or
+ * NULL if the cluster isn't in it.
+ */
+const struct ubi_delta_extent *ubi_delta_find(const struct ubi_delta_extent *extents,
+                                              uint64_t extent_count, uint64_t cluster) {
+    uint64_t lo = 0, hi = extent_count;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (extents[mid].cluster < cluster) {
+            lo = mid + 1;
+        } else if (extents[mid].cluster > cluster) {
+            hi = mid;
+        } else {
+            return &extents[mid];
+        }
+    }
+    return NULL;
+}
+
+struct delta_bdev_load {
+    struct ubi_delta_bdev *delta;
+    struct spdk_io_channel *ch;
+    void *buf;
+    struct ubi_delta_header header;
+    ubi_delta_bdev_load_cb cb_fn;
+    void *cb_arg;
+};
+
+static void delta_bdev_load_done(struct delta_bdev_load *load, int rc) {
+    struct ubi_delta_bdev *delta = load->delta;
+
+    spdk_put_io_channel(load->ch);
+    spdk_dma_free(load->buf);
+    if (rc != 0) {
+        ubi_delta_bdev_close(delta);
+        delta = NULL;
+    }
+    load->cb_fn(load->cb_arg, delta, rc);
+    free(load);
+}
+
+static void delta_bdev_table_read(struct spdk_bdev_io *bdev_io, bool success,
+                                  void *cb_arg) {
+    struct delta_bdev_load *load = cb_arg;
+    struct ubi_delta_bdev *delta = load->delta;
+    size_t table_len = load->header.table_count * sizeof(struct ubi_delta_extent);
+
+    spdk_bdev_free_io(bdev_io);
+    if (!success) {
+        SPDK_ERRLOG("could not read extents of %s\n", delta->name);
+        delta_bdev_load_done(load, -EIO);
+        return;
+    } else if (delta_crc(load->buf, table_len) != load->header.table_crc) {
+        SPDK_ERRLOG("extent table of %s is corrupt\n", delta->name);
+        delta_bdev_load_done(load, -EILSEQ);
+        return;
+    }
+
+    delta->extents = malloc(spdk_max(table_len, 1));
+    if (delta->extents == NULL) {
+        delta_bdev_load_done(load, -ENOMEM);
+        return;
+    }
+    memcpy(delta->extents, load->buf, table_len);
+    delta->extent_count = load->header.table_count;
+    delta_bdev_load_done(load,
+                         check_delta_extents(delta->extents, delta->extent_count,
+                                             delta->name));
+}
+
+static void delta_bdev_header_read(struct spdk_bdev_io *bdev_io, bool success,
+                                   void *cb_arg) {
+    struct delta_bdev_load *load = cb_arg;
+    struct ubi_delta_bdev *delta = load->delta;
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(delta->desc);
+    uint64_t bdev_size = spdk_bdev_get_block_size(bdev) * spdk_bdev_get_num_blocks(bdev);
+
+    spdk_bdev_free_io(bdev_io);
+    if (!success) {
+        SPDK_ERRLOG("could not read header of %s\n", delta->name);
+        delta_bdev_load_done(load, -EIO);
+        return;
+    }
+
+    memcpy(&load->header, load->buf, sizeof(load->header));
+    if (memcmp(load->header.magic, UBI_DELTA_MAGIC, sizeof(load->header.magic))) {
+        SPDK_ERRLOG("%s doesn't hold a delta\n", delta->name);
+        delta_bdev_load_done(load, -EINVAL);
+        return;
+    }
+    int rc = check_delta_header(&load->header, delta->name, 0);
+    if (rc != 0) {
+        delta_bdev_load_done(load, rc);
+        return;
+    }
+
+    delta->cluster_size = load->header.cluster_size;
+    delta->size = load->header.size;
+    strcpy(delta->parent, load->header.parent);
+
+    /* The table is padded to whole blocks when it's written to a bdev. */
+    size_t table_len = load->header.table_count * sizeof(struct ubi_delta_extent);
+    size_t read_len = SPDK_ALIGN_CEIL(spdk_max(table_len, 1), UBI_DELTA_ALIGN);
+    if (load->header.table_offset % UBI_DELTA_ALIGN != 0 ||
+        load->header.table_offset + read_len > bdev_size) {
+        SPDK_ERRLOG("extent table of %s is out of bounds\n", delta->name);
+        delta_bdev_load_done(load, -EINVAL);
+        return;
+    }
+
+    spdk_dma_free(load->buf);
+    load->buf = spdk_dma_malloc(read_len, UBI_DELTA_ALIGN, NULL);
+    if (load->buf == NULL) {
+        delta_bdev_load_done(load, -ENOMEM);
+        return;
+    }
+    rc = spdk_bdev_read(delta->desc, load->ch, load->buf, load->header.table_offset,
+                        read_len, delta_bdev_table_read, load);
+    if (rc != 0) {
+        delta_bdev_load_done(load, rc);
+    }
+}
+
+static void delta_bdev_read_event_cb(enum spdk_bdev_event_type type,
+                                     struct spdk_bdev *bdev, void *event_ctx) {
+    SPDK_NOTICELOG("Unsupported bdev event: type %d, bdev: %s\n", type,
+                   spdk_bdev_get_name(bdev));
+}
+
+/*
+ * ubi_delta_bdev_load opens the delta which a snapshot wrote to the bdev
+ * bdev_name, reads its header and extent table, and calls cb_fn with it. The
+ * bdev stays open for reading until ubi_delta_bdev_close, which must be called
+ * on the same thread. Returns an error without calling cb_fn if the bdev
+ * can't be read.
+ */
+int ubi_delta_bdev_load(const char *bdev_name, ubi_delta_bdev_load_cb cb_fn,
+                        void *cb_arg) {
+    struct delta_bdev_load *load = calloc(1, sizeof(*load));
+    struct ubi_delta_bdev *delta = calloc(1, sizeof(*delta));
+    int rc;
+
+    if (load == NULL || delta == NULL) {
+        free(load);
+        free(delta);
+        return -ENOMEM;
+    }
+    snprintf(delta->name, sizeof(delta->name), "%s", bdev_name);
+    load->delta = delta;
+    load->cb_fn = cb_fn;
+    load->cb_arg = cb_arg;
+
+    rc = spdk_bdev_open_ext(bdev_name, false, delta_bdev_read_event_cb, NULL,
+                            &delta->desc);
+    if (rc != 0) {
+        SPDK_ERRLOG("could not open %s: %s\n", bdev_name, strerror(-rc));
+        delta->desc = NULL;
+        goto err;
+    }
+
+    uint32_t block_size = spdk_bdev_get_block_size(spdk_bdev_desc_get_bdev(delta->desc));
+    if (UBI_DELTA_ALIGN % block_size != 0) {
+        SPDK_ERRLOG("%s has blocks of %u bytes, which don't divide %d\n", bdev_name,
+                    block_size, UBI_DELTA_ALIGN);
+        rc = -EINVAL;
+        goto err;
+    }
+
+    load->ch = spdk_bdev_get_io_channel(delta->desc);
+    load->buf = spdk_dma_malloc(UBI_DELTA_HEADER_SIZE, UBI_DELTA_ALIGN, NULL);
+    if (load->ch == NULL || load->buf == NULL) {
+        rc = -ENOMEM;
+        goto err;
+    }
+
+    rc = spdk_bdev_read(delta->desc, load->ch, load->buf, 0, UBI_DELTA_HEADER_SIZE,
+                        delta_bdev_header_read, load);
+    if (rc == 0) {
+        return 0;
+    }
+
+err:
+    if (load->ch != NULL) {
+        spdk_put_io_channel(load->ch);
+    }
+    spdk_dma_free(load->buf);
+    ubi_delta_bdev_close(delta);
+    free(load);
+    return rc;
+}
+
+void ubi_delta_bdev_close(struct ubi_delta_bdev *delta) {
+    if (delta == NULL) {
+        return;
+    }
+    if (delta->desc != NULL) {
+        spdk_bdev_close(delta->desc);
+    }
+    free(delta->extents);
+    free(delta);
+}
+
+static void delta_set_cluster(struct bs_dev_delta *delta_dev, uint64_t cluster,
+                              uint64_t offset, uint32_t crc, uint32_t length) {
+    __atomic_store_n(&delta_dev->cluster_crcs[cluster], crc, __ATOMIC_RELAXED);
+    __atomic_store_n(&delta_dev->cluster_lengths[cluster], length, __ATOMIC_RELAXED);
+    __atomic_store_n(&delta_dev->cluster_offsets[cluster], offset, __ATOMIC_RELEASE);
+}
+
+/*
+ * delta_write_done completes a cluster write. Writes may complete in any
+ * order, since each one has its own place in the file. A cluster is only
+ * added to the map once its data is written.
+ */
+static void delta_write_done(struct delta_write *req, int res) {
+    struct spdk_bs_dev_cb_args *cb_args = req->cb_args;
+    int bserrno = 0;
+
+    if (res < 0) {
+        SPDK_ERRLOG("could not write to delta file: %s\n", strerror(-res));
+        bserrno = -EIO;
+    } else if ((uint64_t)res != req->write_len) {
+        SPDK_ERRLOG("short write to delta file: %d of %lu bytes\n", res,
+                    req->write_len);
+        bserrno = -EIO;
+    } else {
+        delta_set_cluster(req->ch->delta_dev, req->cluster, req->offset, req->crc,
+                          req->cbuf ? req->clen : 0);
+    }
+
+    spdk_dma_free(req->cbuf);
+    free(req);
+    cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, bserrno);
+}
+
+static int64_t bucket_refill(int64_t tokens, uint64_t rate, double elapsed_sec) {
+    if (rate == 0) {
+        return 0;
+    }
+    return spdk_min(tokens + (double)rate * elapsed_sec, (double)rate / 10);
+}
+
+/*
+ * delta_refill adds the tokens a channel earned since its last refill. A
+ * bucket holds at most 100ms worth of tokens. A write is let through while
+ * the bucket isn't empty and may take it below zero, so clusters larger than
+ * the bucket still pass and the debt is paid back before the next one.
+ */
+static void delta_refill(struct bs_dev_delta_io_channel *ch) {
+    struct bs_dev_delta *delta_dev = ch->delta_dev;
+    uint64_t now = spdk_get_ticks();
+    double elapsed = (double)(now - ch->last_refill_tsc) / spdk_get_ticks_hz();
+
+    ch->last_refill_tsc = now;
+    ch->byte_tokens = bucket_refill(
+        ch->byte_tokens, __atomic_load_n(&delta_dev->max_bytes_per_sec, __ATOMIC_RELAXED),
+        elapsed);
+    ch->io_tokens = bucket_refill(
+        ch->io_tokens, __atomic_load_n(&delta_dev->max_ios_per_sec, __ATOMIC_RELAXED),
+        elapsed);
+}
+
+static bool delta_rate_allows(struct bs_dev_delta_io_channel *ch) {
+    struct bs_dev_delta *delta_dev = ch->delta_dev;
+
+    if (__atomic_load_n(&delta_dev->max_bytes_per_sec, __ATOMIC_RELAXED) &&
+        ch->byte_tokens <= 0) {
+        return false;
+    }
+    if (__atomic_load_n(&delta_dev->max_ios_per_sec, __ATOMIC_RELAXED) &&
+        ch->io_tokens <= 0) {
+        return false;
+    }
+    return true;
+}
+
+static void delta_bdev_write_done(struct spdk_bdev_io *bdev_io, bool success,
+                                  void *cb_arg) {
+    struct delta_write *req = cb_arg;
+
+    spdk_bdev_free_io(bdev_io);
+    spdk_trace_record(TRACE_BDEV_UBI_DELTA_WRITE_DONE, 0, 0, (uintptr_t)req->cb_args,
+                      success);
+    delta_write_done(req, success ? (int)req->write_len : -EIO);
+}
+
+/*
+ * delta_bdev_writev writes a cluster to the target bdev. The bdev layer
+ * queues as many writes as it has bdev_io for, which is the export's queue
+ * depth on every channel unless the bdev is shared. Compressed clusters are
+ * padded to a whole UBI_DELTA_ALIGN, which the target's blocks divide.
+ * Returns -ENOMEM if the bdev layer is out of bdev_io.
+ */
+static int delta_bdev_writev(struct bs_dev_delta_io_channel *ch,
+                             struct delta_write *req) {
+    struct bs_dev_delta *delta_dev = ch->delta_dev;
+    uint64_t len = SPDK_ALIGN_CEIL(req->write_len, UBI_DELTA_ALIGN);
+
+    if (req->offset + len > delta_dev->target_size) {
+        SPDK_ERRLOG("%s is full\n", delta_dev->filename);
+        return -ENOSPC;
+    }
+    return spdk_bdev_writev(delta_dev->desc, ch->bdev_channel, req->iovs, req->iovcnt,
+                            req->offset, len, delta_bdev_write_done, req);
+}
+
+/*
+ * delta_submit_pending submits queued writes until the queue is empty, the
+ * rate limit is reached or the ring or the bdev layer is full. The poller
+ * calls it again later. Zero clusters count against the rate limit like any
+ * other cluster, since the export read them from the base bdev all the same.
+ */
+static void delta_submit_pending(struct bs_dev_delta_io_channel *ch) {
+    struct io_uring *ring = &ch->image_file_ring;
+    bool submitted = false;
+
+    delta_refill(ch);
+    while (!TAILQ_EMPTY(&ch->pending) && delta_rate_allows(ch)) {
+        struct delta_write *req = TAILQ_FIRST(&ch->pending);
+        struct io_uring_sqe *sqe = NULL;
+        int rc = 0;
+
+        if (!req->zero && ch->bdev_channel != NULL) {
+            rc = delta_bdev_writev(ch, req);
+            if (rc == -ENOMEM) {
+                break;
+            }
+        } else if (!req->zero) {
+            sqe = io_uring_get_sqe(ring);
+            if (sqe == NULL) {
+                break;
+            }
+        }
+
+        TAILQ_REMOVE(&ch->pending, req, link);
+        ch->byte_tokens -= req->len;
+        ch->io_tokens -= 1;
+
+        if (req->zero) {
+            struct spdk_bs_dev_cb_args *cb_args = req->cb_args;
+
+            delta_set_cluster(ch->delta_dev, req->cluster, UBI_DELTA_ZERO_CLUSTER, 0, 0);
+            free(req);
+            cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
+            continue;
+        } else if (rc != 0) {
+            delta_write_done(req, rc);
+            continue;
+        }
+
+        spdk_trace_record(TRACE_BDEV_UBI_DELTA_WRITE_START, 0, req->len,
+                          (uintptr_t)req->cb_args, req->cluster, req->offset,
+                          (uintptr_t)req->cb_args->cb_arg);
+        if (sqe != NULL) {
+            io_uring_prep_writev(sqe, ch->delta_file_fd, req->iovs, req->iovcnt,
+                                 req->offset);
+            io_uring_sqe_set_data(sqe, req);
+            submitted = true;
+        }
+    }
+
+    if (!submitted) {
+        return;
+    }
+
+    /* Entries which the kernel didn't take are submitted again by the poller. */
+    int ret = io_uring_submit(ring);
+    if (ret < 0) {
+        SPDK_ERRLOG("io_uring_submit error: %s\n", strerror(-ret));
+    }
+}
+
 int bs_dev_delta_poll(void *arg) {
     struct bs_dev_delta_io_channel *ch = arg;
     struct io_uring *ring = &ch->image_file_ring;
 
     struct io_uring_cqe *cqe[64];
 
+    /* Writes to a bdev complete through the bdev layer. */
+    if (ch->bdev_channel != NULL) {
+        if (!TAILQ_EMPTY(&ch->pending)) {
+            delta_submit_pending(ch);
+        }
+        return SPDK_POLLER_BUSY;
+    }
+
     int ret = io_uring_peek_batch_cqe(ring, cqe, 64);
     if (ret == -EAGAIN) {
         return SPDK_POLLER_BUSY;
@@ -60,61 +812,362 @@ int bs_dev_delta_poll(void *arg) {
     }
 
     for (int i = 0; i < ret; i++) {
-        struct spdk_bs_dev_cb_args *cb_args = io_uring_cqe_get_data(cqe[i]);
-        if (cqe[i]->res < 0) {
-            SPDK_ERRLOG("io_uring error: %s\n", strerror(-cqe[i]->res));
-            cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -EIO);
-        } else {
-            cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
-        }
+        struct delta_write *req = io_uring_cqe_get_data(cqe[i]);
+        int res = cqe[i]->res;
 
         /* Mark the completion as seen. */
         io_uring_cqe_seen(ring, cqe[i]);
+
+        spdk_trace_record(TRACE_BDEV_UBI_DELTA_WRITE_DONE, 0, 0, (uintptr_t)req->cb_args,
+                          res);
+        delta_write_done(req, res);
     }
+
+    /* Completions made room in the ring, and the buckets may have refilled. */
+    if (!TAILQ_EMPTY(&ch->pending)) {
+        delta_submit_pending(ch);
+    } else if (io_uring_sq_ready(ring) > 0) {
+        io_uring_submit(ring);
+    }
+
     return SPDK_POLLER_BUSY;
 }
 
-static int bs_dev_delta_create_channel_cb(void *io_device, void *ctx_buf) {
-    struct bs_dev_delta *delta_dev = io_device;
-    struct bs_dev_delta_io_channel *ch = ctx_buf;
-
-    SPDK_ERRLOG("opening delta device %s\n", delta_dev->filename);
+static void delta_header_init(struct bs_dev_delta *delta_dev,
+                              struct ubi_delta_header *header, uint64_t table_offset,
+                              uint64_t table_count, uint32_t table_crc) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, UBI_DELTA_MAGIC, sizeof(header->magic));
+    header->version = UBI_DELTA_VERSION;
+    header->cluster_size = (uint64_t)delta_dev->cluster_size * delta_dev->base.blocklen;
+    header->table_offset = table_offset;
+    header->table_count = table_count;
+    header->table_crc = table_crc;
+    header->compression = delta_dev->compression;
+    strcpy(header->parent, delta_dev->parent_path);
+    header->size = delta_dev->base.blockcnt * delta_dev->base.blocklen;
+    header->header_crc = delta_crc(header, sizeof(*header));
+}
 
-    if (delta_dev->direction == BS_DEV_DELTA_WRITE) {
-        ch->delta_file_fd = open(delta_dev->filename, O_RDWR | O_CREAT, 0644);
-    } else {
-        ch->delta_file_fd = open(delta_dev->filename, O_RDONLY);
+static int delta_pwrite(struct bs_dev_delta *delta_dev, int fd, const void *buf,
+                        size_t len, uint64_t offset) {
+    ssize_t n = pwrite(fd, buf, len, offset);
+    if (n < 0) {
+        SPDK_ERRLOG("could not write to %s: %s\n", delta_dev->filename, strerror(errno));
+        return -errno;
+    } else if ((size_t)n != len) {
+        SPDK_ERRLOG("short write to %s: %zd of %zu bytes\n", delta_dev->filename, n,
+                    len);
+        return -EIO;
+    } else if (fdatasync(fd) < 0) {
+        SPDK_ERRLOG("could not sync %s: %s\n", delta_dev->filename, strerror(errno));
+        return -errno;
     }
-    if (ch->delta_file_fd < 0) {
-        SPDK_ERRLOG("could not open %s: %s\n", delta_dev->filename, strerror(errno));
-        free(ch);
-        return -1;
+    return 0;
+}
+
+/*
+ * delta_build_table lists the clusters of all channels in an extent table,
+ * which the caller frees with spdk_dma_free. The table is padded with zeroes
+ * to a whole UBI_DELTA_ALIGN, so that it can be written to a bdev.
+ */
+static int delta_build_table(struct bs_dev_delta *delta_dev,
+                             struct ubi_delta_extent **table, uint64_t *table_count) {
+    struct ubi_delta_extent *extents;
+    uint64_t count = 0;
+
+    for (uint64_t i = 0; i < delta_dev->num_clusters; i++) {
+        count += __atomic_load_n(&delta_dev->cluster_offsets[i], __ATOMIC_ACQUIRE) != 0;
     }
 
-    memset(ch->cluster_map, 0, sizeof(ch->cluster_map));
-    ch->initialized = false;
+    size_t table_len = count * sizeof(struct ubi_delta_extent);
+    extents = spdk_dma_zmalloc(SPDK_ALIGN_CEIL(spdk_max(table_len, 1), UBI_DELTA_ALIGN),
+                               UBI_DELTA_ALIGN, NULL);
+    if (extents == NULL) {
+        SPDK_ERRLOG("could not allocate extent table of %s\n", delta_dev->filename);
+        return -ENOMEM;
+    }
 
-    // read cluster_map using linux read
-    if (delta_dev->direction == BS_DEV_DELTA_READ) {
-        ssize_t n = read(ch->delta_file_fd, ch->cluster_map, sizeof(ch->cluster_map));
-        if (n < 0) {
-            SPDK_ERRLOG("could not read cluster_map: %s\n", strerror(errno));
-            close(ch->delta_file_fd);
-            free(ch);
-            return -1;
+    uint64_t n = 0;
+    for (uint64_t i = 0; i < delta_dev->num_clusters && n < count; i++) {
+        uint64_t offset =
+            __atomic_load_n(&delta_dev->cluster_offsets[i], __ATOMIC_ACQUIRE);
+        if (offset != 0) {
+            extents[n].cluster = i;
+            extents[n].offset = offset;
+            extents[n].crc = delta_dev->cluster_crcs[i];
+            extents[n].length = delta_dev->cluster_lengths[i];
+            n++;
         }
-        ch->initialized = true;
     }
 
+    *table = extents;
+    *table_count = count;
+    return 0;
+}
+
+static void delta_free(struct bs_dev_delta *delta_dev);
+
+static void delta_free_msg(void *arg) { delta_free(arg); }
+
+/*
+ * delta_put drops a reference to delta_dev, and frees it with the last one.
+ * The target bdev is closed on the thread which opened it.
+ */
+static void delta_put(struct bs_dev_delta *delta_dev) {
+    if (__atomic_sub_fetch(&delta_dev->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+
+    if (delta_dev->desc != NULL && delta_dev->thread != spdk_get_thread()) {
+        spdk_thread_send_msg(delta_dev->thread, delta_free_msg, delta_dev);
+        return;
+    }
+    delta_free(delta_dev);
+}
+
+static void delta_committed_msg(void *arg) {
+    struct bs_dev_delta *delta_dev = arg;
+    spdk_blob_op_complete done_fn = delta_dev->done_fn;
+
+    delta_dev->done_fn = NULL;
+    if (done_fn != NULL) {
+        done_fn(delta_dev->done_arg, delta_dev->commit_rc);
+    }
+    delta_put(delta_dev);
+}
+
+/*
+ * delta_committed passes the status of the commit to done_fn on its thread,
+ * and drops the reference the commit held.
+ */
+static void delta_committed(struct bs_dev_delta *delta_dev, int rc) {
+    delta_dev->commit_rc = rc;
+    spdk_thread_send_msg(delta_dev->done_thread, delta_committed_msg, delta_dev);
+}
+
+/*
+ * delta_file_committed releases what the commit of a delta file held, the
+ * file included, and passes on its status.
+ */
+static void delta_file_committed(struct bs_dev_delta *delta_dev, int rc) {
+    if (rc != 0) {
+        SPDK_ERRLOG("could not commit delta to %s: %s\n", delta_dev->filename,
+                    strerror(-rc));
+    }
+
+    close(delta_dev->commit_fd);
+    delta_dev->commit_fd = -1;
+    spdk_dma_free(delta_dev->commit_table);
+    spdk_dma_free(delta_dev->commit_header);
+    delta_dev->commit_table = NULL;
+    delta_dev->commit_header = NULL;
+    delta_committed(delta_dev, rc);
+}
+
+/*
+ * delta_file_commit_thread writes the table and then the header which
+ * delta_file_commit built, each followed by a sync. It runs on a thread of its
+ * own so that the syncs don't stall the reactor.
+ */
+static void *delta_file_commit_thread(void *arg) {
+    struct bs_dev_delta *delta_dev = arg;
+    struct ubi_delta_header *header = delta_dev->commit_header;
+
+    int rc = delta_pwrite(delta_dev, delta_dev->commit_fd, delta_dev->commit_table,
+                          header->table_count * sizeof(struct ubi_delta_extent),
+                          header->table_offset);
+    if (rc == 0) {
+        rc = delta_pwrite(delta_dev, delta_dev->commit_fd, header, sizeof(*header), 0);
+    }
+    delta_file_committed(delta_dev, rc);
+    return NULL;
+}
+
+/*
+ * delta_file_commit completes the delta file with the clusters of all
+ * channels, taking over fd. The extent table goes after the cluster data, and
+ * the header is only pointed to it once the table and the data are on disk,
+ * so a crash at any point leaves either a complete delta or one which readers
+ * refuse. The status goes to the device's done_fn.
+ */
+static void delta_file_commit(struct bs_dev_delta *delta_dev, int fd) {
+    struct ubi_delta_extent *extents;
+    pthread_t thread;
+    uint64_t count;
+
+    __atomic_fetch_add(&delta_dev->refs, 1, __ATOMIC_RELAXED);
+    delta_dev->commit_fd = fd;
+    delta_dev->commit_header = spdk_dma_zmalloc(UBI_DELTA_HEADER_SIZE, UBI_DELTA_ALIGN,
+                                                NULL);
+    if (delta_dev->commit_header == NULL) {
+        delta_file_committed(delta_dev, -ENOMEM);
+        return;
+    }
+
+    int rc = delta_build_table(delta_dev, &extents, &count);
+    if (rc != 0) {
+        delta_file_committed(delta_dev, rc);
+        return;
+    }
+    delta_dev->commit_table = extents;
+
+    size_t table_len = count * sizeof(struct ubi_delta_extent);
+    uint64_t table_offset =
+        __atomic_fetch_add(&delta_dev->append_offset, table_len, __ATOMIC_RELAXED);
+    delta_header_init(delta_dev, delta_dev->commit_header, table_offset, count,
+                      delta_crc(extents, table_len));
+
+    if (pthread_create(&thread, NULL, delta_file_commit_thread, delta_dev) != 0) {
+        delta_file_committed(delta_dev, -EAGAIN);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+/*
+ * delta_bdev_flush flushes the target bdev and calls cb_fn, right away if
+ * the bdev has no volatile cache to flush.
+ */
+static int delta_bdev_flush(struct bs_dev_delta *delta_dev, struct spdk_io_channel *ch,
+                            spdk_bdev_io_completion_cb cb_fn) {
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(delta_dev->desc);
+
+    if (!spdk_bdev_io_type_supported(bdev, SPDK_BDEV_IO_TYPE_FLUSH)) {
+        cb_fn(NULL, true, delta_dev);
+        return 0;
+    }
+    return spdk_bdev_flush(delta_dev->desc, ch, 0, delta_dev->target_size, cb_fn,
+                           delta_dev);
+}
+
+static void delta_bdev_committed(struct bs_dev_delta *delta_dev, int rc) {
+    if (rc != 0) {
+        SPDK_ERRLOG("could not commit delta to %s: %s\n", delta_dev->filename,
+                    strerror(-rc));
+    }
+
+    spdk_put_io_channel(delta_dev->commit_channel);
+    delta_dev->commit_channel = NULL;
+    spdk_dma_free(delta_dev->commit_table);
+    spdk_dma_free(delta_dev->commit_header);
+    delta_dev->commit_table = NULL;
+    delta_dev->commit_header = NULL;
+    delta_committed(delta_dev, rc);
+}
+
+static void delta_bdev_header_flushed(struct spdk_bdev_io *bdev_io, bool success,
+                                      void *cb_arg) {
+    if (bdev_io != NULL) {
+        spdk_bdev_free_io(bdev_io);
+    }
+    delta_bdev_committed(cb_arg, success ? 0 : -EIO);
+}
+
+static void delta_bdev_header_written(struct spdk_bdev_io *bdev_io, bool success,
+                                      void *cb_arg) {
+    struct bs_dev_delta *delta_dev = cb_arg;
+
+    spdk_bdev_free_io(bdev_io);
+    int rc = success ? delta_bdev_flush(delta_dev, delta_dev->commit_channel,
+                                        delta_bdev_header_flushed)
+                     : -EIO;
+    if (rc != 0) {
+        delta_bdev_committed(delta_dev, rc);
+    }
+}
+
+static void delta_bdev_table_flushed(struct spdk_bdev_io *bdev_io, bool success,
+                                     void *cb_arg) {
+    struct bs_dev_delta *delta_dev = cb_arg;
+
+    if (bdev_io != NULL) {
+        spdk_bdev_free_io(bdev_io);
+    }
+    int rc = success ? spdk_bdev_write(delta_dev->desc, delta_dev->commit_channel,
+                                       delta_dev->commit_header, 0,
+                                       UBI_DELTA_HEADER_SIZE,
+                                       delta_bdev_header_written, delta_dev)
+                     : -EIO;
+    if (rc != 0) {
+        delta_bdev_committed(delta_dev, rc);
+    }
+}
+
+static void delta_bdev_table_written(struct spdk_bdev_io *bdev_io, bool success,
+                                     void *cb_arg) {
+    struct bs_dev_delta *delta_dev = cb_arg;
+
+    spdk_bdev_free_io(bdev_io);
+    int rc = success ? delta_bdev_flush(delta_dev, delta_dev->commit_channel,
+                                        delta_bdev_table_flushed)
+                     : -EIO;
+    if (rc != 0) {
+        delta_bdev_committed(delta_dev, rc);
+    }
+}
+
+/*
+ * delta_bdev_commit completes a delta on a bdev the way delta_file_commit does
+ * a file, writing the table, then the header, each followed by a flush. It
+ * takes over ch, the bdev channel of the last delta channel, and runs after
+ * that is gone. A failed commit leaves a delta which readers refuse, and its
+ * status goes to the device's done_fn.
+ */
+static void delta_bdev_commit(struct bs_dev_delta *delta_dev,
+                              struct spdk_io_channel *ch) {
+    struct ubi_delta_extent *extents;
+    uint64_t count;
+
+    __atomic_fetch_add(&delta_dev->refs, 1, __ATOMIC_RELAXED);
+    delta_dev->commit_channel = ch;
+    delta_dev->commit_header = spdk_dma_zmalloc(UBI_DELTA_HEADER_SIZE, UBI_DELTA_ALIGN,
+                                                NULL);
+    if (delta_dev->commit_header == NULL) {
+        delta_bdev_committed(delta_dev, -ENOMEM);
+        return;
+    }
+
+    int rc = delta_build_table(delta_dev, &extents, &count);
+    if (rc != 0) {
+        delta_bdev_committed(delta_dev, rc);
+        return;
+    }
+    delta_dev->commit_table = extents;
+
+    size_t table_len = count * sizeof(struct ubi_delta_extent);
+    size_t write_len = SPDK_ALIGN_CEIL(spdk_max(table_len, 1), UBI_DELTA_ALIGN);
+    uint64_t table_offset =
+        __atomic_fetch_add(&delta_dev->append_offset, write_len, __ATOMIC_RELAXED);
+    if (table_offset + write_len > delta_dev->target_size) {
+        SPDK_ERRLOG("%s is full\n", delta_dev->filename);
+        delta_bdev_committed(delta_dev, -ENOSPC);
+        return;
+    }
+    delta_header_init(delta_dev, delta_dev->commit_header, table_offset, count,
+                      delta_crc(extents, table_len));
+
+    rc = spdk_bdev_write(delta_dev->desc, ch, extents, table_offset, write_len,
+                         delta_bdev_table_written, delta_dev);
+    if (rc != 0) {
+        delta_bdev_committed(delta_dev, rc);
+    }
+}
+
+/*
+ * delta_channel_open_file opens the delta file and a ring to write it for a
+ * channel of a delta which isn't on a bdev.
+ */
+static int delta_channel_open_file(struct bs_dev_delta *delta_dev,
+                                   struct bs_dev_delta_io_channel *ch) {
     if (delta_dev->direction == BS_DEV_DELTA_WRITE) {
-        // reserve the space for the cluster_map using linux write
-        ssize_t n = write(ch->delta_file_fd, ch->cluster_map, sizeof(ch->cluster_map));
-        if (n < 0) {
-            SPDK_ERRLOG("could not write cluster_map: %s\n", strerror(errno));
-            close(ch->delta_file_fd);
-            free(ch);
-            return -1;
-        }
+        ch->delta_file_fd = open(delta_dev->filename, O_RDWR);
+    } else {
+        ch->delta_file_fd = open(delta_dev->filename, O_RDONLY);
+    }
+    if (ch->delta_file_fd < 0) {
+        SPDK_ERRLOG("could not open %s: %s\n", delta_dev->filename, strerror(errno));
+        return -1;
     }
 
     struct io_uring_params io_uring_params;
@@ -123,11 +1176,46 @@ static int bs_dev_delta_create_channel_cb(void *io_device, void *ctx_buf) {
     if (rc != 0) {
         SPDK_ERRLOG("Unable to setup io_uring: %s\n", strerror(-rc));
         close(ch->delta_file_fd);
-        free(ch);
         return -1;
     }
+    return 0;
+}
+
+static int bs_dev_delta_create_channel_cb(void *io_device, void *ctx_buf) {
+    struct bs_dev_delta *delta_dev = io_device;
+    struct bs_dev_delta_io_channel *ch = ctx_buf;
+
+    SPDK_ERRLOG("opening delta device %s\n", delta_dev->filename);
+
+    ch->bdev_channel = NULL;
+    if (delta_dev->desc != NULL) {
+        ch->bdev_channel = spdk_bdev_get_io_channel(delta_dev->desc);
+        if (ch->bdev_channel == NULL) {
+            SPDK_ERRLOG("could not get a channel of %s\n", delta_dev->filename);
+            return -1;
+        }
+    } else if (delta_channel_open_file(delta_dev, ch) != 0) {
+        return -1;
+    }
+
+    TAILQ_INIT(&ch->pending);
+    ch->delta_dev = delta_dev;
+    ch->byte_tokens = 0;
+    ch->io_tokens = 0;
+    ch->last_refill_tsc = spdk_get_ticks();
+
+    ch->accel_channel = NULL;
+    if (delta_dev->direction == BS_DEV_DELTA_WRITE &&
+        delta_dev->compression != UBI_DELTA_COMPRESSION_NONE) {
+        ch->accel_channel = spdk_accel_get_io_channel();
+        if (ch->accel_channel == NULL) {
+            SPDK_WARNLOG("no accel channel, %s is written uncompressed\n",
+                         delta_dev->filename);
+        }
+    }
 
     ch->poller = SPDK_POLLER_REGISTER(bs_dev_delta_poll, ch, 0);
+    __atomic_fetch_add(&delta_dev->channel_count, 1, __ATOMIC_RELAXED);
 
     return 0;
 }
@@ -136,24 +1224,30 @@ static void bs_dev_delta_destroy_channel_cb(void *io_device, void *ctx_buf) {
     struct bs_dev_delta_io_channel *ch = ctx_buf;
     struct bs_dev_delta *delta_dev = io_device;
 
-    // write cluster_map using linux write
-    // SPDK_ERRLOG("destroying channel\n");
-    if (delta_dev->direction == BS_DEV_DELTA_WRITE) {
-        // SPDK_ERRLOG("writing cluster_map, first item is: %lu\n", ch->cluster_map[0]);
-        int ret = lseek(ch->delta_file_fd, 0, SEEK_SET);
-        if (ret < 0) {
-            SPDK_ERRLOG("could not seek to beginning of file: %s\n", strerror(errno));
-        }
-        lseek(ch->delta_file_fd, 0, SEEK_CUR);
-        ssize_t n = write(ch->delta_file_fd, ch->cluster_map, sizeof(ch->cluster_map));
-        // SPDK_ERRLOG("wrote %lu bytes\n", n);
-        if (n < 0) {
-            SPDK_ERRLOG("could not write cluster_map: %s\n", strerror(errno));
-        }
+    /*
+     * Channels are destroyed once blobstore is done with the device, after
+     * their writes completed, so the last one sees every cluster.
+     */
+    bool last = __atomic_sub_fetch(&delta_dev->channel_count, 1, __ATOMIC_ACQ_REL) == 0;
+    if (ch->accel_channel != NULL) {
+        spdk_put_io_channel(ch->accel_channel);
     }
-    io_uring_queue_exit(&ch->image_file_ring);
-    close(ch->delta_file_fd);
     spdk_poller_unregister(&ch->poller);
+
+    if (ch->bdev_channel != NULL && last && delta_dev->direction == BS_DEV_DELTA_WRITE) {
+        delta_bdev_commit(delta_dev, ch->bdev_channel);
+        return;
+    } else if (ch->bdev_channel != NULL) {
+        spdk_put_io_channel(ch->bdev_channel);
+        return;
+    }
+
+    io_uring_queue_exit(&ch->image_file_ring);
+    if (last && delta_dev->direction == BS_DEV_DELTA_WRITE) {
+        delta_file_commit(delta_dev, ch->delta_file_fd);
+    } else {
+        close(ch->delta_file_fd);
+    }
 }
 
 static struct spdk_io_channel *bs_dev_delta_create_channel(struct spdk_bs_dev *dev) {
@@ -166,9 +1260,20 @@ static void bs_dev_delta_destroy_channel(struct spdk_bs_dev *dev,
     spdk_put_io_channel(channel);
 }
 
+static void delta_free(struct bs_dev_delta *delta_dev) {
+    if (delta_dev->desc != NULL) {
+        spdk_bdev_close(delta_dev->desc);
+    }
+    free(delta_dev->cluster_offsets);
+    free(delta_dev->cluster_crcs);
+    free(delta_dev->cluster_lengths);
+    free(delta_dev);
+}
+
+static void bs_dev_delta_free(void *io_device) { delta_put(io_device); }
+
 static void bs_dev_delta_destroy(struct spdk_bs_dev *dev) {
-    spdk_io_device_unregister(dev, NULL);
-    // TODO: free anything?
+    spdk_io_device_unregister(dev, bs_dev_delta_free);
 }
 
 static void bs_dev_delta_read(struct spdk_bs_dev *dev, struct spdk_io_channel *channel,
@@ -194,62 +1299,141 @@ static void bs_dev_delta_readv_ext(struct spdk_bs_dev *dev,
     bs_dev_delta_readv(dev, channel, iov, iovcnt, lba, lba_count, cb_args);
 }
 
-static void bs_dev_delta_write(struct spdk_bs_dev *dev, struct spdk_io_channel *channel,
-                               void *payload, uint64_t lba, uint32_t lba_count,
-                               struct spdk_bs_dev_cb_args *cb_args) {
+/*
+ * delta_queue_write reserves the space of a cluster in the file, aligned so
+ * that every cluster starts on a UBI_DELTA_ALIGN boundary, and queues its
+ * write.
+ */
+static void delta_queue_write(struct delta_write *req) {
+    struct bs_dev_delta_io_channel *ch = req->ch;
+
+    if (!req->zero) {
+        req->offset = __atomic_fetch_add(&ch->delta_dev->append_offset,
+                                         SPDK_ALIGN_CEIL(req->write_len, UBI_DELTA_ALIGN),
+                                         __ATOMIC_RELAXED);
+    }
+
+    TAILQ_INSERT_TAIL(&ch->pending, req, link);
+    delta_submit_pending(ch);
+}
+
+/*
+ * delta_compress_done writes the compressed cluster if compressing it saved
+ * at least a block, and the raw cluster otherwise. Clusters which didn't fit
+ * their buffer compressed fail with an error, and are written raw too.
+ */
+static void delta_compress_done(void *cb_arg, int status) {
+    struct delta_write *req = cb_arg;
+
+    uint64_t padded_len = SPDK_ALIGN_CEIL(req->clen, UBI_DELTA_ALIGN);
+
+    if (status == 0 && padded_len < req->len) {
+        req->ciov.iov_base = req->cbuf;
+        req->ciov.iov_len = req->clen;
+        if (req->ch->bdev_channel != NULL) {
+            /* Bdevs are written in whole blocks. */
+            memset((uint8_t *)req->cbuf + req->clen, 0, padded_len - req->clen);
+            req->ciov.iov_len = padded_len;
+        }
+        req->iovs = &req->ciov;
+        req->iovcnt = 1;
+        req->write_len = req->clen;
+    } else {
+        spdk_dma_free(req->cbuf);
+        req->cbuf = NULL;
+    }
+
+    delta_queue_write(req);
+}
+
+/*
+ * delta_compress offloads the compression of a cluster to the accel
+ * framework. Returns an error if it couldn't be submitted, in which case the
+ * cluster is written raw.
+ */
+static int delta_compress(struct delta_write *req) {
+    req->cbuf = spdk_dma_malloc(req->len, UBI_DELTA_ALIGN, NULL);
+    if (req->cbuf == NULL) {
+        return -ENOMEM;
+    }
+
+    int rc = spdk_accel_submit_compress(req->ch->accel_channel, req->cbuf, req->len,
+                                        req->iovs, req->iovcnt, &req->clen, 0,
+                                        delta_compress_done, req);
+    if (rc != 0) {
+        spdk_dma_free(req->cbuf);
+        req->cbuf = NULL;
+    }
+    return rc;
+}
+
+/*
+ * delta_writev appends a cluster to the delta file. Either iovs or payload
+ * holds the data.
+ */
+static void delta_writev(struct spdk_bs_dev *dev, struct spdk_io_channel *channel,
+                         struct iovec *iovs, int iovcnt, void *payload, uint64_t lba,
+                         uint32_t lba_count, struct spdk_bs_dev_cb_args *cb_args) {
     struct bs_dev_delta_io_channel *ch = spdk_io_channel_get_ctx(channel);
     struct bs_dev_delta *delta_dev = SPDK_CONTAINEROF(dev, struct bs_dev_delta, base);
     uint64_t size = dev->blocklen * lba_count;
-
-    // get file current position
-    off_t pos = lseek(ch->delta_file_fd, 0, SEEK_CUR);
-    if (pos < 0) {
-        SPDK_ERRLOG("could not get current position: %s\n", strerror(errno));
-        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -EIO);
-        return;
-    }
+    struct delta_write *req;
 
     if (lba % delta_dev->cluster_size != 0) {
         SPDK_ERRLOG("lba must be a multiple of cluster_size\n");
         cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -EINVAL);
         return;
+    } else if (lba / delta_dev->cluster_size >= delta_dev->num_clusters) {
+        SPDK_ERRLOG("lba %lu is past the end of the delta device\n", lba);
+        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -EINVAL);
+        return;
     }
 
-    ch->cluster_map[lba / delta_dev->cluster_size] = pos;
-
-    bool all_zero = true;
-    for (int i = 0; i < size; i++) {
-        if (((char *)payload)[i] != 0) {
-            all_zero = false;
-            break;
-        }
+    req = calloc(1, sizeof(*req));
+    if (req == NULL) {
+        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -ENOMEM);
+        return;
     }
 
-    SPDK_ERRLOG("write lba=%lu lba_count=%u, len: %lu, all_zero=%d, pos=%lu, "
-                "first_8_bytes=0x%lx\n",
-                lba, lba_count, size, all_zero, pos, *(uint64_t *)payload);
+    if (iovs == NULL) {
+        req->iov.iov_base = payload;
+        req->iov.iov_len = size;
+        iovs = &req->iov;
+        iovcnt = 1;
+    }
 
-    // SPDK_ERRLOG("Setting cluster_map[%lu] = %lu\n", lba / delta_dev->cluster_size,
-    // pos);
+    req->ch = ch;
+    req->cb_args = cb_args;
+    req->iovs = iovs;
+    req->iovcnt = iovcnt;
+    req->cluster = lba / delta_dev->cluster_size;
+    req->len = size;
+    req->write_len = size;
 
-    int ret = write(ch->delta_file_fd, payload, size);
-    if (ret < 0) {
-        SPDK_ERRLOG("could not write to delta file: %s\n", strerror(errno));
-        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -EIO);
+    /* Zero clusters are only marked in the map, and take no space in the file. */
+    req->zero = ubi_iovs_are_zero(iovs, iovcnt);
+    if (req->zero) {
+        __atomic_fetch_add(&delta_dev->zero_clusters, 1, __ATOMIC_RELAXED);
+        delta_queue_write(req);
         return;
     }
 
-    cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
+    req->crc = ~spdk_crc32c_iov_update(iovs, iovcnt, ~0u);
+    if (ch->accel_channel == NULL || delta_compress(req) != 0) {
+        delta_queue_write(req);
+    }
+}
+
+static void bs_dev_delta_write(struct spdk_bs_dev *dev, struct spdk_io_channel *channel,
+                               void *payload, uint64_t lba, uint32_t lba_count,
+                               struct spdk_bs_dev_cb_args *cb_args) {
+    delta_writev(dev, channel, NULL, 0, payload, lba, lba_count, cb_args);
 }
 
 static void bs_dev_delta_writev(struct spdk_bs_dev *dev, struct spdk_io_channel *channel,
                                 struct iovec *iov, int iovcnt, uint64_t lba,
                                 uint32_t lba_count, struct spdk_bs_dev_cb_args *cb_args) {
-    SPDK_ERRLOG("XXX writev lba=%lu lba_count=%u, len: %lu\n", lba, lba_count,
-                iov[0].iov_len);
-
-    // TODO
-    cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
+    delta_writev(dev, channel, iov, iovcnt, NULL, lba, lba_count, cb_args);
 }
 
 static void bs_dev_delta_writev_ext(struct spdk_bs_dev *dev,
@@ -257,9 +1441,7 @@ static void bs_dev_delta_writev_ext(struct spdk_bs_dev *dev,
                                     int iovcnt, uint64_t lba, uint32_t lba_count,
                                     struct spdk_bs_dev_cb_args *cb_args,
                                     struct spdk_blob_ext_io_opts *ext_io_opts) {
-    SPDK_ERRLOG("XXX writev_ext lba=%lu lba_count=%u\n", lba, lba_count);
-    // TODO
-    cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
+    delta_writev(dev, channel, iov, iovcnt, NULL, lba, lba_count, cb_args);
 }
 
 static void bs_dev_delta_flush(struct spdk_bs_dev *dev, struct spdk_io_channel *channel,
@@ -314,9 +1496,75 @@ static void bs_dev_delta_copy(struct spdk_bs_dev *dev, struct spdk_io_channel *c
 
 static bool bs_dev_delta_is_degraded(struct spdk_bs_dev *dev) { return false; }
 
-struct spdk_bs_dev *bs_dev_delta_create(const char *filename, uint64_t blockcnt,
-                                        uint32_t blocklen, uint32_t cluster_size,
-                                        enum bs_dev_delta_direction direction) {
+/*
+ * bs_dev_delta_set_rate_limit limits how fast each channel of a writing delta
+ * device accepts clusters. 0 means unlimited. Can be called from any thread,
+ * and takes effect at the next write or poll.
+ */
+void bs_dev_delta_set_rate_limit(struct spdk_bs_dev *dev, uint64_t max_bytes_per_sec,
+                                 uint64_t max_ios_per_sec) {
+    struct bs_dev_delta *delta_dev = SPDK_CONTAINEROF(dev, struct bs_dev_delta, base);
+
+    __atomic_store_n(&delta_dev->max_bytes_per_sec, max_bytes_per_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&delta_dev->max_ios_per_sec, max_ios_per_sec, __ATOMIC_RELAXED);
+}
+
+/*
+ * bs_dev_delta_on_commit sets the callback which gets the status of the
+ * commit of a writing delta device, once its last channel is destroyed. It's
+ * called on the calling thread, and the device is still registered then.
+ */
+void bs_dev_delta_on_commit(struct spdk_bs_dev *dev, spdk_blob_op_complete cb_fn,
+                            void *cb_arg) {
+    struct bs_dev_delta *delta_dev = SPDK_CONTAINEROF(dev, struct bs_dev_delta, base);
+
+    delta_dev->done_fn = cb_fn;
+    delta_dev->done_arg = cb_arg;
+    delta_dev->done_thread = spdk_get_thread();
+}
+
+/*
+ * bs_dev_delta_get_progress returns the number of all-zero clusters a writing
+ * delta device was given, and the bytes of the file its clusters take so far.
+ * Can be called from any thread.
+ */
+void bs_dev_delta_get_progress(struct spdk_bs_dev *dev, uint64_t *zero_clusters,
+                               uint64_t *bytes_written) {
+    struct bs_dev_delta *delta_dev = SPDK_CONTAINEROF(dev, struct bs_dev_delta, base);
+    uint64_t offset = __atomic_load_n(&delta_dev->append_offset, __ATOMIC_RELAXED);
+
+    *zero_clusters = __atomic_load_n(&delta_dev->zero_clusters, __ATOMIC_RELAXED);
+    *bytes_written = offset > UBI_DELTA_DATA_OFFSET ? offset - UBI_DELTA_DATA_OFFSET : 0;
+}
+
+/*
+ * delta_create_file creates or truncates the delta file and writes a header
+ * without an extent table, which marks the delta incomplete.
+ */
+static int delta_create_file(struct bs_dev_delta *delta_dev) {
+    struct ubi_delta_header header;
+
+    int fd = open(delta_dev->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        SPDK_ERRLOG("could not create %s: %s\n", delta_dev->filename, strerror(errno));
+        return -errno;
+    }
+
+    delta_header_init(delta_dev, &header, 0, 0, 0);
+    int rc = delta_pwrite(delta_dev, fd, &header, sizeof(header), 0);
+    close(fd);
+    return rc;
+}
+
+/*
+ * delta_alloc allocates a delta device and its cluster map. name is the delta
+ * file, or the target bdev.
+ */
+static struct bs_dev_delta *delta_alloc(const char *name, const char *parent_path,
+                                        uint64_t blockcnt, uint32_t blocklen,
+                                        uint32_t cluster_size,
+                                        enum bs_dev_delta_direction direction,
+                                        enum ubi_delta_compression compression) {
     struct bs_dev_delta *delta_dev = calloc(1, sizeof *delta_dev);
     if (delta_dev == NULL) {
         SPDK_ERRLOG("could not allocate delta_dev\n");
@@ -327,12 +1575,34 @@ struct spdk_bs_dev *bs_dev_delta_create(const char *filename, uint64_t blockcnt,
     delta_dev->base.blocklen = blocklen;
     delta_dev->cluster_size = cluster_size / blocklen;
     delta_dev->direction = direction;
+    delta_dev->compression = compression;
+    delta_dev->append_offset = UBI_DELTA_DATA_OFFSET;
+    delta_dev->refs = 1;
+    delta_dev->done_thread = spdk_get_thread();
+    snprintf(delta_dev->parent_path, sizeof(delta_dev->parent_path), "%s",
+             parent_path ? parent_path : "");
 
     SPDK_WARNLOG("creating delta device. filename=%s blockcnt=%lu blocklen=%u "
                  "cluster_size=%u direction=%d\n",
-                 filename, blockcnt, blocklen, cluster_size, direction);
+                 name, blockcnt, blocklen, cluster_size, direction);
+
+    snprintf(delta_dev->filename, sizeof(delta_dev->filename), "%s", name);
 
-    strcpy(delta_dev->filename, filename);
+    /* calloc maps zero pages, so the map only takes memory as it's written. */
+    delta_dev->num_clusters = SPDK_CEIL_DIV(blockcnt, delta_dev->cluster_size);
+    delta_dev->cluster_offsets = calloc(delta_dev->num_clusters, sizeof(uint64_t));
+    delta_dev->cluster_crcs = calloc(delta_dev->num_clusters, sizeof(uint32_t));
+    delta_dev->cluster_lengths = calloc(delta_dev->num_clusters, sizeof(uint32_t));
+    if (delta_dev->cluster_offsets == NULL || delta_dev->cluster_crcs == NULL ||
+        delta_dev->cluster_lengths == NULL) {
+        SPDK_ERRLOG("could not allocate cluster map of %s\n", name);
+        delta_free(delta_dev);
+        return NULL;
+    }
+    return delta_dev;
+}
+
+static struct spdk_bs_dev *delta_register(struct bs_dev_delta *delta_dev) {
     struct spdk_bs_dev *dev = &delta_dev->base;
     dev->create_channel = bs_dev_delta_create_channel;
     dev->destroy = bs_dev_delta_destroy;
@@ -359,3 +1629,141 @@ struct spdk_bs_dev *bs_dev_delta_create(const char *filename, uint64_t blockcnt,
 
     return dev;
 }
+
+struct spdk_bs_dev *bs_dev_delta_create(const char *filename, const char *parent_path,
+                                        uint64_t blockcnt, uint32_t blocklen,
+                                        uint32_t cluster_size,
+                                        enum bs_dev_delta_direction direction,
+                                        enum ubi_delta_compression compression) {
+    struct bs_dev_delta *delta_dev = delta_alloc(filename, parent_path, blockcnt,
+                                                 blocklen, cluster_size, direction,
+                                                 compression);
+    if (delta_dev == NULL) {
+        return NULL;
+    }
+
+    if (direction == BS_DEV_DELTA_WRITE && delta_create_file(delta_dev) != 0) {
+        delta_free(delta_dev);
+        return NULL;
+    }
+
+    return delta_register(delta_dev);
+}
+
+struct delta_bdev_create {
+    struct bs_dev_delta *delta_dev;
+    struct spdk_io_channel *ch;
+    void *header;
+    bs_dev_delta_create_cb cb_fn;
+    void *cb_arg;
+};
+
+static void delta_bdev_create_done(struct delta_bdev_create *create, int rc) {
+    struct spdk_bs_dev *dev = NULL;
+
+    spdk_put_io_channel(create->ch);
+    spdk_dma_free(create->header);
+    if (rc == 0) {
+        dev = delta_register(create->delta_dev);
+    } else {
+        delta_free(create->delta_dev);
+    }
+    create->cb_fn(create->cb_arg, dev, rc);
+    free(create);
+}
+
+static void delta_bdev_created(struct spdk_bdev_io *bdev_io, bool success, void *cb_arg) {
+    struct delta_bdev_create *create = cb_arg;
+
+    spdk_bdev_free_io(bdev_io);
+    if (!success) {
+        SPDK_ERRLOG("could not write header to %s\n", create->delta_dev->filename);
+    }
+    delta_bdev_create_done(create, success ? 0 : -EIO);
+}
+
+static void delta_bdev_event_cb(enum spdk_bdev_event_type type, struct spdk_bdev *bdev,
+                                void *event_ctx) {
+    switch (type) {
+    case SPDK_BDEV_EVENT_REMOVE:
+        SPDK_WARNLOG("delta target %s is being removed\n", spdk_bdev_get_name(bdev));
+        break;
+    default:
+        SPDK_NOTICELOG("Unsupported bdev event: type %d, bdev: %s\n", type,
+                       spdk_bdev_get_name(bdev));
+        break;
+    }
+}
+
+/*
+ * bs_dev_delta_create_bdev creates a delta device which writes to the bdev
+ * bdev_name instead of a file, laid out the same way from its first block,
+ * and calls cb_fn with it once the bdev holds a header which marks the delta
+ * incomplete. The blocks of the bdev must divide UBI_DELTA_ALIGN. Returns an
+ * error without calling cb_fn if the bdev can't be used.
+ */
+int bs_dev_delta_create_bdev(const char *bdev_name, const char *parent_path,
+                             uint64_t blockcnt, uint32_t blocklen, uint32_t cluster_size,
+                             enum ubi_delta_compression compression,
+                             bs_dev_delta_create_cb cb_fn, void *cb_arg) {
+    struct delta_bdev_create *create = calloc(1, sizeof(*create));
+    if (create == NULL) {
+        return -ENOMEM;
+    }
+
+    create->delta_dev = delta_alloc(bdev_name, parent_path, blockcnt, blocklen,
+                                    cluster_size, BS_DEV_DELTA_WRITE, compression);
+    if (create->delta_dev == NULL) {
+        free(create);
+        return -ENOMEM;
+    }
+    struct bs_dev_delta *delta_dev = create->delta_dev;
+
+    int rc = spdk_bdev_open_ext(bdev_name, true, delta_bdev_event_cb, NULL,
+                                &delta_dev->desc);
+    if (rc != 0) {
+        SPDK_ERRLOG("could not open %s: %s\n", bdev_name, strerror(-rc));
+        delta_dev->desc = NULL;
+        goto err;
+    }
+    delta_dev->thread = spdk_get_thread();
+
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(delta_dev->desc);
+    uint32_t block_size = spdk_bdev_get_block_size(bdev);
+    delta_dev->target_size = block_size * spdk_bdev_get_num_blocks(bdev);
+    if (UBI_DELTA_ALIGN % block_size != 0) {
+        SPDK_ERRLOG("%s has blocks of %u bytes, which don't divide %d\n", bdev_name,
+                    block_size, UBI_DELTA_ALIGN);
+        rc = -EINVAL;
+        goto err;
+    } else if (delta_dev->target_size < UBI_DELTA_DATA_OFFSET + UBI_DELTA_ALIGN) {
+        SPDK_ERRLOG("%s is too small for a delta\n", bdev_name);
+        rc = -ENOSPC;
+        goto err;
+    }
+
+    create->ch = spdk_bdev_get_io_channel(delta_dev->desc);
+    create->header = spdk_dma_zmalloc(UBI_DELTA_HEADER_SIZE, UBI_DELTA_ALIGN, NULL);
+    if (create->ch == NULL || create->header == NULL) {
+        rc = -ENOMEM;
+        goto err;
+    }
+    delta_header_init(delta_dev, create->header, 0, 0, 0);
+
+    create->cb_fn = cb_fn;
+    create->cb_arg = cb_arg;
+    rc = spdk_bdev_write(delta_dev->desc, create->ch, create->header, 0,
+                         UBI_DELTA_HEADER_SIZE, delta_bdev_created, create);
+    if (rc == 0) {
+        return 0;
+    }
+
+err:
+    if (create->ch != NULL) {
+        spdk_put_io_channel(create->ch);
+    }
+    spdk_dma_free(create->header);
+    delta_free(delta_dev);
+    free(create);
+    return rc;
+}
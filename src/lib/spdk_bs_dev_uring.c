@@ -1,5 +1,8 @@
 #include "bdev_ubi_internal.h"
+#include "spdk/accel.h"
+#include "spdk/bdev.h"
 #include "spdk/blob.h"
+#include "spdk/crc32.h"
 #include "spdk/env.h"
 #include "spdk/log.h"
 #include "spdk/thread.h"
@@ -7,24 +10,153 @@
 
 #define UBI_URING_QUEUE_SIZE 4096
 
+/* Completions of compressed reads are told apart by the low bit of their data. */
+#define UBI_URING_COMPRESSED_TAG 1UL
+
 struct bs_dev_uring_io_channel {
+    /* -1 if the device has no image */
     int image_file_fd;
-    int snapshot_file_fd;
+    /* one fd per layer, from the top down, -1 for a layer on a bdev */
+    int layer_fds[UBI_DELTA_MAX_CHAIN];
+    /* channel of the topmost layer's bdev, NULL if it's a file */
+    struct spdk_io_channel *layer_bdev_channel;
     struct io_uring file_io_ring;
     struct spdk_poller *poller;
+    /* decompresses clusters of the layers, NULL if none is compressed */
+    struct spdk_io_channel *accel_channel;
+};
+
+/*
+ * A read from a compressed cluster of a layer. The compressed data of the
+ * whole cluster is read into cbuf, decompressed by the accel framework into
+ * buf, checked against the cluster's CRC, and the requested range copied from
+ * there.
+ */
+struct uring_compressed_read {
+    struct bs_dev_uring_io_channel *ch;
+    struct spdk_bs_dev_cb_args *cb_args;
+    struct iovec *iovs;
+    int iovcnt;
+    struct iovec iov;
+    /* offset of the range in the cluster, and its length */
+    uint64_t skip;
+    uint64_t len;
+    uint64_t cluster_size;
+    uint32_t clen;
+    uint32_t crc;
+    void *cbuf;
+    void *buf;
+    struct iovec src_iov;
+    struct iovec dst_iov;
+    uint32_t output_size;
 };
 
 struct bs_dev_uring {
     struct spdk_bs_dev base;
+    /* the image, empty if the layers are mounted on their own */
     char filename[1024];
-    char snapshot_path[1024];
-    uint64_t cluster_map[MAX_CLUSTERS];
+    /* the deltas over the image, from the top down */
+    char layer_paths[UBI_DELTA_MAX_CHAIN][UBI_PATH_LEN];
+    int layer_count;
+    /* bdev of the topmost layer, NULL if all layers are files */
+    struct spdk_bdev_desc *layer_desc;
+
+    /*
+     * Where the data of each cluster is: its offset in the topmost layer
+     * which has it, tagged with the layer's index, UBI_DELTA_ZERO_CLUSTER if
+     * that layer has it as zeroes, or 0 if no layer has it. Indexed by
+     * cluster, so resolving one doesn't walk the layers.
+     */
+    uint64_t *layer_map;
+    /* compressed length of each cluster in layer_map, 0 if it's stored raw */
+    uint32_t *layer_lengths;
+    /*
+     * CRC32C of each cluster in layer_map. Compressed clusters are checked
+     * against it, as they're read whole. Legacy layers have no CRCs, but
+     * aren't compressed either.
+     */
+    uint32_t *layer_crcs;
+    uint64_t layer_clusters;
+    bool layers_compressed;
+
+    /* One bit per image cluster, set if the cluster isn't a hole in the file. */
+    uint64_t *image_data_map;
+    uint64_t image_clusters;
+
+    /*
+     * One bit per image cluster, set while the cluster is being allocated by
+     * sub-cluster copy-on-write. Such clusters report zeroes so that the
+     * blobstore allocates them without copying data from the image.
+     */
+    uint64_t *cow_bypass_map;
+
     bool directio;
     uint64_t lba_to_cluster_shift;
     uint64_t lba_offset_mask;
     uint64_t lba_to_addr_shift;
 };
 
+static void uring_compressed_read_complete(struct uring_compressed_read *req, int rc) {
+    struct spdk_bs_dev_cb_args *cb_args = req->cb_args;
+
+    spdk_dma_free(req->cbuf);
+    spdk_dma_free(req->buf);
+    free(req);
+    cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, rc);
+}
+
+static void uring_decompress_done(void *cb_arg, int status) {
+    struct uring_compressed_read *req = cb_arg;
+    const uint8_t *src = (const uint8_t *)req->buf + req->skip;
+    uint64_t left = req->len;
+
+    if (status != 0 || req->output_size != req->cluster_size) {
+        SPDK_ERRLOG("could not decompress layer cluster: %d\n", status);
+        uring_compressed_read_complete(req, -EIO);
+        return;
+    } else if (~spdk_crc32c_update(req->buf, req->cluster_size, ~0u) != req->crc) {
+        SPDK_ERRLOG("layer cluster doesn't match its CRC\n");
+        uring_compressed_read_complete(req, -EIO);
+        return;
+    }
+
+    for (int i = 0; i < req->iovcnt && left > 0; i++) {
+        size_t n = spdk_min(req->iovs[i].iov_len, left);
+        memcpy(req->iovs[i].iov_base, src, n);
+        src += n;
+        left -= n;
+    }
+    uring_compressed_read_complete(req, 0);
+}
+
+static void uring_compressed_read_done(struct uring_compressed_read *req, int res) {
+    if (res < (int)req->clen) {
+        SPDK_ERRLOG("could not read compressed cluster: %s\n",
+                    res < 0 ? strerror(-res) : "short read");
+        uring_compressed_read_complete(req, -EIO);
+        return;
+    }
+
+    req->src_iov.iov_base = req->cbuf;
+    req->src_iov.iov_len = req->clen;
+    req->dst_iov.iov_base = req->buf;
+    req->dst_iov.iov_len = req->cluster_size;
+    int rc = spdk_accel_submit_decompress(req->ch->accel_channel, &req->dst_iov, 1,
+                                          &req->src_iov, 1, &req->output_size, 0,
+                                          uring_decompress_done, req);
+    if (rc != 0) {
+        uring_compressed_read_complete(req, rc);
+    }
+}
+
+static void uring_bdev_compressed_read_done(struct spdk_bdev_io *bdev_io, bool success,
+                                            void *cb_arg) {
+    struct uring_compressed_read *req = cb_arg;
+
+    spdk_bdev_free_io(bdev_io);
+    uring_compressed_read_done(req, success ? (int)req->clen : -EIO);
+}
+
 int bs_dev_uring_poll(void *arg) {
     struct bs_dev_uring_io_channel *ch = arg;
     struct io_uring *ring = &ch->file_io_ring;
@@ -40,7 +172,18 @@ int bs_dev_uring_poll(void *arg) {
     }
 
     for (int i = 0; i < ret; i++) {
-        struct spdk_bs_dev_cb_args *cb_args = io_uring_cqe_get_data(cqe[i]);
+        uintptr_t data = (uintptr_t)io_uring_cqe_get_data(cqe[i]);
+        if (data & UBI_URING_COMPRESSED_TAG) {
+            int res = cqe[i]->res;
+            io_uring_cqe_seen(ring, cqe[i]);
+            uring_compressed_read_done(
+                (struct uring_compressed_read *)(data & ~UBI_URING_COMPRESSED_TAG), res);
+            continue;
+        }
+
+        struct spdk_bs_dev_cb_args *cb_args = (struct spdk_bs_dev_cb_args *)data;
+        spdk_trace_record(TRACE_BDEV_UBI_ESNAP_REAP, 0, 0, (uintptr_t)cb_args,
+                          cqe[i]->res);
         if (cqe[i]->res < 0) {
             SPDK_ERRLOG("io_uring error: %s\n", strerror(-cqe[i]->res));
             cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -EIO);
@@ -54,6 +197,23 @@ int bs_dev_uring_poll(void *arg) {
     return SPDK_POLLER_BUSY;
 }
 
+static void bs_dev_uring_close_layers(struct bs_dev_uring_io_channel *ch) {
+    for (int i = 0; i < UBI_DELTA_MAX_CHAIN; i++) {
+        if (ch->layer_fds[i] >= 0) {
+            close(ch->layer_fds[i]);
+        }
+    }
+    if (ch->layer_bdev_channel != NULL) {
+        spdk_put_io_channel(ch->layer_bdev_channel);
+    }
+}
+
+static void bs_dev_uring_close_image(struct bs_dev_uring_io_channel *ch) {
+    if (ch->image_file_fd >= 0) {
+        close(ch->image_file_fd);
+    }
+}
+
 static int bs_dev_uring_create_channel_cb(void *io_device, void *ctx_buf) {
     struct bs_dev_uring *uring_dev = io_device;
     struct bs_dev_uring_io_channel *ch = ctx_buf;
@@ -61,25 +221,37 @@ static int bs_dev_uring_create_channel_cb(void *io_device, void *ctx_buf) {
     int open_flags = O_RDONLY;
     if (uring_dev->directio)
         open_flags |= O_DIRECT;
-    ch->image_file_fd = open(uring_dev->filename, open_flags);
-    if (ch->image_file_fd < 0) {
+    ch->image_file_fd = -1;
+    if (uring_dev->filename[0] != '\0') {
+        ch->image_file_fd = open(uring_dev->filename, open_flags);
+    }
+    if (ch->image_file_fd < 0 && uring_dev->filename[0] != '\0') {
         SPDK_ERRLOG("could not open %s: %s\n", uring_dev->filename, strerror(errno));
-        free(ch);
         return -1;
     }
 
-    if (uring_dev->snapshot_path[0]) {
-        SPDK_WARNLOG("Opening snapshot: %s\n", uring_dev->snapshot_path);
-        ch->snapshot_file_fd = open(uring_dev->snapshot_path, open_flags);
-        if (ch->snapshot_file_fd < 0) {
-            SPDK_ERRLOG("could not open %s: %s\n", uring_dev->snapshot_path,
+    for (int i = 0; i < UBI_DELTA_MAX_CHAIN; i++) {
+        ch->layer_fds[i] = -1;
+    }
+    ch->layer_bdev_channel = NULL;
+    if (uring_dev->layer_desc != NULL) {
+        ch->layer_bdev_channel = spdk_bdev_get_io_channel(uring_dev->layer_desc);
+        if (ch->layer_bdev_channel == NULL) {
+            SPDK_ERRLOG("could not get a channel of %s\n", uring_dev->layer_paths[0]);
+            bs_dev_uring_close_image(ch);
+            return -1;
+        }
+    }
+    for (int i = uring_dev->layer_desc != NULL; i < uring_dev->layer_count; i++) {
+        SPDK_WARNLOG("Opening layer: %s\n", uring_dev->layer_paths[i]);
+        ch->layer_fds[i] = open(uring_dev->layer_paths[i], open_flags);
+        if (ch->layer_fds[i] < 0) {
+            SPDK_ERRLOG("could not open %s: %s\n", uring_dev->layer_paths[i],
                         strerror(errno));
-            close(ch->image_file_fd);
-            free(ch);
+            bs_dev_uring_close_layers(ch);
+            bs_dev_uring_close_image(ch);
             return -1;
         }
-    } else {
-        ch->snapshot_file_fd = -1;
     }
 
     struct io_uring_params io_uring_params;
@@ -87,14 +259,24 @@ static int bs_dev_uring_create_channel_cb(void *io_device, void *ctx_buf) {
     int rc = io_uring_queue_init(UBI_URING_QUEUE_SIZE, &ch->file_io_ring, 0);
     if (rc != 0) {
         SPDK_ERRLOG("Unable to setup io_uring: %s\n", strerror(-rc));
-        close(ch->image_file_fd);
-        if (ch->snapshot_file_fd >= 0) {
-            close(ch->snapshot_file_fd);
-        }
-        free(ch);
+        bs_dev_uring_close_image(ch);
+        bs_dev_uring_close_layers(ch);
         return -1;
     }
 
+    ch->accel_channel = NULL;
+    if (uring_dev->layers_compressed) {
+        ch->accel_channel = spdk_accel_get_io_channel();
+        if (ch->accel_channel == NULL) {
+            SPDK_ERRLOG("could not get accel channel to decompress %s\n",
+                        uring_dev->layer_paths[0]);
+            io_uring_queue_exit(&ch->file_io_ring);
+            bs_dev_uring_close_image(ch);
+            bs_dev_uring_close_layers(ch);
+            return -1;
+        }
+    }
+
     ch->poller = SPDK_POLLER_REGISTER(bs_dev_uring_poll, ch, 0);
 
     return 0;
@@ -102,8 +284,12 @@ static int bs_dev_uring_create_channel_cb(void *io_device, void *ctx_buf) {
 
 static void bs_dev_uring_destroy_channel_cb(void *io_device, void *ctx_buf) {
     struct bs_dev_uring_io_channel *ch = ctx_buf;
+    if (ch->accel_channel != NULL) {
+        spdk_put_io_channel(ch->accel_channel);
+    }
     io_uring_queue_exit(&ch->file_io_ring);
-    close(ch->image_file_fd);
+    bs_dev_uring_close_image(ch);
+    bs_dev_uring_close_layers(ch);
     spdk_poller_unregister(&ch->poller);
 }
 
@@ -117,26 +303,155 @@ static void bs_dev_uring_destroy_channel(struct spdk_bs_dev *dev,
     spdk_put_io_channel(channel);
 }
 
-static void bs_dev_uring_destroy(struct spdk_bs_dev *dev) {
-    SPDK_WARNLOG("unregistering uring_dev: %p\n", dev);
-    spdk_io_device_unregister(dev, NULL);
-    // TODO: free anything?
+static uint64_t layer_entry(struct bs_dev_uring *uring_dev, uint64_t cluster) {
+    return cluster < uring_dev->layer_clusters ? uring_dev->layer_map[cluster] : 0;
 }
 
-void set_io_opts(struct bs_dev_uring *uring_dev, struct bs_dev_uring_io_channel *ch,
-                 uint64_t lba, int *fd, uint64_t *offset) {
-    uint32_t cluster_id = lba >> uring_dev->lba_to_cluster_shift;
-    if (uring_dev->cluster_map[cluster_id] == 0) {
+/*
+ * set_io_opts finds where the data of the given lba is stored. Returns false
+ * if it's in a zero cluster of a layer, or in a cluster no layer has when
+ * there's no image, neither of which has data in any file. fd is set to -1
+ * if the data is in the topmost layer and that's on a bdev. length is set to
+ * the length of the cluster's compressed data, or to 0 if the data isn't
+ * compressed.
+ */
+bool set_io_opts(struct bs_dev_uring *uring_dev, struct bs_dev_uring_io_channel *ch,
+                 uint64_t lba, int *fd, uint64_t *offset, uint32_t *length) {
+    uint64_t cluster = lba >> uring_dev->lba_to_cluster_shift;
+    uint64_t entry = layer_entry(uring_dev, cluster);
+
+    *length = 0;
+    if (entry == UBI_DELTA_ZERO_CLUSTER) {
+        return false;
+    } else if (entry == 0 && ch->image_file_fd < 0) {
+        return false;
+    } else if (entry == 0) {
         *fd = ch->image_file_fd;
         *offset = (lba << uring_dev->lba_to_addr_shift);
     } else {
-        *fd = ch->snapshot_file_fd;
-        uint64_t cluster_start = uring_dev->cluster_map[cluster_id];
+        *fd = ch->layer_fds[entry >> UBI_DELTA_INDEX_SHIFT];
+        uint64_t cluster_start = entry & UBI_DELTA_OFFSET_MASK;
         uint64_t lba_offset = (lba & uring_dev->lba_offset_mask);
         *offset = cluster_start + (lba_offset << uring_dev->lba_to_addr_shift);
+        *length = uring_dev->layer_lengths[cluster];
+    }
+    return true;
+}
+
+/*
+ * bs_dev_uring_read_compressed reads a range of a compressed cluster, which
+ * starts at lba and whose data is at offset of fd.
+ */
+static void bs_dev_uring_read_compressed(struct bs_dev_uring *uring_dev,
+                                         struct bs_dev_uring_io_channel *ch, int fd,
+                                         uint64_t offset, uint32_t length,
+                                         struct iovec *iovs, int iovcnt, void *payload,
+                                         uint64_t lba, uint32_t lba_count,
+                                         struct spdk_bs_dev_cb_args *cb_args) {
+    struct io_uring *ring = &ch->file_io_ring;
+    struct uring_compressed_read *req;
+    uint64_t skip = (lba & uring_dev->lba_offset_mask) << uring_dev->lba_to_addr_shift;
+    uint64_t read_len = SPDK_ALIGN_CEIL(length, UBI_DELTA_ALIGN);
+
+    req = calloc(1, sizeof(*req));
+    if (req == NULL) {
+        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -ENOMEM);
+        return;
+    }
+
+    req->ch = ch;
+    req->cb_args = cb_args;
+    req->iovs = iovs;
+    req->iovcnt = iovcnt;
+    if (iovs == NULL) {
+        req->iov.iov_base = payload;
+        req->iov.iov_len = lba_count * uring_dev->base.blocklen;
+        req->iovs = &req->iov;
+        req->iovcnt = 1;
+    }
+    req->skip = skip;
+    req->len = lba_count * uring_dev->base.blocklen;
+    req->cluster_size =
+        1ULL << (uring_dev->lba_to_cluster_shift + uring_dev->lba_to_addr_shift);
+    req->clen = length;
+    req->crc = uring_dev->layer_crcs[lba >> uring_dev->lba_to_cluster_shift];
+
+    /* Buffers and the read are aligned, as layers may be opened O_DIRECT. */
+    req->cbuf = spdk_dma_malloc(read_len, UBI_DELTA_ALIGN, NULL);
+    req->buf = spdk_dma_malloc(req->cluster_size, UBI_DELTA_ALIGN, NULL);
+    if (fd < 0) {
+        int rc = req->cbuf && req->buf && ch->accel_channel
+                     ? spdk_bdev_read(uring_dev->layer_desc, ch->layer_bdev_channel,
+                                      req->cbuf, offset - skip, read_len,
+                                      uring_bdev_compressed_read_done, req)
+                     : -ENOMEM;
+        if (rc != 0) {
+            /* Out of memory or bdev_io, the caller can retry later. */
+            uring_compressed_read_complete(req, rc);
+            return;
+        }
+        spdk_trace_record(TRACE_BDEV_UBI_ESNAP_SUBMIT, 0, read_len, (uintptr_t)cb_args,
+                          lba, lba_count, (uintptr_t)cb_args->cb_arg);
+        return;
+    }
+
+    struct io_uring_sqe *sqe =
+        req->cbuf && req->buf && ch->accel_channel ? io_uring_get_sqe(ring) : NULL;
+    if (sqe == NULL) {
+        /* Out of memory or submission entries, the caller can retry later. */
+        uring_compressed_read_complete(req, -ENOMEM);
+        return;
+    }
+
+    io_uring_prep_read(sqe, fd, req->cbuf, read_len, offset - skip);
+    io_uring_sqe_set_data(sqe, (void *)((uintptr_t)req | UBI_URING_COMPRESSED_TAG));
+
+    spdk_trace_record(TRACE_BDEV_UBI_ESNAP_SUBMIT, 0, read_len, (uintptr_t)cb_args, lba,
+                      lba_count, (uintptr_t)cb_args->cb_arg);
+    int ret = io_uring_submit(ring);
+    if (ret < 0) {
+        SPDK_ERRLOG("io_uring_submit error: %s\n", strerror(-ret));
     }
 }
 
+static void uring_bdev_read_done(struct spdk_bdev_io *bdev_io, bool success,
+                                 void *cb_arg) {
+    struct spdk_bs_dev_cb_args *cb_args = cb_arg;
+
+    spdk_bdev_free_io(bdev_io);
+    spdk_trace_record(TRACE_BDEV_UBI_ESNAP_REAP, 0, 0, (uintptr_t)cb_args, success);
+    cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, success ? 0 : -EIO);
+}
+
+/*
+ * bs_dev_uring_read_bdev reads a range of a raw cluster of the topmost layer
+ * when that's on a bdev, from offset of the bdev. Either iovs or payload holds
+ * the buffer.
+ */
+static void bs_dev_uring_read_bdev(struct bs_dev_uring *uring_dev,
+                                   struct bs_dev_uring_io_channel *ch, uint64_t offset,
+                                   struct iovec *iovs, int iovcnt, void *payload,
+                                   uint64_t lba, uint32_t lba_count,
+                                   struct spdk_bs_dev_cb_args *cb_args) {
+    uint64_t len = lba_count * uring_dev->base.blocklen;
+    int rc;
+
+    if (iovs == NULL) {
+        rc = spdk_bdev_read(uring_dev->layer_desc, ch->layer_bdev_channel, payload,
+                            offset, len, uring_bdev_read_done, cb_args);
+    } else {
+        rc = spdk_bdev_readv(uring_dev->layer_desc, ch->layer_bdev_channel, iovs, iovcnt,
+                             offset, len, uring_bdev_read_done, cb_args);
+    }
+    if (rc != 0) {
+        /* -ENOMEM if the bdev layer is out of bdev_io, the caller can retry later. */
+        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, rc);
+        return;
+    }
+    spdk_trace_record(TRACE_BDEV_UBI_ESNAP_SUBMIT, 0, len, (uintptr_t)cb_args, lba,
+                      lba_count, (uintptr_t)cb_args->cb_arg);
+}
+
 static void bs_dev_uring_read(struct spdk_bs_dev *dev, struct spdk_io_channel *channel,
                               void *payload, uint64_t lba, uint32_t lba_count,
                               struct spdk_bs_dev_cb_args *cb_args) {
@@ -145,18 +460,39 @@ static void bs_dev_uring_read(struct spdk_bs_dev *dev, struct spdk_io_channel *c
     struct io_uring *ring = &ch->file_io_ring;
     int fd;
     uint64_t offset;
+    uint32_t length;
 
     if (lba >= dev->blockcnt) {
         cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
         return;
     }
 
-    set_io_opts(uring_dev, ch, lba, &fd, &offset);
+    if (!set_io_opts(uring_dev, ch, lba, &fd, &offset, &length)) {
+        memset(payload, 0, lba_count * dev->blocklen);
+        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
+        return;
+    }
+    if (length != 0) {
+        bs_dev_uring_read_compressed(uring_dev, ch, fd, offset, length, NULL, 0, payload,
+                                     lba, lba_count, cb_args);
+        return;
+    } else if (fd < 0) {
+        bs_dev_uring_read_bdev(uring_dev, ch, offset, NULL, 0, payload, lba, lba_count,
+                               cb_args);
+        return;
+    }
 
     struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        /* The submission queue is full, the caller can retry later. */
+        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -ENOMEM);
+        return;
+    }
     io_uring_prep_read(sqe, fd, payload, lba_count * dev->blocklen, offset);
     io_uring_sqe_set_data(sqe, cb_args);
 
+    spdk_trace_record(TRACE_BDEV_UBI_ESNAP_SUBMIT, 0, lba_count * dev->blocklen,
+                      (uintptr_t)cb_args, lba, lba_count, (uintptr_t)cb_args->cb_arg);
     int ret = io_uring_submit(ring);
     if (ret < 0) {
         SPDK_ERRLOG("io_uring_submit error: %s\n", strerror(-ret));
@@ -172,18 +508,41 @@ static void bs_dev_uring_readv(struct spdk_bs_dev *dev, struct spdk_io_channel *
     struct io_uring *ring = &ch->file_io_ring;
     int fd;
     uint64_t offset;
+    uint32_t length;
 
     if (lba >= dev->blockcnt) {
         cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
         return;
     }
 
-    set_io_opts(uring_dev, ch, lba, &fd, &offset);
+    if (!set_io_opts(uring_dev, ch, lba, &fd, &offset, &length)) {
+        for (int i = 0; i < iovcnt; i++) {
+            memset(iov[i].iov_base, 0, iov[i].iov_len);
+        }
+        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, 0);
+        return;
+    }
+    if (length != 0) {
+        bs_dev_uring_read_compressed(uring_dev, ch, fd, offset, length, iov, iovcnt, NULL,
+                                     lba, lba_count, cb_args);
+        return;
+    } else if (fd < 0) {
+        bs_dev_uring_read_bdev(uring_dev, ch, offset, iov, iovcnt, NULL, lba, lba_count,
+                               cb_args);
+        return;
+    }
 
     struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (sqe == NULL) {
+        /* The submission queue is full, the caller can retry later. */
+        cb_args->cb_fn(cb_args->channel, cb_args->cb_arg, -ENOMEM);
+        return;
+    }
     io_uring_prep_readv(sqe, fd, iov, iovcnt, offset);
     io_uring_sqe_set_data(sqe, cb_args);
 
+    spdk_trace_record(TRACE_BDEV_UBI_ESNAP_SUBMIT, 0, lba_count * dev->blocklen,
+                      (uintptr_t)cb_args, lba, lba_count, (uintptr_t)cb_args->cb_arg);
     int ret = io_uring_submit(ring);
     if (ret < 0) {
         SPDK_ERRLOG("io_uring_submit error: %s\n", strerror(-ret));
@@ -252,7 +611,7 @@ static bool bs_dev_uring_is_range_valid(struct spdk_bs_dev *dev, uint64_t lba,
     struct bs_dev_uring *uring_dev = (struct bs_dev_uring *)dev;
     if (lba >= uring_dev->base.blockcnt) {
         uint64_t cluster = lba >> uring_dev->lba_to_cluster_shift;
-        if (uring_dev->cluster_map[cluster] != 0) {
+        if (layer_entry(uring_dev, cluster) != 0) {
             SPDK_ERRLOG("Non-zero cluster-map: %lu\n", cluster);
             return true;
         }
@@ -267,9 +626,76 @@ static bool bs_dev_uring_is_range_valid(struct spdk_bs_dev *dev, uint64_t lba,
     return true;
 }
 
+static bool bs_dev_uring_image_has_data(struct bs_dev_uring *uring_dev,
+                                        uint64_t cluster) {
+    if (cluster >= uring_dev->image_clusters) {
+        return false;
+    }
+    return (uring_dev->image_data_map[cluster / 64] >> (cluster % 64)) & 1;
+}
+
+static bool bs_dev_uring_cow_bypassed(struct bs_dev_uring *uring_dev,
+                                      uint64_t cluster) {
+    if (cluster >= uring_dev->image_clusters) {
+        return false;
+    }
+    uint64_t word =
+        __atomic_load_n(&uring_dev->cow_bypass_map[cluster / 64], __ATOMIC_ACQUIRE);
+    return (word >> (cluster % 64)) & 1;
+}
+
+/*
+ * bs_dev_uring_is_zeroes returns true if no cluster in the range has data in
+ * either the layers or the image. Holes in the image file and the area past
+ * its end read as zeroes, and so do zero clusters of the topmost layer which
+ * has them, whatever is under them. Clusters with the copy-on-write bypass set are
+ * reported as zeroes too.
+ */
 static bool bs_dev_uring_is_zeroes(struct spdk_bs_dev *dev, uint64_t lba,
                                    uint64_t lba_count) {
-    return !bs_dev_uring_is_range_valid(dev, lba, lba_count);
+    struct bs_dev_uring *uring_dev = (struct bs_dev_uring *)dev;
+    uint64_t first = lba >> uring_dev->lba_to_cluster_shift;
+    uint64_t last = (lba + lba_count - 1) >> uring_dev->lba_to_cluster_shift;
+
+    for (uint64_t cluster = first; cluster <= last; cluster++) {
+        if (bs_dev_uring_cow_bypassed(uring_dev, cluster)) {
+            continue;
+        }
+        uint64_t entry = layer_entry(uring_dev, cluster);
+        if (entry == UBI_DELTA_ZERO_CLUSTER) {
+            continue;
+        }
+        if (entry != 0) {
+            return false;
+        }
+        if (bs_dev_uring_image_has_data(uring_dev, cluster)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * bs_dev_uring_set_cow_bypass sets or clears the copy-on-write bypass of an
+ * image cluster. It can be called from any thread.
+ */
+void bs_dev_uring_set_cow_bypass(struct spdk_bs_dev *dev, uint64_t cluster,
+                                 bool bypass) {
+    struct bs_dev_uring *uring_dev = (struct bs_dev_uring *)dev;
+    uint64_t bit = 1ULL << (cluster % 64);
+
+    if (cluster >= uring_dev->image_clusters) {
+        return;
+    }
+
+    if (bypass) {
+        __atomic_fetch_or(&uring_dev->cow_bypass_map[cluster / 64], bit,
+                          __ATOMIC_RELEASE);
+    } else {
+        __atomic_fetch_and(&uring_dev->cow_bypass_map[cluster / 64], ~bit,
+                           __ATOMIC_RELEASE);
+    }
 }
 
 static bool bs_dev_uring_translate_lba(struct spdk_bs_dev *dev, uint64_t lba,
@@ -278,6 +704,10 @@ static bool bs_dev_uring_translate_lba(struct spdk_bs_dev *dev, uint64_t lba,
     return true;
 }
 
+/*
+ * The blobstore doesn't copy clusters of esnap clones through their back
+ * device, it reads them and writes them to the blob, so this isn't reached.
+ */
 static void bs_dev_uring_copy(struct spdk_bs_dev *dev, struct spdk_io_channel *channel,
                               uint64_t dst_lba, uint64_t src_lba, uint64_t lba_count,
                               struct spdk_bs_dev_cb_args *cb_args) {
@@ -287,9 +717,210 @@ static void bs_dev_uring_copy(struct spdk_bs_dev *dev, struct spdk_io_channel *c
 
 static bool bs_dev_uring_is_degraded(struct spdk_bs_dev *dev) { return false; }
 
-struct spdk_bs_dev *bs_dev_uring_create(const char *filename, const char *snapshot_path,
+/*
+ * bs_dev_uring_load_image_map finds the clusters of the image file which hold
+ * data using SEEK_DATA/SEEK_HOLE. Filesystems without hole support report the
+ * whole file as data.
+ */
+static int bs_dev_uring_load_image_map(struct bs_dev_uring *uring_dev,
+                                       uint64_t image_size, uint32_t cluster_size) {
+    uring_dev->image_clusters = SPDK_CEIL_DIV(image_size, cluster_size);
+    uring_dev->image_data_map =
+        calloc(SPDK_CEIL_DIV(uring_dev->image_clusters, 64), sizeof(uint64_t));
+    uring_dev->cow_bypass_map =
+        calloc(SPDK_CEIL_DIV(uring_dev->image_clusters, 64), sizeof(uint64_t));
+    if (uring_dev->image_data_map == NULL || uring_dev->cow_bypass_map == NULL) {
+        SPDK_ERRLOG("could not allocate image data map\n");
+        return -ENOMEM;
+    }
+
+    int fd = open(uring_dev->filename, O_RDONLY);
+    if (fd < 0) {
+        int rc = -errno;
+        SPDK_ERRLOG("could not open %s: %s\n", uring_dev->filename, strerror(-rc));
+        return rc;
+    }
+
+    off_t offset = 0;
+    while ((uint64_t)offset < image_size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        off_t hole;
+        if (data < 0 && errno == ENXIO) {
+            /* No data after offset. */
+            break;
+        } else if (data < 0) {
+            SPDK_WARNLOG("SEEK_DATA failed on %s: %s\n", uring_dev->filename,
+                         strerror(errno));
+            data = offset;
+            hole = image_size;
+        } else {
+            hole = lseek(fd, data, SEEK_HOLE);
+            if (hole <= data || (uint64_t)hole > image_size) {
+                hole = image_size;
+            }
+        }
+
+        uint64_t last = SPDK_CEIL_DIV(hole, cluster_size);
+        for (uint64_t c = data / cluster_size; c < last; c++) {
+            uring_dev->image_data_map[c / 64] |= 1ULL << (c % 64);
+        }
+        offset = hole;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/*
+ * bs_dev_uring_load_layers reads the extents of the layers and flattens them
+ * into the per-cluster layer map. A top_layer on a bdev goes above them, at
+ * index 0 of the chain. size receives the size recorded by the topmost layer
+ * which has one, or 0 if none does.
+ */
+static int bs_dev_uring_load_layers(struct bs_dev_uring *uring_dev,
+                                    const char *const *layers, int layer_count,
+                                    const struct ubi_delta_bdev *top_layer,
+                                    uint64_t cluster_size, uint64_t *size) {
+    struct ubi_delta_extent *extents = NULL;
+    uint64_t count = 0;
+    int first = top_layer != NULL;
+    uint32_t unchecked;
+    int depth = 0;
+
+    char(*paths)[UBI_PATH_LEN] = calloc(UBI_DELTA_MAX_CHAIN, UBI_PATH_LEN);
+    if (paths == NULL) {
+        return -ENOMEM;
+    }
+
+    *size = 0;
+    int rc = layer_count > 0 ? ubi_read_delta_layers(layers, layer_count, cluster_size,
+                                                     &extents, &count, paths, &depth,
+                                                     size, &unchecked)
+                             : 0;
+    if (rc == 0 && depth + first > UBI_DELTA_MAX_CHAIN) {
+        SPDK_ERRLOG("more than %d deltas under %s\n", UBI_DELTA_MAX_CHAIN,
+                    top_layer->name);
+        rc = -E2BIG;
+    }
+    if (rc != 0) {
+        SPDK_ERRLOG("could not read layers under %s\n",
+                    top_layer != NULL ? top_layer->name : layers[0]);
+        free(extents);
+        free(paths);
+        return rc;
+    }
+
+    for (int i = 0; i < depth; i++) {
+        strcpy(uring_dev->layer_paths[first + i], paths[i]);
+    }
+    free(paths);
+    uring_dev->layer_count = first + depth;
+
+    uint64_t clusters = count > 0 ? extents[count - 1].cluster + 1 : 0;
+    if (top_layer != NULL) {
+        strcpy(uring_dev->layer_paths[0], top_layer->name);
+        uring_dev->layer_desc = top_layer->desc;
+        if (top_layer->size != 0) {
+            *size = top_layer->size;
+        }
+        if (top_layer->extent_count > 0) {
+            uint64_t last = top_layer->extents[top_layer->extent_count - 1].cluster;
+            clusters = spdk_max(clusters, last + 1);
+        }
+    }
+
+    uring_dev->layer_clusters = clusters;
+    uring_dev->layer_map = calloc(spdk_max(clusters, 1), sizeof(uint64_t));
+    uring_dev->layer_lengths = calloc(spdk_max(clusters, 1), sizeof(uint32_t));
+    uring_dev->layer_crcs = calloc(spdk_max(clusters, 1), sizeof(uint32_t));
+    if (uring_dev->layer_map == NULL || uring_dev->layer_lengths == NULL ||
+        uring_dev->layer_crcs == NULL) {
+        SPDK_ERRLOG("could not allocate layer map\n");
+        free(extents);
+        return -ENOMEM;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t offset = extents[i].offset;
+        /* The files are below the bdev in the chain. */
+        if (offset != UBI_DELTA_ZERO_CLUSTER) {
+            offset += (uint64_t)first << UBI_DELTA_INDEX_SHIFT;
+        }
+        uring_dev->layer_map[extents[i].cluster] = offset;
+        uring_dev->layer_lengths[extents[i].cluster] = extents[i].length;
+        uring_dev->layer_crcs[extents[i].cluster] = extents[i].crc;
+    }
+    free(extents);
+
+    for (uint64_t i = 0; top_layer != NULL && i < top_layer->extent_count; i++) {
+        const struct ubi_delta_extent *extent = &top_layer->extents[i];
+        uring_dev->layer_map[extent->cluster] = extent->offset;
+        uring_dev->layer_lengths[extent->cluster] = extent->length;
+        uring_dev->layer_crcs[extent->cluster] = extent->crc;
+    }
+
+    for (uint64_t i = 0; i < clusters; i++) {
+        if (uring_dev->layer_lengths[i] != 0) {
+            uring_dev->layers_compressed = true;
+            break;
+        }
+    }
+    return 0;
+}
+
+static void bs_dev_uring_free(struct bs_dev_uring *uring_dev) {
+    free(uring_dev->image_data_map);
+    free(uring_dev->cow_bypass_map);
+    free(uring_dev->layer_map);
+    free(uring_dev->layer_lengths);
+    free(uring_dev->layer_crcs);
+    free(uring_dev);
+}
+
+static void bs_dev_uring_unregister_cb(void *io_device) {
+    bs_dev_uring_free(io_device);
+}
+
+static void bs_dev_uring_destroy(struct spdk_bs_dev *dev) {
+    SPDK_WARNLOG("unregistering uring_dev: %p\n", dev);
+    spdk_io_device_unregister(dev, bs_dev_uring_unregister_cb);
+}
+
+/*
+ * bs_dev_uring_create creates a device which reads the image at filename
+ * overlaid with the given delta layers, ordered from the top down. Each layer
+ * brings the deltas it's incremental to right under it. top_layer, if it isn't
+ * NULL, is a delta on a bdev which goes above all of them, and whose parent
+ * must be the first of the layers. There may be no image or no layers, but not
+ * neither. Without an image, clusters no layer has read as zeroes and the
+ * device has the size recorded in the topmost layer.
+ */
+struct spdk_bs_dev *bs_dev_uring_create(const char *filename, const char *const *layers,
+                                        int layer_count,
+                                        const struct ubi_delta_bdev *top_layer,
                                         uint32_t blocklen, uint32_t cluster_size,
                                         bool directio) {
+    bool has_image = filename && filename[0];
+    uint64_t size = 0;
+
+    if (!has_image && layer_count == 0 && top_layer == NULL) {
+        SPDK_ERRLOG("either an image or a layer is needed\n");
+        return NULL;
+    }
+
+    if (top_layer != NULL) {
+        struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(top_layer->desc);
+        if (top_layer->cluster_size != cluster_size) {
+            SPDK_ERRLOG("%s has cluster size %lu, expected %u\n", top_layer->name,
+                        top_layer->cluster_size, cluster_size);
+            return NULL;
+        } else if (blocklen % spdk_bdev_get_block_size(bdev) != 0) {
+            SPDK_ERRLOG("blocks of %s don't divide %u bytes\n", top_layer->name,
+                        blocklen);
+            return NULL;
+        }
+    }
+
     struct bs_dev_uring *uring_dev = calloc(1, sizeof *uring_dev);
     if (uring_dev == NULL) {
         SPDK_ERRLOG("could not allocate uring_dev\n");
@@ -297,30 +928,43 @@ struct spdk_bs_dev *bs_dev_uring_create(const char *filename, const char *snapsh
     }
 
     struct stat statBuffer;
-    if (stat(filename, &statBuffer) != 0) {
+    if (has_image && stat(filename, &statBuffer) != 0) {
         SPDK_ERRLOG("could not stat %s: %s\n", filename, strerror(errno));
         free(uring_dev);
         return NULL;
     }
 
-    int ret = (snapshot_path && snapshot_path[0])
-                  ? ubi_read_cluster_map(snapshot_path, uring_dev->cluster_map)
+    int ret = layer_count > 0 || top_layer != NULL
+                  ? bs_dev_uring_load_layers(uring_dev, layers, layer_count, top_layer,
+                                             cluster_size, &size)
                   : 0;
     if (ret != 0) {
-        SPDK_ERRLOG("could not read cluster map\n");
-        free(uring_dev);
+        bs_dev_uring_free(uring_dev);
         return NULL;
     }
 
-    uring_dev->base.blockcnt = statBuffer.st_size / blocklen;
+    if (has_image) {
+        size = statBuffer.st_size;
+    } else if (size == 0) {
+        /* Legacy deltas don't record the size, so it ends with their last cluster. */
+        size = uring_dev->layer_clusters * cluster_size;
+    }
+
+    uring_dev->base.blockcnt = size / blocklen;
     uring_dev->base.blocklen = blocklen;
 
     uring_dev->lba_to_cluster_shift = spdk_u64log2(cluster_size / blocklen);
     uring_dev->lba_to_addr_shift = spdk_u64log2(blocklen);
     uring_dev->lba_offset_mask = (1 << uring_dev->lba_to_cluster_shift) - 1;
 
-    strcpy(uring_dev->filename, filename);
-    strcpy(uring_dev->snapshot_path, snapshot_path);
+    strcpy(uring_dev->filename, has_image ? filename : "");
+
+    ret = has_image ? bs_dev_uring_load_image_map(uring_dev, size, cluster_size) : 0;
+    if (ret != 0) {
+        bs_dev_uring_free(uring_dev);
+        return NULL;
+    }
+
     uring_dev->directio = directio;
     struct spdk_bs_dev *dev = &uring_dev->base;
     dev->create_channel = bs_dev_uring_create_channel;
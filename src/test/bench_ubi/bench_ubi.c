@@ -0,0 +1,258 @@
+#include "spdk/stdinc.h"
+
+#include "spdk/bdev.h"
+#include "spdk/env.h"
+#include "spdk/event.h"
+#include "spdk/string.h"
+#include "spdk/util.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * bench_ubi measures the latency of the first write to a cluster, which for
+ * image backed clusters includes copy-on-write, and compares it with the
+ * latency of a second write to the same cluster. Writes are issued one at a
+ * time, each one sector long, at the start of consecutive clusters.
+ */
+
+#define DEFAULT_BDEV_NAME "ubi0"
+#define DEFAULT_CLUSTERS 32
+#define DEFAULT_CLUSTER_SIZE_KB 1024
+
+#define SECTOR_SIZE 4096
+#define MAX_BDEVS 10
+
+struct {
+    char *bdev_names[MAX_BDEVS];
+    int n_bdevs;
+    uint64_t n_clusters;
+    uint64_t cluster_size;
+} g_opts;
+
+int g_bdevs_tested = 0;
+struct bench_state {
+    const char *bdev_name;
+    struct spdk_bdev_desc *bdev_desc;
+    struct spdk_io_channel *ch;
+    void *buf;
+
+    /* 0 for first touch, 1 for second touch */
+    int phase;
+    uint64_t n_done;
+    uint64_t start_tsc;
+    uint64_t *latencies;
+} g_state;
+
+enum bench_cmdline_opts {
+    BENCH_OPTION_BDEV = 0x1000,
+    BENCH_OPTION_CLUSTERS,
+    BENCH_OPTION_CLUSTER_SIZE_KB,
+};
+
+static struct option g_cmdline_opts[] = {
+    {.name = "bdev", .has_arg = 1, .flag = NULL, .val = BENCH_OPTION_BDEV},
+    {.name = "clusters", .has_arg = 1, .flag = NULL, .val = BENCH_OPTION_CLUSTERS},
+    {.name = "cluster_size_kb",
+     .has_arg = 1,
+     .flag = NULL,
+     .val = BENCH_OPTION_CLUSTER_SIZE_KB},
+    {.name = NULL}};
+
+static void open_bdev(void *arg);
+static void submit_write(void *arg);
+
+#define continue_with_fn(fn)                                                             \
+    {                                                                                    \
+        spdk_thread_send_msg(spdk_get_thread(), fn, NULL);                               \
+        return;                                                                          \
+    }
+
+static void ubi_event_cb(enum spdk_bdev_event_type type, struct spdk_bdev *bdev,
+                         void *event_ctx) {
+    SPDK_NOTICELOG("Unsupported bdev event: type %d\n", type);
+}
+
+static void close_bdev(void) {
+    if (g_state.ch)
+        spdk_put_io_channel(g_state.ch);
+    if (g_state.bdev_desc)
+        spdk_bdev_close(g_state.bdev_desc);
+    spdk_dma_free(g_state.buf);
+    free(g_state.latencies);
+}
+
+static void fail_bench(void *arg) {
+    close_bdev();
+
+    SPDK_ERRLOG("Benchmark failed.\n");
+    spdk_app_stop(-1);
+}
+
+static void finish_bench(void *arg) { spdk_app_stop(0); }
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report_phase(void) {
+    uint64_t n = g_opts.n_clusters, total = 0;
+    uint64_t ticks_hz = spdk_get_ticks_hz();
+
+    qsort(g_state.latencies, n, sizeof(uint64_t), compare_u64);
+    for (uint64_t i = 0; i < n; i++) {
+        total += g_state.latencies[i];
+    }
+
+#define TICKS_TO_USEC(ticks) ((double)(ticks)*SPDK_SEC_TO_USEC / ticks_hz)
+    printf("%-20s %-14s avg %10.1f us  p50 %10.1f us  p99 %10.1f us  max %10.1f us\n",
+           g_state.bdev_name, g_state.phase == 0 ? "first touch" : "second touch",
+           TICKS_TO_USEC(total / n), TICKS_TO_USEC(g_state.latencies[n / 2]),
+           TICKS_TO_USEC(g_state.latencies[n * 99 / 100]),
+           TICKS_TO_USEC(g_state.latencies[n - 1]));
+#undef TICKS_TO_USEC
+}
+
+static void write_completion_cb(struct spdk_bdev_io *bdev_io, bool success, void *arg) {
+    spdk_bdev_free_io(bdev_io);
+    if (!success)
+        continue_with_fn(fail_bench);
+
+    g_state.latencies[g_state.n_done++] = spdk_get_ticks() - g_state.start_tsc;
+    if (g_state.n_done < g_opts.n_clusters)
+        continue_with_fn(submit_write);
+
+    report_phase();
+    if (g_state.phase == 0) {
+        g_state.phase = 1;
+        g_state.n_done = 0;
+        continue_with_fn(submit_write);
+    }
+
+    close_bdev();
+    continue_with_fn(open_bdev);
+}
+
+static void submit_write(void *arg) {
+    uint64_t offset = g_state.n_done * g_opts.cluster_size + g_state.phase * SECTOR_SIZE;
+
+    for (size_t i = 0; i < SECTOR_SIZE; i++) {
+        ((char *)g_state.buf)[i] = rand();
+    }
+
+    g_state.start_tsc = spdk_get_ticks();
+    int rc = spdk_bdev_write(g_state.bdev_desc, g_state.ch, g_state.buf, offset,
+                             SECTOR_SIZE, write_completion_cb, NULL);
+    if (rc) {
+        SPDK_ERRLOG("Could not submit write: %s\n", spdk_strerror(-rc));
+        continue_with_fn(fail_bench);
+    }
+}
+
+static void open_bdev(void *arg) {
+    if (g_bdevs_tested >= g_opts.n_bdevs) {
+        continue_with_fn(finish_bench);
+    }
+
+    memset(&g_state, 0, sizeof(g_state));
+    g_state.bdev_name = g_opts.bdev_names[g_bdevs_tested++];
+
+    int rc = spdk_bdev_open_ext(g_state.bdev_name, true, ubi_event_cb, NULL,
+                                &g_state.bdev_desc);
+    if (rc < 0) {
+        SPDK_ERRLOG("Could not open bdev %s: %s\n", g_state.bdev_name, strerror(-rc));
+        continue_with_fn(fail_bench);
+    }
+
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(g_state.bdev_desc);
+    uint64_t size = spdk_bdev_get_num_blocks(bdev) * spdk_bdev_get_block_size(bdev);
+    if (g_opts.n_clusters * g_opts.cluster_size > size) {
+        SPDK_ERRLOG("bdev %s is too small for %lu clusters\n", g_state.bdev_name,
+                    g_opts.n_clusters);
+        continue_with_fn(fail_bench);
+    }
+
+    g_state.ch = spdk_bdev_get_io_channel(g_state.bdev_desc);
+    g_state.buf = spdk_dma_zmalloc(SECTOR_SIZE, SECTOR_SIZE, NULL);
+    g_state.latencies = calloc(g_opts.n_clusters, sizeof(uint64_t));
+    if (g_state.ch == NULL || g_state.buf == NULL || g_state.latencies == NULL) {
+        SPDK_ERRLOG("Could not allocate benchmark state: %s\n", strerror(ENOMEM));
+        continue_with_fn(fail_bench);
+    }
+
+    continue_with_fn(submit_write);
+}
+
+static void start_bench(void *arg) { continue_with_fn(open_bdev); }
+
+static void usage(void) {
+    printf("  -bdev Block device to be benchmarked.\n");
+    printf("  -clusters Number of clusters to write. Defaults to %d.\n",
+           DEFAULT_CLUSTERS);
+    printf("  -cluster_size_kb Cluster size of the bdev. Defaults to %d.\n",
+           DEFAULT_CLUSTER_SIZE_KB);
+}
+
+static int parse_arg(int argc, char *argv) {
+    long long value;
+
+    switch (argc) {
+    case BENCH_OPTION_BDEV:
+        if (g_opts.n_bdevs >= MAX_BDEVS) {
+            fprintf(stderr, "Too many bdevs.\n");
+            exit(-1);
+        }
+        g_opts.bdev_names[g_opts.n_bdevs++] = strdup(argv);
+        break;
+    case BENCH_OPTION_CLUSTERS:
+        value = spdk_strtoll(argv, 10);
+        if (value <= 0) {
+            return -EINVAL;
+        }
+        g_opts.n_clusters = value;
+        break;
+    case BENCH_OPTION_CLUSTER_SIZE_KB:
+        value = spdk_strtoll(argv, 10);
+        if (value * 1024 < 2 * SECTOR_SIZE) {
+            return -EINVAL;
+        }
+        g_opts.cluster_size = value * 1024;
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int rc;
+    struct spdk_app_opts opts = {};
+    spdk_app_opts_init(&opts, sizeof(opts));
+    opts.name = "bench_ubi";
+    opts.reactor_mask = "0x1";
+
+    g_opts.n_clusters = DEFAULT_CLUSTERS;
+    g_opts.cluster_size = DEFAULT_CLUSTER_SIZE_KB * 1024;
+
+    rc = spdk_app_parse_args(argc, argv, &opts, NULL, g_cmdline_opts, parse_arg, usage);
+    if (rc != SPDK_APP_PARSE_ARGS_SUCCESS) {
+        exit(rc);
+    }
+
+    if (g_opts.n_bdevs == 0) {
+        g_opts.n_bdevs = 1;
+        g_opts.bdev_names[0] = strdup(DEFAULT_BDEV_NAME);
+    }
+
+    rc = spdk_app_start(&opts, start_bench, NULL);
+    if (rc) {
+        SPDK_ERRLOG("Error occured while benchmarking bdev_ubi.\n");
+    }
+
+    for (int i = 0; i < g_opts.n_bdevs; i++)
+        free(g_opts.bdev_names[i]);
+
+    spdk_app_fini();
+
+    return rc;
+}
@@ -1,3 +1,4 @@
+#include "bdev_ubi_internal.h"
 #include "test_ubi.h"
 
 #define DEFAULT_BDEV_NAME "ubi0"
@@ -6,6 +7,7 @@ enum dd_cmdline_opts {
     TEST_OPTION_BDEV = 0x1000,
     TEST_OPTION_IMAGE_PATH = 0x1001,
     TEST_OPTION_FREE_BASE_BDEV = 0x1002,
+    TEST_OPTION_FLATTEN_PATH = 0x1003,
 };
 
 static struct option g_cmdline_opts[] = {{
@@ -26,6 +28,12 @@ static struct option g_cmdline_opts[] = {{
                                              .flag = NULL,
                                              .val = TEST_OPTION_IMAGE_PATH,
                                          },
+                                         {
+                                             .name = "flatten_path",
+                                             .has_arg = 1,
+                                             .flag = NULL,
+                                             .val = TEST_OPTION_FLATTEN_PATH,
+                                         },
                                          {.name = NULL}};
 
 static struct test_opts g_opts;
@@ -91,6 +99,41 @@ void init_thread_delete_bdev_ubi(void *arg) {
     bdev_ubi_delete(req->name, bdev_ubi_delete_done_cb, req);
 }
 
+/*
+ * snapshot_poll waits for the snapshot to complete, which is after
+ * bdev_ubi_snapshot's callback once the copy has started.
+ */
+static int snapshot_poll(void *arg) {
+    struct ubi_snapshot_request *req = arg;
+    struct spdk_bdev *bdev = spdk_bdev_get_by_name(req->opts.name);
+    struct ubi_bdev *ubi_bdev = SPDK_CONTAINEROF(bdev, struct ubi_bdev, bdev);
+
+    if (ubi_bdev->snapshot_status.in_progress) {
+        return SPDK_POLLER_IDLE;
+    }
+
+    req->result = ubi_bdev->snapshot_status.result;
+    spdk_poller_unregister(&req->poller);
+    wake_ut_thread();
+    return SPDK_POLLER_BUSY;
+}
+
+static void bdev_ubi_snapshot_started_cb(void *arg, int status) {
+    struct ubi_snapshot_request *req = arg;
+
+    if (status != 0) {
+        req->result = status;
+        wake_ut_thread();
+        return;
+    }
+    req->poller = SPDK_POLLER_REGISTER(snapshot_poll, req, 1000);
+}
+
+void init_thread_snapshot_bdev_ubi(void *arg) {
+    struct ubi_snapshot_request *req = arg;
+    bdev_ubi_snapshot(&req->opts, bdev_ubi_snapshot_started_cb, req);
+}
+
 static void usage(void) { printf("  -bdev Block device to be used for testing.\n"); }
 
 static int parse_arg(int argc, char *argv) {
@@ -108,6 +151,9 @@ static int parse_arg(int argc, char *argv) {
     case TEST_OPTION_FREE_BASE_BDEV:
         g_opts.free_base_bdev = strdup(argv);
         break;
+    case TEST_OPTION_FLATTEN_PATH:
+        g_opts.flatten_path = strdup(argv);
+        break;
     default:
         return -EINVAL;
     }
@@ -142,6 +188,11 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    if (g_opts.flatten_path == NULL) {
+        printf("Missing flatten_path\n");
+        return -1;
+    }
+
     rc = spdk_app_start(&opts, test_ubi_run, NULL);
     if (rc) {
         SPDK_ERRLOG("Error occured while testing bdev_ubi.\n");
@@ -149,6 +200,7 @@ int main(int argc, char **argv) {
 
     free(g_opts.free_base_bdev);
     free(g_opts.image_path);
+    free(g_opts.flatten_path);
     for (int i = 0; i < g_opts.n_bdevs; i++)
         free(g_opts.bdev_names[i]);
 
@@ -1,4 +1,5 @@
 #include "bdev_ubi.h"
+#include "bdev_ubi_internal.h"
 #include "test_ubi.h"
 
 void exit_io_thread(void *arg) {
@@ -60,6 +61,90 @@ void io_thread_read(void *arg) {
     }
 }
 
+void io_thread_write_sector(void *arg) {
+    struct ubi_io_request *req = arg;
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(req->bdev->desc);
+    uint32_t blocklen = spdk_bdev_get_block_size(bdev);
+
+    // Reset success. This will be set in the completion callback.
+    req->success = false;
+
+    int rc = spdk_bdev_write_blocks(req->bdev->desc, req->bdev->ch, req->buf,
+                                    req->block_idx, MAX_BLOCK_SIZE / blocklen,
+                                    io_completion_cb, req);
+
+    if (rc) {
+        wake_ut_thread();
+    }
+}
+
+void io_thread_read_sector(void *arg) {
+    struct ubi_io_request *req = arg;
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(req->bdev->desc);
+    uint32_t blocklen = spdk_bdev_get_block_size(bdev);
+
+    // Reset success. This will be set in the completion callback.
+    req->success = false;
+
+    int rc = spdk_bdev_read_blocks(req->bdev->desc, req->bdev->ch, req->buf,
+                                   req->block_idx, MAX_BLOCK_SIZE / blocklen,
+                                   io_completion_cb, req);
+
+    if (rc) {
+        wake_ut_thread();
+    }
+}
+
+void io_thread_write_zeroes(void *arg) {
+    struct ubi_io_request *req = arg;
+
+    // Reset success. This will be set in the completion callback.
+    req->success = false;
+
+    int rc = spdk_bdev_write_zeroes_blocks(req->bdev->desc, req->bdev->ch, req->block_idx,
+                                           1, io_completion_cb, req);
+
+    if (rc) {
+        wake_ut_thread();
+    }
+}
+
+static void seek_completion_cb(struct spdk_bdev_io *bdev_io, bool success, void *arg) {
+    struct ubi_io_request *req = arg;
+    req->success = success;
+    req->seek_offset = spdk_bdev_io_get_seek_offset(bdev_io);
+    spdk_bdev_free_io(bdev_io);
+    wake_ut_thread();
+}
+
+void io_thread_seek_data(void *arg) {
+    struct ubi_io_request *req = arg;
+
+    // Reset success. This will be set in the completion callback.
+    req->success = false;
+
+    int rc = spdk_bdev_seek_data(req->bdev->desc, req->bdev->ch, req->block_idx,
+                                 seek_completion_cb, req);
+
+    if (rc) {
+        wake_ut_thread();
+    }
+}
+
+void io_thread_seek_hole(void *arg) {
+    struct ubi_io_request *req = arg;
+
+    // Reset success. This will be set in the completion callback.
+    req->success = false;
+
+    int rc = spdk_bdev_seek_hole(req->bdev->desc, req->bdev->ch, req->block_idx,
+                                 seek_completion_cb, req);
+
+    if (rc) {
+        wake_ut_thread();
+    }
+}
+
 void io_thread_flush(void *arg) {
     struct ubi_io_request *req = arg;
 
@@ -73,3 +158,90 @@ void io_thread_flush(void *arg) {
         wake_ut_thread();
     }
 }
+
+static void delta_committed_cb(void *arg, int rc) {
+    struct ubi_delta_request *req = arg;
+    req->rc = rc;
+    req->dev->destroy(req->dev);
+    wake_ut_thread();
+}
+
+void io_thread_open_delta(void *arg) {
+    struct ubi_delta_request *req = arg;
+
+    req->ch = req->dev->create_channel(req->dev);
+    if (req->ch == NULL) {
+        SPDK_ERRLOG("Could not get delta channel: %s\n", strerror(ENOMEM));
+    }
+    bs_dev_delta_on_commit(req->dev, delta_committed_cb, req);
+
+    wake_ut_thread();
+}
+
+static void delta_write_done_cb(struct spdk_io_channel *channel, void *arg, int bserrno) {
+    struct ubi_delta_request *req = arg;
+    req->rc = bserrno;
+    wake_ut_thread();
+}
+
+void io_thread_write_delta(void *arg) {
+    struct ubi_delta_request *req = arg;
+
+    req->cb_args.cb_fn = delta_write_done_cb;
+    req->cb_args.channel = req->ch;
+    req->cb_args.cb_arg = req;
+    req->dev->write(req->dev, req->ch, req->buf, req->lba, req->lba_count,
+                    &req->cb_args);
+}
+
+/*
+ * io_thread_commit_delta releases the channel of the delta, which commits it
+ * and destroys the device once the commit completes.
+ */
+void io_thread_commit_delta(void *arg) {
+    struct ubi_delta_request *req = arg;
+    req->dev->destroy_channel(req->dev, req->ch);
+}
+
+void io_thread_open_esnap(void *arg) {
+    struct ubi_esnap_request *req = arg;
+
+    req->ch = req->dev->create_channel(req->dev);
+    if (req->ch == NULL) {
+        SPDK_ERRLOG("Could not get esnap channel: %s\n", strerror(ENOMEM));
+    }
+
+    wake_ut_thread();
+}
+
+static void esnap_read_done_cb(struct spdk_io_channel *channel, void *arg, int bserrno) {
+    struct ubi_esnap_request *req = arg;
+    req->rc = bserrno;
+    wake_ut_thread();
+}
+
+void io_thread_read_esnap(void *arg) {
+    struct ubi_esnap_request *req = arg;
+
+    req->cb_args.cb_fn = esnap_read_done_cb;
+    req->cb_args.channel = req->ch;
+    req->cb_args.cb_arg = req;
+    if (req->iovcnt == 0) {
+        req->dev->read(req->dev, req->ch, req->iovs[0].iov_base, req->lba,
+                       req->lba_count, &req->cb_args);
+    } else {
+        req->dev->readv(req->dev, req->ch, req->iovs, req->iovcnt, req->lba,
+                        req->lba_count, &req->cb_args);
+    }
+}
+
+void io_thread_close_esnap(void *arg) {
+    struct ubi_esnap_request *req = arg;
+
+    if (req->ch != NULL) {
+        req->dev->destroy_channel(req->dev, req->ch);
+    }
+    req->dev->destroy(req->dev);
+
+    wake_ut_thread();
+}
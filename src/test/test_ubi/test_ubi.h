@@ -25,6 +25,7 @@ struct test_bdev {
 struct test_opts {
     char *free_base_bdev;
     char *image_path;
+    char *flatten_path;
     char *bdev_names[MAX_BDEVS];
     int n_bdevs;
 
@@ -44,9 +45,18 @@ struct ubi_delete_request {
     bool success;
 };
 
+struct ubi_snapshot_request {
+    struct spdk_ubi_snapshot_opts opts;
+    struct spdk_poller *poller;
+
+    /* result of the snapshot, once it's complete */
+    int result;
+};
+
 extern void stop_init_thread(void *arg);
 extern void init_thread_create_bdev_ubi(void *arg);
 extern void init_thread_delete_bdev_ubi(void *arg);
+extern void init_thread_snapshot_bdev_ubi(void *arg);
 
 /*
  * io_thread.c
@@ -56,6 +66,9 @@ struct ubi_io_request {
     uint64_t block_idx;
     struct test_bdev *bdev;
 
+    /* result of seek requests */
+    uint64_t seek_offset;
+
     bool success;
 };
 
@@ -65,6 +78,49 @@ extern void exit_io_thread(void *arg);
 extern void io_thread_write(void *arg);
 extern void io_thread_read(void *arg);
 extern void io_thread_flush(void *arg);
+extern void io_thread_write_zeroes(void *arg);
+extern void io_thread_write_sector(void *arg);
+extern void io_thread_read_sector(void *arg);
+extern void io_thread_seek_data(void *arg);
+extern void io_thread_seek_hole(void *arg);
+
+/* Writes to a writing delta device, see bs_dev_delta_create. */
+struct ubi_delta_request {
+    struct spdk_bs_dev *dev;
+    struct spdk_io_channel *ch;
+    struct spdk_bs_dev_cb_args cb_args;
+    void *buf;
+    uint64_t lba;
+    uint32_t lba_count;
+
+    /* status of the last write, or of the commit */
+    int rc;
+};
+
+extern void io_thread_open_delta(void *arg);
+extern void io_thread_write_delta(void *arg);
+extern void io_thread_commit_delta(void *arg);
+
+/* Reads of an esnap device, see bs_dev_uring_create. */
+#define MAX_ESNAP_IOVS 4
+
+struct ubi_esnap_request {
+    struct spdk_bs_dev *dev;
+    struct spdk_io_channel *ch;
+    struct spdk_bs_dev_cb_args cb_args;
+    /* read with readv, or with read into iovs[0] if iovcnt is 0 */
+    struct iovec iovs[MAX_ESNAP_IOVS];
+    int iovcnt;
+    uint64_t lba;
+    uint32_t lba_count;
+
+    /* status of the last read */
+    int rc;
+};
+
+extern void io_thread_open_esnap(void *arg);
+extern void io_thread_read_esnap(void *arg);
+extern void io_thread_close_esnap(void *arg);
 
 /*
  * ut_thread.c
@@ -81,4 +137,12 @@ extern void test_bdev_io(const char *bdev_name, const char *image_path, int *n_t
                          int *n_failures);
 extern void test_bdev_recreate(const char *base_bdev, const char *image_path,
                                int *n_tests, int *n_failures);
+extern void test_delta(const char *base_bdev, const char *image_path,
+                       const char *flatten_path, int *n_tests, int *n_failures);
+extern void test_snapshot_flatten(const char *bdev_name, const char *image_path,
+                                  const char *flatten_path, int *n_tests,
+                                  int *n_failures);
+extern void test_snapshot_bdev_target(const char *bdev_name, const char *base_bdev,
+                                      const char *image_path, int *n_tests,
+                                      int *n_failures);
 #endif
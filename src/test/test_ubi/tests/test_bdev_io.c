@@ -14,9 +14,16 @@ static bool open_bdev(const char *bdev_name, struct bdev_io_test_state *state);
 static bool open_base_image(const char *image_path, struct bdev_io_test_state *state);
 static bool test_read(struct bdev_io_test_state *state, uint32_t start, uint32_t count);
 static bool test_write(struct bdev_io_test_state *state, uint32_t start, uint32_t count);
+static bool test_write_zeroes(struct bdev_io_test_state *state, uint32_t start,
+                              uint32_t count);
+static bool test_seek(struct bdev_io_test_state *state);
+static bool test_first_touch(struct bdev_io_test_state *state, uint64_t offset);
+static bool test_zero_sector(struct bdev_io_test_state *state, uint64_t offset);
 static bool test_random_ops(struct bdev_io_test_state *state, uint32_t count);
 static bool verify_image_block(struct bdev_io_test_state *state, uint64_t block,
                                char *buf);
+static bool verify_image_range(struct bdev_io_test_state *state, uint64_t start,
+                               uint64_t count);
 static bool file_size(FILE *f, uint64_t *out);
 
 void test_bdev_io(const char *bdev_name, const char *image_path, int *n_tests,
@@ -57,6 +64,18 @@ void test_bdev_io(const char *bdev_name, const char *image_path, int *n_tests,
     RUN_TEST(test_write(&state, 20, 100));
     // write 100 blocks to the non-image addresses
     RUN_TEST(test_write(&state, state.n_image_blocks + 2, 100));
+    // write zeroes to 100 blocks of the image addresses
+    RUN_TEST(test_write_zeroes(&state, 200, 100));
+    // write zeroes to 100 blocks of the non-image addresses
+    RUN_TEST(test_write_zeroes(&state, state.n_image_blocks + 200, 100));
+    // seek data and holes
+    RUN_TEST(test_seek(&state));
+    // first sector-sized write to untouched clusters of the image
+    RUN_TEST(test_first_touch(&state, 5 * 1024 * 1024));
+    RUN_TEST(test_first_touch(&state, 6 * 1024 * 1024 + 3 * MAX_BLOCK_SIZE));
+    // zero-filled sector writes, which may be elided outside the image
+    RUN_TEST(test_zero_sector(&state, 8 * 1024 * 1024));
+    RUN_TEST(test_zero_sector(&state, state.image_size + 2 * 1024 * 1024));
     // Some random io
     RUN_TEST(test_random_ops(&state, 50));
 
@@ -157,6 +176,165 @@ static bool test_write(struct bdev_io_test_state *state, uint32_t start, uint32_
     return true;
 }
 
+static bool test_write_zeroes(struct bdev_io_test_state *state, uint32_t start,
+                              uint32_t count) {
+    struct ubi_io_request read_req, zeroes_req;
+    char zeroes[MAX_BLOCK_SIZE];
+
+    memset(zeroes, 0, sizeof(zeroes));
+    read_req.bdev = &state->bdev;
+    zeroes_req.bdev = &state->bdev;
+    for (size_t i = 0; i < count; i++) {
+        zeroes_req.block_idx = start + i;
+        read_req.block_idx = start + i;
+
+        execute_spdk_function(io_thread_write_zeroes, &zeroes_req);
+        if (!zeroes_req.success) {
+            SPDK_ERRLOG("Write zeroes failed.\n");
+            return false;
+        }
+
+        execute_spdk_function(io_thread_read, &read_req);
+        if (!read_req.success) {
+            SPDK_ERRLOG("Read failed.\n");
+            return false;
+        }
+
+        if (memcmp(zeroes, read_req.buf, state->blocklen)) {
+            SPDK_ERRLOG("Block %lu isn't zero after write zeroes.\n", read_req.block_idx);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool test_seek(struct bdev_io_test_state *state) {
+    struct ubi_io_request req;
+
+    req.bdev = &state->bdev;
+
+    // The test image is random data, so the bdev starts with data.
+    req.block_idx = 0;
+    execute_spdk_function(io_thread_seek_data, &req);
+    if (!req.success || req.seek_offset != 0) {
+        SPDK_ERRLOG("seek_data(0) returned %lu.\n", req.seek_offset);
+        return false;
+    }
+
+    // The first hole can't be before the end of the image.
+    execute_spdk_function(io_thread_seek_hole, &req);
+    if (!req.success || req.seek_offset < state->n_image_blocks) {
+        SPDK_ERRLOG("seek_hole(0) returned %lu.\n", req.seek_offset);
+        return false;
+    }
+
+    // Blocks written past the image are data.
+    req.block_idx = state->n_image_blocks + 2;
+    execute_spdk_function(io_thread_seek_data, &req);
+    if (!req.success || req.seek_offset > state->n_image_blocks + 102) {
+        SPDK_ERRLOG("seek_data(%lu) returned %lu.\n", req.block_idx, req.seek_offset);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * test_first_touch writes a whole sector at the given byte offset, which must
+ * be in a part of the image that hasn't been written before, and verifies both
+ * the written sector and its neighbours, which must still read image data.
+ */
+static bool test_first_touch(struct bdev_io_test_state *state, uint64_t offset) {
+    struct ubi_io_request write_req, read_req;
+    uint64_t sector_blocks = MAX_BLOCK_SIZE / state->blocklen;
+
+    write_req.bdev = &state->bdev;
+    read_req.bdev = &state->bdev;
+    write_req.block_idx = offset / state->blocklen;
+    for (size_t j = 0; j < MAX_BLOCK_SIZE; j++) {
+        write_req.buf[j] = rand() % 128;
+    }
+
+    execute_spdk_function(io_thread_write_sector, &write_req);
+    if (!write_req.success) {
+        SPDK_ERRLOG("Sector write failed.\n");
+        return false;
+    }
+
+    read_req.block_idx = write_req.block_idx;
+    execute_spdk_function(io_thread_read_sector, &read_req);
+    if (!read_req.success || memcmp(write_req.buf, read_req.buf, MAX_BLOCK_SIZE)) {
+        SPDK_ERRLOG("Read data didn't match written sector.\n");
+        return false;
+    }
+
+    // The sectors around the written one still come from the image.
+    uint64_t block = write_req.block_idx;
+    return verify_image_range(state, block - sector_blocks, sector_blocks) &&
+           verify_image_range(state, block + sector_blocks, sector_blocks);
+}
+
+/*
+ * test_zero_sector writes a zero-filled sector at the given byte offset and
+ * verifies that it reads back as zeroes.
+ */
+static bool test_zero_sector(struct bdev_io_test_state *state, uint64_t offset) {
+    struct ubi_io_request req;
+
+    req.bdev = &state->bdev;
+    req.block_idx = offset / state->blocklen;
+    memset(req.buf, 0, MAX_BLOCK_SIZE);
+
+    execute_spdk_function(io_thread_write_sector, &req);
+    if (!req.success) {
+        SPDK_ERRLOG("Zero sector write failed.\n");
+        return false;
+    }
+
+    memset(req.buf, 0xff, MAX_BLOCK_SIZE);
+    execute_spdk_function(io_thread_read_sector, &req);
+    if (!req.success) {
+        SPDK_ERRLOG("Read failed.\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < MAX_BLOCK_SIZE; i++) {
+        if (req.buf[i] != 0) {
+            SPDK_ERRLOG("Byte %lu of sector at %lu isn't zero.\n", i, offset);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * verify_image_range reads the given blocks one by one and compares them with
+ * the image.
+ */
+static bool verify_image_range(struct bdev_io_test_state *state, uint64_t start,
+                               uint64_t count) {
+    struct ubi_io_request req;
+
+    req.bdev = &state->bdev;
+    for (uint64_t block = start; block < start + count; block++) {
+        req.block_idx = block;
+        execute_spdk_function(io_thread_read, &req);
+        if (!req.success) {
+            SPDK_ERRLOG("Read failed.\n");
+            return false;
+        }
+
+        if (!verify_image_block(state, block, req.buf)) {
+            SPDK_ERRLOG("Block %lu doesn't match the image.\n", block);
+            return false;
+        }
+    }
+
+    return true;
+}
+
 static bool test_random_ops(struct bdev_io_test_state *state, uint32_t count) {
     struct ubi_io_request req;
     req.bdev = &state->bdev;
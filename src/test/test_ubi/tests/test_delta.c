@@ -0,0 +1,719 @@
+#include "bdev_ubi_internal.h"
+#include "spdk/crc32.h"
+#include "test_ubi.h"
+
+#define TEST_DELTA_BLOCKLEN 512
+#define TEST_DELTA_CLUSTER_SIZE (64 * 1024)
+#define TEST_DELTA_CLUSTERS 8
+
+/* Layers of a bdev have the cluster size of its blobstore, SPDK's default. */
+#define TEST_LAYER_CLUSTER_SIZE (1024 * 1024)
+#define TEST_LAYER_BDEV "test_delta_layers"
+
+/* Fill of clusters which aren't written to a delta. A fill of 0 is a zero cluster. */
+#define NOT_WRITTEN (-1)
+
+static uint8_t cluster_byte(int fill, uint64_t i);
+
+static bool write_delta(const char *path, const char *parent, uint64_t cluster_size,
+                        const int *fills, enum ubi_delta_compression compression);
+static bool read_delta_chain(const char *path, struct ubi_delta_extent **extents,
+                             uint64_t *count, char (*paths)[UBI_PATH_LEN], int *depth);
+static bool check_cluster(char (*paths)[UBI_PATH_LEN],
+                          const struct ubi_delta_extent *extents, uint64_t count,
+                          uint64_t cluster, int fill, uint64_t index);
+static bool flip_byte(const char *path, uint64_t offset);
+static bool open_esnap(struct ubi_esnap_request *req, const char *path);
+static int read_esnap(struct ubi_esnap_request *req, void *buf, uint64_t offset,
+                      uint64_t len);
+static bool check_esnap_read(struct ubi_esnap_request *req, const int *fills,
+                             uint64_t offset, const uint32_t *iov_lens, int iovcnt);
+static bool flatten_fails(const char *flatten_path, const char *dir, const char *path);
+static bool check_layer_reads(struct test_bdev *bdev, const char *image_path,
+                              const int *fills);
+static bool test_delta_round_trip(const char *dir);
+static bool test_delta_corruption(const char *dir);
+static bool test_delta_chain(const char *dir);
+static bool test_delta_compressed_round_trip(const char *dir);
+static bool test_delta_data_corruption(const char *dir, const char *flatten_path);
+static bool test_delta_layers(const char *dir, const char *base_bdev,
+                              const char *image_path);
+
+void test_delta(const char *base_bdev, const char *image_path, const char *flatten_path,
+                int *n_tests, int *n_failures) {
+    char dir[] = "/tmp/test_ubi_delta.XXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        SPDK_ERRLOG("Could not create %s: %s\n", dir, strerror(errno));
+        (*n_failures)++;
+        return;
+    }
+
+#define RUN_TEST(x)                                                                      \
+    {                                                                                    \
+        (*n_tests)++;                                                                    \
+        if (!(x)) {                                                                      \
+            (*n_failures)++;                                                             \
+            SPDK_ERRLOG("Test failed: %s\n", #x);                                        \
+        }                                                                                \
+    }
+
+    // clusters written to a delta are read back with their CRCs
+    RUN_TEST(test_delta_round_trip(dir));
+    // deltas whose header or extent table is corrupt are refused
+    RUN_TEST(test_delta_corruption(dir));
+    // a chain reads each cluster from the newest delta which has it
+    RUN_TEST(test_delta_chain(dir));
+    // compressed clusters read back through an esnap device, in part too
+    RUN_TEST(test_delta_compressed_round_trip(dir));
+    // clusters whose data doesn't match their CRC fail to read or flatten
+    RUN_TEST(test_delta_data_corruption(dir, flatten_path));
+    // a bdev on an image and two layers reads each cluster from the topmost
+    RUN_TEST(test_delta_layers(dir, base_bdev, image_path));
+
+    char cmd[64 + sizeof(dir)];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) {
+        SPDK_WARNLOG("Could not remove %s\n", dir);
+    }
+}
+
+/*
+ * cluster_byte is the byte at i of a cluster written with fill, which changes
+ * every block so that reads of part of a cluster are told apart. Clusters
+ * which are zero or aren't written read as zeroes.
+ */
+static uint8_t cluster_byte(int fill, uint64_t i) {
+    return fill <= 0 ? 0 : (uint8_t)(fill + i / TEST_DELTA_BLOCKLEN);
+}
+
+/*
+ * write_delta writes a delta of TEST_DELTA_CLUSTERS clusters of cluster_size
+ * to path through a writing delta device, cluster i filled by cluster_byte
+ * with fills[i].
+ */
+static bool write_delta(const char *path, const char *parent, uint64_t cluster_size,
+                        const int *fills, enum ubi_delta_compression compression) {
+    struct ubi_delta_request req;
+    memset(&req, 0, sizeof(req));
+
+    uint32_t cluster_blocks = cluster_size / TEST_DELTA_BLOCKLEN;
+    req.dev = bs_dev_delta_create(path, parent, TEST_DELTA_CLUSTERS * cluster_blocks,
+                                  TEST_DELTA_BLOCKLEN, cluster_size, BS_DEV_DELTA_WRITE,
+                                  compression);
+    if (req.dev == NULL) {
+        SPDK_ERRLOG("Could not create delta %s\n", path);
+        return false;
+    }
+
+    req.buf = spdk_dma_malloc(cluster_size, UBI_DELTA_ALIGN, NULL);
+    execute_spdk_function(io_thread_open_delta, &req);
+    bool success = req.buf != NULL && req.ch != NULL;
+
+    for (uint64_t i = 0; i < TEST_DELTA_CLUSTERS && success; i++) {
+        if (fills[i] == NOT_WRITTEN) {
+            continue;
+        }
+
+        for (uint64_t j = 0; j < cluster_size; j++) {
+            ((uint8_t *)req.buf)[j] = cluster_byte(fills[i], j);
+        }
+        req.lba = i * cluster_blocks;
+        req.lba_count = cluster_blocks;
+        execute_spdk_function(io_thread_write_delta, &req);
+        if (req.rc != 0) {
+            SPDK_ERRLOG("Could not write cluster %lu of %s: %s\n", i, path,
+                        strerror(-req.rc));
+            success = false;
+        }
+    }
+
+    /* The device is destroyed once it's committed, even if a write failed. */
+    if (req.ch != NULL) {
+        execute_spdk_function(io_thread_commit_delta, &req);
+        if (req.rc != 0) {
+            SPDK_ERRLOG("Could not commit %s: %s\n", path, strerror(-req.rc));
+            success = false;
+        }
+    }
+    spdk_dma_free(req.buf);
+    return success;
+}
+
+static bool read_delta_chain(const char *path, struct ubi_delta_extent **extents,
+                             uint64_t *count, char (*paths)[UBI_PATH_LEN], int *depth) {
+    uint64_t size;
+    uint32_t unchecked;
+
+    int rc = ubi_read_delta_layers(&path, 1, TEST_DELTA_CLUSTER_SIZE, extents, count,
+                                   paths, depth, &size, &unchecked);
+    if (rc != 0) {
+        SPDK_ERRLOG("Could not read %s: %s\n", path, strerror(-rc));
+        return false;
+    } else if (size != (uint64_t)TEST_DELTA_CLUSTERS * TEST_DELTA_CLUSTER_SIZE ||
+               unchecked != 0) {
+        SPDK_ERRLOG("%s records size %lu, unchecked deltas %#x\n", path, size,
+                    unchecked);
+        free(*extents);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * check_cluster checks that a raw cluster of merged extents is filled with
+ * fill, and comes from the delta at index in the chain.
+ */
+static bool check_cluster(char (*paths)[UBI_PATH_LEN],
+                          const struct ubi_delta_extent *extents, uint64_t count,
+                          uint64_t cluster, int fill, uint64_t index) {
+    const struct ubi_delta_extent *extent = ubi_delta_find(extents, count, cluster);
+
+    if (fill == NOT_WRITTEN || extent == NULL) {
+        if ((fill == NOT_WRITTEN) != (extent == NULL)) {
+            SPDK_ERRLOG("Cluster %lu is %s the delta\n", cluster,
+                        extent == NULL ? "missing from" : "unexpectedly in");
+            return false;
+        }
+        return true;
+    } else if (fill == 0) {
+        if (extent->offset != UBI_DELTA_ZERO_CLUSTER) {
+            SPDK_ERRLOG("Cluster %lu isn't a zero cluster\n", cluster);
+            return false;
+        }
+        return true;
+    } else if (extent->offset >> UBI_DELTA_INDEX_SHIFT != index) {
+        SPDK_ERRLOG("Cluster %lu comes from delta %lu, expected %lu\n", cluster,
+                    extent->offset >> UBI_DELTA_INDEX_SHIFT, index);
+        return false;
+    }
+
+    uint8_t *buf = malloc(TEST_DELTA_CLUSTER_SIZE);
+    int fd = open(paths[index], O_RDONLY);
+    uint64_t offset = extent->offset & UBI_DELTA_OFFSET_MASK;
+    bool success = buf != NULL && fd >= 0 &&
+                   pread(fd, buf, TEST_DELTA_CLUSTER_SIZE, offset) ==
+                       TEST_DELTA_CLUSTER_SIZE;
+    if (!success) {
+        SPDK_ERRLOG("Could not read cluster %lu of %s\n", cluster, paths[index]);
+    }
+
+    for (size_t i = 0; i < TEST_DELTA_CLUSTER_SIZE && success; i++) {
+        if (buf[i] != cluster_byte(fill, i)) {
+            SPDK_ERRLOG("Cluster %lu has %#x at %zu, expected %#x\n", cluster, buf[i], i,
+                        cluster_byte(fill, i));
+            success = false;
+        }
+    }
+
+    uint32_t crc = success ? ~spdk_crc32c_update(buf, TEST_DELTA_CLUSTER_SIZE, ~0u) : 0;
+    if (success && crc != extent->crc) {
+        SPDK_ERRLOG("CRC of cluster %lu doesn't match its extent\n", cluster);
+        success = false;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(buf);
+    return success;
+}
+
+static bool flip_byte(const char *path, uint64_t offset) {
+    uint8_t byte;
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        SPDK_ERRLOG("Could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    bool success = pread(fd, &byte, 1, offset) == 1;
+    byte ^= 0xff;
+    success = success && pwrite(fd, &byte, 1, offset) == 1;
+    close(fd);
+    return success;
+}
+
+/*
+ * open_esnap opens the delta at path as the only layer of an esnap device,
+ * which reads it the way a bdev created on it does.
+ */
+static bool open_esnap(struct ubi_esnap_request *req, const char *path) {
+    const char *layers[] = {path};
+
+    memset(req, 0, sizeof(*req));
+    req->dev = bs_dev_uring_create(NULL, layers, 1, NULL, TEST_DELTA_BLOCKLEN,
+                                   TEST_DELTA_CLUSTER_SIZE, false);
+    if (req->dev == NULL) {
+        SPDK_ERRLOG("Could not create esnap device on %s\n", path);
+        return false;
+    }
+
+    execute_spdk_function(io_thread_open_esnap, req);
+    if (req->ch == NULL) {
+        execute_spdk_function(io_thread_close_esnap, req);
+        return false;
+    }
+    return true;
+}
+
+static int read_esnap(struct ubi_esnap_request *req, void *buf, uint64_t offset,
+                      uint64_t len) {
+    req->iovs[0].iov_base = buf;
+    req->iovs[0].iov_len = len;
+    req->iovcnt = 0;
+    req->lba = offset / TEST_DELTA_BLOCKLEN;
+    req->lba_count = len / TEST_DELTA_BLOCKLEN;
+    execute_spdk_function(io_thread_read_esnap, req);
+    return req->rc;
+}
+
+/*
+ * check_esnap_read reads from offset of the esnap device into iovcnt buffers
+ * of iov_lens bytes with readv, or into one with read if iovcnt is 0, and
+ * checks what it reads against the fills of the clusters.
+ */
+static bool check_esnap_read(struct ubi_esnap_request *req, const int *fills,
+                             uint64_t offset, const uint32_t *iov_lens, int iovcnt) {
+    uint64_t len = 0;
+
+    for (int i = 0; i < spdk_max(iovcnt, 1); i++) {
+        req->iovs[i].iov_len = iov_lens[i];
+        req->iovs[i].iov_base = spdk_dma_malloc(iov_lens[i], UBI_DELTA_ALIGN, NULL);
+        len += iov_lens[i];
+    }
+    req->iovcnt = iovcnt;
+    req->lba = offset / TEST_DELTA_BLOCKLEN;
+    req->lba_count = len / TEST_DELTA_BLOCKLEN;
+
+    bool success = true;
+    for (int i = 0; i < spdk_max(iovcnt, 1); i++) {
+        success = success && req->iovs[i].iov_base != NULL;
+    }
+    if (success) {
+        execute_spdk_function(io_thread_read_esnap, req);
+        success = req->rc == 0;
+    }
+    if (!success) {
+        SPDK_ERRLOG("Could not read %lu bytes at %lu: %d\n", len, offset, req->rc);
+    }
+
+    for (int i = 0; i < spdk_max(iovcnt, 1); i++) {
+        const uint8_t *buf = req->iovs[i].iov_base;
+        for (uint64_t j = 0; j < iov_lens[i] && success; j++, offset++) {
+            uint64_t cluster = offset / TEST_DELTA_CLUSTER_SIZE;
+            uint8_t expected =
+                cluster_byte(fills[cluster], offset % TEST_DELTA_CLUSTER_SIZE);
+            if (buf[j] != expected) {
+                SPDK_ERRLOG("Read %#x at %lu, expected %#x\n", buf[j], offset, expected);
+                success = false;
+            }
+        }
+        spdk_dma_free(req->iovs[i].iov_base);
+    }
+    return success;
+}
+
+/* flatten_fails checks that ubi_flatten refuses to flatten the delta at path. */
+static bool flatten_fails(const char *flatten_path, const char *dir, const char *path) {
+    char cmd[3 * UBI_PATH_LEN];
+
+    snprintf(cmd, sizeof(cmd),
+             "%s --layer %s --output %s/flat.raw --cluster_size_kb %d --buffered "
+             "> /dev/null 2>&1",
+             flatten_path, path, dir, TEST_DELTA_CLUSTER_SIZE / 1024);
+    int status = system(cmd);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) == 0) {
+        SPDK_ERRLOG("%s flattened %s with status %d\n", flatten_path, path, status);
+        return false;
+    }
+    return true;
+}
+
+static bool test_delta_round_trip(const char *dir) {
+    const int fills[TEST_DELTA_CLUSTERS] = {
+        NOT_WRITTEN, 0xa1, NOT_WRITTEN, 0, NOT_WRITTEN, 0xa5, NOT_WRITTEN, 0xa7,
+    };
+    char paths[UBI_DELTA_MAX_CHAIN][UBI_PATH_LEN];
+    struct ubi_delta_extent *extents;
+    char path[UBI_PATH_LEN];
+    uint64_t count;
+    int depth;
+
+    snprintf(path, sizeof(path), "%s/round_trip.delta", dir);
+    if (!write_delta(path, NULL, TEST_DELTA_CLUSTER_SIZE, fills,
+                     UBI_DELTA_COMPRESSION_NONE) ||
+        !read_delta_chain(path, &extents, &count, paths, &depth)) {
+        return false;
+    }
+
+    bool success = depth == 1 && count == 4;
+    for (uint64_t i = 0; i < TEST_DELTA_CLUSTERS && success; i++) {
+        success = check_cluster(paths, extents, count, i, fills[i], 0);
+    }
+
+    free(extents);
+    return success;
+}
+
+static bool test_delta_corruption(const char *dir) {
+    const int fills[TEST_DELTA_CLUSTERS] = {
+        0xc0, 0xc1, NOT_WRITTEN, NOT_WRITTEN, NOT_WRITTEN, NOT_WRITTEN, 0, 0xc7,
+    };
+    char paths[UBI_DELTA_MAX_CHAIN][UBI_PATH_LEN];
+    const char *files[1];
+    struct ubi_delta_extent *extents;
+    struct ubi_delta_header header;
+    char path[UBI_PATH_LEN];
+    uint64_t count, size;
+    uint32_t unchecked;
+    int depth;
+
+    snprintf(path, sizeof(path), "%s/corrupt.delta", dir);
+    if (!write_delta(path, NULL, TEST_DELTA_CLUSTER_SIZE, fills,
+                     UBI_DELTA_COMPRESSION_NONE)) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || pread(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        SPDK_ERRLOG("Could not read header of %s\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    close(fd);
+
+    files[0] = path;
+    uint64_t offsets[] = {offsetof(struct ubi_delta_header, cluster_size),
+                          header.table_offset + sizeof(struct ubi_delta_extent)};
+    for (size_t i = 0; i < SPDK_COUNTOF(offsets); i++) {
+        if (!flip_byte(path, offsets[i])) {
+            return false;
+        }
+
+        int rc = ubi_read_delta_layers(files, 1, TEST_DELTA_CLUSTER_SIZE, &extents,
+                                       &count, paths, &depth, &size, &unchecked);
+        if (rc != -EILSEQ) {
+            SPDK_ERRLOG("Corrupt byte at %lu of %s read with %d\n", offsets[i], path, rc);
+            return false;
+        }
+
+        /* Once the byte is restored, the delta is read again. */
+        if (!flip_byte(path, offsets[i]) ||
+            !read_delta_chain(path, &extents, &count, paths, &depth)) {
+            return false;
+        }
+        free(extents);
+    }
+    return true;
+}
+
+static bool test_delta_chain(const char *dir) {
+    const int older_fills[TEST_DELTA_CLUSTERS] = {
+        0x10, 0x11, 0x12, 0, 0, NOT_WRITTEN, NOT_WRITTEN, NOT_WRITTEN,
+    };
+    const int newer_fills[TEST_DELTA_CLUSTERS] = {
+        NOT_WRITTEN, 0x21, 0, 0x23, NOT_WRITTEN, 0x25, NOT_WRITTEN, NOT_WRITTEN,
+    };
+    /* the newer delta overrides the older one, zero clusters included */
+    const int fills[TEST_DELTA_CLUSTERS] = {
+        0x10, 0x21, 0, 0x23, 0, 0x25, NOT_WRITTEN, NOT_WRITTEN,
+    };
+    const uint64_t indexes[TEST_DELTA_CLUSTERS] = {1, 0, 0, 0, 1, 0, 0, 0};
+    char paths[UBI_DELTA_MAX_CHAIN][UBI_PATH_LEN];
+    struct ubi_delta_extent *extents;
+    char older[UBI_PATH_LEN], newer[UBI_PATH_LEN];
+    uint64_t count;
+    int depth;
+
+    snprintf(older, sizeof(older), "%s/older.delta", dir);
+    snprintf(newer, sizeof(newer), "%s/newer.delta", dir);
+    if (!write_delta(older, NULL, TEST_DELTA_CLUSTER_SIZE, older_fills,
+                     UBI_DELTA_COMPRESSION_NONE) ||
+        !write_delta(newer, older, TEST_DELTA_CLUSTER_SIZE, newer_fills,
+                     UBI_DELTA_COMPRESSION_NONE) ||
+        !read_delta_chain(newer, &extents, &count, paths, &depth)) {
+        return false;
+    }
+
+    bool success = depth == 2 && count == 6 && strcmp(paths[1], older) == 0;
+    for (uint64_t i = 0; i < TEST_DELTA_CLUSTERS && success; i++) {
+        success = check_cluster(paths, extents, count, i, fills[i], indexes[i]);
+    }
+
+    free(extents);
+    return success;
+}
+
+/*
+ * test_delta_compressed_round_trip writes a deflated delta and reads it back
+ * through an esnap device, whole clusters as well as ranges which start inside
+ * a cluster, with read and with readv into several buffers.
+ */
+static bool test_delta_compressed_round_trip(const char *dir) {
+    const int fills[TEST_DELTA_CLUSTERS] = {
+        0xe0, NOT_WRITTEN, 0xe2, 0, NOT_WRITTEN, 0xe5, 0xe6, NOT_WRITTEN,
+    };
+    const uint32_t cluster_len[] = {TEST_DELTA_CLUSTER_SIZE};
+    const uint32_t range_len[] = {10 * TEST_DELTA_BLOCKLEN};
+    const uint32_t iov_lens[] = {TEST_DELTA_BLOCKLEN, 3 * TEST_DELTA_BLOCKLEN,
+                                 2 * TEST_DELTA_BLOCKLEN};
+    char paths[UBI_DELTA_MAX_CHAIN][UBI_PATH_LEN];
+    struct ubi_delta_extent *extents;
+    struct ubi_esnap_request req;
+    char path[UBI_PATH_LEN];
+    uint64_t count;
+    int depth;
+
+    snprintf(path, sizeof(path), "%s/compressed.delta", dir);
+    if (!write_delta(path, NULL, TEST_DELTA_CLUSTER_SIZE, fills,
+                     UBI_DELTA_COMPRESSION_DEFLATE) ||
+        !read_delta_chain(path, &extents, &count, paths, &depth)) {
+        return false;
+    }
+
+    /* every cluster with data compresses, as it repeats each block's byte */
+    bool success = depth == 1 && count == 5;
+    for (uint64_t i = 0; i < TEST_DELTA_CLUSTERS && success; i++) {
+        const struct ubi_delta_extent *extent = ubi_delta_find(extents, count, i);
+        if (fills[i] > 0 && (extent == NULL || extent->length == 0)) {
+            SPDK_ERRLOG("Cluster %lu of %s isn't compressed\n", i, path);
+            success = false;
+        }
+    }
+    free(extents);
+    if (!success || !open_esnap(&req, path)) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < TEST_DELTA_CLUSTERS && success; i++) {
+        success = check_esnap_read(&req, fills, i * TEST_DELTA_CLUSTER_SIZE, cluster_len,
+                                   0);
+    }
+    // a range inside a cluster, and one which ends at the end of a cluster
+    success = success && check_esnap_read(&req, fills,
+                                          2 * TEST_DELTA_CLUSTER_SIZE +
+                                              33 * TEST_DELTA_BLOCKLEN,
+                                          range_len, 0);
+    success = success && check_esnap_read(&req, fills,
+                                          6 * TEST_DELTA_CLUSTER_SIZE - range_len[0],
+                                          range_len, 0);
+    // readv of a range inside a cluster into buffers of different lengths
+    success = success && check_esnap_read(&req, fills,
+                                          5 * TEST_DELTA_CLUSTER_SIZE +
+                                              7 * TEST_DELTA_BLOCKLEN,
+                                          iov_lens, SPDK_COUNTOF(iov_lens));
+
+    execute_spdk_function(io_thread_close_esnap, &req);
+    return success;
+}
+
+/*
+ * test_delta_data_corruption flips a byte of a cluster's data, which the
+ * extent table's checksum doesn't cover. The esnap device reads compressed
+ * clusters whole and fails the read, and ubi_flatten fails to flatten a raw
+ * one through its buffers.
+ */
+static bool test_delta_data_corruption(const char *dir, const char *flatten_path) {
+    const int fills[TEST_DELTA_CLUSTERS] = {
+        NOT_WRITTEN, 0xd1, NOT_WRITTEN, NOT_WRITTEN, NOT_WRITTEN, 0xd5, NOT_WRITTEN, 0,
+    };
+    const enum ubi_delta_compression compressions[] = {
+        UBI_DELTA_COMPRESSION_DEFLATE,
+        UBI_DELTA_COMPRESSION_NONE,
+    };
+    char paths[UBI_DELTA_MAX_CHAIN][UBI_PATH_LEN];
+    struct ubi_delta_extent *extents;
+    struct ubi_esnap_request req;
+    char path[UBI_PATH_LEN];
+    uint64_t count;
+    int depth;
+
+    for (size_t i = 0; i < SPDK_COUNTOF(compressions); i++) {
+        snprintf(path, sizeof(path), "%s/corrupt_data_%zu.delta", dir, i);
+        if (!write_delta(path, NULL, TEST_DELTA_CLUSTER_SIZE, fills, compressions[i]) ||
+            !read_delta_chain(path, &extents, &count, paths, &depth)) {
+            return false;
+        }
+
+        const struct ubi_delta_extent *extent = ubi_delta_find(extents, count, 1);
+        bool compressed = compressions[i] != UBI_DELTA_COMPRESSION_NONE;
+        /* a compressed cluster is corrupted halfway through its deflate stream */
+        bool success = extent != NULL && (extent->length != 0) == compressed;
+        if (success) {
+            uint64_t len = compressed ? extent->length : TEST_DELTA_CLUSTER_SIZE;
+            uint64_t offset = extent->offset & UBI_DELTA_OFFSET_MASK;
+            success = flip_byte(path, offset + len / 2);
+        }
+        free(extents);
+        if (!success) {
+            SPDK_ERRLOG("Could not corrupt cluster 1 of %s\n", path);
+            return false;
+        }
+
+        if (!compressed) {
+            if (!flatten_fails(flatten_path, dir, path)) {
+                return false;
+            }
+            continue;
+        }
+
+        if (!open_esnap(&req, path)) {
+            return false;
+        }
+
+        uint8_t *buf = spdk_dma_malloc(TEST_DELTA_CLUSTER_SIZE, UBI_DELTA_ALIGN, NULL);
+        int rc = buf ? read_esnap(&req, buf, TEST_DELTA_CLUSTER_SIZE,
+                                  TEST_DELTA_CLUSTER_SIZE)
+                     : -ENOMEM;
+        if (rc != -EIO) {
+            SPDK_ERRLOG("Corrupt cluster of %s read with %d\n", path, rc);
+            success = false;
+        }
+
+        /* The clusters around it still read. */
+        rc = buf ? read_esnap(&req, buf, 5 * TEST_DELTA_CLUSTER_SIZE,
+                              TEST_DELTA_CLUSTER_SIZE)
+                 : -ENOMEM;
+        for (size_t j = 0; j < TEST_DELTA_CLUSTER_SIZE && rc == 0; j++) {
+            rc = buf[j] == cluster_byte(fills[5], j) ? 0 : -EILSEQ;
+        }
+        if (rc != 0) {
+            SPDK_ERRLOG("Intact cluster of %s read with %d\n", path, rc);
+            success = false;
+        }
+
+        execute_spdk_function(io_thread_close_esnap, &req);
+        spdk_dma_free(buf);
+        if (!success) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void layer_bdev_event_cb(enum spdk_bdev_event_type type, struct spdk_bdev *bdev,
+                                void *event_ctx) {
+    SPDK_NOTICELOG("Unsupported bdev event: type %d\n", type);
+}
+
+/*
+ * check_layer_reads reads blocks of each cluster of the layered bdev, and
+ * checks them against the layer whose fill is in fills, or the image where
+ * that's NOT_WRITTEN.
+ */
+static bool check_layer_reads(struct test_bdev *bdev, const char *image_path,
+                              const int *fills) {
+    const uint64_t offsets[] = {0, 37 * MAX_BLOCK_SIZE,
+                                TEST_LAYER_CLUSTER_SIZE - MAX_BLOCK_SIZE};
+    struct ubi_io_request req;
+    uint8_t expected[MAX_BLOCK_SIZE];
+
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) {
+        SPDK_ERRLOG("Could not open %s: %s\n", image_path, strerror(errno));
+        return false;
+    }
+
+    struct spdk_bdev *spdk_bdev = spdk_bdev_desc_get_bdev(bdev->desc);
+    uint32_t blocklen = spdk_bdev_get_block_size(spdk_bdev);
+    req.bdev = bdev;
+    bool success = true;
+    for (uint64_t i = 0; i < TEST_DELTA_CLUSTERS && success; i++) {
+        for (size_t j = 0; j < SPDK_COUNTOF(offsets) && success; j++) {
+            uint64_t offset = i * TEST_LAYER_CLUSTER_SIZE + offsets[j];
+            if (fills[i] != NOT_WRITTEN) {
+                for (uint64_t k = 0; k < MAX_BLOCK_SIZE; k++) {
+                    expected[k] = cluster_byte(fills[i], offsets[j] + k);
+                }
+            } else if (pread(fd, expected, MAX_BLOCK_SIZE, offset) != MAX_BLOCK_SIZE) {
+                SPDK_ERRLOG("Could not read %s at %lu\n", image_path, offset);
+                success = false;
+                break;
+            }
+
+            req.block_idx = offset / blocklen;
+            execute_spdk_function(io_thread_read_sector, &req);
+            if (!req.success) {
+                SPDK_ERRLOG("Could not read %s at %lu\n", TEST_LAYER_BDEV, offset);
+                success = false;
+            } else if (memcmp(req.buf, expected, MAX_BLOCK_SIZE) != 0) {
+                SPDK_ERRLOG("Cluster %lu of %s doesn't read from the expected layer\n",
+                            i, TEST_LAYER_BDEV);
+                success = false;
+            }
+        }
+    }
+
+    close(fd);
+    return success;
+}
+
+/*
+ * test_delta_layers creates a bdev on base_bdev from the image and two delta
+ * layers, and checks that each cluster reads from the topmost layer which has
+ * it, down to the image. A zero cluster of the top layer hides the bottom
+ * layer's data as well as the image's.
+ */
+static bool test_delta_layers(const char *dir, const char *base_bdev,
+                              const char *image_path) {
+    const int bottom_fills[TEST_DELTA_CLUSTERS] = {
+        0x30, 0x31, 0x32, NOT_WRITTEN, NOT_WRITTEN, 0x35, NOT_WRITTEN, NOT_WRITTEN,
+    };
+    const int top_fills[TEST_DELTA_CLUSTERS] = {
+        NOT_WRITTEN, 0x41, 0, 0x43, 0, NOT_WRITTEN, NOT_WRITTEN, NOT_WRITTEN,
+    };
+    /* fills read from the bdev, NOT_WRITTEN for clusters of the image */
+    const int fills[TEST_DELTA_CLUSTERS] = {
+        0x30, 0x41, 0, 0x43, 0, 0x35, NOT_WRITTEN, NOT_WRITTEN,
+    };
+    char bottom[UBI_PATH_LEN], top[UBI_PATH_LEN];
+    struct ubi_create_request create_req;
+    struct ubi_delete_request delete_req;
+    struct test_bdev bdev;
+
+    snprintf(bottom, sizeof(bottom), "%s/bottom_layer.delta", dir);
+    snprintf(top, sizeof(top), "%s/top_layer.delta", dir);
+    if (!write_delta(bottom, NULL, TEST_LAYER_CLUSTER_SIZE, bottom_fills,
+                     UBI_DELTA_COMPRESSION_NONE) ||
+        !write_delta(top, NULL, TEST_LAYER_CLUSTER_SIZE, top_fills,
+                     UBI_DELTA_COMPRESSION_NONE)) {
+        return false;
+    }
+
+    const char *layers[] = {bottom, top};
+    memset(&create_req, 0, sizeof(create_req));
+    create_req.opts.name = TEST_LAYER_BDEV;
+    create_req.opts.base_bdev_name = base_bdev;
+    create_req.opts.image_path = image_path;
+    create_req.opts.layers = layers;
+    create_req.opts.num_layers = SPDK_COUNTOF(layers);
+    create_req.opts.format_bdev = true;
+    execute_app_function(init_thread_create_bdev_ubi, &create_req);
+    if (!create_req.success) {
+        SPDK_ERRLOG("Could not create %s\n", TEST_LAYER_BDEV);
+        return false;
+    }
+
+    memset(&bdev, 0, sizeof(bdev));
+    bool success = spdk_bdev_open_ext(TEST_LAYER_BDEV, false, layer_bdev_event_cb, NULL,
+                                      &bdev.desc) == 0;
+    if (success) {
+        struct spdk_bdev *spdk_bdev = spdk_bdev_desc_get_bdev(bdev.desc);
+        struct ubi_bdev *ubi_bdev = SPDK_CONTAINEROF(spdk_bdev, struct ubi_bdev, bdev);
+        execute_spdk_function(open_io_channel, &bdev);
+        uint64_t cluster_size = spdk_bs_get_cluster_size(ubi_bdev->blobstore);
+        success = bdev.ch != NULL && cluster_size == TEST_LAYER_CLUSTER_SIZE &&
+                  check_layer_reads(&bdev, image_path, fills);
+        execute_spdk_function(close_io_channel, &bdev);
+        spdk_bdev_close(bdev.desc);
+    }
+
+    memset(&delete_req, 0, sizeof(delete_req));
+    delete_req.name = TEST_LAYER_BDEV;
+    execute_app_function(init_thread_delete_bdev_ubi, &delete_req);
+    return success && delete_req.success;
+}
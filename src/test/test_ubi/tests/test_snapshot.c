@@ -0,0 +1,335 @@
+#include "bdev_ubi_internal.h"
+#include "test_ubi.h"
+
+/* malloc bdev of test_conf.json which snapshots are written to */
+#define SNAPSHOT_TARGET_BDEV "delta_target"
+#define RESTORED_BDEV "test_snapshot_restored"
+
+struct snapshot_test_state {
+    struct test_bdev bdev;
+    const char *bdev_name;
+    uint32_t blocklen;
+    uint64_t size;
+    uint64_t cluster_size;
+    char dir[64];
+};
+
+static bool open_test_bdev(const char *name, struct test_bdev *bdev);
+static void close_test_bdev(struct test_bdev *bdev);
+static bool open_bdev(struct snapshot_test_state *state);
+static bool write_sectors(struct snapshot_test_state *state, uint64_t offset,
+                          uint32_t count, char fill);
+static bool run_snapshot(struct snapshot_test_state *state,
+                         struct ubi_snapshot_request *req);
+static bool take_snapshot(struct snapshot_test_state *state, const char *name,
+                          const char *parent, uint32_t num_threads,
+                          uint32_t queue_depth);
+static bool test_restore_from_bdev(struct snapshot_test_state *state,
+                                   const char *base_bdev, const char *image_path,
+                                   const char *snapshot_bdev);
+static bool test_flatten(struct snapshot_test_state *state, const char *image_path,
+                         const char *flatten_path, const char *layer);
+static bool compare_with_bdev(struct snapshot_test_state *state, const char *path);
+static bool compare_bdevs(struct snapshot_test_state *state, struct test_bdev *other);
+
+/*
+ * test_snapshot_flatten takes a full and an incremental snapshot of a bdev,
+ * each after writing to it, and checks that flattening the image with the
+ * chain of deltas gives what the guest reads. A full snapshot copied by
+ * several threads, each with several clusters in flight, flattens to the same.
+ */
+void test_snapshot_flatten(const char *bdev_name, const char *image_path,
+                           const char *flatten_path, int *n_tests, int *n_failures) {
+    struct snapshot_test_state state;
+    memset(&state, 0, sizeof(state));
+    state.bdev_name = bdev_name;
+
+    snprintf(state.dir, sizeof(state.dir), "/tmp/test_ubi_snapshot.XXXXXX");
+    if (mkdtemp(state.dir) == NULL) {
+        SPDK_ERRLOG("Could not create %s: %s\n", state.dir, strerror(errno));
+        (*n_failures)++;
+        return;
+    }
+
+    if (!open_bdev(&state)) {
+        rmdir(state.dir);
+        (*n_failures)++;
+        return;
+    }
+
+#define RUN_TEST(x)                                                                      \
+    {                                                                                    \
+        (*n_tests)++;                                                                    \
+        if (!(x)) {                                                                      \
+            (*n_failures)++;                                                             \
+            SPDK_ERRLOG("Test failed: %s\n", #x);                                        \
+        }                                                                                \
+    }
+
+    // full snapshot, after writing to two clusters
+    RUN_TEST(write_sectors(&state, 3 * state.cluster_size, 4, 'a'));
+    RUN_TEST(write_sectors(&state, 7 * state.cluster_size + MAX_BLOCK_SIZE, 2, 'b'));
+    RUN_TEST(take_snapshot(&state, "full.delta", NULL, 0, 0));
+    // incremental snapshot, after overwriting one of those clusters, writing to
+    // another and zeroing a cluster of the image
+    RUN_TEST(write_sectors(&state, 3 * state.cluster_size + MAX_BLOCK_SIZE, 2, 'c'));
+    RUN_TEST(write_sectors(&state, state.size - state.cluster_size, 3, 'd'));
+    RUN_TEST(write_sectors(&state, 12 * state.cluster_size,
+                           state.cluster_size / MAX_BLOCK_SIZE, 0));
+    RUN_TEST(take_snapshot(&state, "incremental.delta", "full.delta", 0, 0));
+    // the chain flattened over the image reads as the bdev does
+    RUN_TEST(test_flatten(&state, image_path, flatten_path, "incremental.delta"));
+    // a full snapshot exported by two threads with eight clusters in flight
+    // each, after writing to a run of clusters, flattens to what the bdev reads
+    for (uint64_t i = 16; i < 24; i++) {
+        RUN_TEST(write_sectors(&state, i * state.cluster_size, 1, 'f' + i % 2));
+    }
+    RUN_TEST(take_snapshot(&state, "parallel.delta", NULL, 2, 8));
+    RUN_TEST(test_flatten(&state, image_path, flatten_path, "parallel.delta"));
+
+    close_test_bdev(&state.bdev);
+
+    char cmd[sizeof(state.dir) + 16];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", state.dir);
+    if (system(cmd) != 0) {
+        SPDK_WARNLOG("Could not remove %s\n", state.dir);
+    }
+}
+
+/*
+ * test_snapshot_bdev_target takes a snapshot of a bdev to another bdev, and
+ * checks that a bdev restored from it on base_bdev reads as the original.
+ */
+void test_snapshot_bdev_target(const char *bdev_name, const char *base_bdev,
+                               const char *image_path, int *n_tests, int *n_failures) {
+    struct snapshot_test_state state;
+    memset(&state, 0, sizeof(state));
+    state.bdev_name = bdev_name;
+
+    if (!open_bdev(&state)) {
+        (*n_failures)++;
+        return;
+    }
+
+    struct ubi_snapshot_request req;
+    memset(&req, 0, sizeof(req));
+    req.opts.target_bdev = SNAPSHOT_TARGET_BDEV;
+
+#define RUN_TEST(x)                                                                      \
+    {                                                                                    \
+        (*n_tests)++;                                                                    \
+        if (!(x)) {                                                                      \
+            (*n_failures)++;                                                             \
+            SPDK_ERRLOG("Test failed: %s\n", #x);                                        \
+        }                                                                                \
+    }
+
+    RUN_TEST(write_sectors(&state, 5 * state.cluster_size + MAX_BLOCK_SIZE, 3, 'e'));
+    RUN_TEST(run_snapshot(&state, &req));
+    RUN_TEST(test_restore_from_bdev(&state, base_bdev, image_path, SNAPSHOT_TARGET_BDEV));
+
+    close_test_bdev(&state.bdev);
+}
+
+static void ubi_event_cb(enum spdk_bdev_event_type type, struct spdk_bdev *bdev,
+                         void *event_ctx) {
+    SPDK_NOTICELOG("Unsupported bdev event: type %d\n", type);
+}
+
+static bool open_test_bdev(const char *name, struct test_bdev *bdev) {
+    int rc = spdk_bdev_open_ext(name, true, ubi_event_cb, NULL, &bdev->desc);
+    if (rc < 0) {
+        SPDK_ERRLOG("Could not open bdev %s: %s\n", name, strerror(-rc));
+        return false;
+    }
+
+    execute_spdk_function(open_io_channel, bdev);
+    if (bdev->ch == NULL) {
+        spdk_bdev_close(bdev->desc);
+        return false;
+    }
+    return true;
+}
+
+static void close_test_bdev(struct test_bdev *bdev) {
+    execute_spdk_function(close_io_channel, bdev);
+    spdk_bdev_close(bdev->desc);
+}
+
+static bool open_bdev(struct snapshot_test_state *state) {
+    if (!open_test_bdev(state->bdev_name, &state->bdev)) {
+        return false;
+    }
+
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(state->bdev.desc);
+    struct ubi_bdev *ubi_bdev = SPDK_CONTAINEROF(bdev, struct ubi_bdev, bdev);
+    state->blocklen = bdev->blocklen;
+    state->size = bdev->blockcnt * bdev->blocklen;
+    state->cluster_size = spdk_bs_get_cluster_size(ubi_bdev->blobstore);
+    return true;
+}
+
+static bool write_sectors(struct snapshot_test_state *state, uint64_t offset,
+                          uint32_t count, char fill) {
+    struct ubi_io_request req;
+
+    req.bdev = &state->bdev;
+    memset(req.buf, fill, sizeof(req.buf));
+    for (uint32_t i = 0; i < count; i++) {
+        req.block_idx = (offset + i * MAX_BLOCK_SIZE) / state->blocklen;
+        execute_spdk_function(io_thread_write_sector, &req);
+        if (!req.success) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* run_snapshot takes a snapshot of the bdev with the options of req. */
+static bool run_snapshot(struct snapshot_test_state *state,
+                         struct ubi_snapshot_request *req) {
+    req->opts.name = state->bdev_name;
+    execute_app_function(init_thread_snapshot_bdev_ubi, req);
+    if (req->result != 0) {
+        SPDK_ERRLOG("Snapshot of %s to %s failed: %s\n", state->bdev_name,
+                    req->opts.path ? req->opts.path : req->opts.target_bdev,
+                    strerror(-req->result));
+        return false;
+    }
+    return true;
+}
+
+/* take_snapshot takes a snapshot to a file, 0 picking the default copy options. */
+static bool take_snapshot(struct snapshot_test_state *state, const char *name,
+                          const char *parent, uint32_t num_threads,
+                          uint32_t queue_depth) {
+    char path[UBI_PATH_LEN], parent_path[UBI_PATH_LEN];
+    struct ubi_snapshot_request req;
+
+    snprintf(path, sizeof(path), "%s/%s", state->dir, name);
+    snprintf(parent_path, sizeof(parent_path), "%s/%s", state->dir, parent ? parent : "");
+
+    memset(&req, 0, sizeof(req));
+    req.opts.path = path;
+    req.opts.parent_path = parent ? parent_path : NULL;
+    req.opts.num_threads = num_threads;
+    req.opts.queue_depth = queue_depth;
+    return run_snapshot(state, &req);
+}
+
+/*
+ * test_restore_from_bdev creates a bdev on base_bdev from the image and the
+ * delta on snapshot_bdev, checks that it reads as the snapshotted bdev, and
+ * deletes it.
+ */
+static bool test_restore_from_bdev(struct snapshot_test_state *state,
+                                   const char *base_bdev, const char *image_path,
+                                   const char *snapshot_bdev) {
+    struct ubi_create_request create_req;
+    struct ubi_delete_request delete_req;
+    struct test_bdev restored;
+
+    memset(&create_req, 0, sizeof(create_req));
+    create_req.opts.name = RESTORED_BDEV;
+    create_req.opts.base_bdev_name = base_bdev;
+    create_req.opts.image_path = image_path;
+    create_req.opts.snapshot_bdev = snapshot_bdev;
+    create_req.opts.format_bdev = true;
+    execute_app_function(init_thread_create_bdev_ubi, &create_req);
+    if (!create_req.success) {
+        SPDK_ERRLOG("Could not restore %s from %s\n", state->bdev_name, snapshot_bdev);
+        return false;
+    }
+
+    bool success = open_test_bdev(RESTORED_BDEV, &restored);
+    if (success) {
+        success = compare_bdevs(state, &restored);
+        close_test_bdev(&restored);
+    }
+
+    memset(&delete_req, 0, sizeof(delete_req));
+    delete_req.name = RESTORED_BDEV;
+    execute_app_function(init_thread_delete_bdev_ubi, &delete_req);
+    return success && delete_req.success;
+}
+
+static bool test_flatten(struct snapshot_test_state *state, const char *image_path,
+                         const char *flatten_path, const char *layer) {
+    char cmd[3 * UBI_PATH_LEN];
+    char output[UBI_PATH_LEN];
+
+    snprintf(output, sizeof(output), "%s/flat.raw", state->dir);
+    snprintf(cmd, sizeof(cmd),
+             "%s --image %s --layer %s/%s --output %s --cluster_size_kb %lu > /dev/null",
+             flatten_path, image_path, state->dir, layer, output,
+             state->cluster_size / 1024);
+    int status = system(cmd);
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        SPDK_ERRLOG("%s failed with status %d\n", flatten_path, status);
+        return false;
+    }
+
+    return compare_with_bdev(state, output);
+}
+
+/*
+ * compare_with_bdev reads the whole bdev and checks it against the flattened
+ * image at path, which reads as zeroes past its end.
+ */
+static bool compare_with_bdev(struct snapshot_test_state *state, const char *path) {
+    struct ubi_io_request req;
+    char buf[MAX_BLOCK_SIZE];
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        SPDK_ERRLOG("Could not open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    req.bdev = &state->bdev;
+    bool success = true;
+    for (uint64_t offset = 0; offset < state->size && success; offset += MAX_BLOCK_SIZE) {
+        ssize_t n = pread(fd, buf, sizeof(buf), offset);
+        if (n < 0) {
+            SPDK_ERRLOG("Could not read %s: %s\n", path, strerror(errno));
+            success = false;
+            break;
+        }
+        memset(buf + n, 0, sizeof(buf) - n);
+
+        req.block_idx = offset / state->blocklen;
+        execute_spdk_function(io_thread_read_sector, &req);
+        if (!req.success) {
+            SPDK_ERRLOG("Could not read %s at %lu\n", state->bdev_name, offset);
+            success = false;
+        } else if (memcmp(buf, req.buf, sizeof(buf)) != 0) {
+            SPDK_ERRLOG("%s differs from %s at %lu\n", path, state->bdev_name, offset);
+            success = false;
+        }
+    }
+
+    close(fd);
+    return success;
+}
+
+/* compare_bdevs checks that other reads as the bdev, as far as the bdev goes. */
+static bool compare_bdevs(struct snapshot_test_state *state, struct test_bdev *other) {
+    struct ubi_io_request req, other_req;
+
+    req.bdev = &state->bdev;
+    other_req.bdev = other;
+    bool success = true;
+    for (uint64_t offset = 0; offset < state->size && success; offset += MAX_BLOCK_SIZE) {
+        req.block_idx = other_req.block_idx = offset / state->blocklen;
+        execute_spdk_function(io_thread_read_sector, &req);
+        execute_spdk_function(io_thread_read_sector, &other_req);
+        if (!req.success || !other_req.success) {
+            SPDK_ERRLOG("Could not read at %lu\n", offset);
+            success = false;
+        } else if (memcmp(req.buf, other_req.buf, sizeof(req.buf)) != 0) {
+            SPDK_ERRLOG("Bdevs differ from %s at %lu\n", state->bdev_name, offset);
+            success = false;
+        }
+    }
+    return success;
+}
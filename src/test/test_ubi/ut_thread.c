@@ -40,6 +40,12 @@ void run_ut_thread(void *arg) {
     }
 
     test_bdev_recreate(opts->free_base_bdev, opts->image_path, &n_tests, &n_failures);
+    test_delta(opts->free_base_bdev, opts->image_path, opts->flatten_path, &n_tests,
+               &n_failures);
+    test_snapshot_flatten(opts->bdev_names[0], opts->image_path, opts->flatten_path,
+                          &n_tests, &n_failures);
+    test_snapshot_bdev_target(opts->bdev_names[0], opts->free_base_bdev, opts->image_path,
+                              &n_tests, &n_failures);
 
     SPDK_NOTICELOG("Tests run: %u, failures: %u\n", n_tests, n_failures);
 